@@ -20,6 +20,8 @@
  */
 
 #include "core/ragel.hh"
+#include "core/iostream.hh"
+#include "net/packet.hh"
 #include "apps/memcached/memcached.hh"
 #include <memory>
 #include <algorithm>
@@ -35,23 +37,6 @@ action mark {
     g.mark_start(p);
 }
 
-action start_blob {
-    g.mark_start(p);
-    _size_left = _size;
-}
-
-action advance_blob {
-    auto len = std::min((uint32_t)(pe - p), _size_left);
-    _size_left -= len;
-    p += len;
-    if (_size_left == 0) {
-        _blob = str();
-        p--;
-        fret;
-    }
-    p--;
-}
-
 crlf = '\r\n';
 sp = ' ';
 u32 = digit+ >{ _u32 = 0; } ${ _u32 *= 10; _u32 += fc - '0'; };
@@ -60,16 +45,16 @@ key = [^ ]+ >mark %{ _key = memcache::item_key(str()); };
 flags = digit+ >mark %{ _flags_str = str(); };
 expiration = u32 %{ _expiration = _u32; };
 size = u32 >mark %{ _size = _u32; _size_str = str(); };
-blob := any+ >start_blob $advance_blob;
 maybe_noreply = (sp "noreply" @{ _noreply = true; })? >{ _noreply = false; };
 maybe_expiration = (sp expiration)? >{ _expiration = 0; };
 version_field = u64 %{ _version = _u64; };
 
-insertion_params = sp key sp flags sp expiration sp size maybe_noreply (crlf @{ fcall blob; } ) crlf;
+# The value of a storage command is left in the stream, see read_value()
+insertion_params = sp key sp flags sp expiration sp size maybe_noreply crlf;
 set = "set" insertion_params @{ _state = state::cmd_set; };
 add = "add" insertion_params @{ _state = state::cmd_add; };
 replace = "replace" insertion_params @{ _state = state::cmd_replace; };
-cas = "cas" sp key sp flags sp expiration sp size sp version_field maybe_noreply (crlf @{ fcall blob; } ) crlf @{ _state = state::cmd_cas; };
+cas = "cas" sp key sp flags sp expiration sp size sp version_field maybe_noreply crlf @{ _state = state::cmd_cas; };
 get = "get" (sp key %{ _keys.emplace_back(std::move(_key)); })+ crlf @{ _state = state::cmd_get; };
 gets = "gets" (sp key %{ _keys.emplace_back(std::move(_key)); })+ crlf @{ _state = state::cmd_gets; };
 delete = "delete" sp key maybe_noreply crlf @{ _state = state::cmd_delete; };
@@ -120,9 +105,9 @@ public:
     uint32_t _expiration;
     uint32_t _size;
     sstring _size_str;
-    uint32_t _size_left;
     uint64_t _version;
-    sstring _blob;
+    // The value of a storage command, in the buffers it was received in
+    net::packet _blob;
     bool _noreply;
     std::vector<memcache::item_key> _keys;
 public:
@@ -149,4 +134,39 @@ public:
     bool eof() const {
         return _state == state::eof;
     }
+    // Whether the command is followed by a value, to be read with read_value()
+    bool has_value() const {
+        return _state == state::cmd_set || _state == state::cmd_cas
+            || _state == state::cmd_add || _state == state::cmd_replace;
+    }
+    // Reads the _size bytes of value that follow a storage command, and the
+    // "\r\n" after them.  The value is not copied: _blob shares the buffers
+    // the stream received it in, however many pieces it arrived in.  A value
+    // cut short or not followed by "\r\n" is an error.
+    future<> read_value(input_stream<char>& in) {
+        return in.read_exactly_scattered(size_t(_size) + 2).then([this] (net::packet p) {
+            if (p.len() != size_t(_size) + 2 || !ends_with_crlf(p)) {
+                _state = state::error;
+                return;
+            }
+            p.trim_back(2);
+            _blob = std::move(p);
+        });
+    }
+private:
+    static bool ends_with_crlf(const net::packet& p) {
+        const char crlf[] = { '\r', '\n' };
+        size_t matched = 0;
+        auto frags = p.fragments();
+        for (auto i = frags.end(); i != frags.begin() && matched < 2; ) {
+            --i;
+            for (auto c = i->base + i->size; c != i->base && matched < 2; ) {
+                if (*--c != crlf[1 - matched]) {
+                    return false;
+                }
+                ++matched;
+            }
+        }
+        return matched == 2;
+    }
 };
@@ -57,6 +57,7 @@ namespace memcache {
 static constexpr double default_slab_growth_factor = 1.25;
 static constexpr uint64_t default_slab_page_size = 1UL*MB;
 static constexpr uint64_t default_per_cpu_slab_size = 0UL; // zero means reclaimer is enabled.
+static constexpr uint32_t default_max_item_size = 1UL*MB;
 static __thread slab_allocator<item>* slab;
 
 template<typename T>
@@ -145,11 +146,11 @@ class item : public slab_item_base {
     friend class cache;
 public:
     item(uint32_t slab_page_index, item_key&& key, sstring&& ascii_prefix,
-         sstring&& value, expiration expiry, version_type version = 1)
+         const packet& value, expiration expiry, version_type version = 1)
         : _version(version)
         , _key_hash(key.hash())
         , _expiry(expiry)
-        , _value_size(value.size())
+        , _value_size(value.len())
         , _slab_page_index(slab_page_index)
         , _ref_count(0U)
         , _key_size(key.key().size())
@@ -161,9 +162,11 @@ class item : public slab_item_base {
         memcpy(_data, key.key().c_str(), _key_size);
         // storing ascii_prefix
         memcpy(_data + align_up(_key_size, field_alignment), ascii_prefix.c_str(), _ascii_prefix_size);
-        // storing value
-        memcpy(_data + align_up(_key_size, field_alignment) + align_up(_ascii_prefix_size, field_alignment),
-               value.c_str(), _value_size);
+        // storing value, straight from the buffers it was received in
+        auto p = _data + align_up(_key_size, field_alignment) + align_up(_ascii_prefix_size, field_alignment);
+        for (auto&& frag : value.fragments()) {
+            p = std::copy_n(frag.base, frag.size, p);
+        }
     }
 
     item(const item&) = delete;
@@ -355,10 +358,15 @@ struct local_origin_tag {
 struct item_insertion_data {
     item_key key;
     sstring ascii_prefix;
-    sstring data;
+    // Only read when the item is created, possibly on another shard
+    packet data;
     expiration expiry;
 };
 
+static packet value_packet(const sstring& value) {
+    return packet(value.begin(), value.size());
+}
+
 class cache {
 private:
     using cache_type = bi::unordered_set<item,
@@ -377,6 +385,7 @@ class cache {
     clock_type::duration _wc_to_clock_type_delta;
     cache_stats _stats;
     timer<clock_type> _flush_timer;
+    uint32_t _max_item_size;
 private:
     size_t item_size(item& item_ref) {
         constexpr size_t field_alignment = alignof(void*);
@@ -391,7 +400,7 @@ class cache {
         auto size = sizeof(item) +
             align_up(insertion.key.key().size(), field_alignment) +
             align_up(insertion.ascii_prefix.size(), field_alignment) +
-            insertion.data.size();
+            insertion.data.len();
 #ifdef __DEBUG__
         static bool print_item_footprint = true;
         if (print_item_footprint) {
@@ -399,7 +408,7 @@ class cache {
             std::cout << __FUNCTION__ << ": " << size << "\n";
             std::cout << "sizeof(item)      " << sizeof(item) << "\n";
             std::cout << "key.size          " << insertion.key.key().size() << "\n";
-            std::cout << "value.size        " << insertion.data.size() << "\n";
+            std::cout << "value.size        " << insertion.data.len() << "\n";
             std::cout << "ascii_prefix.size " << insertion.ascii_prefix.size() << "\n";
         }
 #endif
@@ -458,7 +467,7 @@ class cache {
 
         size_t size = item_size(insertion);
         auto new_item = slab->create(size, Origin::move_if_local(insertion.key), Origin::move_if_local(insertion.ascii_prefix),
-            Origin::move_if_local(insertion.data), insertion.expiry, old_item_version + 1);
+            insertion.data, insertion.expiry, old_item_version + 1);
         intrusive_ptr_add_ref(new_item);
 
         auto insert_result = _cache.insert(*new_item);
@@ -475,7 +484,7 @@ class cache {
     void add_new(item_insertion_data& insertion) {
         size_t size = item_size(insertion);
         auto new_item = slab->create(size, Origin::move_if_local(insertion.key), Origin::move_if_local(insertion.ascii_prefix),
-            Origin::move_if_local(insertion.data), insertion.expiry);
+            insertion.data, insertion.expiry);
         intrusive_ptr_add_ref(new_item);
         auto& item_ref = *new_item;
         _cache.insert(item_ref);
@@ -502,9 +511,10 @@ class cache {
         }
     }
 public:
-    cache(uint64_t per_cpu_slab_size, uint64_t slab_page_size)
+    cache(uint64_t per_cpu_slab_size, uint64_t slab_page_size, uint32_t max_item_size)
         : _buckets(new cache_type::bucket_type[initial_bucket_count])
         , _cache(cache_type::bucket_traits(_buckets, initial_bucket_count))
+        , _max_item_size(max_item_size)
     {
         using namespace std::chrono;
 
@@ -649,7 +659,7 @@ class cache {
         item_insertion_data insertion {
             .key = Origin::move_if_local(key),
             .ascii_prefix = sstring(item_ref.ascii_prefix().data(), item_ref.ascii_prefix_size()),
-            .data = to_sstring(*value + delta),
+            .data = value_packet(to_sstring(*value + delta)),
             .expiry = item_ref._expiry
         };
         i = add_overriding<local_origin_tag>(i, insertion);
@@ -672,7 +682,7 @@ class cache {
         item_insertion_data insertion {
             .key = Origin::move_if_local(key),
             .ascii_prefix = sstring(item_ref.ascii_prefix().data(), item_ref.ascii_prefix_size()),
-            .data = to_sstring(*value - std::min(*value, delta)),
+            .data = value_packet(to_sstring(*value - std::min(*value, delta))),
             .expiry = item_ref._expiry
         };
         i = add_overriding<local_origin_tag>(i, insertion);
@@ -722,6 +732,7 @@ class cache {
 
     future<> stop() { return make_ready_future<>(); }
     clock_type::duration get_wc_to_clock_type_delta() { return _wc_to_clock_type_delta; }
+    uint32_t max_item_size() const { return _max_item_size; }
 };
 
 class sharded_cache {
@@ -744,6 +755,7 @@ class sharded_cache {
     }
 
     auto get_wc_to_clock_type_delta() { return _peers.local().get_wc_to_clock_type_delta(); }
+    uint32_t max_item_size() { return _peers.local().max_item_size(); }
 
     // The caller must keep @insertion live until the resulting future resolves.
     future<bool> set(item_insertion_data& insertion) {
@@ -879,6 +891,9 @@ class ascii_protocol {
     static constexpr const char *msg_stat = "STAT ";
     static constexpr const char *msg_out_of_memory = "SERVER_ERROR Out of memory allocating new item\r\n";
     static constexpr const char *msg_error_non_numeric_value = "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n";
+    static constexpr const char *msg_object_too_large = "SERVER_ERROR object too large for cache\r\n";
+    // Bytes of a rejected value read and dropped at a time
+    static constexpr size_t swallow_chunk_size = 64 * 1024;
 private:
     template <bool WithVersion>
     static void append_item(scattered_message<char>& msg, item_ptr item) {
@@ -1034,9 +1049,45 @@ class ascii_protocol {
         };
     }
 
+    // Reads and drops a value, without holding more than a chunk of it
+    static future<> swallow(input_stream<char>& in, size_t len) {
+        return do_with(len, [&in] (size_t& left) {
+            return repeat([&in, &left] {
+                return in.read_exactly_scattered(std::min(left, swallow_chunk_size)).then([&left] (packet p) {
+                    left -= p.len();
+                    return !left || !p.len() ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        });
+    }
+
+    // Reads the value of a storage command.  A value over the size limit is
+    // rejected as memcached does, before any of it is buffered; the command
+    // is then done with.
+    future<bool> read_value(input_stream<char>& in, output_stream<char>& out) {
+        if (_parser._size > _cache.max_item_size()) {
+            return swallow(in, size_t(_parser._size) + 2).then([&out] {
+                return out.write(msg_object_too_large);
+            }).then([] {
+                return false;
+            });
+        }
+        return _parser.read_value(in).then([] {
+            return true;
+        });
+    }
+
     future<> handle(input_stream<char>& in, output_stream<char>& out) {
         _parser.init();
-        return in.consume(_parser).then([this, &out] () -> future<> {
+        return in.consume(_parser).then([this, &in, &out] {
+            if (_parser.has_value()) {
+                return read_value(in, out);
+            }
+            return make_ready_future<bool>(true);
+        }).then([this, &out] (bool proceed) -> future<> {
+            if (!proceed) {
+                return make_ready_future<>();
+            }
             switch (_parser._state) {
                 case memcache_ascii_parser::state::eof:
                     return make_ready_future<>();
@@ -1416,6 +1467,8 @@ int main(int ac, char** av) {
              "Maximum memory to be used for items (value in megabytes) (reclaimer is disabled if set)")
         ("slab-page-size", bpo::value<uint64_t>()->default_value(memcache::default_slab_page_size/MB),
              "Size of slab page (value in megabytes)")
+        ("max-item-size", bpo::value<uint32_t>()->default_value(memcache::default_max_item_size),
+             "Maximum size of an item's value (value in bytes); larger ones are rejected")
         ("stats",
              "Print basic statistics periodically (every second)")
         ("port", bpo::value<uint16_t>()->default_value(11211),
@@ -1432,7 +1485,8 @@ int main(int ac, char** av) {
         uint16_t port = config["port"].as<uint16_t>();
         uint64_t per_cpu_slab_size = config["max-slab-size"].as<uint64_t>() * MB;
         uint64_t slab_page_size = config["slab-page-size"].as<uint64_t>() * MB;
-        return cache_peers.start(std::move(per_cpu_slab_size), std::move(slab_page_size)).then([&system_stats] {
+        uint32_t max_item_size = config["max-item-size"].as<uint32_t>();
+        return cache_peers.start(std::move(per_cpu_slab_size), std::move(slab_page_size), std::move(max_item_size)).then([&system_stats] {
             return system_stats.start(memcache::clock_type::now());
         }).then([&] {
             std::cout << PLATFORM << " memcached " << VERSION << "\n";
@@ -197,11 +197,23 @@ tests = [
     'tests/rpc',
     'tests/semaphore_test',
     'tests/packet_test',
+    'tests/ip_frag_test',
     'tests/tls_test',
     'tests/fair_queue_test',
     'tests/rpc_test',
     'tests/connect_test',
     'tests/chunked_fifo_test',
+    'tests/page_cache_test',
+    'tests/append_log_test',
+    'tests/tcp_congestion_test',
+    'tests/ipv6_test',
+    'tests/native_tcp_test',
+    'tests/flow_table_test',
+    'tests/checksum_test',
+    'tests/checksum_perf',
+    'tests/input_stream_test',
+    'tests/udp_test',
+    'tests/connection_pool_test',
     ]
 
 apps = [
@@ -251,20 +263,25 @@ libnet = [
     'net/virtio.cc',
     'net/dpdk.cc',
     'net/ip.cc',
+    'net/ipv6.cc',
     'net/ethernet.cc',
     'net/arp.cc',
     'net/native-stack.cc',
     'net/ip_checksum.cc',
     'net/udp.cc',
     'net/tcp.cc',
+    'net/tcp-congestion.cc',
     'net/dhcp.cc',
     'net/tls.cc',
+    'net/connection_pool.cc',
     ]
 
 core = [
     'core/reactor.cc',
     'core/systemwide_memory_barrier.cc',
     'core/fstream.cc',
+    'core/page_cache.cc',
+    'core/append_log.cc',
     'core/posix.cc',
     'core/memory.cc',
     'core/resource.cc',
@@ -382,8 +399,20 @@ deps = {
     'tests/rpc': ['tests/rpc.cc'] + core + libnet,
     'tests/rpc_test': ['tests/rpc_test.cc'] + core + libnet + boost_test_lib,
     'tests/packet_test': ['tests/packet_test.cc'] + core + libnet,
+    'tests/ip_frag_test': ['tests/ip_frag_test.cc'] + core + libnet,
     'tests/connect_test': ['tests/connect_test.cc'] + core + libnet + boost_test_lib,
     'tests/chunked_fifo_test': ['tests/chunked_fifo_test.cc'] + core,
+    'tests/page_cache_test': ['tests/page_cache_test.cc'] + core + boost_test_lib,
+    'tests/append_log_test': ['tests/append_log_test.cc'] + core + boost_test_lib,
+    'tests/tcp_congestion_test': ['tests/tcp_congestion_test.cc'] + core + libnet + boost_test_lib,
+    'tests/ipv6_test': ['tests/ipv6_test.cc'] + core + libnet + boost_test_lib,
+    'tests/native_tcp_test': ['tests/native_tcp_test.cc'] + core + libnet + boost_test_lib,
+    'tests/flow_table_test': ['tests/flow_table_test.cc'],
+    'tests/checksum_test': ['tests/checksum_test.cc'] + core + libnet,
+    'tests/checksum_perf': ['tests/checksum_perf.cc'] + core + libnet,
+    'tests/input_stream_test': ['tests/input_stream_test.cc'] + core + libnet + boost_test_lib,
+    'tests/udp_test': ['tests/udp_test.cc'] + core + libnet + boost_test_lib,
+    'tests/connection_pool_test': ['tests/connection_pool_test.cc'] + core + libnet + boost_test_lib,
 }
 
 warnings = [
@@ -502,6 +531,24 @@ if not try_compile(args.cxx, '#include <experimental/string_view>', ['-std=gnu++
 
 modes['debug']['sanitize'] += ' ' + sanitize_flags
 
+# Kernel TLS needs the TLS ULP headers (linux >= 4.17 for receive) and
+# gnutls_record_get_state() to hand the negotiated keys over.
+def have_ktls():
+    return try_compile(compiler = args.cxx, flags = ['-std=gnu++1y'], source = textwrap.dedent('''\
+        #include <gnutls/gnutls.h>
+        #include <sys/socket.h>
+        #include <netinet/tcp.h>
+        #include <linux/tls.h>
+        int x = TCP_ULP + SOL_TLS + TLS_TX + TLS_RX + TLS_SET_RECORD_TYPE + TLS_GET_RECORD_TYPE;
+        tls12_crypto_info_aes_gcm_256 ci;
+        auto f = &gnutls_record_get_state;
+        '''))
+
+if have_ktls():
+    defines.append('HAVE_KTLS')
+else:
+    print('Note: kernel TLS headers or gnutls >= 3.6 not found.  TLS records are always processed in userspace.')
+
 def have_hwloc():
     return try_compile(compiler = args.cxx, source = '#include <hwloc.h>\n#include <numa.h>')
 
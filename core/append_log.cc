@@ -0,0 +1,390 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "append_log.hh"
+#include "reactor.hh"
+#include "fstream.hh"
+#include "byteorder.hh"
+#include "align.hh"
+#include "print.hh"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+struct append_log::batch {
+    uint64_t segment_id;
+    // Offset of buf in the segment; always aligned.  The buffer may start
+    // with the tail of the previous batch, which is rewritten along with
+    // the new records.
+    uint64_t file_pos;
+    temporary_buffer<char> buf;
+    size_t used = 0;
+    std::vector<std::pair<promise<append_log_position>, append_log_position>> waiters;
+};
+
+static uint32_t crc32(const char* data, size_t len) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ uint8_t(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void put_le32(char* p, uint32_t v) {
+    v = cpu_to_le(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get_le32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return le_to_cpu(v);
+}
+
+static sstring segment_name(const sstring& directory, const sstring& prefix, uint64_t id) {
+    return sprint("%s/%s-%016d.log", directory, prefix, id);
+}
+
+// Returns the ids of the segments present in the directory, in ascending order.
+static future<std::vector<uint64_t>> list_segments(sstring directory, sstring prefix) {
+    return engine().open_directory(directory).then([prefix] (file dir) {
+        auto ids = make_lw_shared<std::vector<uint64_t>>();
+        auto lister = make_lw_shared<subscription<directory_entry>>(dir.list_directory(
+                [ids, prefix] (directory_entry de) {
+            auto& name = de.name;
+            auto p = prefix + "-";
+            static const sstring suffix = ".log";
+            if (name.size() > p.size() + suffix.size()
+                    && std::equal(p.begin(), p.end(), name.begin())
+                    && std::equal(suffix.begin(), suffix.end(), name.end() - suffix.size())) {
+                auto digits = name.substr(p.size(), name.size() - p.size() - suffix.size());
+                if (std::all_of(digits.begin(), digits.end(), ::isdigit)) {
+                    ids->push_back(std::stoull(std::string(digits.begin(), digits.end())));
+                }
+            }
+            return make_ready_future<>();
+        }));
+        return lister->done().then([lister, ids, dir] () mutable {
+            std::sort(ids->begin(), ids->end());
+            return dir.close().then([ids] {
+                return std::move(*ids);
+            });
+        });
+    });
+}
+
+static future<file> open_segment(const append_log_config& cfg, uint64_t id) {
+    auto size = cfg.segment_size;
+    return open_file_dma(segment_name(cfg.directory, cfg.prefix, id),
+            open_flags::rw | open_flags::create | open_flags::truncate).then([size] (file f) {
+        // Fixing the size up front means a sync after a write does not have
+        // to update the file size as well.
+        return f.allocate(0, size).then([f, size] () mutable {
+            return f.truncate(size);
+        }).then([f] {
+            return f;
+        });
+    }).then([wrapper = cfg.segment_file_wrapper] (file f) {
+        return wrapper ? wrapper(std::move(f)) : std::move(f);
+    });
+}
+
+append_log::append_log(private_tag, append_log_config cfg, uint64_t segment_id, file segment)
+        : _cfg(std::move(cfg))
+        , _disk_alignment(segment.disk_write_dma_alignment())
+        , _memory_alignment(segment.memory_dma_alignment())
+        , _segment_id(segment_id)
+        , _open_segment_id(segment_id)
+        , _segment(std::move(segment))
+        , _next_segment(open_segment(_cfg, segment_id + 1))
+        , _current(make_batch(segment_id, 0, 0))
+        , _commit_timer([this] { commit_window_expired(); }) {
+}
+
+append_log::~append_log() {
+}
+
+future<lw_shared_ptr<append_log>> append_log::open(append_log_config cfg) {
+    return list_segments(cfg.directory, cfg.prefix).then([cfg] (std::vector<uint64_t> ids) mutable {
+        auto id = ids.empty() ? 0 : ids.back() + 1;
+        return open_segment(cfg, id).then([cfg = std::move(cfg), id] (file f) mutable {
+            return make_lw_shared<append_log>(private_tag(), std::move(cfg), id, std::move(f));
+        });
+    });
+}
+
+std::unique_ptr<append_log::batch>
+append_log::make_batch(uint64_t segment_id, uint64_t file_pos, size_t min_capacity) {
+    auto b = std::make_unique<batch>();
+    b->segment_id = segment_id;
+    b->file_pos = file_pos;
+    auto capacity = align_up(std::max(_cfg.buffer_size, min_capacity), size_t(_disk_alignment));
+    b->buf = temporary_buffer<char>::aligned(_memory_alignment, capacity);
+    // Padding up to the alignment must read back as an end-of-segment marker.
+    std::fill(b->buf.get_write(), b->buf.get_write() + capacity, 0);
+    return b;
+}
+
+future<append_log_position> append_log::append(const char* data, size_t len) {
+    assert(!_closed);
+    if (_failed) {
+        return make_exception_future<append_log_position>(_failed);
+    }
+    // A zero length marks the end of a segment, so an empty record would
+    // hide itself and everything after it from replay.
+    if (len == 0) {
+        return make_exception_future<append_log_position>(
+                std::invalid_argument("cannot append an empty record"));
+    }
+    auto record_size = record_header_size + len;
+    if (record_size > _cfg.segment_size) {
+        return make_exception_future<append_log_position>(
+                std::invalid_argument(sprint("record of %d bytes does not fit a log segment", len)));
+    }
+    if (_current->file_pos + _current->used + record_size > _cfg.segment_size) {
+        // Roll over to the next segment.  The rest of this one is left
+        // zeroed, which ends it for readers.
+        if (!_current->waiters.empty()) {
+            seal();
+        }
+        _current = make_batch(++_segment_id, 0, record_size);
+    } else if (_current->used + record_size > _current->buf.size()) {
+        if (!_current->waiters.empty()) {
+            seal(record_size);
+        } else {
+            // Only the tail of the previous batch is in here; grow the buffer.
+            auto b = make_batch(_current->segment_id, _current->file_pos, _current->used + record_size);
+            std::copy_n(_current->buf.get(), _current->used, b->buf.get_write());
+            b->used = _current->used;
+            _current = std::move(b);
+        }
+    }
+
+    auto& b = *_current;
+    auto p = b.buf.get_write() + b.used;
+    put_le32(p, len);
+    put_le32(p + 4, crc32(data, len));
+    std::copy_n(data, len, p + record_header_size);
+    auto pos = append_log_position{b.segment_id, b.file_pos + b.used};
+    b.used += record_size;
+    b.waiters.emplace_back(promise<append_log_position>(), pos);
+    auto f = b.waiters.back().first.get_future();
+
+    if (b.used >= _cfg.buffer_size) {
+        seal();
+    } else if (!_commit_timer.armed()) {
+        _commit_timer.arm(_cfg.commit_window);
+    }
+    return f;
+}
+
+// A batch is sealed once its commit window has expired and no write is in
+// flight, so that records appended while a write is outstanding share the
+// next write and fdatasync instead of queueing one per window.
+void append_log::commit_window_expired() {
+    if (_writes_in_flight) {
+        _seal_after_write = true;
+    } else {
+        seal();
+    }
+}
+
+void append_log::seal(size_t min_capacity) {
+    _commit_timer.cancel();
+    _seal_after_write = false;
+    if (_current->waiters.empty()) {
+        return;
+    }
+    auto b = std::move(_current);
+    auto tail_start = align_down(b->used, size_t(_disk_alignment));
+    auto tail_size = b->used - tail_start;
+    _current = make_batch(b->segment_id, b->file_pos + tail_start, tail_size + min_capacity);
+    std::copy_n(b->buf.get() + tail_start, tail_size, _current->buf.get_write());
+    _current->used = tail_size;
+    // write() reports errors through the batch's waiters.
+    write(std::move(b));
+}
+
+future<> append_log::switch_segment(uint64_t id) {
+    if (id == _open_segment_id) {
+        return make_ready_future<>();
+    }
+    assert(id == _open_segment_id + 1);
+    auto old = std::move(_segment);
+    auto next = std::move(*_next_segment);
+    _next_segment = {};
+    return old.close().then([next = std::move(next)] () mutable {
+        return std::move(next);
+    }).then([this, id] (file f) {
+        _segment = std::move(f);
+        _open_segment_id = id;
+        _next_segment = open_segment(_cfg, id + 1);
+    });
+}
+
+future<> append_log::write(std::unique_ptr<batch> b) {
+    ++_writes_in_flight;
+    return with_semaphore(_write_sem, 1, [this, b = std::move(b)] () mutable {
+        auto& br = *b;
+        auto f = _failed ? make_exception_future<>(_failed) : switch_segment(br.segment_id).then([this, &br] {
+            auto len = align_up(br.used, size_t(_disk_alignment));
+            return _segment.dma_write(br.file_pos, br.buf.get(), len, _cfg.io_priority_class).then([len] (size_t written) {
+                if (written != len) {
+                    throw std::runtime_error("short write to log segment");
+                }
+            });
+        }).then([this] {
+            return _segment.flush();
+        });
+        return f.then_wrapped([this, b = std::move(b)] (future<> f) {
+            try {
+                f.get();
+                for (auto&& w : b->waiters) {
+                    w.first.set_value(w.second);
+                }
+            } catch (...) {
+                // A failed write leaves a hole in the log; nothing appended
+                // after it can be trusted.
+                _failed = std::current_exception();
+                for (auto&& w : b->waiters) {
+                    w.first.set_exception(_failed);
+                }
+            }
+            if (!--_writes_in_flight && _seal_after_write) {
+                seal();
+            }
+        });
+    });
+}
+
+future<> append_log::sync() {
+    seal();
+    return with_semaphore(_write_sem, 1, [this] {
+        if (_failed) {
+            return make_exception_future<>(_failed);
+        }
+        return make_ready_future<>();
+    });
+}
+
+future<> append_log::close() {
+    return sync().finally([this] {
+        _closed = true;
+        if (!_next_segment) {
+            // An earlier segment switch failed before opening the next one.
+            return _segment.close();
+        }
+        auto next = std::move(*_next_segment);
+        _next_segment = {};
+        // The preallocated next segment is empty, and would otherwise be
+        // skipped over by the next open(); remove it.
+        return next.then([this] (file f) {
+            return f.close().then([this] {
+                return remove_file(segment_name(_cfg.directory, _cfg.prefix, _open_segment_id + 1));
+            });
+        }).then_wrapped([this] (future<> f) {
+            f.ignore_ready_future();
+            return _segment.close();
+        });
+    });
+}
+
+future<> append_log::remove_segments_before(uint64_t segment_id) {
+    return list_segments(_cfg.directory, _cfg.prefix).then([this, segment_id] (std::vector<uint64_t> ids) {
+        return do_with(std::move(ids), [this, segment_id] (std::vector<uint64_t>& ids) {
+            return do_for_each(ids, [this, segment_id] (uint64_t id) {
+                if (id >= segment_id || id >= _open_segment_id) {
+                    return make_ready_future<>();
+                }
+                return remove_file(segment_name(_cfg.directory, _cfg.prefix, id));
+            });
+        });
+    });
+}
+
+static future<> replay_segment(sstring name, uint64_t id,
+        std::function<future<> (temporary_buffer<char>, append_log_position)>& func) {
+    return open_file_dma(name, open_flags::ro).then([id, &func] (file f) {
+        // Segments are created at their full size
+        return f.size().then([f, id, &func] (uint64_t segment_size) {
+            struct state {
+                input_stream<char> in;
+                uint64_t pos = 0;
+                state(file f) : in(make_file_input_stream(std::move(f))) {}
+            };
+            auto s = make_lw_shared<state>(f);
+            return repeat([s, id, segment_size, &func] {
+                return s->in.read_exactly(append_log::record_header_size).then([s, id, segment_size, &func] (temporary_buffer<char> hdr) {
+                    if (hdr.size() < append_log::record_header_size) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    auto len = get_le32(hdr.get());
+                    auto crc = get_le32(hdr.get() + 4);
+                    // A length that runs past the end of the segment is
+                    // garbage left by an incomplete write; do not try to
+                    // read that much.
+                    if (len == 0 || len > segment_size - s->pos - append_log::record_header_size) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    return s->in.read_exactly(len).then([s, id, len, crc, &func] (temporary_buffer<char> data) {
+                        // A short or corrupt record is a write that did not
+                        // complete; it ends the segment.
+                        if (data.size() < len || crc32(data.get(), data.size()) != crc) {
+                            return make_ready_future<stop_iteration>(stop_iteration::yes);
+                        }
+                        auto pos = append_log_position{id, s->pos};
+                        s->pos += append_log::record_header_size + len;
+                        return func(std::move(data), pos).then([] {
+                            return stop_iteration::no;
+                        });
+                    });
+                });
+            }).finally([s] {
+                // Waits for the read-ahead still in flight on the file
+                return s->in.close();
+            });
+        }).finally([f] () mutable {
+            return f.close();
+        });
+    });
+}
+
+future<> replay_append_log(sstring directory, sstring prefix,
+        std::function<future<> (temporary_buffer<char>, append_log_position)> func) {
+    return list_segments(directory, prefix).then([directory, prefix, func = std::move(func)] (std::vector<uint64_t> ids) mutable {
+        return do_with(std::move(ids), std::move(func), [directory, prefix] (auto& ids, auto& func) {
+            return do_for_each(ids, [directory, prefix, &func] (uint64_t id) {
+                return replay_segment(segment_name(directory, prefix, id), id, func);
+            });
+        });
+    });
+}
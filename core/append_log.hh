@@ -0,0 +1,163 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+
+// Append-only, segmented log with group commit.
+//
+// Records appended to an append_log are packed into aligned buffers and
+// written to the current segment with DMA writes; records appended while a
+// write is in progress, or within the configured commit window, share both
+// the write and the following fdatasync.  The future returned by append()
+// resolves once the record is on stable storage.
+//
+// Segments are preallocated files named <prefix>-<id>.log in the log
+// directory.  Each record is stored as a little-endian header (payload
+// length and CRC32 of the payload) followed by the payload; a zero length
+// marks the end of the data in a segment.  replay_append_log() streams the
+// records of all segments back in order, stopping at the first torn or
+// corrupt record of each segment.
+
+#include "file.hh"
+#include "semaphore.hh"
+#include "timer.hh"
+#include "temporary_buffer.hh"
+#include "sstring.hh"
+#include <experimental/optional>
+#include <chrono>
+#include <vector>
+#include <memory>
+
+/// \addtogroup fileio-module
+/// @{
+
+/// Configuration of an \ref append_log.
+struct append_log_config {
+    /// Directory holding the segment files.  It must exist.
+    sstring directory;
+    /// Segment file names are <prefix>-<id>.log.
+    sstring prefix = "log";
+    /// Size each segment is preallocated to; no record may be larger.
+    uint64_t segment_size = 32 << 20;
+    /// Preferred size of a single write.  Appends are batched up to this
+    /// size before a write is issued regardless of the commit window.
+    size_t buffer_size = 128 << 10;
+    /// How long the first record of a batch may wait for more records
+    /// before the batch is written and synced.  Zero writes as soon as the
+    /// previous write completes, still batching records that arrive meanwhile.
+    std::chrono::microseconds commit_window = std::chrono::microseconds(1000);
+    ::io_priority_class io_priority_class = default_priority_class();
+    /// If set, applied to each segment file once it is opened, e.g. to
+    /// account for or interpose on its I/O.
+    std::function<file (file)> segment_file_wrapper;
+};
+
+/// Location of a record in the log.
+struct append_log_position {
+    uint64_t segment_id;
+    uint64_t offset;
+};
+
+/// Append-only log with group commit.
+///
+/// Must be used on the shard that opened it.
+class append_log {
+public:
+    static constexpr size_t record_header_size = 8;
+private:
+    struct batch;
+
+    append_log_config _cfg;
+    uint32_t _disk_alignment;
+    uint32_t _memory_alignment;
+    // Segment new records go to.
+    uint64_t _segment_id;
+    // Segment being written to; lags _segment_id while the batches of the
+    // previous segment are still being written.
+    uint64_t _open_segment_id;
+    file _segment;
+    // Opening (and preallocating) the next segment starts as soon as the
+    // current one is in use, so that rolling over does not stall appends.
+    std::experimental::optional<future<file>> _next_segment;
+    std::unique_ptr<batch> _current;
+    semaphore _write_sem = { 1 };
+    // Writes issued and not completed yet.
+    unsigned _writes_in_flight = 0;
+    // The commit window of _current expired while a write was in flight;
+    // _current is sealed once that write completes.
+    bool _seal_after_write = false;
+    timer<> _commit_timer;
+    std::exception_ptr _failed;
+    bool _closed = false;
+private:
+    struct private_tag {};
+    std::unique_ptr<batch> make_batch(uint64_t segment_id, uint64_t file_pos, size_t min_capacity);
+    void seal(size_t min_capacity = 0);
+    void commit_window_expired();
+    future<> write(std::unique_ptr<batch> b);
+    future<> switch_segment(uint64_t id);
+public:
+    append_log(private_tag, append_log_config cfg, uint64_t segment_id, file segment);
+    /// Opens a log in \c cfg.directory.  Appends go to a new segment,
+    /// numbered after any segment already present; use
+    /// \ref replay_append_log() first to recover existing records.
+    static future<lw_shared_ptr<append_log>> open(append_log_config cfg);
+
+    append_log(const append_log&) = delete;
+    append_log& operator=(const append_log&) = delete;
+    ~append_log();
+
+    /// Appends a record.  Empty records are rejected with
+    /// std::invalid_argument.
+    ///
+    /// \return the position of the record, once it has been written and
+    ///         synced to stable storage together with the rest of its batch.
+    future<append_log_position> append(const char* data, size_t len);
+    future<append_log_position> append(const temporary_buffer<char>& data) {
+        return append(data.get(), data.size());
+    }
+
+    /// Writes and syncs all appended records without waiting for the
+    /// commit window to expire.
+    future<> sync();
+
+    /// Syncs outstanding records and closes the current segment.  No
+    /// appends may be issued after close() is called.
+    future<> close();
+
+    /// Removes all segments with an id lower than \c segment_id, once
+    /// their records are no longer needed.
+    future<> remove_segments_before(uint64_t segment_id);
+
+    /// Id of the segment new records are appended to.
+    uint64_t current_segment_id() const { return _segment_id; }
+};
+
+/// Reads back all records of the log in \c directory, in append order.
+///
+/// \param func called for each record, with its payload and position; the
+///             next record is read after the returned future resolves.
+future<> replay_append_log(sstring directory, sstring prefix,
+        std::function<future<> (temporary_buffer<char>, append_log_position)> func);
+
+/// @}
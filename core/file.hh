@@ -29,6 +29,9 @@
 #include "core/future-util.hh"
 #include "core/fair_queue.hh"
 #include <experimental/optional>
+#include <algorithm>
+#include <numeric>
+#include <vector>
 #include <system_error>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
@@ -81,6 +84,18 @@ struct file_open_options {
     uint64_t extent_allocation_size_hint = 1 << 20; ///< Allocate this much disk space when extending the file
 };
 
+/// Options for \ref file::dma_read_many()
+///
+/// Controls how neighbouring read requests are merged into larger reads.
+struct dma_read_many_options {
+    /// Requests separated by at most this many bytes (after alignment) are
+    /// served by one read; the bytes in the gap are read and discarded.
+    size_t max_gap = 16 << 10;
+    /// Requests are not merged beyond this size.  A single request larger
+    /// than this is still issued as one read.
+    size_t max_read_size = 128 << 10;
+};
+
 /// \cond internal
 class io_queue;
 class io_priority_class {
@@ -141,6 +156,7 @@ class posix_file_impl : public file_impl {
     virtual subscription<directory_entry> list_directory(std::function<future<> (directory_entry de)> next) override;
 private:
     void query_dma_alignment();
+    future<> flush_threaded();
 };
 
 class blockdev_file_impl : public posix_file_impl {
@@ -303,6 +319,26 @@ class file {
         });
     }
 
+    /**
+     * Read a batch of byte ranges, merging neighbouring ranges into fewer
+     * larger reads.
+     *
+     * @param ranges (offset, length) pairs to read; no alignment is required
+     *        and the ranges may be given in any order and may overlap.
+     * @param options controls how ranges are merged
+     * @param pc the IO priority class under which to queue the reads
+     *
+     * @return a vector with one buffer per requested range, in the order of
+     *         \c ranges.  Buffers of merged ranges share the memory of the
+     *         read that covered them, so no data is copied.  A buffer may be
+     *         shorter than requested (or empty) if EOF is reached.
+     * @throw exception in case of I/O error
+     */
+    template <typename CharType>
+    future<std::vector<temporary_buffer<CharType>>>
+    dma_read_many(std::vector<std::pair<uint64_t, size_t>> ranges,
+            dma_read_many_options options = {}, const io_priority_class& pc = default_priority_class());
+
     /// Performs a DMA read into the specified iovec.
     ///
     /// \param pos offset to read from.  Must be aligned to \ref dma_alignment.
@@ -585,6 +621,64 @@ file::dma_read_bulk(uint64_t offset, size_t range_size, const io_priority_class&
     });
 }
 
+template <typename CharType>
+future<std::vector<temporary_buffer<CharType>>>
+file::dma_read_many(std::vector<std::pair<uint64_t, size_t>> ranges,
+        dma_read_many_options options, const io_priority_class& pc) {
+    using tmp_buf_type = temporary_buffer<CharType>;
+    struct read_group {
+        uint64_t pos;
+        uint64_t end;
+        std::vector<size_t> members;
+    };
+
+    std::vector<size_t> order(ranges.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&ranges] (size_t a, size_t b) {
+        return ranges[a].first < ranges[b].first;
+    });
+
+    //
+    // Walk the ranges by offset, and extend the current read for as long as
+    // the next range starts close enough to its end.
+    //
+    auto alignment = disk_read_dma_alignment();
+    std::vector<read_group> groups;
+    for (auto i : order) {
+        auto start = ranges[i].first;
+        auto end = start + ranges[i].second;
+        if (!groups.empty()) {
+            auto& g = groups.back();
+            auto merged_end = std::max(g.end, end);
+            if (align_down(start, alignment) <= align_up(g.end, alignment) + options.max_gap
+                    && merged_end - g.pos <= options.max_read_size) {
+                g.end = merged_end;
+                g.members.push_back(i);
+                continue;
+            }
+        }
+        groups.push_back(read_group{start, end, {i}});
+    }
+
+    auto result = make_lw_shared<std::vector<tmp_buf_type>>(ranges.size());
+    return do_with(std::move(ranges), std::move(groups),
+            [this, result, &pc] (auto& ranges, auto& groups) {
+        return parallel_for_each(groups, [this, result, &ranges, &pc] (read_group& g) {
+            return this->dma_read_bulk<CharType>(g.pos, g.end - g.pos, pc).then(
+                    [result, &ranges, &g] (tmp_buf_type buf) {
+                for (auto i : g.members) {
+                    auto off = ranges[i].first - g.pos;
+                    if (off < buf.size()) {
+                        (*result)[i] = buf.share(off, std::min(ranges[i].second, buf.size() - off));
+                    }
+                }
+            });
+        }).then([result] {
+            return make_ready_future<std::vector<tmp_buf_type>>(std::move(*result));
+        });
+    });
+}
+
 template <typename CharType>
 future<temporary_buffer<CharType>>
 file::read_maybe_eof(uint64_t pos, size_t len, const io_priority_class& pc) {
@@ -141,6 +141,39 @@ input_stream<CharType>::read_exactly(size_t n) {
     }
 }
 
+template <typename CharType>
+future<net::packet>
+input_stream<CharType>::read_exactly_scattered_part(size_t n, net::packet out) {
+    while (out.len() < n) {
+        if (_buf.empty()) {
+            if (_eof) {
+                break;
+            }
+            return _fd.get().then([this, n, out = std::move(out)] (tmp_buf buf) mutable {
+                _eof = buf.empty();
+                _buf = std::move(buf);
+                return this->read_exactly_scattered_part(n, std::move(out));
+            });
+        }
+        auto now = std::min(n - out.len(), available());
+        if (now == available()) {
+            out = net::packet(std::move(out), std::move(_buf));
+            _buf = tmp_buf();
+        } else {
+            out = net::packet(std::move(out), _buf.share(0, now));
+            _buf.trim_front(now);
+        }
+    }
+    return make_ready_future<net::packet>(std::move(out));
+}
+
+template <typename CharType>
+future<net::packet>
+input_stream<CharType>::read_exactly_scattered(size_t n) {
+    static_assert(std::is_same<CharType, char>::value, "packet works on char");
+    return read_exactly_scattered_part(n, net::packet());
+}
+
 template <typename CharType>
 template <typename Consumer>
 future<>
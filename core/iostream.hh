@@ -140,6 +140,11 @@ class input_stream final {
     input_stream(input_stream&&) = default;
     input_stream& operator=(input_stream&&) = default;
     future<temporary_buffer<CharType>> read_exactly(size_t n);
+    /// Reads exactly \c n bytes (fewer only at end of stream) without
+    /// copying or linearizing them: the returned packet's fragments share
+    /// the buffers produced by the data source, so a large body that
+    /// arrived in many small pieces is handed over as is.
+    future<net::packet> read_exactly_scattered(size_t n);
     template <typename Consumer>
     future<> consume(Consumer& c);
     bool eof() { return _eof; }
@@ -160,6 +165,7 @@ class input_stream final {
     }
 private:
     future<temporary_buffer<CharType>> read_exactly_part(size_t n, tmp_buf buf, size_t completed);
+    future<net::packet> read_exactly_scattered_part(size_t n, net::packet out);
 };
 
 // Facilitates data buffering before it's handed over to data_sink.
@@ -0,0 +1,345 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "page_cache.hh"
+#include "future-util.hh"
+#include "do_with.hh"
+#include <boost/range/irange.hpp>
+#include <cstring>
+#include <limits>
+
+class cached_file_impl : public file_impl {
+    page_cache& _cache;
+    file _file;
+    uint64_t _dev;
+    uint64_t _ino;
+public:
+    cached_file_impl(page_cache& cache, file f, uint64_t dev, uint64_t ino)
+            : _cache(cache), _file(std::move(f)), _dev(dev), _ino(ino) {
+        _memory_dma_alignment = _file.memory_dma_alignment();
+        _disk_read_dma_alignment = _file.disk_read_dma_alignment();
+        _disk_write_dma_alignment = _file.disk_write_dma_alignment();
+    }
+
+    virtual future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len, const io_priority_class& pc) override {
+        invalidate_range(pos, len);
+        return _file.dma_write(pos, reinterpret_cast<const char*>(buffer), len, pc).finally([this, pos, len] {
+            // Drop blocks that were re-read while the write was in flight.
+            invalidate_range(pos, len);
+        });
+    }
+
+    virtual future<size_t> write_dma(uint64_t pos, std::vector<iovec> iov, const io_priority_class& pc) override {
+        size_t len = 0;
+        for (auto&& v : iov) {
+            len += v.iov_len;
+        }
+        invalidate_range(pos, len);
+        return _file.dma_write(pos, std::move(iov), pc).finally([this, pos, len] {
+            invalidate_range(pos, len);
+        });
+    }
+
+    virtual future<size_t> read_dma(uint64_t pos, void* buffer, size_t len, const io_priority_class& pc) override {
+        if (!len) {
+            return make_ready_future<size_t>(0);
+        }
+        auto bs = _cache.block_size();
+        auto first = pos / bs;
+        auto last = (pos + len - 1) / bs;
+        auto copied = make_lw_shared<std::vector<size_t>>(last - first + 1, 0);
+        auto dst = static_cast<char*>(buffer);
+        return parallel_for_each(boost::irange(first, last + 1), [this, pos, dst, len, bs, first, copied, &pc] (uint64_t idx) {
+            return _cache.get_block(_file, page_cache::block_key{_dev, _ino, idx}, pc).then(
+                    [pos, dst, len, bs, idx, first, copied] (temporary_buffer<char> data) {
+                auto block_start = idx * bs;
+                auto from = std::max(pos, block_start);
+                auto to = std::min(pos + len, block_start + data.size());
+                if (from < to) {
+                    std::memcpy(dst + (from - pos), data.get() + (from - block_start), to - from);
+                    (*copied)[idx - first] = to - from;
+                }
+            });
+        }).then([pos, len, bs, first, copied] {
+            // A block shorter than requested marks end-of-file; whatever
+            // follows it in the buffer is not valid data.
+            size_t total = 0;
+            for (size_t i = 0; i < copied->size(); ++i) {
+                auto block_start = (first + i) * bs;
+                auto wanted = std::min(pos + len, block_start + bs) - std::max(pos, block_start);
+                total += (*copied)[i];
+                if ((*copied)[i] < wanted) {
+                    break;
+                }
+            }
+            return make_ready_future<size_t>(total);
+        });
+    }
+
+    virtual future<size_t> read_dma(uint64_t pos, std::vector<iovec> iov, const io_priority_class& pc) override {
+        return do_with(std::move(iov), size_t(0), false, [this, pos, &pc] (std::vector<iovec>& iov, size_t& total, bool& eof) {
+            return do_for_each(iov, [this, pos, &total, &eof, &pc] (iovec& v) {
+                if (eof) {
+                    return make_ready_future<>();
+                }
+                return read_dma(pos + total, v.iov_base, v.iov_len, pc).then([&total, &eof, &v] (size_t n) {
+                    total += n;
+                    eof = n < v.iov_len;
+                });
+            }).then([&total] {
+                return make_ready_future<size_t>(total);
+            });
+        });
+    }
+
+    virtual future<> flush(void) override {
+        return _file.flush();
+    }
+
+    virtual future<struct stat> stat(void) override {
+        return _file.stat();
+    }
+
+    virtual future<> truncate(uint64_t length) override {
+        _cache.invalidate(_dev, _ino);
+        return _file.truncate(length);
+    }
+
+    virtual future<> discard(uint64_t offset, uint64_t length) override {
+        invalidate_range(offset, length);
+        return _file.discard(offset, length);
+    }
+
+    virtual future<> allocate(uint64_t position, uint64_t length) override {
+        return _file.allocate(position, length);
+    }
+
+    virtual future<uint64_t> size(void) override {
+        return _file.size();
+    }
+
+    virtual future<> close() override {
+        return _file.close();
+    }
+
+    virtual subscription<directory_entry> list_directory(std::function<future<> (directory_entry de)> next) override {
+        return _file.list_directory(std::move(next));
+    }
+private:
+    void invalidate_range(uint64_t pos, uint64_t len) {
+        if (!len) {
+            return;
+        }
+        auto bs = _cache.block_size();
+        _cache.invalidate(_dev, _ino, pos / bs, (pos + len - 1) / bs);
+    }
+};
+
+page_cache::page_cache(size_t max_memory, size_t block_size)
+        : _max_memory(max_memory)
+        , _block_size(block_size)
+        , _reclaimer([this] { return reclaim(); })
+        , _collectd_regs(register_collectd_metrics()) {
+    assert(block_size && !(block_size & (block_size - 1)));
+}
+
+page_cache::~page_cache() {
+    _clock.clear();
+}
+
+future<file> page_cache::wrap(file f) {
+    if (_block_size % f.disk_read_dma_alignment() || _block_size % f.memory_dma_alignment()) {
+        return make_ready_future<file>(std::move(f));
+    }
+    auto st = f.stat();
+    return st.then([this, f = std::move(f)] (struct stat st) mutable {
+        return file(make_shared<cached_file_impl>(*this, std::move(f), st.st_dev, st.st_ino));
+    });
+}
+
+future<temporary_buffer<char>>
+page_cache::get_block(file& f, block_key key, const io_priority_class& pc) {
+    auto i = _blocks.find(key);
+    if (i != _blocks.end()) {
+        auto& b = i->second;
+        if (b.loaded) {
+            ++_stats.hits;
+            b.referenced = true;
+            return make_ready_future<temporary_buffer<char>>(b.data.share());
+        }
+        if (!b.stale) {
+            ++_stats.coalesced;
+            return b.loading.get_future().then([] (lw_shared_ptr<temporary_buffer<char>> data) {
+                return data->share();
+            });
+        }
+        // The read in progress started before a write to this block, and
+        // may return the old data; start over.
+        b.stale = false;
+        b.loading = {};
+    }
+    ++_stats.misses;
+    auto generation = ++_next_generation;
+    auto& nb = _blocks[key];
+    nb.key = key;
+    nb.generation = generation;
+    auto loading = shared_future<lw_shared_ptr<temporary_buffer<char>>>(load_block(f, key, generation, pc));
+    // The read may have completed (and the entry been dropped) already.
+    i = _blocks.find(key);
+    if (i != _blocks.end() && !i->second.loaded && i->second.generation == generation) {
+        i->second.loading = loading;
+    }
+    return loading.get_future().then([] (lw_shared_ptr<temporary_buffer<char>> data) {
+        return data->share();
+    });
+}
+
+future<lw_shared_ptr<temporary_buffer<char>>>
+page_cache::load_block(file f, block_key key, uint64_t generation, const io_priority_class& pc) {
+    auto buf = temporary_buffer<char>::aligned(f.memory_dma_alignment(), _block_size);
+    auto p = buf.get_write();
+    auto read = f.dma_read(key.index * _block_size, p, _block_size, pc);
+    return read.then_wrapped([this, key, generation, f, buf = std::move(buf)] (future<size_t> fut) mutable {
+        // A stale read may have been superseded by a newer one, whose entry
+        // is not ours to update.
+        auto i = _blocks.find(key);
+        auto owned = i != _blocks.end() && i->second.generation == generation;
+        try {
+            size_t size;
+            try {
+                size = std::get<0>(fut.get());
+            } catch (std::system_error& e) {
+                // Reading past the end of a file whose size is not
+                // aligned may fail with EINVAL; treat it as end-of-file.
+                if (e.code().value() != EINVAL) {
+                    throw;
+                }
+                size = 0;
+            }
+            buf.trim(size);
+        } catch (...) {
+            if (owned) {
+                _blocks.erase(i);
+            }
+            throw;
+        }
+        auto data = make_lw_shared<temporary_buffer<char>>(std::move(buf));
+        if (!owned) {
+            return data;
+        }
+        auto& b = i->second;
+        if (b.stale) {
+            _blocks.erase(i);
+            return data;
+        }
+        b.data = data->share();
+        b.loaded = true;
+        b.loading = {};
+        _clock.push_back(b);
+        _used_memory += _block_size;
+        shrink(_max_memory);
+        return data;
+    });
+}
+
+void page_cache::invalidate(uint64_t dev, uint64_t ino) {
+    invalidate(dev, ino, 0, std::numeric_limits<uint64_t>::max());
+}
+
+void page_cache::invalidate(uint64_t dev, uint64_t ino, uint64_t first_index, uint64_t last_index) {
+    auto drop = [this] (block& b) {
+        if (b.loaded) {
+            erase(b);
+        } else {
+            b.stale = true;
+        }
+    };
+    if (last_index - first_index < _blocks.size()) {
+        for (auto idx = first_index; idx <= last_index; ++idx) {
+            auto i = _blocks.find(block_key{dev, ino, idx});
+            if (i != _blocks.end()) {
+                drop(i->second);
+            }
+        }
+        return;
+    }
+    for (auto i = _blocks.begin(); i != _blocks.end();) {
+        auto& b = (i++)->second;
+        if (b.key.dev == dev && b.key.ino == ino
+                && b.key.index >= first_index && b.key.index <= last_index) {
+            drop(b);
+        }
+    }
+}
+
+void page_cache::erase(block& b) {
+    _clock.erase(_clock.iterator_to(b));
+    _used_memory -= _block_size;
+    _blocks.erase(b.key);
+}
+
+bool page_cache::evict_one() {
+    while (!_clock.empty()) {
+        auto& b = _clock.front();
+        if (b.referenced) {
+            b.referenced = false;
+            _clock.pop_front();
+            _clock.push_back(b);
+            continue;
+        }
+        erase(b);
+        ++_stats.evictions;
+        return true;
+    }
+    return false;
+}
+
+void page_cache::shrink(size_t target) {
+    while (_used_memory > target && evict_one()) {
+    }
+}
+
+memory::reclaiming_result page_cache::reclaim() {
+    if (_clock.empty()) {
+        return memory::reclaiming_result::reclaimed_nothing;
+    }
+    // Give back a batch at a time, so that a burst of allocations does
+    // not have to call us once per block.
+    static constexpr size_t reclaim_batch = 64 * memory::page_size;
+    shrink(_used_memory - std::min(_used_memory, std::max(reclaim_batch, _block_size)));
+    return memory::reclaiming_result::reclaimed_something;
+}
+
+scollectd::registrations page_cache::register_collectd_metrics() {
+    auto add = [] (auto type_name, auto name, auto data_type, auto func) {
+        return scollectd::add_polled_metric(scollectd::type_instance_id("page_cache",
+                scollectd::per_cpu_plugin_instance,
+                type_name, name),
+                scollectd::make_typed(data_type, func));
+    };
+    return scollectd::registrations({
+        add("total_operations", "hits", scollectd::data_type::DERIVE, [this] { return _stats.hits; }),
+        add("total_operations", "misses", scollectd::data_type::DERIVE, [this] { return _stats.misses; }),
+        add("total_operations", "coalesced", scollectd::data_type::DERIVE, [this] { return _stats.coalesced; }),
+        add("total_operations", "evictions", scollectd::data_type::DERIVE, [this] { return _stats.evictions; }),
+        add("bytes", "used", scollectd::data_type::GAUGE, [this] { return _used_memory; }),
+    });
+}
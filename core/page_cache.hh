@@ -0,0 +1,152 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+
+// Per-shard block cache for read-mostly files.
+//
+// Seastar files bypass the kernel page cache (O_DIRECT), so every read
+// reaches the disk.  A page_cache keeps aligned blocks of files in memory
+// and serves reads from them.  Files are wrapped with page_cache::wrap(),
+// which returns a \ref file whose reads go through the cache; blocks are
+// keyed by the (device, inode) of the underlying file, so the cache remains
+// effective across separate opens of the same file.
+//
+// Eviction uses the CLOCK (second chance) algorithm, and the cache gives
+// memory back to the allocator when the system runs low on memory.
+// Concurrent misses on the same block are coalesced into a single read.
+//
+// Writes through a wrapped file invalidate the affected blocks; writes
+// through other (unwrapped) handles are not seen, which is why the cache
+// is meant for read-mostly data.
+
+#include "file.hh"
+#include "memory.hh"
+#include "shared_future.hh"
+#include "scollectd.hh"
+#include "temporary_buffer.hh"
+#include <boost/intrusive/list.hpp>
+#include <unordered_map>
+#include <vector>
+
+class cached_file_impl;
+
+/// \addtogroup fileio-module
+/// @{
+
+/// Cache of file blocks, to be instantiated once per shard.
+class page_cache {
+public:
+    /// Cache statistics.
+    struct stats {
+        uint64_t hits = 0;        ///< Block lookups served from memory
+        uint64_t misses = 0;      ///< Block lookups that caused a disk read
+        uint64_t coalesced = 0;   ///< Block lookups that waited for a read already in progress
+        uint64_t evictions = 0;   ///< Blocks dropped due to the memory limit or reclaim
+    };
+private:
+    struct block_key {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t index;
+        bool operator==(const block_key& x) const {
+            return dev == x.dev && ino == x.ino && index == x.index;
+        }
+    };
+    struct block_key_hash {
+        size_t operator()(const block_key& k) const {
+            auto h = std::hash<uint64_t>()(k.dev);
+            h = h * 31 + std::hash<uint64_t>()(k.ino);
+            h = h * 31 + std::hash<uint64_t>()(k.index);
+            return h;
+        }
+    };
+    struct block {
+        block_key key;
+        temporary_buffer<char> data;
+        // Engaged while the block is being read from disk; later lookups
+        // of the same block wait on it instead of issuing another read.
+        shared_future<lw_shared_ptr<temporary_buffer<char>>> loading;
+        bool loaded = false;
+        // Set on each hit; cleared when the clock hand passes over the block.
+        bool referenced = false;
+        // Set when the block was invalidated while being loaded; it is
+        // dropped as soon as the read completes, and later lookups start
+        // a new read instead of waiting for it.
+        bool stale = false;
+        // Identifies the read that fills this entry, so that a stale read
+        // completing late does not touch the entry that replaced it.
+        uint64_t generation = 0;
+        boost::intrusive::list_member_hook<> clock_link;
+    };
+    using block_map = std::unordered_map<block_key, block, block_key_hash>;
+    using clock_list = boost::intrusive::list<block,
+        boost::intrusive::member_hook<block, boost::intrusive::list_member_hook<>, &block::clock_link>,
+        boost::intrusive::constant_time_size<false>>;
+    size_t _max_memory;
+    size_t _block_size;
+    size_t _used_memory = 0;
+    uint64_t _next_generation = 0;
+    block_map _blocks;
+    clock_list _clock;
+    stats _stats;
+    memory::reclaimer _reclaimer;
+    scollectd::registrations _collectd_regs;
+public:
+    /// Constructs a page cache.
+    ///
+    /// \param max_memory upper bound on the memory used for cached data, in bytes
+    /// \param block_size granularity of caching; must be a power of two, and a
+    ///                   multiple of the read alignment of the cached files.
+    explicit page_cache(size_t max_memory, size_t block_size = 4096);
+    ~page_cache();
+    page_cache(const page_cache&) = delete;
+    page_cache& operator=(const page_cache&) = delete;
+
+    /// Wraps a file so that reads from it are served through this cache.
+    ///
+    /// The cache must outlive the returned file.  If the file's read alignment
+    /// is incompatible with the cache's block size, the file is returned as is.
+    future<file> wrap(file f);
+
+    /// Drops all cached blocks of the file with the given device and inode.
+    void invalidate(uint64_t dev, uint64_t ino);
+
+    /// Memory currently used by cached blocks, in bytes.
+    size_t used_memory() const { return _used_memory; }
+    size_t block_size() const { return _block_size; }
+    const stats& get_stats() const { return _stats; }
+private:
+    future<temporary_buffer<char>> get_block(file& f, block_key key, const io_priority_class& pc);
+    future<lw_shared_ptr<temporary_buffer<char>>> load_block(file f, block_key key, uint64_t generation, const io_priority_class& pc);
+    void invalidate(uint64_t dev, uint64_t ino, uint64_t first_index, uint64_t last_index);
+    void erase(block& b);
+    bool evict_one();
+    void shrink(size_t target);
+    memory::reclaiming_result reclaim();
+    scollectd::registrations register_collectd_metrics();
+
+    friend class cached_file_impl;
+};
+
+/// @}
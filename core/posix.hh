@@ -205,6 +205,14 @@ class file_desc {
         throw_system_error_on(r == -1, "recvmsg");
         return { size_t(r) };
     }
+    boost::optional<size_t> recvmmsg(mmsghdr* msgvec, unsigned vlen, int flags) {
+        auto r = ::recvmmsg(_fd, msgvec, vlen, flags, nullptr);
+        if (r == -1 && errno == EAGAIN) {
+            return {};
+        }
+        throw_system_error_on(r == -1, "recvmmsg");
+        return { size_t(r) };
+    }
     boost::optional<size_t> send(const void* buffer, size_t len, int flags) {
         auto r = ::send(_fd, buffer, len, flags);
         if (r == -1 && errno == EAGAIN) {
@@ -229,6 +237,14 @@ class file_desc {
         throw_system_error_on(r == -1, "sendmsg");
         return { size_t(r) };
     }
+    boost::optional<size_t> sendmmsg(mmsghdr* msgvec, unsigned vlen, int flags) {
+        auto r = ::sendmmsg(_fd, msgvec, vlen, flags);
+        if (r == -1 && errno == EAGAIN) {
+            return {};
+        }
+        throw_system_error_on(r == -1, "sendmmsg");
+        return { size_t(r) };
+    }
     void bind(sockaddr& sa, socklen_t sl) {
         auto r = ::bind(_fd, &sa, sl);
         throw_system_error_on(r == -1, "bind");
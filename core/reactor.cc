@@ -54,6 +54,7 @@
 #include <dirent.h>
 #include <linux/types.h> // for xfs, below
 #include <sys/ioctl.h>
+#include <netinet/tcp.h>
 #include <xfs/linux.h>
 #define min min    /* prevent xfs.h from defining min() as a macro */
 #include <xfs/xfs.h>
@@ -234,7 +235,7 @@ reactor::reactor()
     , _cpu_started(0)
     , _io_context(0)
     , _io_context_available(max_aio)
-    , _reuseport(posix_reuseport_detect()) {
+    , _reuseport(posix_reuseport_detect(false)) {
 
     seastar::thread_impl::init();
     auto r = ::io_setup(max_aio, &_io_context);
@@ -378,6 +379,10 @@ class network_stack_registry {
 };
 
 void reactor::configure(boost::program_options::variables_map vm) {
+    // Before the network stack, which picks its listening sockets from it
+    if (vm.count("reuseport-cpu-steering")) {
+        _reuseport = _reuseport_steering = posix_reuseport_detect(true);
+    }
     auto network_stack_ready = vm.count("network-stack")
         ? network_stack_registry::create(sstring(vm["network-stack"].as<std::string>()), vm)
         : network_stack_registry::create(vm);
@@ -391,6 +396,12 @@ void reactor::configure(boost::program_options::variables_map vm) {
         _max_poll_time = std::chrono::nanoseconds::max();
     }
     set_strict_dma(!vm.count("relaxed-dma"));
+    _aio_fdsync = !vm.count("no-aio-fsync");
+    _busy_poll_usec = vm["busy-poll-us"].as<unsigned>();
+    _prefer_busy_poll = vm.count("prefer-busy-poll");
+#ifndef HAVE_OSV
+    _thread_pool.set_nr_threads(vm["syscall-threads"].as<unsigned>());
+#endif
 }
 
 future<> reactor_backend_epoll::get_epoll_future(pollable_fd_state& pfd,
@@ -463,6 +474,16 @@ future<> reactor_backend_epoll::notified(reactor_notifier *n) {
 }
 
 
+static const char* posix_congestion_control_name(tcp_congestion_control cc) {
+    switch (cc) {
+    case tcp_congestion_control::reno: return "reno";
+    case tcp_congestion_control::cubic: return "cubic";
+    case tcp_congestion_control::bbr: return "bbr";
+    case tcp_congestion_control::stack_default: break;
+    }
+    abort();
+}
+
 pollable_fd
 reactor::posix_listen(socket_address sa, listen_options opts) {
     file_desc fd = file_desc::socket(sa.u.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, int(opts.proto));
@@ -471,6 +492,10 @@ reactor::posix_listen(socket_address sa, listen_options opts) {
     }
     if (_reuseport)
         fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+    if (opts.congestion_control != tcp_congestion_control::stack_default) {
+        // Inherited by the accepted sockets
+        fd.setsockopt(IPPROTO_TCP, TCP_CONGESTION, posix_congestion_control_name(opts.congestion_control));
+    }
 
     fd.bind(sa.u.sa, sizeof(sa.u.sas));
     fd.listen(100);
@@ -478,9 +503,11 @@ reactor::posix_listen(socket_address sa, listen_options opts) {
 }
 
 bool
-reactor::posix_reuseport_detect() {
-    return false; // FIXME: reuseport currently leads to heavy load imbalance. Until we fix that, just
-                  // disable it unconditionally.
+reactor::posix_reuseport_detect(bool steering) {
+    if (!steering) {
+        return false; // FIXME: reuseport with the kernel's hash leads to heavy load imbalance, so it is
+                      // only used when steering connections by CPU.
+    }
     try {
         file_desc fd = file_desc::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
@@ -490,6 +517,87 @@ reactor::posix_reuseport_detect() {
     }
 }
 
+class reactor::busy_poll_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    busy_poll_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll() final override {
+        return _r.busy_poll_napi();
+    }
+    virtual bool pure_poll() override final {
+        return poll(); // actually performs work, but triggers no user continuations, so okay
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        // Device interrupts take over while sleeping in epoll
+        return true;
+    }
+    virtual void exit_interrupt_mode() override final {
+    }
+};
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_INCOMING_NAPI_ID
+#define SO_INCOMING_NAPI_ID 56
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+unsigned
+reactor::posix_busy_poll_add(file_desc& fd) {
+    if (!_busy_poll_usec) {
+        return 0;
+    }
+    unsigned napi_id;
+    try {
+        fd.setsockopt(SOL_SOCKET, SO_BUSY_POLL, int(_busy_poll_usec));
+        if (_prefer_busy_poll) {
+            fd.setsockopt(SOL_SOCKET, SO_PREFER_BUSY_POLL, 1);
+        }
+        napi_id = fd.getsockopt<unsigned>(SOL_SOCKET, SO_INCOMING_NAPI_ID);
+    } catch (std::system_error& e) {
+        seastar_logger.warn("busy polling disabled: {}", e.what());
+        _busy_poll_usec = 0;
+        return 0;
+    }
+    // No NAPI context (yet) for loopback and some virtual devices
+    if (!napi_id) {
+        return 0;
+    }
+    _napi_sockets[napi_id].push_back(fd.get());
+    if (!_busy_poll_poller) {
+        _busy_poll_poller = poller(std::make_unique<busy_poll_pollfn>(*this));
+    }
+    return napi_id;
+}
+
+void
+reactor::posix_busy_poll_remove(file_desc& fd, unsigned napi_id) {
+    auto i = _napi_sockets.find(napi_id);
+    if (i == _napi_sockets.end()) {
+        return;
+    }
+    auto& fds = i->second;
+    fds.erase(std::remove(fds.begin(), fds.end(), fd.get()), fds.end());
+    if (fds.empty()) {
+        _napi_sockets.erase(i);
+    }
+}
+
+bool
+reactor::busy_poll_napi() {
+    char c;
+    for (auto& n : _napi_sockets) {
+        // A non-blocking read of a busy polled socket with nothing queued
+        // runs its NAPI context once; any socket of the context will do.
+        ::recv(n.second.front(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    }
+    // The packets brought in wake their readers through epoll
+    return false;
+}
+
 lw_shared_ptr<pollable_fd>
 reactor::make_pollable_fd(socket_address sa, transport proto) {
     file_desc fd = file_desc::socket(sa.u.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, int(proto));
@@ -497,7 +605,10 @@ reactor::make_pollable_fd(socket_address sa, transport proto) {
 }
 
 future<>
-reactor::posix_connect(lw_shared_ptr<pollable_fd> pfd, socket_address sa, socket_address local) {
+reactor::posix_connect(lw_shared_ptr<pollable_fd> pfd, socket_address sa, socket_address local, connect_options opts) {
+    if (opts.congestion_control != tcp_congestion_control::stack_default) {
+        pfd->get_file_desc().setsockopt(IPPROTO_TCP, TCP_CONGESTION, posix_congestion_control_name(opts.congestion_control));
+    }
     pfd->get_file_desc().bind(local.u.sa, sizeof(sa.u.sas));
     pfd->get_file_desc().connect(sa.u.sa, sizeof(sa.u.sas));
     return pfd->writeable().then([pfd]() mutable {
@@ -524,6 +635,11 @@ reactor::connect(socket_address sa, socket_address local, transport proto) {
     return _network_stack->connect(sa, local, proto);
 }
 
+future<connected_socket>
+reactor::connect(socket_address sa, socket_address local, connect_options opts) {
+    return _network_stack->connect(sa, local, opts);
+}
+
 void reactor_backend_epoll::complete_epoll_event(pollable_fd_state& pfd, promise<> pollable_fd_state::*pr,
         int events, int event) {
     if (pfd.events_requested & events & event) {
@@ -567,7 +683,11 @@ reactor::flush_pending_aio() {
             switch (ec) {
                 case EAGAIN:
                     return did_work;
-                case EBADF: {
+                case EBADF:
+                case EINVAL: {
+                    // Fail only the offending request; EINVAL is returned for
+                    // operations the kernel cannot do asynchronously, such as
+                    // fdsync on older kernels.
                     auto pr = reinterpret_cast<promise<io_event>*>(iocbs[0]->data);
                     try {
                         throw_kernel_error(r);
@@ -591,7 +711,7 @@ reactor::flush_pending_aio() {
         if (nr_consumed == nr) {
             _pending_aio.clear();
         } else {
-            _pending_aio.erase(_pending_aio.begin(), _pending_aio.begin() + r);
+            _pending_aio.erase(_pending_aio.begin(), _pending_aio.begin() + nr_consumed);
         }
     }
     return did_work;
@@ -1043,10 +1163,39 @@ reactor::touch_directory(sstring name) {
 future<>
 posix_file_impl::flush(void) {
     ++engine()._fsyncs;
+    if (!engine()._aio_fdsync) {
+        return flush_threaded();
+    }
+    auto start = steady_clock_type::now();
+    return engine().submit_io([fd = _fd] (iocb& io) {
+        io_prep_fdsync(&io, fd);
+    }).then_wrapped([this, start] (future<io_event> f) {
+        try {
+            auto ev = std::get<0>(f.get());
+            throw_kernel_error(long(ev.res));
+        } catch (std::system_error& e) {
+            if (e.code().value() != EINVAL) {
+                throw;
+            }
+            // The kernel or filesystem cannot fdsync through aio; stop trying.
+            engine()._aio_fdsync = false;
+            return flush_threaded();
+        }
+        ++engine()._fsyncs_aio;
+        engine()._fsync_aio_latency += std::chrono::duration_cast<std::chrono::microseconds>(steady_clock_type::now() - start);
+        return make_ready_future<>();
+    });
+}
+
+future<>
+posix_file_impl::flush_threaded() {
+    auto start = steady_clock_type::now();
     return engine()._thread_pool.submit<syscall_result<int>>([this] {
         return wrap_syscall<int>(::fdatasync(_fd));
-    }).then([] (syscall_result<int> sr) {
+    }).then([start] (syscall_result<int> sr) {
         sr.throw_if_error();
+        ++engine()._fsyncs_threaded;
+        engine()._fsync_threaded_latency += std::chrono::duration_cast<std::chrono::microseconds>(steady_clock_type::now() - start);
         return make_ready_future<>();
     });
 }
@@ -1426,12 +1575,46 @@ reactor::register_collectd_metrics() {
                     , scollectd::make_typed(scollectd::data_type::DERIVE, _fsyncs)
             ),
             // total_operations value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "fsyncs-aio")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _fsyncs_aio)
+            ),
+            // total_operations value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "fsyncs-threaded")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _fsyncs_threaded)
+            ),
+            // derive value:DERIVE:0:U
+            // Time (in microseconds) spent in fsyncs, per submission path;
+            // divide by the matching operation count for the average latency.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "derive", "fsync-aio-latency-us")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE,
+                            [this] { return uint64_t(_fsync_aio_latency.count()); })
+            ),
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "derive", "fsync-threaded-latency-us")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE,
+                            [this] { return uint64_t(_fsync_threaded_latency.count()); })
+            ),
+            // total_operations value:DERIVE:0:U
             scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
                     , scollectd::per_cpu_plugin_instance
                     , "total_operations", "io-threaded-fallbacks")
                     , scollectd::make_typed(scollectd::data_type::DERIVE,
                             std::bind(&thread_pool::operation_count, &_thread_pool))
             ),
+            // derive value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "derive", "io-threaded-latency-us")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE,
+                            std::bind(&thread_pool::total_latency, &_thread_pool))
+            ),
             scollectd::add_polled_metric(
                 scollectd::type_instance_id("memory",
                     scollectd::per_cpu_plugin_instance,
@@ -2123,6 +2306,7 @@ syscall_work_queue::syscall_work_queue()
 }
 
 void syscall_work_queue::submit_item(syscall_work_queue::work_item* item) {
+    item->_submitted = steady_clock_type::now();
     _queue_has_room.wait().then([this, item] {
         _pending.push(item);
         _start_eventfd.signal(1);
@@ -2135,8 +2319,10 @@ unsigned syscall_work_queue::complete() {
     auto nr = _completed.consume_all([&] (work_item* wi) {
         *end++ = wi;
     });
+    auto now = steady_clock_type::now();
     for (auto p = tmp_buf.data(); p != end; ++p) {
         auto wi = *p;
+        _total_latency += std::chrono::duration_cast<std::chrono::microseconds>(now - wi->_submitted);
         wi->complete();
         delete wi;
     }
@@ -2319,11 +2505,51 @@ void smp_message_queue::start(unsigned cpuid) {
 
 /* not yet implemented for OSv. TODO: do the notification like we do class smp. */
 #ifndef HAVE_OSV
-thread_pool::thread_pool() : _worker_thread([this] { work(); }), _notify(pthread_self()) {
-    engine()._signals.handle_signal(SIGUSR1, [this] { inter_thread_wq.complete(); });
+thread_pool::thread_pool() : _notify(pthread_self()) {
+    add_worker();
+    engine()._signals.handle_signal(SIGUSR1, [this] { complete(); });
+}
+
+void thread_pool::add_worker() {
+    auto w = std::make_unique<worker>();
+    auto& wq = w->inter_thread_wq;
+    w->thread.emplace([this, &wq] { work(wq); });
+    _workers.push_back(std::move(w));
+}
+
+void thread_pool::set_nr_threads(unsigned nr) {
+    while (_workers.size() < nr) {
+        add_worker();
+    }
+}
+
+thread_pool::worker& thread_pool::pick_worker() {
+    auto least_loaded = _workers.front().get();
+    for (auto&& w : _workers) {
+        if (w->inter_thread_wq.outstanding() < least_loaded->inter_thread_wq.outstanding()) {
+            least_loaded = w.get();
+        }
+    }
+    return *least_loaded;
 }
 
-void thread_pool::work() {
+unsigned thread_pool::complete() {
+    unsigned nr = 0;
+    for (auto&& w : _workers) {
+        nr += w->inter_thread_wq.complete();
+    }
+    return nr;
+}
+
+uint64_t thread_pool::total_latency() const {
+    uint64_t total = 0;
+    for (auto&& w : _workers) {
+        total += w->inter_thread_wq._total_latency.count();
+    }
+    return total;
+}
+
+void thread_pool::work(syscall_work_queue& inter_thread_wq) {
     sigset_t mask;
     sigfillset(&mask);
     auto r = ::pthread_sigmask(SIG_BLOCK, &mask, NULL);
@@ -2353,8 +2579,10 @@ void thread_pool::work() {
 
 thread_pool::~thread_pool() {
     _stopped.store(true, std::memory_order_relaxed);
-    inter_thread_wq._start_eventfd.signal(1);
-    _worker_thread.join();
+    for (auto&& w : _workers) {
+        w->inter_thread_wq._start_eventfd.signal(1);
+        w->thread->join();
+    }
 }
 #endif
 
@@ -2453,7 +2681,12 @@ reactor::get_options_description() {
         ("no-handle-interrupt", "ignore SIGINT (for gdb)")
         ("poll-mode", "poll continuously (100% cpu use)")
         ("task-quota-ms", bpo::value<double>()->default_value(2.0), "Max time (ms) between polls")
-        ("relaxed-dma", "allow using buffered I/O if DMA is not available (reduces performance)");
+        ("relaxed-dma", "allow using buffered I/O if DMA is not available (reduces performance)")
+        ("no-aio-fsync", "always fsync files from the syscall thread pool, even if the kernel supports asynchronous fsync")
+        ("syscall-threads", bpo::value<unsigned>()->default_value(1), "Number of threads per cpu used for blocking system calls (file open, stat, fallocate, ...)")
+        ("busy-poll-us", bpo::value<unsigned>()->default_value(0), "posix stack: busy poll the receive queues of the network devices connections come from while the reactor polls, instead of waiting for interrupts; the value is the SO_BUSY_POLL time of the sockets (0: disabled; raising it needs CAP_NET_ADMIN)")
+        ("prefer-busy-poll", "posix stack: with --busy-poll-us, let the kernel defer device interrupts while the queues are busy polled (SO_PREFER_BUSY_POLL; see the napi_defer_hard_irqs and gro_flush_timeout device settings)")
+        ("reuseport-cpu-steering", "posix stack: give each shard its own listening socket (SO_REUSEPORT), and accept each connection on the shard running on the CPU that received it (connections received on other CPUs are spread by the kernel)")
         ;
     opts.add(network_stack_registry::options_description());
     return opts;
@@ -2497,6 +2730,7 @@ struct reactor_deleter {
 thread_local std::unique_ptr<reactor, reactor_deleter> reactor_holder;
 
 std::vector<smp::thread_adaptor> smp::_threads;
+std::vector<unsigned> smp::_shard_cpus;
 std::experimental::optional<boost::barrier> smp::_all_event_loops_done;
 std::vector<reactor*> smp::_reactors;
 smp_message_queue** smp::_qs;
@@ -2650,6 +2884,10 @@ void smp::configure(boost::program_options::variables_map configuration)
     auto resources = resource::allocate(rc);
     std::vector<resource::cpu> allocations = std::move(resources.cpus);
     smp::pin(allocations[0].cpu_id);
+    _shard_cpus.clear();
+    for (auto&& a : allocations) {
+        _shard_cpus.push_back(a.cpu_id);
+    }
     memory::configure(allocations[0].mem, hugepages_path);
 
 #ifdef HAVE_DPDK
@@ -3056,6 +3294,10 @@ future<connected_socket> connect(socket_address sa, socket_address local, transp
     return engine().connect(sa, local, proto);
 }
 
+future<connected_socket> connect(socket_address sa, socket_address local, connect_options opts) {
+    return engine().connect(sa, local, opts);
+}
+
 void reactor::add_high_priority_task(std::unique_ptr<task>&& t) {
     _pending_tasks.push_front(std::move(t));
     // break .then() chains
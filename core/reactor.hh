@@ -184,6 +184,9 @@ class pollable_fd {
     future<pollable_fd, socket_address> accept();
     future<size_t> sendmsg(struct msghdr *msg);
     future<size_t> recvmsg(struct msghdr *msg);
+    // Batched variants: return the number of messages transferred
+    future<size_t> sendmmsg(struct mmsghdr *msgvec, unsigned vlen);
+    future<size_t> recvmmsg(struct mmsghdr *msgvec, unsigned vlen);
     future<size_t> sendto(socket_address addr, const void* buf, size_t len);
     file_desc& get_file_desc() const { return _s->fd; }
     void shutdown(int how) { _s->fd.shutdown(how); }
@@ -276,7 +279,11 @@ class syscall_work_queue {
     lf_queue _completed;
     writeable_eventfd _start_eventfd;
     semaphore _queue_has_room = { queue_length };
+    // Time spent by completed requests from submission to completion,
+    // including time queued behind other requests.
+    std::chrono::microseconds _total_latency{0};
     struct work_item {
+        steady_clock_type::time_point _submitted;
         virtual ~work_item() {}
         virtual void process() = 0;
         virtual void complete() = 0;
@@ -310,6 +317,10 @@ class syscall_work_queue {
     // Returns the number of requests handled.
     unsigned complete();
     void submit_item(work_item* wi);
+    // Requests submitted and not yet completed, including ones waiting for room.
+    size_t outstanding() const {
+        return queue_length - _queue_has_room.current() + _queue_has_room.waiters();
+    }
 
     friend class thread_pool;
 };
@@ -426,8 +437,14 @@ class thread_pool {
     uint64_t _aio_threaded_fallbacks = 0;
 #ifndef HAVE_OSV
     // FIXME: implement using reactor_notifier abstraction we used for SMP
-    syscall_work_queue inter_thread_wq;
-    posix_thread _worker_thread;
+    //
+    // Each worker thread has its own queue; requests go to the least loaded
+    // one, so that a long fsync does not hold up unrelated metadata operations.
+    struct worker {
+        syscall_work_queue inter_thread_wq;
+        std::experimental::optional<posix_thread> thread;
+    };
+    std::vector<std::unique_ptr<worker>> _workers;
     std::atomic<bool> _stopped = { false };
     std::atomic<bool> _main_thread_idle = { false };
     pthread_t _notify;
@@ -437,11 +454,21 @@ class thread_pool {
     template <typename T, typename Func>
     future<T> submit(Func func) {
         ++_aio_threaded_fallbacks;
-        return inter_thread_wq.submit<T>(std::move(func));
+        return pick_worker().inter_thread_wq.submit<T>(std::move(func));
+    }
+    // Like submit(), for work that is not a fallback from aio
+    template <typename T, typename Func>
+    future<T> submit_work(Func func) {
+        return pick_worker().inter_thread_wq.submit<T>(std::move(func));
     }
     uint64_t operation_count() const { return _aio_threaded_fallbacks; }
+    // Total time, in microseconds, spent by completed requests in the pool.
+    uint64_t total_latency() const;
+    // Grows the pool to nr worker threads.
+    void set_nr_threads(unsigned nr);
+    unsigned nr_threads() const { return _workers.size(); }
 
-    unsigned complete() { return inter_thread_wq.complete(); }
+    unsigned complete();
     // Before we enter interrupt mode, we must make sure that the syscall thread will properly
     // generate signals to wake us up. This means we need to make sure that all modifications to
     // the pending and completed fields in the inter_thread_wq are visible to all threads.
@@ -458,9 +485,15 @@ class thread_pool {
 public:
     template <typename T, typename Func>
     future<T> submit(Func func) { std::cout << "thread_pool not yet implemented on osv\n"; abort(); }
+    template <typename T, typename Func>
+    future<T> submit_work(Func func) { return submit<T>(std::move(func)); }
 #endif
 private:
-    void work();
+#ifndef HAVE_OSV
+    void add_worker();
+    worker& pick_worker();
+    void work(syscall_work_queue& wq);
+#endif
 };
 
 // The "reactor_backend" interface provides a method of waiting for various
@@ -636,6 +669,7 @@ class reactor {
     class drain_cross_cpu_freelist_pollfn;
     class lowres_timer_pollfn;
     class epoll_pollfn;
+    class busy_poll_pollfn;
     class syscall_pollfn;
     friend io_pollfn;
     friend signal_pollfn;
@@ -645,6 +679,7 @@ class reactor {
     friend drain_cross_cpu_freelist_pollfn;
     friend lowres_timer_pollfn;
     friend class epoll_pollfn;
+    friend class busy_poll_pollfn;
     friend class syscall_pollfn;
 public:
     class poller {
@@ -727,6 +762,13 @@ class reactor {
     uint64_t _aio_writes = 0;
     uint64_t _aio_write_bytes = 0;
     uint64_t _fsyncs = 0;
+    // fdatasync is submitted through linux-aio until the kernel rejects it,
+    // and through the syscall thread pool from then on.
+    bool _aio_fdsync = true;
+    uint64_t _fsyncs_aio = 0;
+    uint64_t _fsyncs_threaded = 0;
+    std::chrono::microseconds _fsync_aio_latency{0};
+    std::chrono::microseconds _fsync_threaded_latency{0};
     circular_buffer<std::unique_ptr<task>> _pending_tasks;
     circular_buffer<std::unique_ptr<task>> _at_destroy_tasks;
     std::chrono::duration<double> _task_quota;
@@ -744,7 +786,14 @@ class reactor {
     std::unique_ptr<lowres_clock> _lowres_clock;
     lowres_clock::time_point _lowres_next_timeout;
     std::experimental::optional<poller> _epoll_poller;
-    const bool _reuseport;
+    bool _reuseport;
+    bool _reuseport_steering = false;
+    unsigned _busy_poll_usec = 0;
+    bool _prefer_busy_poll = false;
+    // Busy polled sockets, by the NAPI context (device receive queue)
+    // their packets come from
+    std::unordered_map<unsigned, std::vector<int>> _napi_sockets;
+    std::experimental::optional<poller> _busy_poll_poller;
     circular_buffer<double> _loads;
     double _load = 0;
     std::chrono::nanoseconds _max_poll_time = calculate_poll_time();
@@ -800,7 +849,8 @@ class reactor {
     friend class thread_pool;
 
     void run_tasks(circular_buffer<std::unique_ptr<task>>& tasks);
-    bool posix_reuseport_detect();
+    bool posix_reuseport_detect(bool steering);
+    bool busy_poll_napi();
 public:
     static boost::program_options::options_description get_options_description();
     reactor();
@@ -822,13 +872,24 @@ class reactor {
 
     future<connected_socket> connect(socket_address sa);
     future<connected_socket> connect(socket_address, socket_address, seastar::transport proto = seastar::transport::TCP);
+    future<connected_socket> connect(socket_address sa, socket_address local, connect_options opts);
 
     pollable_fd posix_listen(socket_address sa, listen_options opts = {});
 
     bool posix_reuseport_available() const { return _reuseport; }
+    /// Whether listening sockets shared with SO_REUSEPORT hand each new
+    /// connection to the shard running on the CPU that received it
+    /// (--reuseport-cpu-steering), rather than to a kernel hash pick.
+    bool posix_reuseport_steering() const { return _reuseport_steering; }
+    /// Busy polls the receive queue of socket \c fd while the reactor
+    /// polls (--busy-poll-us).  Returns the NAPI id to pass to
+    /// posix_busy_poll_remove() before the socket is closed, or 0 if the
+    /// socket is not busy polled.
+    unsigned posix_busy_poll_add(file_desc& fd);
+    void posix_busy_poll_remove(file_desc& fd, unsigned napi_id);
 
     lw_shared_ptr<pollable_fd> make_pollable_fd(socket_address sa, seastar::transport proto = seastar::transport::TCP);
-    future<> posix_connect(lw_shared_ptr<pollable_fd> pfd, socket_address sa, socket_address local);
+    future<> posix_connect(lw_shared_ptr<pollable_fd> pfd, socket_address sa, socket_address local, connect_options opts = {});
 
     future<pollable_fd, socket_address> accept(pollable_fd_state& listen_fd);
 
@@ -880,6 +941,18 @@ class reactor {
 
     void add_task(std::unique_ptr<task>&& t) { _pending_tasks.push_back(std::move(t)); }
 
+    // Runs func, which must not touch reactor state, on one of this
+    // shard's syscall threads and returns its result. For CPU heavy work
+    // that would otherwise stall the reactor.
+    template <typename T, typename Func>
+    future<T> submit_to_helper_thread(Func func) {
+        return _thread_pool.submit_work<T>(std::move(func));
+    }
+#ifndef HAVE_OSV
+    // Grows this shard's pool of syscall threads to at least nr threads
+    void set_min_helper_threads(unsigned nr) { _thread_pool.set_nr_threads(nr); }
+#endif
+
     /// Set a handler that will be called when there is no task to execute on cpu.
     /// Handler should do a low priority work.
     /// 
@@ -1019,6 +1092,7 @@ class smp {
     static std::vector<reactor*> _reactors;
     static smp_message_queue** _qs;
     static std::thread::id _tmain;
+    static std::vector<unsigned> _shard_cpus;
 
     template <typename Func>
     using returns_future = is_future<std::result_of_t<Func()>>;
@@ -1031,6 +1105,8 @@ class smp {
     static void arrive_at_event_loop_end();
     static void join_all();
     static bool main_thread() { return std::this_thread::get_id() == _tmain; }
+    /// The CPU that shard \c id runs on.
+    static unsigned shard_cpu(unsigned id) { return _shard_cpus[id]; }
 
     /// Runs a function on a remote core.
     ///
@@ -1335,6 +1411,37 @@ future<size_t> pollable_fd::sendmsg(struct msghdr* msg) {
     });
 }
 
+inline
+future<size_t> pollable_fd::recvmmsg(struct mmsghdr *msgvec, unsigned vlen) {
+    return engine().readable(*_s).then([this, msgvec, vlen] {
+        auto r = get_file_desc().recvmmsg(msgvec, vlen, 0);
+        if (!r) {
+            return recvmmsg(msgvec, vlen);
+        }
+        // Unlike recvmsg(), we can tell when the queue was drained: only
+        // speculate when the batch was filled.
+        if (*r == vlen) {
+            _s->speculate_epoll(EPOLLIN);
+        }
+        return make_ready_future<size_t>(*r);
+    });
+}
+
+inline
+future<size_t> pollable_fd::sendmmsg(struct mmsghdr *msgvec, unsigned vlen) {
+    return engine().writeable(*_s).then([this, msgvec, vlen] () mutable {
+        auto r = get_file_desc().sendmmsg(msgvec, vlen, 0);
+        if (!r) {
+            return sendmmsg(msgvec, vlen);
+        }
+        // See the comment about speculation in sendmsg().
+        if (*r == vlen) {
+            _s->speculate_epoll(EPOLLOUT);
+        }
+        return make_ready_future<size_t>(*r);
+    });
+}
+
 inline
 future<size_t> pollable_fd::sendto(socket_address addr, const void* buf, size_t len) {
     return engine().writeable(*_s).then([this, buf, len, addr] () mutable {
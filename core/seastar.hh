@@ -53,6 +53,7 @@ class server_socket;
 class connected_socket;
 class socket_address;
 class listen_options;
+struct connect_options;
 namespace seastar {
 enum class transport;
 }
@@ -123,6 +124,18 @@ future<connected_socket> connect(socket_address sa);
 /// \return a \ref connected_socket object, or an exception
 future<connected_socket> connect(socket_address sa, socket_address local, seastar::transport proto);
 
+/// Establishes a connection to a given address
+///
+/// Attempts to connect to the given address with a defined local endpoint
+///
+/// \param sa socket address to connect to
+/// \param local socket address for local endpoint
+/// \param opts options controlling the connection, such as its congestion
+///             control
+///
+/// \return a \ref connected_socket object, or an exception
+future<connected_socket> connect(socket_address sa, socket_address local, connect_options opts);
+
 /// @}
 
 /// \defgroup fileio-module File Input/Output
@@ -24,6 +24,8 @@
 #include <iostream>
 #include "core/reactor.hh"
 #include "core/fstream.hh"
+#include "core/future-util.hh"
+#include "core/page_cache.hh"
 #include "core/shared_ptr.hh"
 #include "core/app-template.hh"
 #include "exception.hh"
@@ -98,8 +100,15 @@ future<std::unique_ptr<reply>> file_interaction_handler::read(
         std::unique_ptr<reply> rep) {
     sstring extension = get_extension(file_name);
     rep->set_content_type(extension);
-    return open_file_dma(file_name, open_flags::ro).then(
-            [rep = std::move(rep), extension, this, req = std::move(req)](file f) mutable {
+    return open_file_dma(file_name, open_flags::ro).then([this] (file f) {
+        if (_cache) {
+            return _cache->wrap(std::move(f));
+        }
+        return make_ready_future<file>(std::move(f));
+    }).then([rep = std::move(rep), extension, this, req = std::move(req)](file f) mutable {
+                if (transformer == nullptr) {
+                    return stream(std::move(f), std::move(rep));
+                }
                 std::shared_ptr<reader> r = std::make_shared<reader>(std::move(f), std::move(rep));
 
                 return r->is.consume(*r).then([r, extension, this, req = std::move(req)]() {
@@ -112,6 +121,61 @@ future<std::unique_ptr<reply>> file_interaction_handler::read(
             });
 }
 
+// Closes a file once the last reference to it is gone.  The body writer of
+// a streamed reply holds it, so the file is closed even if the writer never
+// runs: when the connection fails, or the body is replaced.
+class file_closer {
+    file _f;
+public:
+    explicit file_closer(file f) : _f(std::move(f)) {}
+    ~file_closer() {
+        _f.close().handle_exception([f = _f] (std::exception_ptr) {});
+    }
+    file& get() {
+        return _f;
+    }
+};
+
+future<std::unique_ptr<reply>> file_interaction_handler::stream(file f,
+        std::unique_ptr<reply> rep) {
+    return f.size().then([f, rep = std::move(rep)] (uint64_t size) mutable {
+        auto closer = make_lw_shared<file_closer>(std::move(f));
+        rep->write_body(size, [closer, size] (output_stream<char>& out) {
+            auto f = closer->get();
+            // The body is sent as the file's own DMA buffers, so that memory
+            // use is bounded by the stream's buffers rather than by the size
+            // of the file.  Zero-copy writes require the headers already
+            // buffered in the stream to be pushed out first.
+            file_input_stream_options opts;
+            opts.buffer_size = stream_buffer_size;
+            opts.read_ahead = 1;
+            return out.flush().then([f, size, opts, &out] {
+                return do_with(make_file_input_stream(f, 0, size, opts), uint64_t(0),
+                        [&out, size] (input_stream<char>& is, uint64_t& sent) {
+                    return repeat([&is, &out, &sent, size] {
+                        return is.read().then([&out, &sent, size] (temporary_buffer<char> buf) {
+                            if (buf.empty()) {
+                                if (sent != size) {
+                                    throw std::runtime_error("file truncated while being sent");
+                                }
+                                return make_ready_future<stop_iteration>(stop_iteration::yes);
+                            }
+                            sent += buf.size();
+                            return out.write(std::move(buf)).then([] {
+                                return stop_iteration::no;
+                            });
+                        });
+                    }).finally([&is] {
+                        return is.close();
+                    });
+                });
+            }).finally([closer] {});
+        });
+        rep->done();
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    });
+}
+
 bool file_interaction_handler::redirect_if_needed(const request& req,
         reply& rep) const {
     if (req._url.length() == 0 || req._url.back() != '/') {
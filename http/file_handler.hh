@@ -23,6 +23,9 @@
 #define HTTP_FILE_HANDLER_HH_
 
 #include "handlers.hh"
+#include "core/file.hh"
+
+class page_cache;
 
 namespace httpd {
 /**
@@ -74,6 +77,18 @@ class file_interaction_handler : public handler_base {
         return this;
     }
 
+    /**
+     * Serve files through a page cache instead of reading them from
+     * the disk on every request.
+     * @param cache the cache to use; it must outlive the handler.
+     * nullptr disables caching.
+     * @return this
+     */
+    file_interaction_handler* set_page_cache(page_cache* cache) {
+        _cache = cache;
+        return this;
+    }
+
     /**
      * if the url ends without a slash redirect
      * @param req the request
@@ -99,7 +114,18 @@ class file_interaction_handler : public handler_base {
      */
     future<std::unique_ptr<reply> > read(const sstring& file,
             std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+
+    /**
+     * Set the reply to stream the content of an open file, instead of
+     * reading it into memory first.
+     * @param f the file to send
+     * @param rep the reply
+     */
+    future<std::unique_ptr<reply>> stream(::file f, std::unique_ptr<reply> rep);
+
+    static constexpr size_t stream_buffer_size = 64 * 1024;
     file_transformer* transformer;
+    page_cache* _cache = nullptr;
 };
 
 /**
@@ -215,7 +215,7 @@ class http_server {
             _resp->_headers["Server"] = "Seastar httpd";
             _resp->_headers["Date"] = _server._date;
             _resp->_headers["Content-Length"] = to_sstring(
-                    _resp->_content.size());
+                    _resp->content_length());
             return _write_buf.write(_resp->_response_line.begin(),
                     _resp->_response_line.size()).then([this] {
                 return write_reply_headers(_resp->_headers.begin());
@@ -368,6 +368,9 @@ class http_server {
             });
         }
         future<> write_body() {
+            if (_resp->_body_writer) {
+                return _resp->_body_writer(_write_buf);
+            }
             return _write_buf.write(_resp->_content.begin(),
                     _resp->_content.size());
         }
@@ -32,7 +32,10 @@
 #pragma once
 
 #include "core/sstring.hh"
+#include "core/future.hh"
+#include "core/iostream.hh"
 #include <unordered_map>
+#include <functional>
 #include "http/mime_types.hh"
 
 namespace httpd {
@@ -73,6 +76,14 @@ struct reply {
      */
     sstring _content;
 
+    /**
+     * Writes the body of the reply to the connection, when it is streamed
+     * instead of being held in _content.
+     */
+    using body_writer_type = std::function<future<> (output_stream<char>&)>;
+    body_writer_type _body_writer;
+    uint64_t _body_length = 0;
+
     sstring _response_line;
     reply()
             : _status(status_type::ok) {
@@ -92,6 +103,7 @@ struct reply {
         _status = status;
         if (content != "") {
             _content = content;
+            _body_writer = nullptr;
         }
         return *this;
     }
@@ -115,6 +127,24 @@ struct reply {
         return *this;
     }
 
+    /**
+     * Stream the body of the reply instead of setting _content.
+     * The writer is called once the headers have been written, and must
+     * write exactly length bytes to the stream without closing it.
+     */
+    reply& write_body(uint64_t length, body_writer_type writer) {
+        _body_length = length;
+        _body_writer = std::move(writer);
+        return *this;
+    }
+
+    /**
+     * The length of the body, whether streamed or held in _content
+     */
+    uint64_t content_length() const {
+        return _body_writer ? _body_length : _content.size();
+    }
+
     reply& done(const sstring& content_type) {
         return set_content_type(content_type).done();
     }
@@ -44,16 +44,22 @@ class socket_address {
         ::sockaddr_storage sas;
         ::sockaddr sa;
         ::sockaddr_in in;
+        ::sockaddr_in6 in6;
     } u;
     socket_address(sockaddr_in sa) {
         u.in = sa;
     }
+    socket_address(sockaddr_in6 sa) {
+        u.in6 = sa;
+    }
     socket_address(ipv4_addr);
     socket_address() = default;
     ::sockaddr& as_posix_sockaddr() { return u.sa; }
     ::sockaddr_in& as_posix_sockaddr_in() { return u.in; }
     const ::sockaddr& as_posix_sockaddr() const { return u.sa; }
     const ::sockaddr_in& as_posix_sockaddr_in() const { return u.in; }
+    ::sockaddr_in6& as_posix_sockaddr_in6() { return u.in6; }
+    const ::sockaddr_in6& as_posix_sockaddr_in6() const { return u.in6; }
 };
 
 namespace seastar {
@@ -63,16 +69,32 @@ enum class transport {
     SCTP = IPPROTO_SCTP
 };
 
+/// TCP congestion control algorithm used by a connection
+enum class tcp_congestion_control {
+    stack_default, ///< whatever the network stack is configured to use
+    reno,          ///< NewReno (RFC 5681, RFC 6582)
+    cubic,         ///< CUBIC (RFC 8312)
+    bbr,           ///< BBR, model based on bottleneck bandwidth and RTT
+};
+
 }
 
 struct listen_options {
     seastar::transport proto = seastar::transport::TCP;
     bool reuse_address = false;
+    /// Congestion control of the accepted connections
+    seastar::tcp_congestion_control congestion_control = seastar::tcp_congestion_control::stack_default;
     listen_options(bool rua = false)
         : reuse_address(rua)
     {}
 };
 
+struct connect_options {
+    seastar::transport proto = seastar::transport::TCP;
+    /// Congestion control of the connection
+    seastar::tcp_congestion_control congestion_control = seastar::tcp_congestion_control::stack_default;
+};
+
 struct ipv4_addr {
     uint32_t ip;
     uint16_t port;
@@ -152,6 +174,8 @@ class udp_datagram_impl {
     virtual ipv4_addr get_dst() = 0;
     virtual uint16_t get_dst_port() = 0;
     virtual packet& get_data() = 0;
+    virtual socket_address get_src_address() { return socket_address(get_src()); }
+    virtual socket_address get_dst_address() { return socket_address(get_dst()); }
 };
 
 class udp_datagram final {
@@ -163,6 +187,10 @@ class udp_datagram final {
     ipv4_addr get_dst() { return _impl->get_dst(); }
     uint16_t get_dst_port() { return _impl->get_dst_port(); }
     packet& get_data() { return _impl->get_data(); }
+    /// Source and destination of the datagram; unlike get_src() and
+    /// get_dst(), these work for IPv6 channels too
+    socket_address get_src_address() { return _impl->get_src_address(); }
+    socket_address get_dst_address() { return _impl->get_dst_address(); }
 };
 
 class udp_channel {
@@ -177,8 +205,17 @@ class udp_channel {
     udp_channel& operator=(udp_channel&&);
 
     future<udp_datagram> receive();
+    /// Waits until at least one datagram is available, and returns all
+    /// the available ones, up to \c max
+    future<std::vector<udp_datagram>> receive_batch(size_t max);
     future<> send(ipv4_addr dst, const char* msg);
     future<> send(ipv4_addr dst, packet p);
+    /// Sends to an IPv4 or IPv6 destination, matching the channel's family
+    future<> send(const socket_address& dst, packet p);
+    /// Sends several datagrams; the returned future resolves when all of
+    /// them were sent, or fails with the error of one that could not be
+    future<> send_batch(std::vector<std::pair<ipv4_addr, packet>> datagrams);
+    future<> send_batch(std::vector<std::pair<socket_address, packet>> datagrams);
     bool is_closed() const;
     void close();
 };
@@ -279,6 +316,10 @@ class socket {
     ///
     /// \return a \ref connected_socket representing the connection.
     future<connected_socket> connect(socket_address sa, socket_address local = socket_address(::sockaddr_in{AF_INET, INADDR_ANY, {0}}), seastar::transport proto = seastar::transport::TCP);
+    /// Attempts to establish the connection with the given options.
+    ///
+    /// \return a \ref connected_socket representing the connection.
+    future<connected_socket> connect(socket_address sa, socket_address local, connect_options opts);
     /// Stops any in-flight connection attempt.
     ///
     /// Cancels the connection attempt if it's still in progress, and
@@ -333,8 +374,14 @@ class network_stack {
     future<connected_socket> connect(socket_address sa, socket_address local = socket_address(::sockaddr_in{AF_INET, INADDR_ANY, {0}}), seastar::transport proto = seastar::transport::TCP) {
         return socket().connect(sa, local, proto);
     }
+    future<connected_socket> connect(socket_address sa, socket_address local, connect_options opts) {
+        return socket().connect(sa, local, opts);
+    }
     virtual seastar::socket socket() = 0;
     virtual net::udp_channel make_udp_channel(ipv4_addr addr = {}) = 0;
+    /// Opens an IPv6 UDP channel on a local port, or on an anonymous one
+    /// for port 0.  Its datagrams are addressed with \ref socket_address.
+    virtual net::udp_channel make_udp6_channel(uint16_t port = 0);
     virtual future<> initialize() {
         return make_ready_future();
     }
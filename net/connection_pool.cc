@@ -0,0 +1,250 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "connection_pool.hh"
+#include "core/future-util.hh"
+#include <boost/range/irange.hpp>
+#include <utility>
+
+namespace seastar {
+
+connection_pool::entry::entry(connected_socket s)
+    : socket(std::move(s)), in(socket.input()), out(socket.output()) {
+}
+
+size_t connection_pool::address_hash::operator()(const socket_address& a) const {
+    if (a.u.sa.sa_family == AF_INET6) {
+        auto& in6 = a.u.in6;
+        size_t h = in6.sin6_port;
+        for (auto b : in6.sin6_addr.s6_addr) {
+            h = h * 31 + b;
+        }
+        return h;
+    }
+    return std::hash<::sockaddr_in>()(a.u.in);
+}
+
+bool connection_pool::address_equal::operator()(const socket_address& a, const socket_address& b) const {
+    if (a.u.sa.sa_family != b.u.sa.sa_family) {
+        return false;
+    }
+    if (a.u.sa.sa_family == AF_INET6) {
+        return a.u.in6.sin6_port == b.u.in6.sin6_port
+                && !memcmp(&a.u.in6.sin6_addr, &b.u.in6.sin6_addr, sizeof(a.u.in6.sin6_addr));
+    }
+    return a.u.in.sin_port == b.u.in.sin_port && a.u.in.sin_addr.s_addr == b.u.in.sin_addr.s_addr;
+}
+
+connection_pool::connection_pool(connection_pool_config cfg, connect_func connect, health_check_func check)
+    : _cfg(cfg), _connect(std::move(connect)), _check(std::move(check)) {
+    if (!_connect) {
+        _connect = [] (socket_address sa) {
+            return engine().net().connect(sa);
+        };
+    }
+    _cfg.max_in_use = std::max(_cfg.max_in_use, size_t(1));
+    _cfg.min_idle = std::min(_cfg.min_idle, _cfg.max_idle);
+    auto period = _cfg.idle_timeout;
+    if (_check) {
+        period = std::min(period, _cfg.health_check_interval);
+    }
+    _timer.set_callback([this] { on_timer(); });
+    _timer.arm_periodic(std::max(period, std::chrono::milliseconds(10)));
+}
+
+connection_pool::~connection_pool() {
+    // Connections still out must not come back
+    for (auto& d : _destinations) {
+        d.second->pool = nullptr;
+    }
+}
+
+connection_pool::connection::~connection() {
+    if (!_dest) {
+        return;
+    }
+    if (_counted) {
+        _dest->in_use.signal();
+    }
+    if (_entry && _dest->pool) {
+        _dest->pool->release(_dest, std::move(_entry), _counted, _reusable);
+    }
+}
+
+lw_shared_ptr<connection_pool::destination> connection_pool::get_destination(socket_address addr) {
+    auto i = _destinations.find(addr);
+    if (i == _destinations.end()) {
+        i = _destinations.emplace(addr, make_lw_shared<destination>(addr, _cfg.max_in_use, this)).first;
+    }
+    return i->second;
+}
+
+future<connection_pool::connection> connection_pool::get(socket_address addr) {
+    return with_gate(_gate, [this, addr] {
+        auto dest = get_destination(addr);
+        if (!dest->in_use.current()) {
+            ++_stats.waits;
+        }
+        return dest->in_use.wait().then([this, dest] {
+            if (!dest->idle.empty()) {
+                auto e = std::move(dest->idle.back());
+                dest->idle.pop_back();
+                ++_stats.reused;
+                replenish(dest);
+                return make_ready_future<connection>(connection(dest, std::move(e), true));
+            }
+            return open(dest).then_wrapped([this, dest] (future<std::unique_ptr<entry>> f) {
+                if (f.failed()) {
+                    dest->in_use.signal();
+                    return make_exception_future<connection>(f.get_exception());
+                }
+                replenish(dest);
+                return make_ready_future<connection>(connection(dest, std::move(std::get<0>(f.get())), true));
+            });
+        });
+    });
+}
+
+future<std::unique_ptr<connection_pool::entry>> connection_pool::open(lw_shared_ptr<destination> dest) {
+    ++dest->connecting;
+    ++_stats.connects;
+    return futurize<future<connected_socket>>::apply(_connect, dest->addr).then_wrapped([this, dest] (future<connected_socket> f) {
+        --dest->connecting;
+        if (f.failed()) {
+            ++_stats.connect_failures;
+            return make_exception_future<std::unique_ptr<entry>>(f.get_exception());
+        }
+        return make_ready_future<std::unique_ptr<entry>>(std::make_unique<entry>(std::move(std::get<0>(f.get()))));
+    });
+}
+
+future<> connection_pool::fill(lw_shared_ptr<destination> dest) {
+    auto have = dest->idle.size() + dest->connecting;
+    auto needed = _cfg.min_idle > have ? _cfg.min_idle - have : 0;
+    return parallel_for_each(boost::irange(size_t(0), needed), [this, dest] (size_t) {
+        return open(dest).then([this, dest] (std::unique_ptr<entry> e) {
+            release(dest, std::move(e), true, true);
+        });
+    });
+}
+
+future<> connection_pool::warm_up(socket_address addr) {
+    return with_gate(_gate, [this, addr] {
+        return fill(get_destination(addr));
+    });
+}
+
+void connection_pool::replenish(lw_shared_ptr<destination> dest) {
+    if (_stopping || dest->idle.size() + dest->connecting >= _cfg.min_idle) {
+        return;
+    }
+    with_gate(_gate, [this, dest] {
+        // Failures are counted, and retried on the next timer tick
+        return fill(dest).handle_exception([] (auto ep) {});
+    });
+}
+
+void connection_pool::release(lw_shared_ptr<destination> dest, std::unique_ptr<entry> e, bool used, bool reusable) {
+    if (!reusable || _stopping) {
+        close(std::move(e));
+        return;
+    }
+    if (dest->idle.size() >= _cfg.max_idle) {
+        ++_stats.expired;
+        close(std::move(e));
+        return;
+    }
+    if (used) {
+        e->idle_since = lowres_clock::now();
+    }
+    dest->idle.push_back(std::move(e));
+}
+
+void connection_pool::close(std::unique_ptr<entry> e) {
+    if (_stopping) {
+        // Dropping the socket closes it
+        return;
+    }
+    with_gate(_gate, [e = std::move(e)] () mutable {
+        auto& out = e->out;
+        return out.close().then_wrapped([e = std::move(e)] (future<> f) {
+            f.ignore_ready_future();
+        });
+    });
+}
+
+void connection_pool::check(lw_shared_ptr<destination> dest) {
+    dest->last_check = lowres_clock::now();
+    // Connections being checked are not idle, so nobody gets them meanwhile;
+    // healthy ones come back to the idle list once their check completes
+    auto checked = std::exchange(dest->idle, {});
+    for (auto& e : checked) {
+        auto c = make_lw_shared<connection>(connection(dest, std::move(e), false));
+        with_gate(_gate, [this, c] {
+            return futurize<future<bool>>::apply(_check, *c).then_wrapped([this, c] (future<bool> f) {
+                if (f.failed() || !std::get<0>(f.get())) {
+                    f.ignore_ready_future();
+                    ++_stats.health_check_failures;
+                    c->mark_broken();
+                }
+            });
+        });
+    }
+}
+
+void connection_pool::on_timer() {
+    auto now = lowres_clock::now();
+    for (auto& d : _destinations) {
+        auto& dest = d.second;
+        // Checked connections are appended again, so the list is not
+        // ordered by idle_since
+        for (auto i = dest->idle.begin(); i != dest->idle.end() && dest->idle.size() > _cfg.min_idle;) {
+            if (now - (*i)->idle_since >= _cfg.idle_timeout) {
+                ++_stats.expired;
+                close(std::move(*i));
+                i = dest->idle.erase(i);
+            } else {
+                ++i;
+            }
+        }
+        if (_check && now - dest->last_check >= _cfg.health_check_interval) {
+            check(dest);
+        }
+        replenish(dest);
+    }
+}
+
+future<> connection_pool::stop() {
+    _stopping = true;
+    _timer.cancel();
+    for (auto& d : _destinations) {
+        d.second->idle.clear();
+        d.second->in_use.broken();
+    }
+    return _gate.close().then([this] {
+        for (auto& d : _destinations) {
+            d.second->idle.clear();
+            d.second->pool = nullptr;
+        }
+    });
+}
+
+}
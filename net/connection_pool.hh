@@ -0,0 +1,201 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+#include "core/future.hh"
+#include "core/gate.hh"
+#include "core/reactor.hh"
+#include "core/semaphore.hh"
+#include "core/shared_ptr.hh"
+#include "core/timer.hh"
+#include "net/api.hh"
+
+namespace seastar {
+
+/// \addtogroup networking-module
+/// @{
+
+/// Settings of a \ref connection_pool, applying to each destination.
+struct connection_pool_config {
+    /// Idle connections to keep open to a destination once it has been
+    /// used (or warmed up), opened ahead of the requests that need them.
+    size_t min_idle = 0;
+    /// Idle connections kept per destination; connections released
+    /// beyond that are closed.
+    size_t max_idle = 16;
+    /// Connections handed out at once per destination; further
+    /// \ref connection_pool::get() calls wait for one to be released.
+    size_t max_in_use = 64;
+    /// Idle connections unused for this long are closed, except for
+    /// the last \ref min_idle.
+    std::chrono::milliseconds idle_timeout = std::chrono::seconds(60);
+    /// How often idle connections are health checked, if the pool has
+    /// a health check.
+    std::chrono::milliseconds health_check_interval = std::chrono::seconds(10);
+};
+
+/// Client side connections kept open for reuse, per destination address.
+///
+/// A pool belongs to one shard.  It opens connections with a pluggable
+/// connect function, so pooled connections can be TLS ones as well, and
+/// hands them out with their streams; once released, a connection goes
+/// back to the pool for the next request to the same destination.
+///
+/// The pool must be stopped with \ref stop() before it is destroyed.
+class connection_pool {
+public:
+    class connection;
+    /// Opens a connection to a destination
+    using connect_func = std::function<future<connected_socket> (socket_address)>;
+    /// Tells whether an idle connection is still usable.  It may talk to
+    /// the peer, but must leave the streams ready for the next request.
+    using health_check_func = std::function<future<bool> (connection&)>;
+
+    struct stats {
+        /// Connections opened
+        uint64_t connects = 0;
+        uint64_t connect_failures = 0;
+        /// get() calls served with an idle connection
+        uint64_t reused = 0;
+        /// get() calls that had to wait for the max_in_use limit
+        uint64_t waits = 0;
+        /// Idle connections closed because of idle_timeout or max_idle
+        uint64_t expired = 0;
+        uint64_t health_check_failures = 0;
+    };
+private:
+    struct entry {
+        connected_socket socket;
+        input_stream<char> in;
+        output_stream<char> out;
+        lowres_clock::time_point idle_since;
+        explicit entry(connected_socket s);
+    };
+    struct destination {
+        socket_address addr;
+        // Most recently used at the back
+        std::deque<std::unique_ptr<entry>> idle;
+        semaphore in_use;
+        size_t connecting = 0;
+        lowres_clock::time_point last_check;
+        // Null once the pool is stopped
+        connection_pool* pool;
+        destination(socket_address a, size_t max_in_use, connection_pool* p)
+            : addr(a), in_use(max_in_use), pool(p) {}
+    };
+    struct address_hash {
+        size_t operator()(const socket_address& a) const;
+    };
+    struct address_equal {
+        bool operator()(const socket_address& a, const socket_address& b) const;
+    };
+
+    connection_pool_config _cfg;
+    connect_func _connect;
+    health_check_func _check;
+    std::unordered_map<socket_address, lw_shared_ptr<destination>, address_hash, address_equal> _destinations;
+    timer<> _timer;
+    gate _gate;
+    bool _stopping = false;
+    stats _stats;
+public:
+    /// \param cfg settings applying to each destination
+    /// \param connect opens connections; plain TCP connections through
+    ///                the default network stack if empty
+    /// \param check health check of idle connections; none if empty
+    explicit connection_pool(connection_pool_config cfg = {}, connect_func connect = {}, health_check_func check = {});
+    ~connection_pool();
+
+    /// Returns a connection to \c addr: an idle one if there is, a new
+    /// one otherwise.  Waits if max_in_use connections to \c addr are
+    /// out already.
+    future<connection> get(socket_address addr);
+    /// Opens connections to \c addr until min_idle are idle, and starts
+    /// keeping them warm.
+    future<> warm_up(socket_address addr);
+    /// Closes idle connections and fails waiting get() calls.
+    /// Connections still out are closed when released.
+    future<> stop();
+
+    const stats& get_stats() const {
+        return _stats;
+    }
+private:
+    lw_shared_ptr<destination> get_destination(socket_address addr);
+    future<std::unique_ptr<entry>> open(lw_shared_ptr<destination> dest);
+    future<> fill(lw_shared_ptr<destination> dest);
+    void replenish(lw_shared_ptr<destination> dest);
+    void release(lw_shared_ptr<destination> dest, std::unique_ptr<entry> e, bool used, bool reusable);
+    void close(std::unique_ptr<entry> e);
+    void check(lw_shared_ptr<destination> dest);
+    void on_timer();
+};
+
+/// A connection handed out by a \ref connection_pool.  Destroying it
+/// returns the connection to the pool, so all output must have been
+/// flushed and all expected input read by then, unless the connection
+/// was marked broken.
+class connection_pool::connection {
+    lw_shared_ptr<destination> _dest;
+    std::unique_ptr<entry> _entry;
+    // Holds a unit of the destination's in_use semaphore
+    bool _counted = false;
+    bool _reusable = true;
+private:
+    connection(lw_shared_ptr<destination> dest, std::unique_ptr<entry> e, bool counted)
+        : _dest(std::move(dest)), _entry(std::move(e)), _counted(counted) {}
+    friend class connection_pool;
+public:
+    connection(connection&&) noexcept = default;
+    connection& operator=(connection&& x) noexcept {
+        if (this != &x) {
+            this->~connection();
+            new (this) connection(std::move(x));
+        }
+        return *this;
+    }
+    ~connection();
+
+    connected_socket& socket() {
+        return _entry->socket;
+    }
+    input_stream<char>& in() {
+        return _entry->in;
+    }
+    output_stream<char>& out() {
+        return _entry->out;
+    }
+    /// Closes the connection when released, rather than returning it to
+    /// the pool, e.g. after an error left the protocol state unknown.
+    void mark_broken() {
+        _reusable = false;
+    }
+};
+
+/// @}
+
+}
@@ -225,6 +225,9 @@ class dpdk_device : public device {
     std::vector<scollectd::registration> _collectd_regs;
     bool _is_i40e_device = false;
     bool _is_vmxnet3_device = false;
+    // 5-tuple filters can steer flows to queues.  They are only added and
+    // removed from interface::steering_shard, which serializes the updates.
+    bool _ntuple_filters = false;
 
 public:
     rte_eth_dev_info _dev_info = {};
@@ -270,6 +273,14 @@ class dpdk_device : public device {
      */
     void set_hw_flow_control();
 
+    /**
+     * Adds or deletes a 5-tuple filter delivering a flow to a given queue.
+     *
+     * @return TRUE on success
+     */
+    bool ntuple_filter_ctrl(const flow_steering_rule& rule, unsigned qid,
+                            rte_filter_op op);
+
 public:
     dpdk_device(uint8_t port_idx, uint16_t num_queues, bool use_lro,
                 bool enable_fc)
@@ -420,6 +431,14 @@ class dpdk_device : public device {
         assert(_redir_table.size());
         return _redir_table[hash & (_redir_table.size() - 1)];
     }
+    virtual bool flow_steering_supported() override { return _ntuple_filters; }
+    virtual bool add_flow_steering(const flow_steering_rule& rule, unsigned qid) override {
+        return ntuple_filter_ctrl(rule, qid, RTE_ETH_FILTER_ADD);
+    }
+    virtual void remove_flow_steering(const flow_steering_rule& rule) override {
+        ntuple_filter_ctrl(rule, 0, RTE_ETH_FILTER_DELETE);
+    }
+    virtual void set_multicast_addresses(const std::vector<ethernet_address>& addrs) override;
     uint8_t port_idx() { return _port_idx; }
     bool is_i40e_device() const {
         return _is_i40e_device;
@@ -1373,6 +1392,8 @@ class dpdk_qp : public net::qp {
     std::vector<rte_mbuf*> _rx_free_bufs;
     std::vector<fragment> _frags;
     std::vector<char*> _bufs;
+    // Packets of the last rx burst, handed up the stack together
+    std::vector<packet> _rx_burst;
     size_t _num_rx_free_segs = 0;
     reactor::poller _rx_gc_poller;
     std::unique_ptr<void, free_deleter> _rx_xmem;
@@ -1667,6 +1688,11 @@ void dpdk_device::init_port_fini()
         }
 
         set_rss_table();
+
+        if (!rte_eth_dev_filter_supported(_port_idx, RTE_ETH_FILTER_NTUPLE)) {
+            printf("Port %d: NTUPLE FILTER configuration is supported\n", _port_idx);
+            _ntuple_filters = true;
+        }
     }
 
     // Wait for a link
@@ -1675,6 +1701,46 @@ void dpdk_device::init_port_fini()
     printf("Created DPDK device\n");
 }
 
+bool dpdk_device::ntuple_filter_ctrl(const flow_steering_rule& rule,
+                                     unsigned qid, rte_filter_op op)
+{
+    rte_eth_ntuple_filter filter = {};
+
+    filter.flags         = RTE_5TUPLE_FLAGS;
+    filter.dst_ip        = rte_cpu_to_be_32(rule.dst_ip);
+    filter.dst_ip_mask   = UINT32_MAX;
+    filter.src_ip        = rte_cpu_to_be_32(rule.src_ip);
+    filter.src_ip_mask   = UINT32_MAX;
+    filter.dst_port      = rte_cpu_to_be_16(rule.dst_port);
+    filter.dst_port_mask = UINT16_MAX;
+    filter.src_port      = rte_cpu_to_be_16(rule.src_port);
+    filter.src_port_mask = UINT16_MAX;
+    filter.proto         = uint8_t(rule.proto);
+    filter.proto_mask    = UINT8_MAX;
+    filter.priority      = 1;
+    filter.queue         = qid;
+
+    assert(engine().cpu_id() == interface::steering_shard);
+    return rte_eth_dev_filter_ctrl(_port_idx, RTE_ETH_FILTER_NTUPLE, op,
+                                   &filter) == 0;
+}
+
+void dpdk_device::set_multicast_addresses(const std::vector<ethernet_address>& addrs)
+{
+    assert(engine().cpu_id() == interface::steering_shard);
+#if RTE_VERSION >= RTE_VERSION_NUM(2,1,0,0)
+    std::vector<ether_addr> mc_addrs(addrs.size());
+    for (size_t i = 0; i < addrs.size(); ++i) {
+        std::copy(addrs[i].mac.begin(), addrs[i].mac.end(), mc_addrs[i].addr_bytes);
+    }
+    if (rte_eth_dev_set_mc_addr_list(_port_idx, mc_addrs.data(), mc_addrs.size()) == 0) {
+        return;
+    }
+#endif
+    // The PMD cannot filter on a list of groups; take them all
+    rte_eth_allmulticast_enable(_port_idx);
+}
+
 template <bool HugetlbfsMemBackend>
 void* dpdk_qp<HugetlbfsMemBackend>::alloc_mempool_xmem(
     uint16_t num_bufs, uint16_t buf_sz, std::vector<phys_addr_t>& mappings)
@@ -1843,6 +1909,8 @@ dpdk_qp<HugetlbfsMemBackend>::dpdk_qp(dpdk_device* dev, uint8_t qid,
         rte_exit(EXIT_FAILURE, "Cannot initialize mbuf pools\n");
     }
 
+    _rx_burst.reserve(packet_read_size);
+
     static_assert(offsetof(class tx_buf, private_end) -
                   offsetof(class tx_buf, private_start) <= RTE_PKTMBUF_HEADROOM,
                   "RTE_PKTMBUF_HEADROOM is less than dpdk_qp::tx_buf size! "
@@ -2102,9 +2170,11 @@ void dpdk_qp<HugetlbfsMemBackend>::process_packets(
             (*p).set_rss_hash(m->hash.rss);
         }
 
-        _dev->l2receive(std::move(*p));
+        _rx_burst.push_back(std::move(*p));
     }
 
+    _dev->l2receive_burst(_rx_burst);
+
     _stats.rx.good.update_pkts_bunch(count);
     _stats.rx.good.update_frags_stats(nr_frags, bytes);
 
@@ -0,0 +1,203 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#ifndef FLOW_TABLE_HH_
+#define FLOW_TABLE_HH_
+
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+namespace net {
+
+// Hash table for looking up flows (connections) on every received packet.
+//
+// Entries live in a single array of slots with linear probing, so a lookup
+// usually touches one cache line and inserting does not allocate.  Each slot
+// caches the hash of its key, and removal shifts the following entries back
+// instead of leaving tombstones, so lookups never get slower as flows come
+// and go.  The table grows when it is 3/4 full.
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class flow_table {
+public:
+    using value_type = std::pair<const Key, Value>;
+private:
+    struct slot {
+        // Zero for an empty slot; otherwise the hash of the key, with the
+        // top bit set so that it cannot be zero
+        size_t hash = 0;
+        typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type storage;
+        value_type& value() { return *reinterpret_cast<value_type*>(&storage); }
+    };
+    static constexpr size_t min_capacity = 16;
+    static constexpr size_t used_bit = size_t(1) << (sizeof(size_t) * 8 - 1);
+    std::unique_ptr<slot[]> _slots;
+    size_t _mask = 0;
+    size_t _size = 0;
+    Hash _hash_fn;
+    KeyEqual _equal;
+private:
+    size_t hash_of(const Key& k) const {
+        return _hash_fn(k) | used_bit;
+    }
+    size_t capacity() const {
+        return _slots ? _mask + 1 : 0;
+    }
+    slot* find_slot(const Key& k, size_t hash) const {
+        if (!_slots) {
+            return nullptr;
+        }
+        for (size_t i = hash & _mask; ; i = (i + 1) & _mask) {
+            auto& s = _slots[i];
+            if (!s.hash) {
+                return nullptr;
+            }
+            if (s.hash == hash && _equal(s.value().first, k)) {
+                return &s;
+            }
+        }
+    }
+    // Places an entry known not to be in the table; there must be room
+    void place(size_t hash, Key&& k, Value&& v) {
+        auto i = hash & _mask;
+        while (_slots[i].hash) {
+            i = (i + 1) & _mask;
+        }
+        new (&_slots[i].storage) value_type(std::move(k), std::move(v));
+        _slots[i].hash = hash;
+    }
+    void grow() {
+        auto old_capacity = capacity();
+        auto new_capacity = old_capacity ? old_capacity * 2 : min_capacity;
+        auto old = std::move(_slots);
+        _slots = std::make_unique<slot[]>(new_capacity);
+        _mask = new_capacity - 1;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            auto& s = old[i];
+            if (s.hash) {
+                place(s.hash, std::move(const_cast<Key&>(s.value().first)), std::move(s.value().second));
+                s.value().~value_type();
+            }
+        }
+    }
+    void clear_slots() {
+        for (size_t i = 0; i < capacity(); ++i) {
+            if (_slots[i].hash) {
+                _slots[i].value().~value_type();
+                _slots[i].hash = 0;
+            }
+        }
+        _size = 0;
+    }
+public:
+    flow_table() = default;
+    flow_table(flow_table&& x) noexcept
+        : _slots(std::move(x._slots)), _mask(x._mask), _size(x._size)
+        , _hash_fn(std::move(x._hash_fn)), _equal(std::move(x._equal)) {
+        x._mask = 0;
+        x._size = 0;
+    }
+    flow_table(const flow_table&) = delete;
+    ~flow_table() {
+        clear_slots();
+    }
+    flow_table& operator=(flow_table&& x) noexcept {
+        if (this != &x) {
+            this->~flow_table();
+            new (this) flow_table(std::move(x));
+        }
+        return *this;
+    }
+    size_t size() const { return _size; }
+    bool empty() const { return !_size; }
+    // Returns the value stored for a key, or nullptr
+    Value* find(const Key& k) {
+        auto s = find_slot(k, hash_of(k));
+        return s ? &s->value().second : nullptr;
+    }
+    // Adds an entry unless the key is already present; returns whether it
+    // was added
+    bool insert(Key k, Value v) {
+        auto hash = hash_of(k);
+        if (find_slot(k, hash)) {
+            return false;
+        }
+        if ((_size + 1) * 4 > capacity() * 3) {
+            grow();
+        }
+        place(hash, std::move(k), std::move(v));
+        ++_size;
+        return true;
+    }
+    // Removes the entry for a key; returns whether there was one
+    bool erase(const Key& k) {
+        auto s = find_slot(k, hash_of(k));
+        if (!s) {
+            return false;
+        }
+        // Destroy the value only once the table is consistent again, in case
+        // its destructor looks at the table
+        Value removed = std::move(s->value().second);
+        s->value().~value_type();
+        s->hash = 0;
+        --_size;
+        // Move back entries that probed past the freed slot, so that every
+        // entry stays reachable from its home slot without tombstones
+        auto hole = size_t(s - _slots.get());
+        for (auto i = (hole + 1) & _mask; _slots[i].hash; i = (i + 1) & _mask) {
+            auto home = _slots[i].hash & _mask;
+            // Skip entries whose home lies cyclically in (hole, i]
+            if (((i - home) & _mask) < ((i - hole) & _mask)) {
+                continue;
+            }
+            auto& from = _slots[i];
+            new (&_slots[hole].storage) value_type(std::move(const_cast<Key&>(from.value().first)), std::move(from.value().second));
+            _slots[hole].hash = from.hash;
+            from.value().~value_type();
+            from.hash = 0;
+            hole = i;
+        }
+        return true;
+    }
+    void clear() {
+        clear_slots();
+    }
+    // Brings the slot a key hashes to into the cache, ahead of a find()
+    void prefetch(const Key& k) const {
+        if (_slots) {
+            __builtin_prefetch(&_slots[hash_of(k) & _mask]);
+        }
+    }
+    // Calls func(key, value) for every entry
+    template <typename Func>
+    void for_each(Func&& func) {
+        for (size_t i = 0; i < capacity(); ++i) {
+            if (_slots[i].hash) {
+                func(_slots[i].value().first, _slots[i].value().second);
+            }
+        }
+    }
+};
+
+}
+
+#endif /* FLOW_TABLE_HH_ */
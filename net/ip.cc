@@ -21,6 +21,7 @@
  */
 
 #include "ip.hh"
+#include "tcp.hh"
 #include "core/print.hh"
 #include "core/future-util.hh"
 #include "core/shared_ptr.hh"
@@ -38,11 +39,13 @@ std::ostream& operator<<(std::ostream& os, ipv4_address a) {
 }
 
 constexpr std::chrono::seconds ipv4::_frag_timeout;
-constexpr uint32_t ipv4::_frag_low_thresh;
-constexpr uint32_t ipv4::_frag_high_thresh;
+constexpr size_t ipv4_frag_table::default_max_datagrams;
+constexpr uint32_t ipv4_frag_table::default_max_mem;
+constexpr uint32_t ipv4_frag_table::nil;
 
 ipv4::ipv4(interface* netif)
     : _netif(netif)
+    , _hw_features(netif->hw_features())
     , _global_arp(netif)
     , _arp(_global_arp)
     , _host_address(0)
@@ -59,17 +62,71 @@ ipv4::ipv4(interface* netif)
     , _l4({ { uint8_t(ip_protocol_num::tcp), &_tcp }, { uint8_t(ip_protocol_num::icmp), &_icmp }, { uint8_t(ip_protocol_num::udp), &_udp }})
     , _collectd_regs({
         //
-        // Linearized events: DERIVE:0:u
+        // Datagrams reassembled from fragments: DERIVE:0:u
         //
         scollectd::add_polled_metric(scollectd::type_instance_id(
               "ipv4"
             , scollectd::per_cpu_plugin_instance
-            , "total_operations", "linearizations")
+            , "total_operations", "frag-reassembled")
             , scollectd::make_typed(scollectd::data_type::DERIVE
-            , [] { return ipv4_packet_merger::linearizations(); })
+            , [this] { return _frags.get_stats().reassembled; })
+        ),
+        //
+        // Partly reassembled datagrams dropped for lack of room: DERIVE:0:u
+        //
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "frag-evicted")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [this] { return _frags.get_stats().evicted; })
+        ),
+        //
+        // Partly reassembled datagrams dropped on timeout: DERIVE:0:u
+        //
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "frag-timed-out")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [this] { return _frags.get_stats().timed_out; })
+        ),
+        //
+        // Memory held by fragments: GAUGE:0:U
+        //
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "bytes", "frag-memory")
+            , scollectd::make_typed(scollectd::data_type::GAUGE
+            , [this] { return _frags.mem(); })
+        ),
+        //
+        // Segments produced by software TSO: DERIVE:0:u
+        //
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "sw-tso-segments")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [this] { return _sw_tso_segments; })
         ),
     }) {
     _frag_timer.set_callback([this] { frag_timeout(); });
+    _l3.receive_burst([this] (l3_rx_burst& burst) { handle_received_burst(burst); });
+}
+
+void ipv4::handle_received_burst(l3_rx_burst& burst) {
+    for (auto&& rx : burst) {
+        auto f = handle_received_packet(std::move(rx.p), rx.from);
+        // Only a packet filter may still be working on the packet; unlike
+        // the stream path, do not hold the rest of the burst back for it
+        if (f.available()) {
+            f.ignore_ready_future();
+        } else {
+            f.handle_exception([] (std::exception_ptr) {});
+        }
+    }
 }
 
 bool ipv4::forward(forward_hash& out_hash_data, packet& p, size_t off)
@@ -143,7 +200,13 @@ ipv4::handle_received_packet(packet p, ethernet_address from) {
 
     // FIXME: process options
     if (in_my_netmask(h.src_ip) && h.src_ip != _host_address) {
-        _arp.learn(from, h.src_ip);
+        // Consecutive packets usually come from the same peer, and arp
+        // entries are never evicted, so there is nothing new to learn
+        if (h.src_ip != _last_learned_ip || from.mac != _last_learned_mac.mac) {
+            _arp.learn(from, h.src_ip);
+            _last_learned_ip = h.src_ip;
+            _last_learned_mac = from;
+        }
     }
 
     if (_packet_filter) {
@@ -162,23 +225,14 @@ ipv4::handle_received_packet(packet p, ethernet_address from) {
     // Does this IP datagram need reassembly
     auto mf = h.mf();
     if (mf == true || offset != 0) {
-        frag_limit_mem();
-        auto frag_id = ipv4_frag_id{h.src_ip, h.dst_ip, h.id, h.ip_proto};
-        auto& frag = _frags[frag_id];
-        if (mf == false) {
-            frag.last_frag_received = true;
-        }
-        // This is a newly created frag_id
-        if (frag.mem_size == 0) {
-            _frags_age.push_back(frag_id);
-            frag.rx_time = clock_type::now();
-        }
-        auto added_size = frag.merge(h, offset, std::move(p));
-        _frag_mem += added_size;
+        _frags.limit_mem();
+        auto now = clock_type::now();
+        auto& frag = _frags.get(ipv4_frag_id{h.src_ip, h.dst_ip, h.id, h.ip_proto}, now);
+        _frags.add_mem(frag.merge(h, offset, std::move(p)));
         if (frag.is_complete()) {
             // All the fragments are received
-            auto dropped_size = frag.mem_size;
-            auto& ip_data = frag.data.map.begin()->second;
+            _frags.count_reassembled();
+            auto ip_data = frag.assemble();
             // Choose a cpu to forward this packet
             auto cpu_id = engine().cpu_id();
             auto l4 = _l4[h.ip_proto];
@@ -193,20 +247,19 @@ ipv4::handle_received_packet(packet p, ethernet_address from) {
 
             // No need to forward if the dst cpu is the current cpu
             if (cpu_id == engine().cpu_id()) {
-                l4->received(std::move(ip_data), h.src_ip, h.dst_ip);
+                if (l4) {
+                    l4->received(std::move(ip_data), h.src_ip, h.dst_ip);
+                }
             } else {
                 auto to = _netif->hw_address();
-                auto pkt = frag.get_assembled_packet(from, to);
+                auto pkt = frag.get_assembled_packet(std::move(ip_data), from, to);
                 _netif->forward(cpu_id, std::move(pkt));
             }
-
-            // Delete this frag from _frags and _frags_age
-            frag_drop(frag_id, dropped_size);
-            _frags_age.remove(frag_id);
+            _frags.erase(frag);
         } else {
             // Some of the fragments are missing
             if (!_frag_timer.armed()) {
-                frag_arm();
+                frag_arm(now);
             }
         }
         return make_ready_future<>();
@@ -234,7 +287,84 @@ future<ethernet_address> ipv4::get_l2_dst_address(ipv4_address to) {
     return _arp.lookup(dst);
 }
 
+void ipv4::enable_sw_tso() {
+    auto& dev = _netif->hw_features();
+    if (dev.tx_tso) {
+        return;
+    }
+    _sw_tso = true;
+    _hw_features.tx_tso = true;
+    _hw_features.tx_csum_l4_offload = true;
+}
+
+// Splits a TCP packet built for TSO into MSS sized segments.  The payload is
+// shared with the original packet; each segment gets a copy of its header,
+// with the sequence number, flags and checksum fixed up.
+void ipv4::send_tso_segments(ipv4_address to, packet p, ethernet_address e_dst) {
+    auto oi = p.offload_info();
+    auto hdr_len = oi.tcp_hdr_len;
+    auto th = p.get_header<tcp_hdr>(0);
+    assert(th && p.get_header(0, hdr_len));
+    auto h = ntoh(*th);
+    tcp_seq seq = h.seq;
+    std::array<char, 60> tmpl;
+    std::copy_n(reinterpret_cast<char*>(th), hdr_len, tmpl.begin());
+    bool hw_csum = _netif->hw_features().tx_csum_l4_offload;
+    uint32_t payload_len = p.len() - hdr_len;
+    uint32_t mss = oi.tso_seg_size;
+    for (uint32_t off = 0; off < payload_len; off += mss) {
+        auto len = std::min(mss, payload_len - off);
+        bool last = off + len == payload_len;
+        packet seg(fragment{tmpl.data(), hdr_len}, p.share(hdr_len + off, len));
+        auto sth = seg.get_header<tcp_hdr>(0);
+        auto sh = h;
+        sh.seq = seq + off;
+        // FIN and PSH belong to the last segment only
+        sh.f_fin = h.f_fin && last;
+        sh.f_psh = h.f_psh && last;
+        sh.checksum = 0;
+        *sth = hton(sh);
+
+        offload_info soi;
+        soi.protocol = ip_protocol_num::tcp;
+        soi.tcp_hdr_len = hdr_len;
+        checksummer csum;
+        ipv4_traits::tcp_pseudo_header_checksum(csum, _host_address, to, hdr_len + len);
+        if (hw_csum) {
+            sth->checksum = ~csum.get();
+            soi.needs_csum = true;
+        } else {
+            csum.sum(seg);
+            sth->checksum = csum.get();
+        }
+        seg.set_offload_info(soi);
+        ++_sw_tso_segments;
+        send(to, ip_protocol_num::tcp, std::move(seg), e_dst);
+    }
+}
+
 void ipv4::send(ipv4_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst) {
+    if (_sw_tso) {
+        auto& oi = p.offload_info_ref();
+        if (oi.tso_seg_size) {
+            return send_tso_segments(to, std::move(p), e_dst);
+        }
+        if (oi.needs_csum && !_netif->hw_features().tx_csum_l4_offload) {
+            // The L4 checksum field holds the pseudo header sum; summing
+            // the whole segment over it gives the final checksum
+            checksummer csum;
+            csum.sum(p);
+            auto csum_off = proto_num == ip_protocol_num::tcp ? offsetof(tcp_hdr, checksum) : offsetof(udp_hdr, cksum);
+            auto field = p.get_header<packed<uint16_t>>(csum_off);
+            auto sum = csum.get();
+            // A zero UDP checksum means "no checksum"
+            if (proto_num == ip_protocol_num::udp && sum == 0) {
+                sum = 0xffff;
+            }
+            *field = sum;
+            oi.needs_csum = false;
+        }
+    }
     auto needs_frag = this->needs_frag(p, proto_num, hw_features());
 
     auto send_pkt = [this, to, proto_num, needs_frag, e_dst] (packet& pkt, uint16_t remaining, uint16_t offset) mutable  {
@@ -349,89 +479,204 @@ ip_packet_filter * ipv4::packet_filter() const {
     return _packet_filter;
 }
 
-void ipv4::frag_limit_mem() {
-    if (_frag_mem <= _frag_high_thresh) {
-        return;
+void ipv4::frag_timeout() {
+    auto now = clock_type::now();
+    _frags.expire(now, _frag_timeout);
+    if (!_frags.empty()) {
+        frag_arm(_frags.oldest_rx_time());
     }
-    auto drop = _frag_mem - _frag_low_thresh;
-    while (drop) {
-        if (_frags_age.empty()) {
-            return;
-        }
-        // Drop the oldest frag (first element) from _frags_age
-        auto frag_id = _frags_age.front();
-        _frags_age.pop_front();
+}
 
-        // Drop from _frags as well
-        auto& frag = _frags[frag_id];
-        auto dropped_size = frag.mem_size;
-        frag_drop(frag_id, dropped_size);
+void ipv4_frag_table::set_limits(size_t max_datagrams, uint32_t max_mem) {
+    max_datagrams = std::max(max_datagrams, size_t(1));
+    _slots = std::vector<frag>(max_datagrams);
+    size_t index_size = 2;
+    _index_shift = 63;
+    while (index_size < 2 * max_datagrams) {
+        index_size *= 2;
+        --_index_shift;
+    }
+    _index.assign(index_size, nil);
+    _free = nil;
+    for (uint32_t i = max_datagrams; i-- > 0;) {
+        _slots[i].next = _free;
+        _free = i;
+    }
+    _oldest = _newest = nil;
+    _used = 0;
+    _mem = 0;
+    _mem_high = max_mem;
+    _mem_low = max_mem / 4 * 3;
+}
 
-        drop -= std::min(drop, dropped_size);
+void ipv4_frag_table::age_link(uint32_t slot) {
+    auto& f = _slots[slot];
+    f.prev = _newest;
+    f.next = nil;
+    if (_newest != nil) {
+        _slots[_newest].next = slot;
+    } else {
+        _oldest = slot;
     }
+    _newest = slot;
 }
 
-void ipv4::frag_timeout() {
-    if (_frags.empty()) {
-        return;
+void ipv4_frag_table::age_unlink(uint32_t slot) {
+    auto& f = _slots[slot];
+    if (f.prev != nil) {
+        _slots[f.prev].next = f.next;
+    } else {
+        _oldest = f.next;
     }
-    auto now = clock_type::now();
-    for (auto it = _frags_age.begin(); it != _frags_age.end();) {
-        auto frag_id = *it;
-        auto& frag = _frags[frag_id];
-        if (now > frag.rx_time + _frag_timeout) {
-            auto dropped_size = frag.mem_size;
-            // Drop from _frags
-            frag_drop(frag_id, dropped_size);
-            // Drop from _frags_age
-            it = _frags_age.erase(it);
-        } else {
-            // The further items can only be younger
-            break;
+    if (f.next != nil) {
+        _slots[f.next].prev = f.prev;
+    } else {
+        _newest = f.prev;
+    }
+}
+
+ipv4_frag_table::frag& ipv4_frag_table::get(const ipv4_frag_id& id, clock_type::time_point now) {
+    auto mask = _index.size() - 1;
+    auto i = home(id);
+    for (; _index[i] != nil; i = (i + 1) & mask) {
+        auto slot = _index[i];
+        if (_slots[slot].id == id) {
+            return _slots[slot];
         }
     }
-    if (_frags.size() != 0) {
-        frag_arm(now);
-    } else {
-        _frag_mem = 0;
+    if (_free == nil) {
+        ++_stats.evicted;
+        erase(_slots[_oldest]);
+        // The erase may have moved entries of the probe sequence
+        i = home(id);
+        while (_index[i] != nil) {
+            i = (i + 1) & mask;
+        }
+    }
+    auto slot = _free;
+    auto& f = _slots[slot];
+    _free = f.next;
+    ++_used;
+    f.id = id;
+    f.rx_time = now;
+    age_link(slot);
+    _index[i] = slot;
+    return f;
+}
+
+void ipv4_frag_table::erase(frag& f) {
+    auto slot = slot_of(f);
+    // Remove from the index, moving back the entries after it in the
+    // probe sequence that could not be stored in its place
+    auto mask = _index.size() - 1;
+    auto i = home(f.id);
+    while (_index[i] != slot) {
+        i = (i + 1) & mask;
+    }
+    for (auto j = (i + 1) & mask; _index[j] != nil; j = (j + 1) & mask) {
+        auto k = home(_slots[_index[j]].id);
+        // Movable unless its home is cyclically in (i, j]
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            _index[i] = _index[j];
+            i = j;
+        }
+    }
+    _index[i] = nil;
+    age_unlink(slot);
+    _mem -= f.mem_size;
+    f.header = packet();
+    // Keeps its capacity for the next datagram
+    f.data.clear();
+    f.received = 0;
+    f.total = 0;
+    f.last_frag_received = false;
+    f.mem_size = 0;
+    f.next = _free;
+    _free = slot;
+    --_used;
+}
+
+void ipv4_frag_table::limit_mem() {
+    if (_mem <= _mem_high) {
+        return;
+    }
+    while (_mem > _mem_low && _oldest != nil) {
+        ++_stats.evicted;
+        erase(_slots[_oldest]);
     }
 }
 
-void ipv4::frag_drop(ipv4_frag_id frag_id, uint32_t dropped_size) {
-    _frags.erase(frag_id);
-    _frag_mem -= dropped_size;
+void ipv4_frag_table::expire(clock_type::time_point now, clock_type::duration timeout) {
+    // Further datagrams were started later
+    while (_oldest != nil && now >= _slots[_oldest].rx_time + timeout) {
+        ++_stats.timed_out;
+        erase(_slots[_oldest]);
+    }
 }
 
-int32_t ipv4::frag::merge(ip_hdr &h, uint16_t offset, packet p) {
+int32_t ipv4_frag_table::frag::merge(ip_hdr &h, uint32_t offset, packet p) {
     uint32_t old = mem_size;
     unsigned ip_hdr_len = h.ihl * 4;
     // Store IP header
     if (offset == 0) {
         header = p.share(0, ip_hdr_len);
     }
-    // Sotre IP payload
+    // Store IP payload
     p.trim_front(ip_hdr_len);
-    data.merge(offset, std::move(p));
+    auto beg = offset;
+    auto end = beg + p.len();
+    // fragment with MF == 0 inidates it is the last fragment
+    if (!h.mf()) {
+        last_frag_received = true;
+        total = end;
+    }
+    // Keep the data already received where fragments overlap, except for
+    // fragments the new one covers entirely, which it replaces
+    auto i = std::lower_bound(data.begin(), data.end(), beg, [] (const std::pair<uint32_t, packet>& x, uint32_t off) {
+        return x.first < off;
+    });
+    if (i != data.begin()) {
+        auto& prev = *std::prev(i);
+        auto prev_end = prev.first + prev.second.len();
+        if (prev_end > beg) {
+            auto trim = std::min(prev_end, end) - beg;
+            p.trim_front(trim);
+            beg += trim;
+        }
+    }
+    while (i != data.end() && i->first < end) {
+        auto next_end = i->first + i->second.len();
+        if (next_end <= end) {
+            received -= i->second.len();
+            i = data.erase(i);
+        } else {
+            p.trim_back(end - i->first);
+            end = i->first;
+        }
+    }
+    if (end > beg) {
+        received += end - beg;
+        data.emplace(i, beg, std::move(p));
+    }
     // Update mem size
     mem_size = header.memory();
-    for (const auto& x : data.map) {
+    for (const auto& x : data) {
         mem_size += x.second.memory();
     }
-    auto added_size = mem_size - old;
-    return added_size;
+    return int32_t(mem_size) - int32_t(old);
 }
 
-bool ipv4::frag::is_complete() {
-    // If all the fragments are received, ipv4::frag::merge() should merge all
-    // the fragments into a single packet
-    auto offset = data.map.begin()->first;
-    auto nr_packet = data.map.size();
-    return last_frag_received && nr_packet == 1 && offset == 0;
+packet ipv4_frag_table::frag::assemble() {
+    auto ip_data = std::move(data.front().second);
+    for (auto i = std::next(data.begin()); i != data.end(); ++i) {
+        ip_data.append(std::move(i->second));
+    }
+    data.clear();
+    return ip_data;
 }
 
-packet ipv4::frag::get_assembled_packet(ethernet_address from, ethernet_address to) {
+packet ipv4_frag_table::frag::get_assembled_packet(packet ip_data, ethernet_address from, ethernet_address to) {
     auto& ip_header = header;
-    auto& ip_data = data.map.begin()->second;
     // Append a ethernet header, needed for forwarding
     auto eh = ip_header.prepend_header<eth_hdr>();
     eh->src_mac = from;
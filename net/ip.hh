@@ -31,6 +31,8 @@
 #include <map>
 #include <list>
 #include <chrono>
+#include <limits>
+#include <vector>
 #include "core/array_map.hh"
 #include "byteorder.hh"
 #include "arp.hh"
@@ -84,6 +86,11 @@ static inline bool is_unspecified(ipv4_address addr) { return addr.ip == 0; }
 
 std::ostream& operator<<(std::ostream& os, ipv4_address a);
 
+// Appends an address to RSS hash input, in network byte order
+inline void add_to_forward_hash(forward_hash& data, ipv4_address a) {
+    data.push_back(hton(a.ip));
+}
+
 }
 
 namespace std {
@@ -114,6 +121,19 @@ struct ipv4_traits {
         csum.sum_many(src.ip.raw, dst.ip.raw, uint8_t(0), uint8_t(ip_protocol_num::udp), len);
     }
     static constexpr uint8_t ip_hdr_len_min = net::ipv4_hdr_len_min;
+    static constexpr int address_family = AF_INET;
+    static ipv4_address address_of(const socket_address& sa) {
+        return ipv4_address(ipv4_addr(sa));
+    }
+    static uint16_t port_of(const socket_address& sa) {
+        return ntoh(sa.as_posix_sockaddr_in().sin_port);
+    }
+    // collectd plugin of the protocols running over this network layer
+    static const char* tcp_plugin_name() { return "tcp"; }
+    static std::experimental::optional<flow_steering_rule> steering_rule(ipv4_address foreign_ip, uint16_t foreign_port,
+            ipv4_address local_ip, uint16_t local_port, ip_protocol_num proto) {
+        return flow_steering_rule{foreign_ip.ip, local_ip.ip, foreign_port, local_port, proto};
+    }
 };
 
 template <ip_protocol_num ProtoNum>
@@ -151,10 +171,10 @@ struct l4connid {
                 && foreign_port == x.foreign_port;
     }
 
-    uint32_t hash(const rss_key_type& rss_key) {
+    uint32_t hash(const rss_key_type& rss_key) const {
         forward_hash hash_data;
-        hash_data.push_back(hton(foreign_ip.ip));
-        hash_data.push_back(hton(local_ip.ip));
+        add_to_forward_hash(hash_data, foreign_ip);
+        add_to_forward_hash(hash_data, local_ip);
         hash_data.push_back(hton(foreign_port));
         hash_data.push_back(hton(local_port));
         return toeplitz_hash(rss_key, hash_data);
@@ -295,8 +315,111 @@ struct ipv4_frag_id::hash : private std::hash<ipv4_address>,
     }
 };
 
-struct ipv4_tag {};
-using ipv4_packet_merger = packet_merger<uint32_t, ipv4_tag>;
+// Datagrams being reassembled from their fragments.  They live in a fixed
+// number of slots, found through an open addressed index, and are chained
+// in the order they were started, so that both timing out and evicting
+// datagrams when memory runs short take the oldest ones first.  A
+// datagram times out a fixed time after its first fragment, however
+// often more fragments arrive.  Nothing
+// is allocated per datagram once the slots have been used, and fragment
+// payloads are chained rather than copied.
+class ipv4_frag_table {
+public:
+    using clock_type = lowres_clock;
+    static constexpr size_t default_max_datagrams = 1024;
+    static constexpr uint32_t default_max_mem = 4 * 1024 * 1024;
+
+    struct frag {
+        ipv4_frag_id id;
+        packet header;
+        // Payload received so far, by offset; fragments do not overlap
+        std::vector<std::pair<uint32_t, packet>> data;
+        uint32_t received = 0;
+        // Payload length, known once the last fragment (MF == 0) arrived
+        uint32_t total = 0;
+        bool last_frag_received = false;
+        uint32_t mem_size = 0;
+        // Arrival of the first fragment
+        clock_type::time_point rx_time;
+        // Age order, by slot
+        uint32_t prev;
+        uint32_t next;
+
+        // Returns the change in memory used
+        int32_t merge(ip_hdr& h, uint32_t offset, packet p);
+        bool is_complete() const {
+            return last_frag_received && received == total
+                    && data.back().first + data.back().second.len() == total;
+        }
+        // The payload, in one packet; leaves the datagram empty
+        packet assemble();
+        packet get_assembled_packet(packet ip_data, ethernet_address from, ethernet_address to);
+    };
+    struct stats {
+        uint64_t reassembled = 0;
+        // Dropped to make room, for lack of slots or of memory
+        uint64_t evicted = 0;
+        uint64_t timed_out = 0;
+    };
+private:
+    static constexpr uint32_t nil = std::numeric_limits<uint32_t>::max();
+    std::vector<frag> _slots;
+    // Slots by hash of their datagram id, linear probing; at most half full
+    std::vector<uint32_t> _index;
+    unsigned _index_shift;
+    // Free slots, chained through frag::next
+    uint32_t _free = nil;
+    uint32_t _oldest = nil;
+    uint32_t _newest = nil;
+    size_t _used = 0;
+    uint32_t _mem = 0;
+    uint32_t _mem_low;
+    uint32_t _mem_high;
+    stats _stats;
+public:
+    explicit ipv4_frag_table(size_t max_datagrams = default_max_datagrams, uint32_t max_mem = default_max_mem) {
+        set_limits(max_datagrams, max_mem);
+    }
+    // Drops the datagrams being reassembled
+    void set_limits(size_t max_datagrams, uint32_t max_mem);
+    // Finds the datagram, or starts a new one (evicting the oldest if all
+    // slots are taken)
+    frag& get(const ipv4_frag_id& id, clock_type::time_point now);
+    void erase(frag& f);
+    void add_mem(int32_t added) {
+        _mem += added;
+    }
+    // Evicts datagrams while memory is over the limit
+    void limit_mem();
+    // Drops the datagrams started more than \c timeout ago
+    void expire(clock_type::time_point now, clock_type::duration timeout);
+    bool empty() const {
+        return !_used;
+    }
+    // When the oldest datagram was started; the table must not be empty
+    clock_type::time_point oldest_rx_time() const {
+        return _slots[_oldest].rx_time;
+    }
+    uint32_t mem() const {
+        return _mem;
+    }
+    const stats& get_stats() const {
+        return _stats;
+    }
+    void count_reassembled() {
+        ++_stats.reassembled;
+    }
+private:
+    size_t home(const ipv4_frag_id& id) const {
+        // Fibonacci hashing spreads the xor based hash over the index
+        return (uint64_t(ipv4_frag_id::hash()(id)) * 0x9e3779b97f4a7c15ull) >> _index_shift;
+    }
+    uint32_t slot_of(const frag& f) const {
+        return &f - _slots.data();
+    }
+    void age_link(uint32_t slot);
+    void age_unlink(uint32_t slot);
+};
 
 class ipv4 {
 public:
@@ -307,12 +430,19 @@ class ipv4 {
     static proto_type arp_protocol_type() { return proto_type(eth_protocol_num::ipv4); }
 private:
     interface* _netif;
+    // Features of the interface, plus the ones emulated in software
+    net::hw_features _hw_features;
+    bool _sw_tso = false;
+    bool _sw_gro = false;
+    uint64_t _sw_tso_segments = 0;
     std::vector<ipv4_traits::packet_provider_type> _pkt_providers;
     arp _global_arp;
     arp_for<ipv4> _arp;
     ipv4_address _host_address;
     ipv4_address _gw_address;
     ipv4_address _netmask;
+    ipv4_address _last_learned_ip;
+    ethernet_address _last_learned_mac = ethernet::broadcast_address();
     l3_protocol _l3;
     subscription<packet, ethernet_address> _rx_packets;
     ipv4_tcp _tcp;
@@ -320,36 +450,20 @@ class ipv4 {
     ipv4_udp _udp;
     array_map<ip_protocol*, 256> _l4;
     ip_packet_filter * _packet_filter = nullptr;
-    struct frag {
-        packet header;
-        ipv4_packet_merger data;
-        clock_type::time_point rx_time;
-        uint32_t mem_size = 0;
-        // fragment with MF == 0 inidates it is the last fragment
-        bool last_frag_received = false;
-
-        packet get_assembled_packet(ethernet_address from, ethernet_address to);
-        int32_t merge(ip_hdr &h, uint16_t offset, packet p);
-        bool is_complete();
-    };
-    std::unordered_map<ipv4_frag_id, frag, ipv4_frag_id::hash> _frags;
-    std::list<ipv4_frag_id> _frags_age;
+    ipv4_frag_table _frags;
     static constexpr std::chrono::seconds _frag_timeout{30};
-    static constexpr uint32_t _frag_low_thresh{3 * 1024 * 1024};
-    static constexpr uint32_t _frag_high_thresh{4 * 1024 * 1024};
-    uint32_t _frag_mem{0};
     timer<lowres_clock> _frag_timer;
     circular_buffer<l3_protocol::l3packet> _packetq;
     unsigned _pkt_provider_idx = 0;
     scollectd::registrations _collectd_regs;
 private:
     future<> handle_received_packet(packet p, ethernet_address from);
+    void handle_received_burst(l3_rx_burst& burst);
     bool forward(forward_hash& out_hash_data, packet& p, size_t off);
     std::experimental::optional<l3_protocol::l3packet> get_packet();
     bool in_my_netmask(ipv4_address a) const;
-    void frag_limit_mem();
+    void send_tso_segments(ipv4_address to, packet p, ethernet_address e_dst);
     void frag_timeout();
-    void frag_drop(ipv4_frag_id frag_id, uint32_t dropped_size);
     void frag_arm(clock_type::time_point now) {
         auto tp = now + _frag_timeout;
         _frag_timer.arm(tp);
@@ -378,7 +492,21 @@ class ipv4 {
     tcp<ipv4_traits>& get_tcp() { return *_tcp._tcp; }
     ipv4_udp& get_udp() { return _udp; }
     void register_l4(proto_type id, ip_protocol* handler);
-    const net::hw_features& hw_features() const { return _netif->hw_features(); }
+    const net::hw_features& hw_features() const { return _hw_features; }
+    // Segment TCP packets and complete L4 checksums in software if the
+    // device cannot, so that TCP can still hand over large packets
+    void enable_sw_tso();
+    // Coalesce received TCP segments in software if the device has no LRO
+    void enable_sw_gro() {
+        _sw_gro = !_netif->hw_features().rx_lro;
+    }
+    bool sw_gro() const { return _sw_gro; }
+    // Bounds the datagrams reassembled at once from fragments, and the
+    // memory they hold; the oldest ones are dropped beyond that.  Drops
+    // the datagrams being reassembled.
+    void set_frag_limits(size_t max_datagrams, uint32_t max_mem) {
+        _frags.set_limits(max_datagrams, max_mem);
+    }
     static bool needs_frag(packet& p, ip_protocol_num proto_num, net::hw_features hw_features);
     void learn(ethernet_address l2, ipv4_address l3) {
         _arp.learn(l2, l3);
@@ -432,14 +560,18 @@ struct ip_hdr {
 } __attribute__((packed));
 
 template <typename InetTraits>
-struct l4connid<InetTraits>::connid_hash : private std::hash<ipaddr>, private std::hash<uint16_t> {
+struct l4connid<InetTraits>::connid_hash : private std::hash<ipaddr> {
     size_t operator()(const l4connid<InetTraits>& id) const noexcept {
         using h1 = std::hash<ipaddr>;
-        using h2 = std::hash<uint16_t>;
-        return h1::operator()(id.local_ip)
-            ^ h1::operator()(id.foreign_ip)
-            ^ h2::operator()(id.local_port)
-            ^ h2::operator()(id.foreign_port);
+        // Mix all bits, so that the low bits alone are a good bucket index
+        // for an open addressing table
+        uint64_t h = h1::operator()(id.local_ip);
+        h = h * 0x9e3779b97f4a7c15ULL ^ h1::operator()(id.foreign_ip);
+        h = h * 0x9e3779b97f4a7c15ULL ^ ((uint32_t(id.local_port) << 16) | id.foreign_port);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
     }
 };
 
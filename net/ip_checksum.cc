@@ -22,15 +22,20 @@
 #include "ip_checksum.hh"
 #include "net.hh"
 #include <arpa/inet.h>
+#include <stdexcept>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 namespace net {
 
-void checksummer::sum(const char* data, size_t len) {
-    auto orig_len = len;
-    if (odd) {
-        csum += uint8_t(*data++);
-        --len;
-    }
+// The kernels sum a buffer that starts on a 16-bit word boundary.  They
+// return a value congruent, modulo 0xffff, to the sum of the buffer's big
+// endian 16-bit words (a trailing odd byte is the high byte of a last
+// word); checksummer::get() folds it.
+
+static __int128 sum_scalar(const char* data, size_t len) {
+    __int128 csum = 0;
     auto p64 = reinterpret_cast<const packed<uint64_t>*>(data);
     while (len >= 8) {
         csum += ntohq(*p64++);
@@ -43,9 +48,135 @@ void checksummer::sum(const char* data, size_t len) {
     }
     auto p8 = reinterpret_cast<const uint8_t*>(p16);
     if (len) {
-        csum += *p8++ << 8;
-        len -= 1;
+        csum += *p8 << 8;
+    }
+    return csum;
+}
+
+#ifdef __x86_64__
+
+// The vector kernels add the buffer as little endian 32-bit words, each
+// zero extended into a 64-bit lane so that the lanes cannot overflow.
+// Since 0x10000 == 1 (mod 0xffff), that sum is congruent to the sum of the
+// little endian 16-bit words, and a byte swap is a multiplication by 0x100
+// (mod 0xffff), so shifting it left by 8 bits gives the big endian sum
+// without swapping every word.
+
+static __int128 sum_sse2(const char* data, size_t len) {
+    auto zero = _mm_setzero_si128();
+    auto acc0 = _mm_setzero_si128();
+    auto acc1 = _mm_setzero_si128();
+    while (len >= 32) {
+        auto v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        auto v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v0, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v0, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v1, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v1, zero));
+        data += 32;
+        len -= 32;
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), _mm_add_epi64(acc0, acc1));
+    __int128 le = __int128(lanes[0]) + lanes[1];
+    return (le << 8) + sum_scalar(data, len);
+}
+
+__attribute__((target("avx2")))
+static __int128 sum_avx2(const char* data, size_t len) {
+    auto zero = _mm256_setzero_si256();
+    auto acc0 = _mm256_setzero_si256();
+    auto acc1 = _mm256_setzero_si256();
+    while (len >= 64) {
+        auto v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        auto v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+        data += 64;
+        len -= 64;
+    }
+    if (len >= 32) {
+        auto v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+        data += 32;
+        len -= 32;
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), _mm256_add_epi64(acc0, acc1));
+    __int128 le = __int128(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    // Not sum_sse2(): running legacy SSE code with the upper halves of the
+    // ymm registers dirty costs a state transition on many CPUs
+    return (le << 8) + sum_scalar(data, len);
+}
+
+#endif
+
+using sum_fn = __int128 (*)(const char* data, size_t len);
+
+static sum_fn impl_fn(checksum_impl impl) {
+    switch (impl) {
+#ifdef __x86_64__
+    case checksum_impl::sse2: return sum_sse2;
+    case checksum_impl::avx2: return sum_avx2;
+#endif
+    default: return sum_scalar;
+    }
+}
+
+bool checksum_impl_supported(checksum_impl impl) {
+    switch (impl) {
+    case checksum_impl::scalar:
+        return true;
+#ifdef __x86_64__
+    case checksum_impl::sse2:
+        return true;
+    case checksum_impl::avx2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+static checksum_impl best_checksum_impl() {
+    for (auto impl : {checksum_impl::avx2, checksum_impl::sse2}) {
+        if (checksum_impl_supported(impl)) {
+            return impl;
+        }
+    }
+    return checksum_impl::scalar;
+}
+
+static checksum_impl current_impl = best_checksum_impl();
+static sum_fn current_fn = impl_fn(current_impl);
+
+checksum_impl get_checksum_impl() {
+    return current_impl;
+}
+
+void set_checksum_impl(checksum_impl impl) {
+    if (!checksum_impl_supported(impl)) {
+        throw std::invalid_argument("checksum implementation not supported by this CPU");
+    }
+    current_impl = impl;
+    current_fn = impl_fn(impl);
+}
+
+void checksummer::sum(const char* data, size_t len) {
+    if (!len) {
+        return;
+    }
+    auto orig_len = len;
+    if (odd) {
+        // The first byte completes the word left over by the previous call
+        csum += uint8_t(*data++);
+        --len;
     }
+    csum += current_fn(data, len);
     odd ^= orig_len & 1;
 }
 
@@ -31,6 +31,15 @@ namespace net {
 
 uint16_t ip_checksum(const void* data, size_t len);
 
+// Implementations of the inner summing loop.  The fastest one the CPU
+// supports is picked at startup; tests and benchmarks can switch between
+// them.
+enum class checksum_impl { scalar, sse2, avx2 };
+
+bool checksum_impl_supported(checksum_impl impl);
+checksum_impl get_checksum_impl();
+void set_checksum_impl(checksum_impl impl);
+
 struct checksummer {
     __int128 csum = 0;
     bool odd = false;
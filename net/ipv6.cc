@@ -0,0 +1,435 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "ipv6.hh"
+#include "tcp.hh"
+#include "core/print.hh"
+#include <boost/asio/ip/address_v6.hpp>
+
+namespace net {
+
+ipv6_address::ipv6_address(const std::string& addr) {
+    boost::system::error_code ec;
+    auto ipv6 = boost::asio::ip::address_v6::from_string(addr, ec);
+    if (ec) {
+        throw std::runtime_error(sprint("Wrong format for IPv6 address %s", addr));
+    }
+    auto bytes = ipv6.to_bytes();
+    std::copy(bytes.begin(), bytes.end(), ip.begin());
+}
+
+ipv6_address ipv6_address::solicited_node() const {
+    ipv6_address a;
+    a.ip = {{0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xff, ip[13], ip[14], ip[15]}};
+    return a;
+}
+
+ipv6_address ipv6_address::link_local(ethernet_address mac) {
+    auto& m = mac.mac;
+    ipv6_address a;
+    a.ip = {{0xfe, 0x80, 0, 0, 0, 0, 0, 0,
+            uint8_t(m[0] ^ 0x02), m[1], m[2], 0xff, 0xfe, m[3], m[4], m[5]}};
+    return a;
+}
+
+ipv6_address ipv6_address::all_nodes() {
+    ipv6_address a;
+    a.ip = {{0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01}};
+    return a;
+}
+
+::sockaddr_in6 ipv6_address::to_sockaddr(uint16_t port) const {
+    ::sockaddr_in6 sa = {};
+    sa.sin6_family = AF_INET6;
+    sa.sin6_port = htons(port);
+    std::copy(ip.begin(), ip.end(), sa.sin6_addr.s6_addr);
+    return sa;
+}
+
+std::ostream& operator<<(std::ostream& os, const ipv6_address& a) {
+    for (unsigned i = 0; i < 16; i += 2) {
+        if (i) {
+            os << ":";
+        }
+        fprint(os, "%x", (a.ip[i] << 8) | a.ip[i + 1]);
+    }
+    return os;
+}
+
+constexpr uint32_t ndp::flag_solicited;
+constexpr uint32_t ndp::flag_override;
+constexpr unsigned ndp::max_solicitations;
+
+future<ethernet_address> ndp::lookup(const ipv6_address& addr) {
+    if (addr.is_multicast()) {
+        return make_ready_future<ethernet_address>(addr.multicast_mac());
+    }
+    auto i = _table.find(addr);
+    if (i != _table.end()) {
+        return make_ready_future<ethernet_address>(i->second);
+    }
+    auto j = _in_progress.find(addr);
+    auto first_request = j == _in_progress.end();
+    auto& res = first_request ? _in_progress[addr] : j->second;
+
+    if (first_request) {
+        res._timeout_timer.set_callback([addr, this, &res] {
+            auto waiters = std::move(res._waiters);
+            res._waiters.clear();
+            if (res._solicitations < max_solicitations) {
+                ++res._solicitations;
+                send_solicitation(addr);
+            } else {
+                // Nobody answers; stop soliciting.  This destroys the
+                // callback, so only locals are used from here on.
+                auto& in_progress = _in_progress;
+                auto a = addr;
+                in_progress.erase(a);
+            }
+            for (auto& w : waiters) {
+                w.set_exception(ndp_timeout_error());
+            }
+        });
+        res._timeout_timer.arm_periodic(std::chrono::seconds(1));
+        ++res._solicitations;
+        send_solicitation(addr);
+    }
+
+    if (res._waiters.size() >= max_waiters) {
+        return make_exception_future<ethernet_address>(ndp_queue_full_error());
+    }
+
+    res._waiters.emplace_back();
+    return res._waiters.back().get_future();
+}
+
+void ndp::learn(ethernet_address l2, const ipv6_address& l3) {
+    _table[l3] = l2;
+    auto i = _in_progress.find(l3);
+    if (i != _in_progress.end()) {
+        auto& res = i->second;
+        res._timeout_timer.cancel();
+        for (auto&& pr : res._waiters) {
+            pr.set_value(l2);
+        }
+        _in_progress.erase(i);
+    }
+}
+
+void ndp::send_solicitation(const ipv6_address& target) {
+    auto to = target.solicited_node();
+    packet p;
+    auto opt = p.prepend_header<link_layer_option>();
+    opt->type = link_layer_option::source;
+    opt->len = 1;
+    opt->addr = _inet.netif()->hw_address();
+    auto ns = p.prepend_header<ns_na>();
+    ns->flags = 0;
+    ns->target = target;
+    auto ih = p.prepend_header<icmpv6_hdr>();
+    ih->type = icmpv6_hdr::msg_type::neighbor_solicitation;
+    ih->code = 0;
+    ih->csum = 0;
+    _inet.send_icmp(to, std::move(p), to.multicast_mac());
+}
+
+void ndp::send_advertisement(const ipv6_address& to, ethernet_address to_mac, const ipv6_address& target, bool solicited) {
+    packet p;
+    auto opt = p.prepend_header<link_layer_option>();
+    opt->type = link_layer_option::target;
+    opt->len = 1;
+    opt->addr = _inet.netif()->hw_address();
+    auto na = p.prepend_header<ns_na>();
+    na->flags = flag_override | (solicited ? flag_solicited : 0);
+    na->target = target;
+    *na = hton(*na);
+    auto ih = p.prepend_header<icmpv6_hdr>();
+    ih->type = icmpv6_hdr::msg_type::neighbor_advertisement;
+    ih->code = 0;
+    ih->csum = 0;
+    _inet.send_icmp(to, std::move(p), to_mac);
+}
+
+void ndp::received(icmpv6_hdr::msg_type type, packet p, const ipv6_address& from, const ipv6_address& to,
+        ethernet_address from_mac) {
+    auto h = p.get_header<ns_na>(0);
+    if (!h) {
+        return;
+    }
+    auto msg = ntoh(*h);
+    // Look for the link-layer address option
+    std::experimental::optional<ethernet_address> lladdr;
+    for (size_t off = sizeof(ns_na); off + 2 <= p.len(); ) {
+        auto opt = p.get_header<link_layer_option>(off);
+        auto len = opt ? opt->len * 8u : 0u;
+        if (!len) {
+            break;
+        }
+        if ((opt->type == link_layer_option::source && type == icmpv6_hdr::msg_type::neighbor_solicitation)
+                || (opt->type == link_layer_option::target && type == icmpv6_hdr::msg_type::neighbor_advertisement)) {
+            lladdr = opt->addr;
+        }
+        off += len;
+    }
+    if (type == icmpv6_hdr::msg_type::neighbor_solicitation) {
+        if (msg.target != _inet.link_local_address() && msg.target != _inet.host_address()) {
+            return;
+        }
+        if (is_unspecified(from)) {
+            // Duplicate address detection by another node: the address is
+            // ours, so answer to all nodes
+            send_advertisement(ipv6_address::all_nodes(), ipv6_address::all_nodes().multicast_mac(), msg.target, false);
+            return;
+        }
+        // The sender is about to talk to us; remember it to answer
+        auto mac = lladdr ? *lladdr : from_mac;
+        learn(mac, from);
+        send_advertisement(from, mac, msg.target, true);
+    } else {
+        if (!lladdr) {
+            return;
+        }
+        learn(*lladdr, msg.target);
+        if (_learn_hook) {
+            _learn_hook(*lladdr, msg.target);
+        }
+    }
+}
+
+ipv6::ipv6(interface* netif)
+    : _netif(netif)
+    , _hw_features(netif->hw_features())
+    , _link_local_address(ipv6_address::link_local(netif->hw_address()))
+    , _l3(netif, eth_protocol_num::ipv6, [this] { return get_packet(); })
+    , _rx_packets(_l3.receive([this] (packet p, ethernet_address ea) {
+        return handle_received_packet(std::move(p), ea); },
+      [this] (forward_hash& out_hash_data, packet& p, size_t off) {
+        return forward(out_hash_data, p, off);}))
+    , _ndp(*this)
+    , _tcp(*this)
+    , _udp(*this) {
+    _hw_features.tx_csum_ip_offload = false;
+    _hw_features.tx_csum_l4_offload = false;
+    _hw_features.rx_csum_offload = false;
+    _hw_features.tx_tso = false;
+    _hw_features.tx_ufo = false;
+    // Neighbours solicit our addresses through their solicited-node
+    // groups, which a NIC filtering multicast frames would drop otherwise
+    _netif->join_multicast(ipv6_address::all_nodes().multicast_mac());
+    _netif->join_multicast(_link_local_address.solicited_node().multicast_mac());
+}
+
+void ipv6::set_host_address(ipv6_address ip) {
+    _host_address = ip;
+    if (!is_unspecified(ip)) {
+        _netif->join_multicast(ip.solicited_node().multicast_mac());
+    }
+}
+
+bool ipv6::forward(forward_hash& out_hash_data, packet& p, size_t off) {
+    auto iph = p.get_header<ipv6_hdr>(off);
+    if (!iph) {
+        return false;
+    }
+    add_to_forward_hash(out_hash_data, iph->src_ip);
+    add_to_forward_hash(out_hash_data, iph->dst_ip);
+    if (iph->next_header == uint8_t(ip_protocol_num::tcp)) {
+        _tcp.forward(out_hash_data, p, off + sizeof(ipv6_hdr));
+    } else if (iph->next_header == uint8_t(ip_protocol_num::udp)) {
+        _udp.forward(out_hash_data, p, off + sizeof(ipv6_hdr));
+    }
+    return true;
+}
+
+bool ipv6::is_local(const ipv6_address& a) const {
+    return a == _link_local_address
+            || (!is_unspecified(_host_address) && a == _host_address)
+            || a == ipv6_address::all_nodes()
+            || a == _link_local_address.solicited_node()
+            || (!is_unspecified(_host_address) && a == _host_address.solicited_node());
+}
+
+bool ipv6::on_link(const ipv6_address& a) const {
+    if (a.is_link_local() || a.is_multicast()) {
+        return true;
+    }
+    if (is_unspecified(_host_address)) {
+        return false;
+    }
+    unsigned bits = _prefix_length;
+    for (unsigned i = 0; bits; ++i) {
+        auto n = std::min(bits, 8u);
+        uint8_t mask = 0xff << (8 - n);
+        if ((a.ip[i] ^ _host_address.ip[i]) & mask) {
+            return false;
+        }
+        bits -= n;
+    }
+    return true;
+}
+
+future<>
+ipv6::handle_received_packet(packet p, ethernet_address from) {
+    auto iph = p.get_header<ipv6_hdr>(0);
+    if (!iph) {
+        return make_ready_future<>();
+    }
+    auto h = ntoh(*iph);
+    if (h.version() != 6) {
+        return make_ready_future<>();
+    }
+    unsigned len = sizeof(ipv6_hdr) + h.payload_len;
+    if (p.len() > len) {
+        // Trim extra data in the packet beyond the payload length
+        p.trim_back(p.len() - len);
+    } else if (p.len() < len) {
+        return make_ready_future<>();
+    }
+    if (!is_local(h.dst_ip)) {
+        // FIXME: forward
+        return make_ready_future<>();
+    }
+    p.trim_front(sizeof(ipv6_hdr));
+
+    // Skip the extension headers that carry nothing for us.  Fragments
+    // (and routing headers) are not supported and are dropped below.
+    auto next = h.next_header;
+    while (next == 0 || next == 60) {
+        auto opt = p.get_header<ipv6_opt_hdr>(0);
+        if (!opt || p.len() < (opt->len + 1u) * 8) {
+            return make_ready_future<>();
+        }
+        next = opt->next_header;
+        p.trim_front((opt->len + 1u) * 8);
+    }
+
+    switch (ip_protocol_num(next)) {
+    case ip_protocol_num::tcp:
+        _tcp.received(std::move(p), h.src_ip, h.dst_ip);
+        break;
+    case ip_protocol_num::udp:
+        _udp.received(std::move(p), h.src_ip, h.dst_ip);
+        break;
+    case ip_protocol_num::icmpv6:
+        icmp_received(std::move(p), h.src_ip, h.dst_ip, h.hop_limit, from);
+        break;
+    default:
+        break;
+    }
+    return make_ready_future<>();
+}
+
+void ipv6::icmp_received(packet p, const ipv6_address& from, const ipv6_address& to, uint8_t hop_limit,
+        ethernet_address from_mac) {
+    auto ih = p.get_header<icmpv6_hdr>(0);
+    if (!ih) {
+        return;
+    }
+    checksummer csum;
+    ipv6_traits::pseudo_header_checksum(csum, from, to, p.len(), ip_protocol_num::icmpv6);
+    csum.sum(p);
+    if (csum.get() != 0) {
+        return;
+    }
+    switch (ih->type) {
+    case icmpv6_hdr::msg_type::echo_request: {
+        if (to.is_multicast() || _packetq.size() >= max_queued_control_packets) {
+            return;
+        }
+        ih->type = icmpv6_hdr::msg_type::echo_reply;
+        ih->csum = 0;
+        get_l2_dst_address(from).then([this, from, p = std::move(p)] (ethernet_address e_dst) mutable {
+            send_icmp(from, std::move(p), e_dst);
+        }).handle_exception([] (auto ep) {});
+        break;
+    }
+    case icmpv6_hdr::msg_type::neighbor_solicitation:
+    case icmpv6_hdr::msg_type::neighbor_advertisement: {
+        // Only a router could have lowered it: the message came from off
+        // the link, and must not touch the neighbour table (RFC 4861 7.1)
+        if (hop_limit != 255) {
+            return;
+        }
+        auto type = ih->type;
+        p.trim_front(sizeof(icmpv6_hdr));
+        _ndp.received(type, std::move(p), from, to, from_mac);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void ipv6::send_icmp(ipv6_address to, packet p, ethernet_address e_dst) {
+    if (_packetq.size() >= max_queued_control_packets) {
+        return;
+    }
+    auto ih = p.get_header<icmpv6_hdr>(0);
+    checksummer csum;
+    ipv6_traits::pseudo_header_checksum(csum, source_address(to), to, p.len(), ip_protocol_num::icmpv6);
+    csum.sum(p);
+    ih->csum = csum.get();
+    send(to, ip_protocol_num::icmpv6, std::move(p), e_dst);
+}
+
+void ipv6::send(ipv6_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst) {
+    auto iph = p.prepend_header<ipv6_hdr>();
+    iph->ver_tc_flow = uint32_t(6) << 28;
+    iph->payload_len = p.len() - sizeof(ipv6_hdr);
+    iph->next_header = uint8_t(proto_num);
+    // Neighbour discovery messages must carry 255 (RFC4861 section 7.1)
+    iph->hop_limit = proto_num == ip_protocol_num::icmpv6 ? 255 : 64;
+    iph->src_ip = source_address(to);
+    iph->dst_ip = to;
+    *iph = hton(*iph);
+    _packetq.push_back(l3_protocol::l3packet{eth_protocol_num::ipv6, e_dst, std::move(p)});
+}
+
+std::experimental::optional<l3_protocol::l3packet> ipv6::get_packet() {
+    if (_packetq.empty()) {
+        for (size_t i = 0; i < _pkt_providers.size(); i++) {
+            auto l4p = _pkt_providers[_pkt_provider_idx++]();
+            if (_pkt_provider_idx == _pkt_providers.size()) {
+                _pkt_provider_idx = 0;
+            }
+            if (l4p) {
+                auto l4pv = std::move(l4p.value());
+                send(l4pv.to, l4pv.proto_num, std::move(l4pv.p), l4pv.e_dst);
+                break;
+            }
+        }
+    }
+
+    std::experimental::optional<l3_protocol::l3packet> p;
+    if (!_packetq.empty()) {
+        p = std::move(_packetq.front());
+        _packetq.pop_front();
+    }
+    return p;
+}
+
+future<ethernet_address> ipv6::get_l2_dst_address(ipv6_address to) {
+    // Directly connected hosts are resolved themselves, everything else
+    // goes through the default gateway
+    return _ndp.lookup(on_link(to) ? to : _gw_address);
+}
+
+}
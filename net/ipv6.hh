@@ -0,0 +1,400 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#ifndef IPV6_HH_
+#define IPV6_HH_
+
+#include "ip.hh"
+#include <array>
+#include <cstring>
+
+namespace net {
+
+class ipv6;
+template <ip_protocol_num ProtoNum>
+class ipv6_l4;
+
+struct ipv6_address {
+    ipv6_address() : ip{} {}
+    explicit ipv6_address(const std::array<uint8_t, 16>& a) : ip(a) {}
+    explicit ipv6_address(const ::sockaddr_in6& sa) {
+        std::copy_n(sa.sin6_addr.s6_addr, 16, ip.begin());
+    }
+    explicit ipv6_address(const std::string& addr);
+
+    // Network byte order
+    std::array<uint8_t, 16> ip;
+
+    template <typename Adjuster>
+    void adjust_endianness(Adjuster a) {}
+
+    bool is_multicast() const { return ip[0] == 0xff; }
+    bool is_link_local() const { return ip[0] == 0xfe && (ip[1] & 0xc0) == 0x80; }
+    // The solicited-node multicast group (ff02::1:ffXX:XXXX) that neighbour
+    // solicitations for this address are sent to
+    ipv6_address solicited_node() const;
+    // fe80::/64 with an interface identifier derived from a MAC (RFC4291)
+    static ipv6_address link_local(ethernet_address mac);
+    // ff02::1
+    static ipv6_address all_nodes();
+    // The ethernet multicast address for a multicast group (RFC2464)
+    ethernet_address multicast_mac() const {
+        return {0x33, 0x33, ip[12], ip[13], ip[14], ip[15]};
+    }
+    ::sockaddr_in6 to_sockaddr(uint16_t port) const;
+
+    friend bool operator==(const ipv6_address& x, const ipv6_address& y) {
+        return x.ip == y.ip;
+    }
+    friend bool operator!=(const ipv6_address& x, const ipv6_address& y) {
+        return x.ip != y.ip;
+    }
+} __attribute__((packed));
+
+static inline bool is_unspecified(const ipv6_address& addr) {
+    return addr == ipv6_address();
+}
+
+std::ostream& operator<<(std::ostream& os, const ipv6_address& a);
+
+inline void add_to_forward_hash(forward_hash& data, const ipv6_address& a) {
+    for (auto b : a.ip) {
+        data.push_back(b);
+    }
+}
+
+}
+
+namespace std {
+
+template <>
+struct hash<net::ipv6_address> {
+    size_t operator()(const net::ipv6_address& a) const {
+        uint64_t w[2];
+        std::memcpy(w, a.ip.data(), sizeof(w));
+        return (w[0] * 0x9e3779b97f4a7c15ULL) ^ w[1];
+    }
+};
+
+}
+
+namespace net {
+
+struct ipv6_traits {
+    using address_type = ipv6_address;
+    using inet_type = ipv6_l4<ip_protocol_num::tcp>;
+    struct l4packet {
+        ipv6_address to;
+        packet p;
+        ethernet_address e_dst;
+        ip_protocol_num proto_num;
+    };
+    using packet_provider_type = std::function<std::experimental::optional<l4packet> ()>;
+    static void pseudo_header_checksum(checksummer& csum, const ipv6_address& src, const ipv6_address& dst,
+            uint32_t len, ip_protocol_num proto) {
+        csum.sum(reinterpret_cast<const char*>(src.ip.data()), src.ip.size());
+        csum.sum(reinterpret_cast<const char*>(dst.ip.data()), dst.ip.size());
+        csum.sum_many(len, uint32_t(proto));
+    }
+    static void tcp_pseudo_header_checksum(checksummer& csum, const ipv6_address& src, const ipv6_address& dst, uint16_t len) {
+        pseudo_header_checksum(csum, src, dst, len, ip_protocol_num::tcp);
+    }
+    static void udp_pseudo_header_checksum(checksummer& csum, const ipv6_address& src, const ipv6_address& dst, uint16_t len) {
+        pseudo_header_checksum(csum, src, dst, len, ip_protocol_num::udp);
+    }
+    static constexpr uint8_t ip_hdr_len_min = net::ipv6_hdr_len_min;
+    static constexpr int address_family = AF_INET6;
+    static ipv6_address address_of(const socket_address& sa) {
+        return ipv6_address(sa.as_posix_sockaddr_in6());
+    }
+    static uint16_t port_of(const socket_address& sa) {
+        return ntoh(sa.as_posix_sockaddr_in6().sin6_port);
+    }
+    static const char* tcp_plugin_name() { return "tcp6"; }
+    // Devices only steer IPv4 flows
+    static std::experimental::optional<flow_steering_rule> steering_rule(const ipv6_address& foreign_ip, uint16_t foreign_port,
+            const ipv6_address& local_ip, uint16_t local_port, ip_protocol_num proto) {
+        return {};
+    }
+};
+
+template <ip_protocol_num ProtoNum>
+class ipv6_l4 {
+public:
+    ipv6& _inet;
+public:
+    ipv6_l4(ipv6& inet) : _inet(inet) {}
+    void register_packet_provider(ipv6_traits::packet_provider_type func);
+    future<ethernet_address> get_l2_dst_address(ipv6_address to);
+};
+
+class ipv6_tcp {
+    ipv6_l4<ip_protocol_num::tcp> _inet_l4;
+    std::unique_ptr<tcp<ipv6_traits>> _tcp;
+public:
+    ipv6_tcp(ipv6& inet);
+    ~ipv6_tcp();
+    void received(packet p, ipv6_address from, ipv6_address to);
+    bool forward(forward_hash& out_hash_data, packet& p, size_t off);
+    friend class ipv6;
+};
+
+// UDP over IPv6.  Channels address their datagrams with socket_address;
+// the ipv4_addr based udp_channel calls fail on them.  Datagrams are not
+// fragmented: one that does not fit the MTU is refused.
+class ipv6_udp {
+    static const uint16_t min_anonymous_port = 32768;
+    ipv6_l4<ip_protocol_num::udp> _inet_l4;
+    std::unordered_map<uint16_t, lw_shared_ptr<udp_channel_state>> _channels;
+    int _queue_size = ipv4_udp::default_queue_size;
+    uint16_t _next_anonymous_port = min_anonymous_port;
+    circular_buffer<ipv6_traits::l4packet> _packetq;
+private:
+    uint16_t next_port(uint16_t port);
+public:
+    class registration {
+    private:
+        ipv6_udp &_proto;
+        uint16_t _port;
+    public:
+        registration(ipv6_udp &proto, uint16_t port) : _proto(proto), _port(port) {};
+
+        void unregister() {
+            _proto._channels.erase(_proto._channels.find(_port));
+        }
+
+        uint16_t port() const {
+            return _port;
+        }
+    };
+
+    explicit ipv6_udp(ipv6& inet);
+    udp_channel make_channel(uint16_t port);
+    void received(packet p, ipv6_address from, ipv6_address to);
+    void send(uint16_t src_port, const socket_address& dst, packet &&p);
+    // Largest payload that fits the MTU
+    size_t max_datagram_size() const;
+    bool forward(forward_hash& out_hash_data, packet& p, size_t off);
+    void set_queue_size(int size) { _queue_size = size; }
+};
+
+struct ipv6_hdr {
+    // Version (4 bits), traffic class (8 bits) and flow label (20 bits)
+    packed<uint32_t> ver_tc_flow;
+    packed<uint16_t> payload_len;
+    uint8_t next_header;
+    uint8_t hop_limit;
+    ipv6_address src_ip;
+    ipv6_address dst_ip;
+    template <typename Adjuster>
+    auto adjust_endianness(Adjuster a) {
+        return a(ver_tc_flow, payload_len);
+    }
+    unsigned version() const { return uint32_t(ver_tc_flow) >> 28; }
+} __attribute__((packed));
+
+// Hop-by-hop and destination options headers
+struct ipv6_opt_hdr {
+    uint8_t next_header;
+    // In units of 8 octets, not counting the first 8
+    uint8_t len;
+} __attribute__((packed));
+
+struct icmpv6_hdr {
+    enum class msg_type : uint8_t {
+        echo_request = 128,
+        echo_reply = 129,
+        neighbor_solicitation = 135,
+        neighbor_advertisement = 136,
+    };
+    msg_type type;
+    uint8_t code;
+    packed<uint16_t> csum;
+    template <typename Adjuster>
+    auto adjust_endianness(Adjuster a) {
+        return a(csum);
+    }
+} __attribute__((packed));
+
+class ndp_timeout_error : public std::runtime_error {
+public:
+    ndp_timeout_error() : std::runtime_error("Neighbour discovery timeout") {}
+};
+
+class ndp_queue_full_error : public std::runtime_error {
+public:
+    ndp_queue_full_error() : std::runtime_error("Neighbour discovery waiter's queue is full") {}
+};
+
+// Neighbour discovery (RFC4861): resolves on-link addresses to MACs with
+// neighbour solicitations and answers the ones for our own addresses.
+// Router discovery and neighbour unreachability detection are not
+// implemented; the gateway is configured and entries never expire.
+class ndp {
+public:
+    struct ns_na {
+        // R, S and O flags in the top bits for advertisements; reserved
+        // for solicitations
+        packed<uint32_t> flags;
+        ipv6_address target;
+        template <typename Adjuster>
+        auto adjust_endianness(Adjuster a) {
+            return a(flags);
+        }
+    } __attribute__((packed));
+    struct link_layer_option {
+        enum : uint8_t { source = 1, target = 2 };
+        uint8_t type;
+        // In units of 8 octets
+        uint8_t len;
+        ethernet_address addr;
+    } __attribute__((packed));
+    static constexpr uint32_t flag_solicited = 1u << 30;
+    static constexpr uint32_t flag_override = 1u << 29;
+    using learn_hook_type = std::function<void (ethernet_address, ipv6_address)>;
+private:
+    static constexpr auto max_waiters = 512;
+    // Solicitations sent, one per second, before giving up on an address
+    static constexpr unsigned max_solicitations = 3;
+    struct resolution {
+        std::vector<promise<ethernet_address>> _waiters;
+        timer<> _timeout_timer;
+        unsigned _solicitations = 0;
+    };
+    ipv6& _inet;
+    std::unordered_map<ipv6_address, ethernet_address> _table;
+    std::unordered_map<ipv6_address, resolution> _in_progress;
+    learn_hook_type _learn_hook;
+private:
+    void send_solicitation(const ipv6_address& target);
+    void send_advertisement(const ipv6_address& to, ethernet_address to_mac, const ipv6_address& target, bool solicited);
+public:
+    explicit ndp(ipv6& inet) : _inet(inet) {}
+    future<ethernet_address> lookup(const ipv6_address& addr);
+    void learn(ethernet_address l2, const ipv6_address& l3);
+    // Called for every address learned from an advertisement, so that it
+    // can be shared with the other shards
+    void set_learn_hook(learn_hook_type hook) {
+        _learn_hook = std::move(hook);
+    }
+    void received(icmpv6_hdr::msg_type type, packet p, const ipv6_address& from, const ipv6_address& to,
+            ethernet_address from_mac);
+};
+
+class ipv6 {
+public:
+    using clock_type = lowres_clock;
+    using address_type = ipv6_address;
+private:
+    static constexpr size_t max_queued_control_packets = 1024;
+    interface* _netif;
+    // IPv6 does not use device offloads: checksums are computed and
+    // verified in software, and TCP does not ask for TSO
+    net::hw_features _hw_features;
+    bool _sw_gro = false;
+    std::vector<ipv6_traits::packet_provider_type> _pkt_providers;
+    ipv6_address _link_local_address;
+    ipv6_address _host_address;
+    ipv6_address _gw_address;
+    unsigned _prefix_length = 64;
+    l3_protocol _l3;
+    subscription<packet, ethernet_address> _rx_packets;
+    ndp _ndp;
+    ipv6_tcp _tcp;
+    ipv6_udp _udp;
+    circular_buffer<l3_protocol::l3packet> _packetq;
+    unsigned _pkt_provider_idx = 0;
+private:
+    future<> handle_received_packet(packet p, ethernet_address from);
+    bool forward(forward_hash& out_hash_data, packet& p, size_t off);
+    std::experimental::optional<l3_protocol::l3packet> get_packet();
+    bool is_local(const ipv6_address& a) const;
+    bool on_link(const ipv6_address& a) const;
+    void icmp_received(packet p, const ipv6_address& from, const ipv6_address& to, uint8_t hop_limit,
+            ethernet_address from_mac);
+public:
+    explicit ipv6(interface* netif);
+    void set_host_address(ipv6_address ip);
+    // The global address if there is one, otherwise the link-local one
+    ipv6_address host_address() const {
+        return is_unspecified(_host_address) ? _link_local_address : _host_address;
+    }
+    ipv6_address link_local_address() const {
+        return _link_local_address;
+    }
+    // Source address for packets sent to an address
+    ipv6_address source_address(const ipv6_address& to) const {
+        return to.is_link_local() || to.is_multicast() ? _link_local_address : host_address();
+    }
+    void set_gw_address(ipv6_address ip) {
+        _gw_address = ip;
+    }
+    ipv6_address gw_address() const {
+        return _gw_address;
+    }
+    void set_prefix_length(unsigned len) {
+        _prefix_length = std::min(len, 128u);
+    }
+    interface* netif() const {
+        return _netif;
+    }
+    const net::hw_features& hw_features() const { return _hw_features; }
+    void enable_sw_gro() {
+        _sw_gro = !_netif->hw_features().rx_lro;
+    }
+    bool sw_gro() const { return _sw_gro; }
+    // Sends an upper layer packet; the IPv6 header is added here
+    void send(ipv6_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst);
+    // Sends an ICMPv6 message whose header has a zero checksum
+    void send_icmp(ipv6_address to, packet p, ethernet_address e_dst);
+    tcp<ipv6_traits>& get_tcp() { return *_tcp._tcp; }
+    ipv6_udp& get_udp() { return _udp; }
+    ndp& get_ndp() { return _ndp; }
+    void learn(ethernet_address l2, ipv6_address l3) {
+        _ndp.learn(l2, l3);
+    }
+    void register_packet_provider(ipv6_traits::packet_provider_type&& func) {
+        _pkt_providers.push_back(std::move(func));
+    }
+    future<ethernet_address> get_l2_dst_address(ipv6_address to);
+};
+
+template <ip_protocol_num ProtoNum>
+inline
+void ipv6_l4<ProtoNum>::register_packet_provider(ipv6_traits::packet_provider_type func) {
+    _inet.register_packet_provider([func = std::move(func)] {
+        auto l4p = func();
+        if (l4p) {
+            l4p.value().proto_num = ProtoNum;
+        }
+        return l4p;
+    });
+}
+
+template <ip_protocol_num ProtoNum>
+inline
+future<ethernet_address> ipv6_l4<ProtoNum>::get_l2_dst_address(ipv6_address to) {
+    return _inet.get_l2_dst_address(to);
+}
+
+}
+
+#endif /* IPV6_HH_ */
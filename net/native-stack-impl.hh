@@ -49,7 +49,7 @@ class native_server_socket_impl : public server_socket_impl {
 
 template <typename Protocol>
 native_server_socket_impl<Protocol>::native_server_socket_impl(Protocol& proto, uint16_t port, listen_options opt)
-    : _listener(proto.listen(port)) {
+    : _listener(proto.listen(port, 100, opt.congestion_control)) {
 }
 
 template <typename Protocol>
@@ -98,13 +98,18 @@ class native_socket_impl final : public socket_impl {
         : _proto(proto), _conn(nullptr) { }
 
     virtual future<connected_socket> connect(socket_address sa, socket_address local, transport proto = transport::TCP) override {
+        connect_options opts;
+        opts.proto = proto;
+        return connect_with_options(sa, local, opts);
+    }
+    virtual future<connected_socket> connect_with_options(socket_address sa, socket_address local, const connect_options& opts) override {
         //TODO: implement SCTP
-        assert(proto == transport::TCP);
+        assert(opts.proto == transport::TCP);
 
         // FIXME: local is ignored since native stack does not support multiple IPs yet
-        assert(sa.as_posix_sockaddr().sa_family == AF_INET);
+        assert(sa.as_posix_sockaddr().sa_family == Protocol::address_family);
 
-        _conn = make_lw_shared<typename Protocol::connection>(_proto.connect(sa));
+        _conn = make_lw_shared<typename Protocol::connection>(_proto.connect(sa, opts.congestion_control));
         return _conn->connected().then([conn = _conn]() mutable {
             auto csi = std::make_unique<native_connected_socket_impl<Protocol>>(std::move(conn));
             return make_ready_future<connected_socket>(connected_socket(std::move(csi)));
@@ -122,9 +127,11 @@ template <typename Protocol>
 class native_connected_socket_impl<Protocol>::native_data_source_impl final
     : public data_source_impl {
     typename Protocol::connection& _conn;
-    size_t _cur_frag = 0;
     bool _eof = false;
-    packet _buf;
+    // Fragments of the last packet read from the connection, not yet
+    // handed out; they all share the packet's deleter
+    std::vector<temporary_buffer<char>> _bufs;
+    size_t _cur_frag = 0;
 public:
     explicit native_data_source_impl(typename Protocol::connection& conn)
         : _conn(conn) {}
@@ -132,16 +139,18 @@ class native_connected_socket_impl<Protocol>::native_data_source_impl final
         if (_eof) {
             return make_ready_future<temporary_buffer<char>>(temporary_buffer<char>(0));
         }
-        if (_cur_frag != _buf.nr_frags()) {
-            auto& f = _buf.fragments()[_cur_frag++];
-            return make_ready_future<temporary_buffer<char>>(
-                    temporary_buffer<char>(f.base, f.size,
-                            make_deleter(deleter(), [p = _buf.share()] () mutable {})));
+        while (_cur_frag != _bufs.size()) {
+            // An empty buffer would read as end of stream
+            auto buf = std::move(_bufs[_cur_frag++]);
+            if (!buf.empty()) {
+                return make_ready_future<temporary_buffer<char>>(std::move(buf));
+            }
         }
         return _conn.wait_for_data().then([this] {
-            _buf = _conn.read();
+            auto p = _conn.read();
+            _eof = !p.len();
+            _bufs = p.release();
             _cur_frag = 0;
-            _eof = !_buf.len();
             return get();
         });
     }
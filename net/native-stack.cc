@@ -23,6 +23,7 @@
 #include "native-stack-impl.hh"
 #include "net.hh"
 #include "ip.hh"
+#include "ipv6.hh"
 #include "tcp-stack.hh"
 #include "tcp.hh"
 #include "udp.hh"
@@ -135,6 +136,7 @@ class native_network_stack : public network_stack {
 private:
     interface _netif;
     ipv4 _inet;
+    ipv6 _inet6;
     bool _dhcp = false;
     promise<> _config;
     timer<> _timer;
@@ -150,6 +152,7 @@ class native_network_stack : public network_stack {
     virtual server_socket listen(socket_address sa, listen_options opt) override;
     virtual ::seastar::socket socket() override;
     virtual udp_channel make_udp_channel(ipv4_addr addr) override;
+    virtual udp_channel make_udp6_channel(uint16_t port) override;
     virtual future<> initialize() override;
     static future<std::unique_ptr<network_stack>> create(boost::program_options::variables_map opts) {
         if (engine().cpu_id() == 0) {
@@ -161,6 +164,9 @@ class native_network_stack : public network_stack {
     void arp_learn(ethernet_address l2, ipv4_address l3) {
         _inet.learn(l2, l3);
     }
+    void ndp_learn(ethernet_address l2, ipv6_address l3) {
+        _inet6.learn(l2, l3);
+    }
     friend class native_server_socket_impl<tcp4>;
 };
 
@@ -171,6 +177,11 @@ native_network_stack::make_udp_channel(ipv4_addr addr) {
     return _inet.get_udp().make_channel(addr);
 }
 
+udp_channel
+native_network_stack::make_udp6_channel(uint16_t port) {
+    return _inet6.get_udp().make_channel(port);
+}
+
 void
 add_native_net_options_description(boost::program_options::options_description &opts) {
 
@@ -187,10 +198,49 @@ add_native_net_options_description(boost::program_options::options_description &
 #endif
 }
 
+static tcp_congestion_control parse_tcp_congestion_control(const std::string& name) {
+    if (name == "reno") {
+        return tcp_congestion_control::reno;
+    } else if (name == "cubic") {
+        return tcp_congestion_control::cubic;
+    } else if (name == "bbr") {
+        return tcp_congestion_control::bbr;
+    }
+    throw std::runtime_error(sprint("unknown TCP congestion control algorithm: %s", name));
+}
+
+template <typename InetTraits>
+static void configure_tcp(tcp<InetTraits>& tcp, const boost::program_options::variables_map& opts) {
+    tcp.set_default_congestion_control(parse_tcp_congestion_control(opts["tcp-congestion-control"].as<std::string>()));
+    tcp.set_rto_min(std::chrono::milliseconds(opts["tcp-rto-min"].as<unsigned>()));
+    tcp.set_syncookies(opts["tcp-syncookies"].as<std::string>() != "off");
+}
+
+static void ndp_learn(ethernet_address l2, ipv6_address l3);
+
 native_network_stack::native_network_stack(boost::program_options::variables_map opts, std::shared_ptr<device> dev)
     : _netif(std::move(dev))
-    , _inet(&_netif) {
+    , _inet(&_netif)
+    , _inet6(&_netif) {
     _inet.get_udp().set_queue_size(opts["udpv4-queue-size"].as<int>());
+    _inet.set_frag_limits(opts["ipv4-frag-max-datagrams"].as<unsigned>(), opts["ipv4-frag-mem"].as<unsigned>());
+    configure_tcp(_inet.get_tcp(), opts);
+    configure_tcp(_inet6.get_tcp(), opts);
+    if (opts["sw-tso"].as<std::string>() != "off") {
+        _inet.enable_sw_tso();
+    }
+    if (opts["sw-gro"].as<std::string>() != "off") {
+        _inet.enable_sw_gro();
+        _inet6.enable_sw_gro();
+    }
+    if (!opts["host-ipv6-addr"].defaulted()) {
+        _inet6.set_host_address(ipv6_address(opts["host-ipv6-addr"].as<std::string>()));
+    }
+    if (!opts["gw-ipv6-addr"].defaulted()) {
+        _inet6.set_gw_address(ipv6_address(opts["gw-ipv6-addr"].as<std::string>()));
+    }
+    _inet6.set_prefix_length(opts["ipv6-prefix-length"].as<unsigned>());
+    _inet6.get_ndp().set_learn_hook(net::ndp_learn);
     _dhcp = opts["host-ipv4-addr"].defaulted()
             && opts["gw-ipv4-addr"].defaulted()
             && opts["netmask-ipv4-addr"].defaulted() && opts["dhcp"].as<bool>();
@@ -203,12 +253,42 @@ native_network_stack::native_network_stack(boost::program_options::variables_map
 
 server_socket
 native_network_stack::listen(socket_address sa, listen_options opts) {
+    if (sa.as_posix_sockaddr().sa_family == AF_INET6) {
+        return tcpv6_listen(_inet6.get_tcp(), ntohs(sa.as_posix_sockaddr_in6().sin6_port), opts);
+    }
     assert(sa.as_posix_sockaddr().sa_family == AF_INET);
     return tcpv4_listen(_inet.get_tcp(), ntohs(sa.as_posix_sockaddr_in().sin_port), opts);
 }
 
+// A socket that connects over IPv4 or IPv6, depending on the address
+// it is asked to connect to
+class native_dual_socket_impl final : public socket_impl {
+    ::seastar::socket _v4;
+    ::seastar::socket _v6;
+public:
+    native_dual_socket_impl(::seastar::socket v4, ::seastar::socket v6)
+        : _v4(std::move(v4)), _v6(std::move(v6)) {}
+    virtual future<connected_socket> connect(socket_address sa, socket_address local, transport proto = transport::TCP) override {
+        if (sa.as_posix_sockaddr().sa_family == AF_INET6) {
+            return _v6.connect(sa, local, proto);
+        }
+        return _v4.connect(sa, local, proto);
+    }
+    virtual future<connected_socket> connect_with_options(socket_address sa, socket_address local, const connect_options& opts) override {
+        if (sa.as_posix_sockaddr().sa_family == AF_INET6) {
+            return _v6.connect(sa, local, opts);
+        }
+        return _v4.connect(sa, local, opts);
+    }
+    virtual void shutdown() override {
+        _v4.shutdown();
+        _v6.shutdown();
+    }
+};
+
 seastar::socket native_network_stack::socket() {
-    return tcpv4_socket(_inet.get_tcp());
+    return ::seastar::socket(std::make_unique<native_dual_socket_impl>(
+            tcpv4_socket(_inet.get_tcp()), tcpv6_socket(_inet6.get_tcp())));
 }
 
 using namespace std::chrono_literals;
@@ -296,6 +376,19 @@ void arp_learn(ethernet_address l2, ipv4_address l3)
     }
 }
 
+static void ndp_learn(ethernet_address l2, ipv6_address l3)
+{
+    for (unsigned i = 0; i < smp::count; i++) {
+        if (i == engine().cpu_id()) {
+            continue;
+        }
+        smp::submit_to(i, [l2, l3] {
+            auto & ns = static_cast<native_network_stack&>(engine().net());
+            ns.ndp_learn(l2, l3);
+        });
+    }
+}
+
 void create_native_stack(boost::program_options::variables_map opts, std::shared_ptr<device> dev) {
     native_network_stack::ready_promise.set_value(std::unique_ptr<network_stack>(std::make_unique<native_network_stack>(opts, std::move(dev))));
 }
@@ -316,12 +409,36 @@ boost::program_options::options_description nns_options() {
         ("netmask-ipv4-addr",
                 boost::program_options::value<std::string>()->default_value("255.255.255.0"),
                 "static IPv4 netmask to use")
+        ("host-ipv6-addr",
+                boost::program_options::value<std::string>()->default_value("::"),
+                "static global IPv6 address to use (a link-local address is always configured)")
+        ("gw-ipv6-addr",
+                boost::program_options::value<std::string>()->default_value("::"),
+                "static IPv6 gateway to use")
+        ("ipv6-prefix-length",
+                boost::program_options::value<unsigned>()->default_value(64),
+                "length of the on-link IPv6 prefix")
         ("udpv4-queue-size",
                 boost::program_options::value<int>()->default_value(ipv4_udp::default_queue_size),
                 "Default size of the UDPv4 per-channel packet queue")
+        ("ipv4-frag-max-datagrams",
+                boost::program_options::value<unsigned>()->default_value(ipv4_frag_table::default_max_datagrams),
+                "Maximum number of IPv4 datagrams reassembled from fragments at once, per cpu")
+        ("ipv4-frag-mem",
+                boost::program_options::value<unsigned>()->default_value(ipv4_frag_table::default_max_mem),
+                "Maximum memory held by IPv4 fragments awaiting reassembly, per cpu, in bytes")
         ("dhcp",
                 boost::program_options::value<bool>()->default_value(true),
                         "Use DHCP discovery")
+        ("tcp-congestion-control",
+                boost::program_options::value<std::string>()->default_value("reno"),
+                "TCP congestion control algorithm (reno, cubic or bbr)")
+        ("tcp-rto-min",
+                boost::program_options::value<unsigned>()->default_value(1000),
+                "Minimum TCP retransmission timeout, in milliseconds")
+        ("tcp-syncookies",
+                boost::program_options::value<std::string>()->default_value("on"),
+                "Answer SYNs with cookies when a listener's backlog is full")
         ("hw-queue-weight",
                 boost::program_options::value<float>()->default_value(1.0f),
                 "Weighing of a hardware network queue relative to a software queue (0=no work, 1=equal share)")
@@ -331,6 +448,12 @@ boost::program_options::options_description nns_options() {
         ("lro",
                 boost::program_options::value<std::string>()->default_value("on"),
                 "Enable LRO")
+        ("sw-tso",
+                boost::program_options::value<std::string>()->default_value("on"),
+                "Segment TCP packets in software when the device lacks TSO")
+        ("sw-gro",
+                boost::program_options::value<std::string>()->default_value("on"),
+                "Coalesce received TCP segments in software when the device lacks LRO")
         ;
 
     add_native_net_options_description(opts);
@@ -24,6 +24,7 @@
 #include <boost/algorithm/string.hpp>
 #include "net.hh"
 #include <utility>
+#include <algorithm>
 #include "toeplitz.hh"
 
 using std::move;
@@ -253,6 +254,22 @@ device::receive(std::function<future<> (packet)> next_packet) {
     return std::move(sub);
 }
 
+void device::receive_burst(std::function<void (std::vector<packet>&)> next_burst) {
+    _queues[engine().cpu_id()]->_rx_burst_fn = std::move(next_burst);
+}
+
+void device::l2receive_burst(std::vector<packet>& burst) {
+    auto& q = *_queues[engine().cpu_id()];
+    if (q._rx_burst_fn) {
+        q._rx_burst_fn(burst);
+    } else {
+        for (auto&& p : burst) {
+            q._rx_stream.produce(std::move(p));
+        }
+    }
+    burst.clear();
+}
+
 void device::set_local_queue(std::unique_ptr<qp> dev) {
     assert(!_queues[engine().cpu_id()]);
     _queues[engine().cpu_id()] = dev.get();
@@ -271,6 +288,10 @@ subscription<packet, ethernet_address> l3_protocol::receive(
     return _netif->register_l3(_proto_num, std::move(rx_fn), std::move(forward));
 };
 
+void l3_protocol::receive_burst(std::function<void (l3_rx_burst&)> rx_fn) {
+    _netif->register_l3_burst(_proto_num, std::move(rx_fn));
+}
+
 interface::interface(std::shared_ptr<device> dev)
     : _dev(dev)
     , _rx(_dev->receive([this] (packet p) { return dispatch_packet(std::move(p)); }))
@@ -295,6 +316,27 @@ interface::interface(std::shared_ptr<device> dev)
             }
             return p;
         });
+    _collectd_regs.push_back(
+        scollectd::add_polled_metric(scollectd::type_instance_id("network"
+                , scollectd::per_cpu_plugin_instance
+                , "total_operations", "forwarded")
+                , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.forwarded)));
+    _collectd_regs.push_back(
+        scollectd::add_polled_metric(scollectd::type_instance_id("network"
+                , scollectd::per_cpu_plugin_instance
+                , "total_operations", "forward-dropped")
+                , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.forward_dropped)));
+    _collectd_regs.push_back(
+        scollectd::add_polled_metric(scollectd::type_instance_id("network"
+                , scollectd::per_cpu_plugin_instance
+                , "gauge", "steered-flows")
+                , scollectd::make_typed(scollectd::data_type::GAUGE, _stats.steered_flows)));
+    _collectd_regs.push_back(
+        scollectd::add_polled_metric(scollectd::type_instance_id("network"
+                , scollectd::per_cpu_plugin_instance
+                , "total_operations", "steering-failed")
+                , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.steering_failed)));
+    _dev->receive_burst([this] (std::vector<packet>& burst) { dispatch_burst(burst); });
 }
 
 subscription<packet, ethernet_address>
@@ -307,6 +349,12 @@ interface::register_l3(eth_protocol_num proto_num,
     return l3_rx.packet_stream.listen(std::move(next));
 }
 
+void interface::register_l3_burst(eth_protocol_num proto_num, std::function<void (l3_rx_burst&)> next) {
+    auto i = _proto_map.find(uint16_t(proto_num));
+    assert(i != _proto_map.end());
+    i->second.burst_fn = std::move(next);
+}
+
 unsigned interface::hash2cpu(uint32_t hash) {
     return _dev->hash2cpu(hash);
 }
@@ -319,38 +367,103 @@ const rss_key_type& interface::rss_key() const {
     return _dev->rss_key();
 }
 
+bool interface::flow_steering_supported() {
+    return _dev->flow_steering_supported();
+}
+
+bool interface::steering_backed_off() const {
+    return _steering_refused_at && *_steering_refused_at == _dev->flow_filters_removed();
+}
+
+future<bool> interface::steer_flow_here(const flow_steering_rule& rule) {
+    // Assumes qid == cpu_id, like device::hash2cpu()
+    auto cpu = engine().cpu_id();
+    if (!_dev->flow_steering_supported() || cpu >= _dev->hw_queues_count() || _dev->local_queue().has_proxies()
+            || steering_backed_off()) {
+        return make_ready_future<bool>(false);
+    }
+    // Read before asking: a filter removed meanwhile makes the next
+    // request try again
+    auto removed = _dev->flow_filters_removed();
+    // Requests from one shard reach the steering shard in order, so the
+    // removal of a flow's filter is done before a later flow with the same
+    // ports asks for a new one
+    return smp::submit_to(steering_shard, [dev = _dev, rule, cpu] {
+        return dev->add_flow_steering(rule, cpu);
+    }).then([this, removed] (bool steered) {
+        if (steered) {
+            ++_stats.steered_flows;
+        } else {
+            ++_stats.steering_failed;
+            _steering_refused_at = removed;
+        }
+        return steered;
+    });
+}
+
+void interface::unsteer_flow(const flow_steering_rule& rule) {
+    --_stats.steered_flows;
+    smp::submit_to(steering_shard, [dev = _dev, rule] {
+        dev->remove_flow_filter(rule);
+    });
+}
+
+void interface::join_multicast(ethernet_address addr) {
+    smp::submit_to(steering_shard, [dev = _dev, addr] {
+        dev->add_multicast_address(addr);
+    });
+}
+
+void device::add_multicast_address(ethernet_address addr) {
+    auto i = std::find_if(_multicast_addresses.begin(), _multicast_addresses.end(), [&addr] (const ethernet_address& a) {
+        return a.mac == addr.mac;
+    });
+    // Every shard's stack joins the same groups
+    if (i == _multicast_addresses.end()) {
+        _multicast_addresses.push_back(addr);
+        set_multicast_addresses(_multicast_addresses);
+    }
+}
+
 void interface::forward(unsigned cpuid, packet p) {
     static __thread unsigned queue_depth;
 
     if (queue_depth < 1000) {
         queue_depth++;
+        ++_stats.forwarded;
         auto src_cpu = engine().cpu_id();
         smp::submit_to(cpuid, [this, p = std::move(p), src_cpu]() mutable {
             _dev->l2receive(p.free_on_cpu(src_cpu));
         }).then([] {
             queue_depth--;
         });
+    } else {
+        ++_stats.forward_dropped;
     }
 }
 
+unsigned interface::dst_cpu(packet& p, l3_rx_stream& l3) {
+    return _dev->forward_dst(engine().cpu_id(), [&p, &l3, this] () {
+        auto hwrss = p.rss_hash();
+        if (hwrss) {
+            return hwrss.value();
+        } else {
+            forward_hash data;
+            if (l3.forward(data, p, sizeof(eth_hdr))) {
+                return toeplitz_hash(rss_key(), data);
+            }
+            return 0u;
+        }
+    });
+}
+
 future<> interface::dispatch_packet(packet p) {
     auto eh = p.get_header<eth_hdr>();
     if (eh) {
         auto i = _proto_map.find(ntoh(eh->eth_proto));
         if (i != _proto_map.end()) {
             l3_rx_stream& l3 = i->second;
-            auto fw = _dev->forward_dst(engine().cpu_id(), [&p, &l3, this] () {
-                auto hwrss = p.rss_hash();
-                if (hwrss) {
-                    return hwrss.value();
-                } else {
-                    forward_hash data;
-                    if (l3.forward(data, p, sizeof(eth_hdr))) {
-                        return toeplitz_hash(rss_key(), data);
-                    }
-                    return 0u;
-                }
-            });
+            auto fw = dst_cpu(p, l3);
             if (fw != engine().cpu_id()) {
                 forward(fw, std::move(p));
             } else {
@@ -368,4 +481,55 @@ future<> interface::dispatch_packet(packet p) {
     return make_ready_future<>();
 }
 
+void interface::dispatch_burst(std::vector<packet>& burst) {
+    // The headers are usually cold: start loading all of them before
+    // looking at the first one
+    for (auto&& p : burst) {
+        if (p.nr_frags()) {
+            __builtin_prefetch(p.frag(0).base);
+        }
+    }
+    auto cpu = engine().cpu_id();
+    uint16_t last_proto = 0;
+    l3_rx_stream* l3 = nullptr;
+    for (auto&& p : burst) {
+        auto eh = p.get_header<eth_hdr>();
+        if (!eh) {
+            continue;
+        }
+        auto h = ntoh(*eh);
+        // Bursts are mostly made of a single protocol
+        if (!l3 || h.eth_proto != last_proto) {
+            auto i = _proto_map.find(h.eth_proto);
+            if (i == _proto_map.end()) {
+                l3 = nullptr;
+                continue;
+            }
+            l3 = &i->second;
+            last_proto = h.eth_proto;
+        }
+        auto fw = dst_cpu(p, *l3);
+        if (fw != cpu) {
+            forward(fw, std::move(p));
+            continue;
+        }
+        p.trim_front(sizeof(eth_hdr));
+        if (!l3->burst_fn) {
+            if (l3->ready.available()) {
+                l3->ready = l3->packet_stream.produce(std::move(p), h.src_mac);
+            }
+            continue;
+        }
+        if (l3->pending.empty()) {
+            _pending_l3.push_back(l3);
+        }
+        l3->pending.push_back(l3_rx_packet{std::move(p), h.src_mac});
+    }
+    for (auto l3 : _pending_l3) {
+        l3->burst_fn(l3->pending);
+        l3->pending.clear();
+    }
+    _pending_l3.clear();
+}
+
 }
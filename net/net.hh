@@ -65,6 +65,16 @@ class forward_hash {
     }
 };
 
+// A TCP or UDP flow over IPv4, as its packets look when received
+struct flow_steering_rule {
+    // Host byte order
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    ip_protocol_num proto;
+};
+
 struct hw_features {
     // Enable tx ip header checksum offload
     bool tx_csum_ip_offload = false;
@@ -84,6 +94,14 @@ struct hw_features {
     uint16_t max_packet_len = net::ip_packet_len_max - net::eth_hdr_len;
 };
 
+// A packet handed to an L3 protocol, with its L2 header stripped
+struct l3_rx_packet {
+    packet p;
+    ethernet_address from;
+};
+
+using l3_rx_burst = std::vector<l3_rx_packet>;
+
 class l3_protocol {
 public:
     struct l3packet {
@@ -100,6 +118,10 @@ class l3_protocol {
     subscription<packet, ethernet_address> receive(
             std::function<future<> (packet, ethernet_address)> rx_fn,
             std::function<bool (forward_hash&, packet&, size_t)> forward);
+    // Also receive the packets of a device burst in one call, instead of
+    // one stream element each.  Packets forwarded from other shards still
+    // go through the function passed to receive().
+    void receive_burst(std::function<void (l3_rx_burst&)> rx_fn);
 private:
     friend class interface;
 };
@@ -109,16 +131,36 @@ class interface {
         stream<packet, ethernet_address> packet_stream;
         future<> ready;
         std::function<bool (forward_hash&, packet&, size_t)> forward;
+        std::function<void (l3_rx_burst&)> burst_fn;
+        // Packets of the burst being dispatched
+        l3_rx_burst pending;
         l3_rx_stream(std::function<bool (forward_hash&, packet&, size_t)>&& fw) : ready(packet_stream.started()), forward(fw) {}
     };
     std::unordered_map<uint16_t, l3_rx_stream> _proto_map;
+    // Protocols with pending packets in the burst being dispatched
+    std::vector<l3_rx_stream*> _pending_l3;
     std::shared_ptr<device> _dev;
     subscription<packet> _rx;
     ethernet_address _hw_address;
     net::hw_features _hw_features;
     std::vector<l3_protocol::packet_provider_type> _pkt_providers;
+    struct {
+        // Packets received on this shard's queue but owned by another shard
+        uint64_t forwarded = 0;
+        // ... and dropped because too many were already in flight
+        uint64_t forward_dropped = 0;
+        uint64_t steered_flows = 0;
+        uint64_t steering_failed = 0;
+    } _stats;
+    // device::flow_filters_removed() when the device last refused this
+    // shard a filter.  A refusal means the filter table is full, so
+    // steering is not tried again before a filter is removed.
+    std::experimental::optional<uint64_t> _steering_refused_at;
+    scollectd::registrations _collectd_regs;
 private:
+    unsigned dst_cpu(packet& p, l3_rx_stream& l3);
     future<> dispatch_packet(packet p);
+    void dispatch_burst(std::vector<packet>& burst);
 public:
     explicit interface(std::shared_ptr<device> dev);
     ethernet_address hw_address() { return _hw_address; }
@@ -126,6 +168,7 @@ class interface {
     subscription<packet, ethernet_address> register_l3(eth_protocol_num proto_num,
             std::function<future<> (packet p, ethernet_address from)> next,
             std::function<bool (forward_hash&, packet&, size_t)> forward);
+    void register_l3_burst(eth_protocol_num proto_num, std::function<void (l3_rx_burst&)> next);
     void forward(unsigned cpuid, packet p);
     unsigned hash2cpu(uint32_t hash);
     void register_packet_provider(l3_protocol::packet_provider_type func) {
@@ -133,6 +176,24 @@ class interface {
     }
     uint16_t hw_queues_count();
     const rss_key_type& rss_key() const;
+    // Whether the device can steer individual flows to a queue
+    bool flow_steering_supported();
+    // Whether steer_flow_here() would fail right away, because the device
+    // refused a filter and none was removed since
+    bool steering_backed_off() const;
+    // Asks the device to deliver a flow to this shard's queue, whatever its
+    // RSS hash, so that it does not need to be forwarded in software.
+    // Only possible on a shard that owns a hardware queue it does not share
+    // with proxy shards.  The device is programmed from the steering shard,
+    // so that no other reactor waits for the driver.
+    future<bool> steer_flow_here(const flow_steering_rule& rule);
+    // Removes the filter in the background
+    void unsteer_flow(const flow_steering_rule& rule);
+    // Has the device deliver the frames sent to a multicast address, such
+    // as a solicited-node group's; done in the background, from the
+    // steering shard
+    void join_multicast(ethernet_address addr);
+    static constexpr unsigned steering_shard = 0;
     friend class l3_protocol;
 };
 
@@ -215,6 +276,7 @@ class qp {
     std::experimental::optional<std::array<uint8_t, 128>> _sw_reta;
     circular_buffer<packet> _proxy_packetq;
     stream<packet> _rx_stream;
+    std::function<void (std::vector<packet>&)> _rx_burst_fn;
     reactor::poller _tx_poller;
     circular_buffer<packet> _tx_packetq;
 
@@ -250,6 +312,10 @@ class qp {
         _pkt_providers.push_back(std::move(func));
     }
     bool poll_tx();
+    // Whether packets received on this queue are spread over other shards
+    bool has_proxies() const {
+        return bool(_sw_reta);
+    }
     friend class device;
 };
 
@@ -257,6 +323,10 @@ class device {
 protected:
     std::unique_ptr<qp*[]> _queues;
     size_t _rss_table_bits = 0;
+    // Only changed on interface::steering_shard
+    std::vector<ethernet_address> _multicast_addresses;
+    // Flow filters removed so far, read by shards waiting for one to be
+    std::atomic<uint64_t> _flow_filters_removed = { 0 };
 public:
     device() {
         _queues = std::make_unique<qp*[]>(smp::count);
@@ -265,7 +335,13 @@ class device {
     qp& queue_for_cpu(unsigned cpu) { return *_queues[cpu]; }
     qp& local_queue() { return queue_for_cpu(engine().cpu_id()); }
     void l2receive(packet p) { _queues[engine().cpu_id()]->_rx_stream.produce(std::move(p)); }
+    // Hands a burst of received packets up the stack in one call, and
+    // leaves it empty
+    void l2receive_burst(std::vector<packet>& burst);
     subscription<packet> receive(std::function<future<> (packet)> next_packet);
+    // Receives the bursts passed to l2receive_burst() on this shard; without
+    // a burst handler, their packets are delivered one by one to receive()
+    void receive_burst(std::function<void (std::vector<packet>&)> next_burst);
     virtual ethernet_address hw_address() = 0;
     virtual net::hw_features hw_features() = 0;
     virtual const rss_key_type& rss_key() const { return default_rsskey_40bytes; }
@@ -275,6 +351,26 @@ class device {
     virtual unsigned hash2qid(uint32_t hash) {
         return hash % hw_queues_count();
     }
+    virtual bool flow_steering_supported() { return false; }
+    // Programs the device to deliver a flow's packets to a hardware queue
+    // instead of the one its RSS hash selects.  Returns false when the
+    // device cannot, e.g. because its filter table is full.
+    virtual bool add_flow_steering(const flow_steering_rule& rule, unsigned qid) { return false; }
+    virtual void remove_flow_steering(const flow_steering_rule& rule) {}
+    // Calls remove_flow_steering(), on interface::steering_shard
+    void remove_flow_filter(const flow_steering_rule& rule) {
+        remove_flow_steering(rule);
+        _flow_filters_removed.fetch_add(1, std::memory_order_relaxed);
+    }
+    uint64_t flow_filters_removed() const {
+        return _flow_filters_removed.load(std::memory_order_relaxed);
+    }
+    // Programs the device to also accept the frames sent to these multicast
+    // addresses, replacing the previous list.  Devices that do not filter
+    // multicast frames may ignore it.
+    virtual void set_multicast_addresses(const std::vector<ethernet_address>& addrs) {}
+    // Adds an address to the list passed to set_multicast_addresses()
+    void add_multicast_address(ethernet_address addr);
     void set_local_queue(std::unique_ptr<qp> dev);
     template <typename Func>
     unsigned forward_dst(unsigned src_cpuid, Func&& hashfn) {
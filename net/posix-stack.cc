@@ -23,13 +23,154 @@
 #include "net.hh"
 #include "packet.hh"
 #include "api.hh"
+#include "util/log.hh"
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <netinet/sctp.h>
+#ifdef HAVE_KTLS
+#include <linux/tls.h>
+#endif
+#include <linux/filter.h>
+#include <atomic>
+#include <limits>
+#include <map>
+#include <mutex>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
 
 namespace net {
 
 using namespace seastar;
 
+static seastar::logger posix_stack_logger("posix-stack");
+
+struct posix_accept_stats {
+    // Connections accepted by, or handed to, this shard
+    uint64_t accepted = 0;
+    // Of these, connections received on another CPU than this shard's,
+    // known only when steering by CPU
+    uint64_t accepted_remote_cpu = 0;
+};
+
+static thread_local posix_accept_stats accept_stats;
+
+static void count_accepted(pollable_fd& fd) {
+    ++accept_stats.accepted;
+    if (engine().posix_reuseport_steering()) {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        // Not counted if the kernel does not know
+        ::getsockopt(fd.get_file_desc().get(), SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len);
+        if (cpu >= 0 && unsigned(cpu) != smp::shard_cpu(engine().cpu_id())) {
+            ++accept_stats.accepted_remote_cpu;
+        }
+    }
+}
+
+// Listening sockets bound to the same address with SO_REUSEPORT form a
+// group, and the kernel picks one of them for each new connection.  When
+// steering by CPU, the group runs a classic BPF program that picks the
+// socket of the shard running on the CPU that received the connection.
+// The program names sockets by their index in the group, so the group
+// order is mirrored here: sockets are appended as they start listening,
+// and the last one takes the place of one that is closed, as in the kernel.
+// Shards listen and close concurrently, hence the lock.
+class reuseport_steering {
+    struct member {
+        int fd;
+        unsigned cpu;
+    };
+    static std::mutex _mutex;
+    static std::map<sstring, std::vector<member>> _groups;
+
+    static sstring group_key(const socket_address& sa, transport proto);
+    static void attach(const std::vector<member>& group);
+public:
+    static pollable_fd listen(socket_address sa, listen_options opts);
+    static void close(const socket_address& sa, transport proto, pollable_fd& fd);
+};
+
+std::mutex reuseport_steering::_mutex;
+std::map<sstring, std::vector<reuseport_steering::member>> reuseport_steering::_groups;
+
+sstring reuseport_steering::group_key(const socket_address& sa, transport proto) {
+    auto bytes = [] (const auto& x) {
+        return sstring(reinterpret_cast<const char*>(&x), sizeof(x));
+    };
+    if (sa.u.sa.sa_family == AF_INET6) {
+        return bytes(proto) + bytes(sa.u.in6.sin6_port) + bytes(sa.u.in6.sin6_addr);
+    }
+    return bytes(proto) + bytes(sa.u.in.sin_port) + bytes(sa.u.in.sin_addr);
+}
+
+void reuseport_steering::attach(const std::vector<member>& group) {
+    std::vector<sock_filter> prog;
+    auto insn = [&prog] (uint16_t code, uint8_t jt, uint8_t jf, uint32_t k) {
+        prog.push_back(sock_filter{code, jt, jf, k});
+    };
+    insn(BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t(SKF_AD_OFF + SKF_AD_CPU));
+    for (uint32_t i = 0; i < group.size(); ++i) {
+        insn(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, group[i].cpu);
+        insn(BPF_RET | BPF_K, 0, 0, i);
+    }
+    // No shard on that CPU: an index out of range makes the kernel
+    // fall back to its hash
+    insn(BPF_RET | BPF_K, 0, 0, std::numeric_limits<uint32_t>::max());
+    sock_fprog fprog{uint16_t(prog.size()), prog.data()};
+    // The program belongs to the group, whichever socket it is set on
+    if (::setsockopt(group[0].fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)) == -1) {
+        static std::atomic<bool> warned = { false };
+        if (!warned.exchange(true)) {
+            posix_stack_logger.warn("cannot steer connections by CPU, the kernel will pick their shard: {}", strerror(errno));
+        }
+    }
+}
+
+pollable_fd reuseport_steering::listen(socket_address sa, listen_options opts) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto fd = engine().posix_listen(sa, opts);
+    auto& group = _groups[group_key(sa, opts.proto)];
+    group.push_back(member{fd.get_file_desc().get(), smp::shard_cpu(engine().cpu_id())});
+    attach(group);
+    return fd;
+}
+
+void reuseport_steering::close(const socket_address& sa, transport proto, pollable_fd& fd) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto i = _groups.find(group_key(sa, proto));
+    if (i == _groups.end()) {
+        return;
+    }
+    auto& group = i->second;
+    auto m = std::find_if(group.begin(), group.end(), [n = fd.get_file_desc().get()] (const member& m) {
+        return m.fd == n;
+    });
+    if (m == group.end()) {
+        return;
+    }
+    *m = group.back();
+    group.pop_back();
+    // Leave the kernel group before the next socket joins
+    fd.close();
+    if (group.empty()) {
+        _groups.erase(i);
+    } else {
+        attach(group);
+    }
+}
+
+static pollable_fd posix_reuseport_listen(socket_address sa, listen_options opts) {
+    if (engine().posix_reuseport_steering()) {
+        return reuseport_steering::listen(sa, opts);
+    }
+    return engine().posix_listen(sa, opts);
+}
+
 template <transport Transport>
 class posix_connected_socket_operations;
 
@@ -61,6 +202,20 @@ class posix_connected_socket_operations<transport::TCP> {
             _fd.getsockopt<unsigned>(IPPROTO_TCP, TCP_KEEPCNT)
         };
     }
+#ifdef HAVE_KTLS
+    bool enable_kernel_tls(file_desc& _fd, bool rx, const void* crypto_info, size_t size) {
+        // ENOENT if the kernel has no tls module. The ULP can only be
+        // attached once, so the second direction finds it there already.
+        if (::setsockopt(_fd.get(), IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == -1 && errno != EEXIST) {
+            return false;
+        }
+        return ::setsockopt(_fd.get(), SOL_TLS, rx ? TLS_RX : TLS_TX, crypto_info, size) == 0;
+    }
+#else
+    bool enable_kernel_tls(file_desc& _fd, bool rx, const void* crypto_info, size_t size) {
+        return false;
+    }
+#endif
 };
 
 template <>
@@ -98,22 +253,171 @@ class posix_connected_socket_operations<transport::SCTP> {
             params.spp_pathmaxrxt
         };
     }
+    bool enable_kernel_tls(file_desc& _fd, bool rx, const void* crypto_info, size_t size) {
+        return false;
+    }
+};
+
+#ifdef HAVE_KTLS
+
+// TLS record types, as the kernel reports and takes them in control
+// messages on sockets it does TLS for
+static constexpr uint8_t tls_alert = 21;
+static constexpr uint8_t tls_handshake = 22;
+static constexpr uint8_t tls_application_data = 23;
+
+// Room for the record type control message
+struct tls_record_cmsg {
+    alignas(cmsghdr) char buf[CMSG_SPACE(sizeof(uint8_t))];
+};
+
+// Sends a close_notify alert on a socket the kernel encrypts for, as
+// gnutls_bye() would have.
+static future<> send_tls_close_notify(pollable_fd& fd) {
+    struct alert_msg {
+        char alert[2] = { 1, 0 }; // warning, close_notify
+        iovec iov = { alert, sizeof(alert) };
+        tls_record_cmsg control;
+        msghdr msg = {};
+        alert_msg() {
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = &control;
+            msg.msg_controllen = sizeof(control);
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_TLS;
+            cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint8_t));
+            *CMSG_DATA(cmsg) = tls_alert;
+        }
+    };
+    auto m = make_lw_shared<alert_msg>();
+    return fd.sendmsg(&m->msg).then_wrapped([m] (future<size_t> f) {
+        // The peer may well be gone already, and then it does not care
+        f.ignore_ready_future();
+    });
+}
+
+// Source of a socket the kernel decrypts TLS records for. Records other
+// than application data come one at a time, with their type in a control
+// message.
+class posix_ktls_data_source_impl final : public data_source_impl {
+    // Room for a full record, so control records are never truncated
+    static constexpr size_t buf_size = 16384;
+    pollable_fd& _fd;
+    temporary_buffer<char> _buf;
+    iovec _iov;
+    msghdr _msg;
+    tls_record_cmsg _control;
+    bool _eof = false;
+public:
+    explicit posix_ktls_data_source_impl(pollable_fd& fd) : _fd(fd) {}
+    virtual future<temporary_buffer<char>> get() override;
+};
+
+future<temporary_buffer<char>>
+posix_ktls_data_source_impl::get() {
+    if (_eof) {
+        return make_ready_future<temporary_buffer<char>>();
+    }
+    _buf = temporary_buffer<char>(buf_size);
+    _iov = { _buf.get_write(), _buf.size() };
+    _msg = {};
+    _msg.msg_iov = &_iov;
+    _msg.msg_iovlen = 1;
+    _msg.msg_control = &_control;
+    _msg.msg_controllen = sizeof(_control);
+    return _fd.recvmsg(&_msg).then([this] (size_t size) {
+        auto type = tls_application_data;
+        for (auto cmsg = CMSG_FIRSTHDR(&_msg); cmsg; cmsg = CMSG_NXTHDR(&_msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+                type = *CMSG_DATA(cmsg);
+            }
+        }
+        _buf.trim(size);
+        switch (type) {
+        case tls_application_data:
+            return make_ready_future<temporary_buffer<char>>(std::move(_buf));
+        case tls_alert:
+            if (size == 2 && _buf[1] == 0) {
+                // close_notify
+                _eof = true;
+                return make_ready_future<temporary_buffer<char>>();
+            }
+            return make_exception_future<temporary_buffer<char>>(std::runtime_error(
+                    sprint("TLS alert %d received", size == 2 ? int(uint8_t(_buf[1])) : -1)));
+        case tls_handshake:
+            // Post-handshake messages, i.e. TLS 1.3 session tickets, which
+            // nobody is left to use. A key update we cannot follow makes
+            // the kernel fail to decrypt what comes after it.
+            return get();
+        default:
+            return make_exception_future<temporary_buffer<char>>(std::runtime_error(
+                    sprint("unexpected TLS record type %d", int(type))));
+        }
+    });
+}
+
+// Sink of a socket the kernel encrypts TLS records for
+class posix_ktls_data_sink_impl final : public posix_data_sink_impl {
+    pollable_fd& _fd;
+public:
+    explicit posix_ktls_data_sink_impl(pollable_fd& fd) : posix_data_sink_impl(fd), _fd(fd) {}
+    future<> close() override {
+        return send_tls_close_notify(_fd).then([this] {
+            return posix_data_sink_impl::close();
+        });
+    }
 };
 
+#endif
+
 template <transport Transport>
 class posix_connected_socket_impl final : public connected_socket_impl, posix_connected_socket_operations<Transport> {
     lw_shared_ptr<pollable_fd> _fd;
+    // Whether the kernel does TLS record processing for us
+    bool _ktls_tx = false;
+    bool _ktls_rx = false;
+    // NAPI context the socket is busy polled with, if any
+    unsigned _napi_id;
     using _ops = posix_connected_socket_operations<Transport>;
 private:
-    explicit posix_connected_socket_impl(lw_shared_ptr<pollable_fd> fd) : _fd(std::move(fd)) {}
+    explicit posix_connected_socket_impl(lw_shared_ptr<pollable_fd> fd)
+        : _fd(std::move(fd)), _napi_id(engine().posix_busy_poll_add(_fd->get_file_desc())) {}
 public:
-    virtual data_source source() override { return posix_data_source(*_fd); }
-    virtual data_sink sink() override { return posix_data_sink(*_fd); }
+    ~posix_connected_socket_impl() {
+        if (_napi_id) {
+            engine().posix_busy_poll_remove(_fd->get_file_desc(), _napi_id);
+        }
+    }
+    virtual data_source source() override {
+#ifdef HAVE_KTLS
+        if (_ktls_rx) {
+            return data_source(std::make_unique<posix_ktls_data_source_impl>(*_fd));
+        }
+#endif
+        return posix_data_source(*_fd);
+    }
+    virtual data_sink sink() override {
+#ifdef HAVE_KTLS
+        if (_ktls_tx) {
+            return data_sink(std::make_unique<posix_ktls_data_sink_impl>(*_fd));
+        }
+#endif
+        return posix_data_sink(*_fd);
+    }
     virtual future<> shutdown_input() override {
         _fd->shutdown(SHUT_RD);
         return make_ready_future<>();
     }
     virtual future<> shutdown_output() override {
+#ifdef HAVE_KTLS
+        if (_ktls_tx) {
+            return send_tls_close_notify(*_fd).then([fd = _fd] {
+                fd->shutdown(SHUT_WR);
+            });
+        }
+#endif
         _fd->shutdown(SHUT_WR);
         return make_ready_future<>();
     }
@@ -135,6 +439,13 @@ class posix_connected_socket_impl final : public connected_socket_impl, posix_co
     keepalive_params get_keepalive_parameters() const override {
         return _ops::get_keepalive_parameters(_fd->get_file_desc());
     }
+    bool enable_kernel_tls(bool rx, const void* crypto_info, size_t size) override {
+        if (!_ops::enable_kernel_tls(_fd->get_file_desc(), rx, crypto_info, size)) {
+            return false;
+        }
+        (rx ? _ktls_rx : _ktls_tx) = true;
+        return true;
+    }
     friend class posix_server_socket_impl<Transport>;
     friend class posix_ap_server_socket_impl<Transport>;
     friend class posix_reuseport_server_socket_impl<Transport>;
@@ -151,8 +462,14 @@ class posix_socket_impl final : public socket_impl {
     posix_socket_impl() = default;
 
     virtual future<connected_socket> connect(socket_address sa, socket_address local, transport proto = transport::TCP) override {
+        connect_options opts;
+        opts.proto = proto;
+        return connect_with_options(sa, local, opts);
+    }
+    virtual future<connected_socket> connect_with_options(socket_address sa, socket_address local, const connect_options& opts) override {
+        auto proto = opts.proto;
         _fd = engine().make_pollable_fd(sa, proto);
-        return engine().posix_connect(_fd, sa, local).then([fd = _fd, proto]() mutable {
+        return engine().posix_connect(_fd, sa, local, opts).then([fd = _fd, proto]() mutable {
             std::unique_ptr<connected_socket_impl> csi;
             if (proto == transport::TCP) {
                 csi.reset(new posix_connected_tcp_socket_impl(std::move(fd)));
@@ -184,6 +501,7 @@ posix_server_socket_impl<Transport>::accept() {
         auto cpu = balance++ % smp::count;
 
         if (cpu == engine().cpu_id()) {
+            count_accepted(fd);
             std::unique_ptr<connected_socket_impl> csi(
                     new posix_connected_socket_impl<Transport>(make_lw_shared(std::move(fd))));
             return make_ready_future<connected_socket, socket_address>(
@@ -242,6 +560,7 @@ template <transport Transport>
 future<connected_socket, socket_address>
 posix_reuseport_server_socket_impl<Transport>::accept() {
     return _lfd.accept().then([this] (pollable_fd fd, socket_address sa) {
+        count_accepted(fd);
         std::unique_ptr<connected_socket_impl> csi(
                 new posix_connected_socket_impl<Transport>(make_lw_shared(std::move(fd))));
         return make_ready_future<connected_socket, socket_address>(
@@ -255,8 +574,14 @@ posix_reuseport_server_socket_impl<Transport>::abort_accept() {
     _lfd.abort_reader(std::make_exception_ptr(std::system_error(ECONNABORTED, std::system_category())));
 }
 
+template <transport Transport>
+posix_reuseport_server_socket_impl<Transport>::~posix_reuseport_server_socket_impl() {
+    reuseport_steering::close(_sa, Transport, _lfd);
+}
+
 template <transport Transport>
 void  posix_ap_server_socket_impl<Transport>::move_connected_socket(socket_address sa, pollable_fd fd, socket_address addr) {
+    count_accepted(fd);
     auto i = sockets.find(sa.as_posix_sockaddr_in());
     if (i != sockets.end()) {
         try {
@@ -318,16 +643,34 @@ posix_data_sink_impl::put(packet p) {
     return _fd.write_all(_p).then([this] { _p.reset(); });
 }
 
+posix_network_stack::posix_network_stack(boost::program_options::variables_map opts)
+    : _reuseport(engine().posix_reuseport_available())
+    , _collectd_regs({
+        scollectd::add_polled_metric(scollectd::type_instance_id("posix-stack"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "accepted-connections")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [] { return accept_stats.accepted; })
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id("posix-stack"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "accepted-remote-cpu-connections")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [] { return accept_stats.accepted_remote_cpu; })
+        ),
+    }) {
+}
+
 server_socket
 posix_network_stack::listen(socket_address sa, listen_options opt) {
     if (opt.proto == transport::TCP) {
         return _reuseport ?
-            server_socket(std::make_unique<posix_reuseport_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt)))
+            server_socket(std::make_unique<posix_reuseport_server_tcp_socket_impl>(sa, posix_reuseport_listen(sa, opt)))
             :
             server_socket(std::make_unique<posix_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt)));
     } else {
         return _reuseport ?
-            server_socket(std::make_unique<posix_reuseport_server_sctp_socket_impl>(sa, engine().posix_listen(sa, opt)))
+            server_socket(std::make_unique<posix_reuseport_server_sctp_socket_impl>(sa, posix_reuseport_listen(sa, opt)))
             :
             server_socket(std::make_unique<posix_server_sctp_socket_impl>(sa, engine().posix_listen(sa, opt)));
     }
@@ -346,74 +689,138 @@ server_socket
 posix_ap_network_stack::listen(socket_address sa, listen_options opt) {
     if (opt.proto == transport::TCP) {
         return _reuseport ?
-            server_socket(std::make_unique<posix_reuseport_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt)))
+            server_socket(std::make_unique<posix_reuseport_server_tcp_socket_impl>(sa, posix_reuseport_listen(sa, opt)))
             :
             server_socket(std::make_unique<posix_tcp_ap_server_socket_impl>(sa));
     } else {
         return _reuseport ?
-            server_socket(std::make_unique<posix_reuseport_server_sctp_socket_impl>(sa, engine().posix_listen(sa, opt)))
+            server_socket(std::make_unique<posix_reuseport_server_sctp_socket_impl>(sa, posix_reuseport_listen(sa, opt)))
             :
             server_socket(std::make_unique<posix_sctp_ap_server_socket_impl>(sa));
     }
 }
 
-struct cmsg_with_pktinfo {
-    struct cmsghdrcmh;
-    struct in_pktinfo pktinfo;
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Room for the control messages of a received datagram: its destination
+// address, and the segment size when the kernel coalesced several of them
+union udp_recv_cmsg {
+    cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(in_pktinfo)) + CMSG_SPACE(sizeof(int))];
+};
+
+// Room for a UDP_SEGMENT control message
+union udp_send_cmsg {
+    cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
 };
 
 class posix_udp_channel : public udp_channel_impl {
 private:
     static constexpr int MAX_DATAGRAM_SIZE = 65507;
+    // Messages transferred by a single recvmmsg() or sendmmsg() call, at most
+    static constexpr unsigned batch_size = 32;
+    // Received datagrams up to this size are copied out of their receive
+    // buffer, which can then be reused for the next batch
+    static constexpr size_t copy_threshold = 2048;
+    // Maximum number of segments the kernel accepts in one UDP_SEGMENT send
+    static constexpr unsigned max_gso_segments = 64;
+    // Each receive slot needs a buffer for the largest datagram (or the
+    // largest run coalesced by UDP_GRO), so the slots are put to use as
+    // the traffic calls for them: a channel starts with one, and doubles
+    // them whenever a batch fills all that it has.
     struct recv_ctx {
-        struct msghdr _hdr;
-        struct iovec _iov;
-        socket_address _src_addr;
-        char* _buffer;
-        cmsg_with_pktinfo _cmsg;
+        std::array<struct mmsghdr, batch_size> _msgs;
+        std::array<struct iovec, batch_size> _iovs;
+        std::array<socket_address, batch_size> _src_addrs;
+        std::array<udp_recv_cmsg, batch_size> _cmsgs;
+        std::array<std::unique_ptr<char[]>, batch_size> _buffers;
+        unsigned _nr_slots = 1;
 
         recv_ctx() {
-            memset(&_hdr, 0, sizeof(_hdr));
-            _hdr.msg_iov = &_iov;
-            _hdr.msg_iovlen = 1;
-            _hdr.msg_name = &_src_addr.u.sa;
-            _hdr.msg_namelen = sizeof(_src_addr.u.sas);
-            memset(&_cmsg, 0, sizeof(_cmsg));
-            _hdr.msg_control = &_cmsg;
-            _hdr.msg_controllen = sizeof(_cmsg);
+            memset(_msgs.data(), 0, sizeof(_msgs));
+            for (unsigned i = 0; i < batch_size; ++i) {
+                auto& hdr = _msgs[i].msg_hdr;
+                hdr.msg_iov = &_iovs[i];
+                hdr.msg_iovlen = 1;
+                hdr.msg_name = &_src_addrs[i].u.sa;
+                hdr.msg_control = &_cmsgs[i];
+            }
         }
 
         void prepare() {
-            _buffer = new char[MAX_DATAGRAM_SIZE];
-            _iov.iov_base = _buffer;
-            _iov.iov_len = MAX_DATAGRAM_SIZE;
-        }
-    };
-    struct send_ctx {
-        struct msghdr _hdr;
-        std::vector<struct iovec> _iovecs;
-        socket_address _dst;
-        packet _p;
-
-        send_ctx() {
-            memset(&_hdr, 0, sizeof(_hdr));
-            _hdr.msg_name = &_dst.u.sa;
-            _hdr.msg_namelen = sizeof(_dst.u.sas);
+            for (unsigned i = 0; i < _nr_slots; ++i) {
+                if (!_buffers[i]) {
+                    _buffers[i].reset(new char[MAX_DATAGRAM_SIZE]);
+                }
+                _iovs[i].iov_base = _buffers[i].get();
+                _iovs[i].iov_len = MAX_DATAGRAM_SIZE;
+                auto& hdr = _msgs[i].msg_hdr;
+                hdr.msg_namelen = sizeof(_src_addrs[i].u.sas);
+                hdr.msg_controllen = sizeof(_cmsgs[i]);
+                hdr.msg_flags = 0;
+            }
         }
 
-        void prepare(ipv4_addr dst, packet p) {
-            _dst = make_ipv4_address(dst);
-            _p = std::move(p);
-            _iovecs = std::move(to_iovec(_p));
-            _hdr.msg_iov = _iovecs.data();
-            _hdr.msg_iovlen = _iovecs.size();
+        void received(size_t n) {
+            if (n == _nr_slots) {
+                _nr_slots = _nr_slots * 2 < batch_size ? _nr_slots * 2 : batch_size;
+            }
         }
     };
-    std::unique_ptr<pollable_fd> _fd;
+    // Sends are queued and flushed together once the sending task yields,
+    // so that replies produced while processing a batch of received
+    // datagrams leave with one sendmmsg() call.  Shared with the flushing
+    // continuation, which may outlive the channel.
+    class send_queue : public enable_lw_shared_from_this<send_queue> {
+        struct entry {
+            socket_address dst;
+            packet p;
+            // Only on the last datagram of a send() or send_batch() call
+            std::experimental::optional<promise<>> pr;
+        };
+        lw_shared_ptr<pollable_fd> _fd;
+        circular_buffer<entry> _entries;
+        std::array<struct mmsghdr, batch_size> _msgs;
+        std::array<socket_address, batch_size> _dsts;
+        std::array<udp_send_cmsg, batch_size> _cmsgs;
+        // Number of queued entries carried by each message of the batch
+        std::array<unsigned, batch_size> _nr_entries;
+        std::vector<struct iovec> _iovecs;
+        // Error of a datagram whose caller has not been notified yet
+        std::exception_ptr _error;
+        bool _gso;
+        bool _flushing = false;
+        bool _closed = false;
+    public:
+        send_queue(lw_shared_ptr<pollable_fd> fd, bool gso) : _fd(std::move(fd)), _gso(gso) {}
+        future<> send(std::vector<std::pair<ipv4_addr, packet>> datagrams);
+        void close();
+    private:
+        void schedule_flush();
+        unsigned prepare_batch();
+        void complete(unsigned msgs, std::exception_ptr ex = {});
+        void flush();
+    };
+    lw_shared_ptr<pollable_fd> _fd;
     ipv4_addr _address;
     recv_ctx _recv;
-    send_ctx _send;
+    circular_buffer<udp_datagram> _received;
+    lw_shared_ptr<send_queue> _send;
     bool _closed;
+private:
+    void unpack_received(struct mmsghdr& msg, std::unique_ptr<char[]>& buffer);
+    future<> fill_received();
+    udp_datagram pop_received() {
+        auto d = std::move(_received.front());
+        _received.pop_front();
+        return d;
+    }
 public:
     posix_udp_channel(ipv4_addr bind_address)
             : _closed(false) {
@@ -423,32 +830,198 @@ class posix_udp_channel : public udp_channel_impl {
         if (engine().posix_reuseport_available()) {
             fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
         }
+        // Both are optional: older kernels reject them
+        int one = 1;
+        ::setsockopt(fd.get(), SOL_UDP, UDP_GRO, &one, sizeof(one));
+        int gso_size;
+        socklen_t gso_size_len = sizeof(gso_size);
+        bool gso = ::getsockopt(fd.get(), SOL_UDP, UDP_SEGMENT, &gso_size, &gso_size_len) == 0;
         fd.bind(sa.u.sa, sizeof(sa.u.sas));
         _address = ipv4_addr(fd.get_address());
-        _fd = std::make_unique<pollable_fd>(std::move(fd));
+        _fd = make_lw_shared<pollable_fd>(std::move(fd));
+        _send = make_lw_shared<send_queue>(_fd, gso);
     }
     virtual ~posix_udp_channel() { if (!_closed) close(); };
     virtual future<udp_datagram> receive() override;
+    virtual future<std::vector<udp_datagram>> receive_batch(size_t max) override;
     virtual future<> send(ipv4_addr dst, const char *msg);
     virtual future<> send(ipv4_addr dst, packet p);
+    virtual future<> send_batch(std::vector<std::pair<ipv4_addr, packet>> datagrams) override;
     virtual void close() override {
         _closed = true;
-        _fd.reset();
+        _send->close();
+        _fd = {};
     }
     virtual bool is_closed() const override { return _closed; }
 };
 
 future<> posix_udp_channel::send(ipv4_addr dst, const char *message) {
-    auto len = strlen(message);
-    return _fd->sendto(make_ipv4_address(dst), message, len)
-            .then([len] (size_t size) { assert(size == len); });
+    return send(dst, packet(message, strlen(message)));
 }
 
 future<> posix_udp_channel::send(ipv4_addr dst, packet p) {
-    auto len = p.len();
-    _send.prepare(dst, std::move(p));
-    return _fd->sendmsg(&_send._hdr)
-            .then([len] (size_t size) { assert(size == len); });
+    std::vector<std::pair<ipv4_addr, packet>> datagrams;
+    datagrams.emplace_back(dst, std::move(p));
+    return _send->send(std::move(datagrams));
+}
+
+future<> posix_udp_channel::send_batch(std::vector<std::pair<ipv4_addr, packet>> datagrams) {
+    if (datagrams.empty()) {
+        return make_ready_future<>();
+    }
+    return _send->send(std::move(datagrams));
+}
+
+future<> posix_udp_channel::send_queue::send(std::vector<std::pair<ipv4_addr, packet>> datagrams) {
+    if (_closed) {
+        return make_exception_future<>(std::system_error(EBADF, std::system_category()));
+    }
+    for (auto&& dgram : datagrams) {
+        _entries.push_back(entry{make_ipv4_address(dgram.first), std::move(dgram.second), {}});
+    }
+    _entries.back().pr.emplace();
+    auto f = _entries.back().pr->get_future();
+    schedule_flush();
+    return f;
+}
+
+void posix_udp_channel::send_queue::schedule_flush() {
+    if (!_flushing) {
+        _flushing = true;
+        later().then([self = shared_from_this()] {
+            self->flush();
+        });
+    }
+}
+
+void posix_udp_channel::send_queue::close() {
+    _closed = true;
+    if (!_flushing) {
+        _fd = {};
+    }
+}
+
+static bool same_destination(const socket_address& a, const socket_address& b) {
+    return a.u.in.sin_addr.s_addr == b.u.in.sin_addr.s_addr && a.u.in.sin_port == b.u.in.sin_port;
+}
+
+// Builds the next sendmmsg() batch from the head of the queue.  With
+// UDP_SEGMENT, consecutive datagrams to the same destination are sent as
+// one message when all but the last have the same size.
+unsigned posix_udp_channel::send_queue::prepare_batch() {
+    std::array<std::pair<size_t, size_t>, batch_size> iov_ranges;
+    _iovecs.clear();
+    unsigned nr_msgs = 0;
+    auto e = _entries.begin();
+    while (e != _entries.end() && nr_msgs < batch_size) {
+        auto& first = *e;
+        auto seg_size = first.p.len();
+        size_t total = seg_size;
+        unsigned nr = 1;
+        iov_ranges[nr_msgs].first = _iovecs.size();
+        for (auto&& f : first.p.fragments()) {
+            _iovecs.push_back({f.base, f.size});
+        }
+        ++e;
+        if (_gso && seg_size) {
+            while (e != _entries.end() && nr < max_gso_segments
+                    && same_destination(e->dst, first.dst)
+                    && e->p.len() && e->p.len() <= seg_size
+                    && total + e->p.len() <= MAX_DATAGRAM_SIZE) {
+                auto last = e->p.len() < seg_size;
+                for (auto&& f : e->p.fragments()) {
+                    _iovecs.push_back({f.base, f.size});
+                }
+                total += e->p.len();
+                ++nr;
+                ++e;
+                if (last) {
+                    break;
+                }
+            }
+        }
+        iov_ranges[nr_msgs].second = _iovecs.size();
+        auto& hdr = _msgs[nr_msgs].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        _dsts[nr_msgs] = first.dst;
+        hdr.msg_name = &_dsts[nr_msgs].u.sa;
+        hdr.msg_namelen = sizeof(_dsts[nr_msgs].u.in);
+        if (nr > 1) {
+            hdr.msg_control = &_cmsgs[nr_msgs];
+            hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            auto cm = CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gso_size = seg_size;
+            memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+        }
+        _nr_entries[nr_msgs] = nr;
+        ++nr_msgs;
+    }
+    // _iovecs is complete, so it will not move anymore
+    for (unsigned i = 0; i < nr_msgs; ++i) {
+        auto& hdr = _msgs[i].msg_hdr;
+        hdr.msg_iov = _iovecs.data() + iov_ranges[i].first;
+        hdr.msg_iovlen = iov_ranges[i].second - iov_ranges[i].first;
+    }
+    return nr_msgs;
+}
+
+// Resolves the entries of the first msgs messages of the batch.  An error
+// is reported to the caller once the last datagram it passed is done.
+void posix_udp_channel::send_queue::complete(unsigned msgs, std::exception_ptr ex) {
+    if (ex && !_error) {
+        _error = ex;
+    }
+    for (unsigned i = 0; i < msgs; ++i) {
+        for (unsigned j = 0; j < _nr_entries[i]; ++j) {
+            auto& e = _entries.front();
+            if (e.pr) {
+                if (_error) {
+                    e.pr->set_exception(std::move(_error));
+                    _error = {};
+                } else {
+                    e.pr->set_value();
+                }
+            }
+            _entries.pop_front();
+        }
+    }
+}
+
+void posix_udp_channel::send_queue::flush() {
+    if (_closed) {
+        while (!_entries.empty()) {
+            if (_entries.front().pr) {
+                _entries.front().pr->set_exception(std::system_error(EBADF, std::system_category()));
+            }
+            _entries.pop_front();
+        }
+    }
+    if (_entries.empty()) {
+        _flushing = false;
+        if (_closed) {
+            _fd = {};
+        }
+        return;
+    }
+    auto nr_msgs = prepare_batch();
+    _fd->sendmmsg(_msgs.data(), nr_msgs).then_wrapped([this, self = shared_from_this()] (future<size_t> f) {
+        try {
+            complete(f.get0());
+        } catch (...) {
+            if (_nr_entries[0] > 1) {
+                // The device cannot segment it; send datagrams one by one
+                // from now on
+                _gso = false;
+            } else {
+                // The first message was rejected; the others were not tried
+                complete(1, std::current_exception());
+            }
+        }
+        flush();
+    });
 }
 
 udp_channel
@@ -469,13 +1042,72 @@ class posix_datagram : public udp_datagram_impl {
     virtual packet& get_data() override { return _p; }
 };
 
+// Queues the datagrams of a received message: one, or several when the
+// kernel coalesced them (UDP_GRO)
+void posix_udp_channel::unpack_received(struct mmsghdr& msg, std::unique_ptr<char[]>& buffer) {
+    auto& hdr = msg.msg_hdr;
+    size_t size = msg.msg_len;
+    ipv4_addr dst;
+    size_t seg_size = 0;
+    for (auto cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+        if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_PKTINFO) {
+            in_pktinfo pktinfo;
+            memcpy(&pktinfo, CMSG_DATA(cm), sizeof(pktinfo));
+            dst = ipv4_addr(pktinfo.ipi_addr.s_addr, _address.port);
+        } else if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+            seg_size = gso_size;
+        }
+    }
+    auto src = ipv4_addr(*reinterpret_cast<socket_address*>(hdr.msg_name));
+    packet p;
+    if (size <= copy_threshold) {
+        p = packet(buffer.get(), size);
+    } else {
+        auto buf = buffer.release();
+        p = packet(fragment{buf, size}, make_deleter([buf] { delete[] buf; }));
+    }
+    if (!seg_size || seg_size >= size) {
+        _received.push_back(udp_datagram(std::make_unique<posix_datagram>(src, dst, std::move(p))));
+        return;
+    }
+    for (size_t off = 0; off < size; off += seg_size) {
+        auto len = std::min(seg_size, size - off);
+        _received.push_back(udp_datagram(std::make_unique<posix_datagram>(src, dst, p.share(off, len))));
+    }
+}
+
+future<> posix_udp_channel::fill_received() {
+    _recv.prepare();
+    return _fd->recvmmsg(_recv._msgs.data(), _recv._nr_slots).then([this] (size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            unpack_received(_recv._msgs[i], _recv._buffers[i]);
+        }
+        _recv.received(n);
+    });
+}
+
 future<udp_datagram>
 posix_udp_channel::receive() {
-    _recv.prepare();
-    return _fd->recvmsg(&_recv._hdr).then([this] (size_t size) {
-        auto dst = ipv4_addr(_recv._cmsg.pktinfo.ipi_addr.s_addr, _address.port);
-        return make_ready_future<udp_datagram>(udp_datagram(std::make_unique<posix_datagram>(
-            _recv._src_addr, dst, packet(fragment{_recv._buffer, size}, make_deleter([buf = _recv._buffer] { delete[] buf; })))));
+    if (!_received.empty()) {
+        return make_ready_future<udp_datagram>(pop_received());
+    }
+    return fill_received().then([this] {
+        return pop_received();
+    });
+}
+
+future<std::vector<udp_datagram>>
+posix_udp_channel::receive_batch(size_t max) {
+    auto f = _received.empty() ? fill_received() : make_ready_future<>();
+    return f.then([this, max] {
+        std::vector<udp_datagram> datagrams;
+        datagrams.reserve(std::min(max, _received.size()));
+        while (!_received.empty() && datagrams.size() < max) {
+            datagrams.push_back(pop_received());
+        }
+        return datagrams;
     });
 }
 
@@ -23,6 +23,7 @@
 #define POSIX_STACK_HH_
 
 #include "core/reactor.hh"
+#include "core/scollectd.hh"
 #include "stack.hh"
 #include <boost/program_options.hpp>
 
@@ -93,6 +94,7 @@ class posix_reuseport_server_socket_impl : public server_socket_impl {
     pollable_fd _lfd;
 public:
     explicit posix_reuseport_server_socket_impl(socket_address sa, pollable_fd lfd) : _sa(sa), _lfd(std::move(lfd)) {}
+    ~posix_reuseport_server_socket_impl();
     virtual future<connected_socket, socket_address> accept();
     virtual void abort_accept() override;
 };
@@ -102,8 +104,9 @@ using posix_reuseport_server_sctp_socket_impl = posix_reuseport_server_socket_im
 class posix_network_stack : public network_stack {
 private:
     const bool _reuseport;
+    scollectd::registrations _collectd_regs;
 public:
-    explicit posix_network_stack(boost::program_options::variables_map opts) : _reuseport(engine().posix_reuseport_available()) {}
+    explicit posix_network_stack(boost::program_options::variables_map opts);
     virtual server_socket listen(socket_address sa, listen_options opts) override;
     virtual ::seastar::socket socket() override;
     virtual net::udp_channel make_udp_channel(ipv4_addr addr) override;
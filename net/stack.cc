@@ -38,6 +38,10 @@ future<net::udp_datagram> net::udp_channel::receive() {
     return _impl->receive();
 }
 
+future<std::vector<net::udp_datagram>> net::udp_channel::receive_batch(size_t max) {
+    return _impl->receive_batch(max);
+}
+
 future<> net::udp_channel::send(ipv4_addr dst, const char* msg) {
     return _impl->send(std::move(dst), msg);
 }
@@ -46,6 +50,41 @@ future<> net::udp_channel::send(ipv4_addr dst, packet p) {
     return _impl->send(std::move(dst), std::move(p));
 }
 
+future<> net::udp_channel::send(const socket_address& dst, packet p) {
+    return _impl->send(dst, std::move(p));
+}
+
+future<> net::udp_channel::send_batch(std::vector<std::pair<ipv4_addr, packet>> datagrams) {
+    return _impl->send_batch(std::move(datagrams));
+}
+
+future<> net::udp_channel::send_batch(std::vector<std::pair<socket_address, packet>> datagrams) {
+    return _impl->send_batch(std::move(datagrams));
+}
+
+future<> net::udp_channel_impl::send(const socket_address& dst, packet p) {
+    if (dst.u.sa.sa_family != AF_INET) {
+        return make_exception_future<>(std::system_error(EAFNOSUPPORT, std::system_category()));
+    }
+    return send(ipv4_addr(dst), std::move(p));
+}
+
+future<> net::udp_channel_impl::send_batch(std::vector<std::pair<socket_address, packet>> datagrams) {
+    std::vector<std::pair<ipv4_addr, packet>> v4;
+    v4.reserve(datagrams.size());
+    for (auto&& d : datagrams) {
+        if (d.first.u.sa.sa_family != AF_INET) {
+            return make_exception_future<>(std::system_error(EAFNOSUPPORT, std::system_category()));
+        }
+        v4.emplace_back(ipv4_addr(d.first), std::move(d.second));
+    }
+    return send_batch(std::move(v4));
+}
+
+net::udp_channel network_stack::make_udp6_channel(uint16_t port) {
+    throw std::system_error(EAFNOSUPPORT, std::system_category());
+}
+
 bool net::udp_channel::is_closed() const {
     return _impl->is_closed();
 }
@@ -120,6 +159,10 @@ future<connected_socket> seastar::socket::connect(socket_address sa, socket_addr
     return _si->connect(sa, local, proto);
 }
 
+future<connected_socket> seastar::socket::connect(socket_address sa, socket_address local, connect_options opts) {
+    return _si->connect_with_options(sa, local, opts);
+}
+
 void seastar::socket::shutdown() {
     _si->shutdown();
 }
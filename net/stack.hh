@@ -39,12 +39,24 @@ class connected_socket_impl {
     virtual bool get_keepalive() const = 0;
     virtual void set_keepalive_parameters(const keepalive_params&) = 0;
     virtual keepalive_params get_keepalive_parameters() const = 0;
+    // Hands record encryption (or with rx, decryption) of the TLS session
+    // running over this socket to the kernel; crypto_info is one of linux'
+    // struct tls12_crypto_info_*. Returns false if the stack or the kernel
+    // cannot, in which case the data path is unchanged.
+    virtual bool enable_kernel_tls(bool rx, const void* crypto_info, size_t size) {
+        return false;
+    }
 };
 
 class socket_impl {
 public:
     virtual ~socket_impl() {}
     virtual future<connected_socket> connect(socket_address sa, socket_address local, seastar::transport proto = seastar::transport::TCP) = 0;
+    // Stacks that cannot choose the congestion control of a connection
+    // ignore it
+    virtual future<connected_socket> connect_with_options(socket_address sa, socket_address local, const connect_options& opts) {
+        return connect(sa, local, opts.proto);
+    }
     virtual void shutdown() = 0;
 };
 
@@ -59,8 +71,13 @@ class udp_channel_impl {
 public:
     virtual ~udp_channel_impl() {};
     virtual future<udp_datagram> receive() = 0;
+    virtual future<std::vector<udp_datagram>> receive_batch(size_t max) = 0;
     virtual future<> send(ipv4_addr dst, const char* msg) = 0;
     virtual future<> send(ipv4_addr dst, packet p) = 0;
+    virtual future<> send_batch(std::vector<std::pair<ipv4_addr, packet>> datagrams) = 0;
+    // IPv4 channels take IPv4 socket addresses by default
+    virtual future<> send(const socket_address& dst, packet p);
+    virtual future<> send_batch(std::vector<std::pair<socket_address, packet>> datagrams);
     virtual bool is_closed() const = 0;
     virtual void close() = 0;
 };
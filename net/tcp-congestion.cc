@@ -0,0 +1,368 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "tcp-congestion.hh"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+
+namespace net {
+
+void tcp_congestion_controller::init(tcp_congestion_window& w, uint16_t mss, uint32_t peer_window) {
+    _mss = mss;
+    // Setup initial congestion window
+    if (2190 < mss) {
+        w.cwnd = 2 * mss;
+    } else if (1095 < mss && mss <= 2190) {
+        w.cwnd = 3 * mss;
+    } else {
+        w.cwnd = 4 * mss;
+    }
+    // Setup initial slow start threshold
+    w.ssthresh = peer_window;
+}
+
+void tcp_congestion_controller::on_recovery_exit(tcp_congestion_window& w, uint32_t flight_size) {
+    // Set cwnd to min (ssthresh, max(FlightSize, SMSS) + SMSS)
+    w.cwnd = std::min(w.ssthresh, std::max(flight_size, _mss) + _mss);
+}
+
+void tcp_congestion_controller::on_timeout(tcp_congestion_window& w, uint32_t flight_size, bool first_timeout) {
+    // According to RFC5681
+    // Update ssthresh only for the first retransmit
+    if (first_timeout) {
+        w.ssthresh = std::max(flight_size / 2, 2 * _mss);
+    }
+    // Start the slow start process
+    w.cwnd = _mss;
+}
+
+class tcp_reno final : public tcp_congestion_controller {
+public:
+    virtual seastar::tcp_congestion_control type() const override {
+        return seastar::tcp_congestion_control::reno;
+    }
+    virtual void on_ack(tcp_congestion_window& w, uint32_t acked_bytes) override {
+        if (w.cwnd < w.ssthresh) {
+            // In slow start phase
+            w.cwnd += std::min(acked_bytes, _mss);
+        } else {
+            // In congestion avoidance phase
+            uint32_t round_up = 1;
+            w.cwnd += std::max(round_up, _mss * _mss / w.cwnd);
+        }
+    }
+    virtual void on_congestion_event(tcp_congestion_window& w, uint32_t flight_size) override {
+        // RFC5681 Step 3.2
+        w.ssthresh = std::max(flight_size / 2, 2 * _mss);
+    }
+};
+
+// CUBIC, RFC8312.  Window arithmetic is done in segments, as in the RFC.
+class tcp_cubic final : public tcp_congestion_controller {
+    using clock_type = steady_clock_type;
+    static constexpr double beta = 0.7;
+    static constexpr double c = 0.4;
+    // Window at the last congestion event
+    double _w_max = 0;
+    // _w_max before the last reduction, for fast convergence
+    double _w_last_max = 0;
+    // Time to grow back to _w_max, in seconds
+    double _k = 0;
+    // Window a Reno flow would have reached (the TCP-friendly region)
+    double _w_est = 0;
+    bool _epoch_started = false;
+    clock_type::time_point _epoch_start;
+    clock_type::duration _min_rtt = clock_type::duration::max();
+    // Fraction of a byte carried over between increments
+    double _pending = 0;
+public:
+    virtual seastar::tcp_congestion_control type() const override {
+        return seastar::tcp_congestion_control::cubic;
+    }
+    virtual void on_rtt_sample(clock_type::duration rtt) override {
+        _min_rtt = std::min(_min_rtt, rtt);
+    }
+    virtual void on_ack(tcp_congestion_window& w, uint32_t acked_bytes) override {
+        if (w.cwnd < w.ssthresh) {
+            w.cwnd += std::min(acked_bytes, _mss);
+            return;
+        }
+        auto now = clock_type::now();
+        double cwnd = double(w.cwnd) / _mss;
+        if (!_epoch_started) {
+            _epoch_started = true;
+            _epoch_start = now;
+            if (cwnd < _w_max) {
+                _k = std::cbrt((_w_max - cwnd) / c);
+            } else {
+                _k = 0;
+                _w_max = cwnd;
+            }
+            _w_est = cwnd;
+        }
+        auto rtt = _min_rtt == clock_type::duration::max() ? clock_type::duration(0) : _min_rtt;
+        double t = std::chrono::duration<double>(now - _epoch_start + rtt).count();
+        // W_cubic(t + RTT)
+        double target = c * std::pow(t - _k, 3) + _w_max;
+        // Grow at most by half a window per RTT
+        target = std::min(target, 1.5 * cwnd);
+        // W_est grows by alpha segments per RTT, where
+        // alpha = 3 * (1 - beta) / (1 + beta)
+        _w_est += 3 * (1 - beta) / (1 + beta) * acked_bytes / w.cwnd;
+        target = std::max(target, _w_est);
+        if (target > cwnd) {
+            _pending += (target - cwnd) / cwnd * acked_bytes;
+        } else {
+            _pending += double(acked_bytes) / (100 * cwnd);
+        }
+        auto inc = uint32_t(_pending);
+        w.cwnd += inc;
+        _pending -= inc;
+    }
+    virtual void on_congestion_event(tcp_congestion_window& w, uint32_t flight_size) override {
+        double cwnd = double(w.cwnd) / _mss;
+        _epoch_started = false;
+        _pending = 0;
+        if (cwnd < _w_last_max) {
+            // Fast convergence: release bandwidth to newer flows
+            _w_last_max = cwnd;
+            _w_max = cwnd * (1 + beta) / 2;
+        } else {
+            _w_last_max = _w_max = cwnd;
+        }
+        w.ssthresh = std::max(uint32_t(w.cwnd * beta), 2 * _mss);
+    }
+    virtual void on_timeout(tcp_congestion_window& w, uint32_t flight_size, bool first_timeout) override {
+        if (first_timeout) {
+            on_congestion_event(w, flight_size);
+        }
+        _epoch_started = false;
+        w.cwnd = _mss;
+    }
+};
+
+// BBR: sizes the window to the estimated bandwidth-delay product instead
+// of reacting to loss.  The native stack does not pace, so the pacing gain
+// cycle of BBR is applied to the window target instead of the send rate.
+class tcp_bbr final : public tcp_congestion_controller {
+    using clock_type = tcp_rate_sample::clock_type;
+    enum class mode { startup, drain, probe_bw, probe_rtt };
+    // 2/ln(2), the smallest gain that doubles the delivery rate each round
+    static constexpr double high_gain = 2.885;
+    static constexpr unsigned bw_window_rounds = 10;
+    static constexpr unsigned min_cwnd_segments = 4;
+    static constexpr std::chrono::seconds rtprop_window{10};
+    static constexpr std::chrono::milliseconds probe_rtt_duration{200};
+    static constexpr std::array<double, 8> probe_bw_gains{{1.25, 0.75, 1, 1, 1, 1, 1, 1}};
+
+    mode _mode = mode::startup;
+    // Delivery rate in bytes per second; the maximum of each of the last
+    // bw_window_rounds rounds, and the maximum of those
+    std::array<double, bw_window_rounds> _round_bw{};
+    double _btl_bw = 0;
+    uint64_t _round_count = 0;
+    uint64_t _next_round_delivered = 0;
+    clock_type::duration _rt_prop = clock_type::duration::max();
+    clock_type::time_point _rt_prop_stamp;
+    // Startup ends once the bandwidth stopped growing for three rounds
+    double _full_bw = 0;
+    unsigned _full_bw_count = 0;
+    bool _filled_pipe = false;
+    unsigned _cycle_index = 0;
+    clock_type::time_point _cycle_stamp;
+    clock_type::time_point _probe_rtt_done;
+    // Window saved on loss and in probe_rtt, restored afterwards
+    uint32_t _prior_cwnd = 0;
+    uint32_t _acked = 0;
+private:
+    uint32_t min_cwnd() const {
+        return min_cwnd_segments * _mss;
+    }
+    double bdp() const {
+        return _btl_bw * std::chrono::duration<double>(_rt_prop).count();
+    }
+    double gain() const {
+        switch (_mode) {
+        case mode::startup: return high_gain;
+        case mode::drain: return 1;
+        case mode::probe_bw: return probe_bw_gains[_cycle_index];
+        case mode::probe_rtt: return 1;
+        }
+        return 1;
+    }
+    bool have_model() const {
+        return _btl_bw > 0 && _rt_prop != clock_type::duration::max();
+    }
+    void update_bw(const tcp_rate_sample& rs, bool round_start) {
+        if (rs.interval <= clock_type::duration(0)) {
+            return;
+        }
+        auto bw = rs.delivered / std::chrono::duration<double>(rs.interval).count();
+        auto& slot = _round_bw[_round_count % bw_window_rounds];
+        if (round_start) {
+            slot = 0;
+        }
+        slot = std::max(slot, bw);
+        _btl_bw = *std::max_element(_round_bw.begin(), _round_bw.end());
+    }
+    void check_full_pipe(bool round_start) {
+        if (_filled_pipe || !round_start) {
+            return;
+        }
+        if (_btl_bw >= _full_bw * 1.25) {
+            _full_bw = _btl_bw;
+            _full_bw_count = 0;
+            return;
+        }
+        if (++_full_bw_count >= 3) {
+            _filled_pipe = true;
+        }
+    }
+    void enter_probe_bw(clock_type::time_point now) {
+        _mode = mode::probe_bw;
+        // Start anywhere but in the draining phase
+        _cycle_index = (_round_count + 2) % probe_bw_gains.size();
+        if (_cycle_index == 1) {
+            _cycle_index = 2;
+        }
+        _cycle_stamp = now;
+    }
+    void update_mode(const tcp_rate_sample& rs, clock_type::time_point now, bool rt_prop_expired) {
+        if (_mode == mode::startup && _filled_pipe) {
+            _mode = mode::drain;
+        }
+        if (_mode == mode::drain && rs.prior_in_flight <= bdp()) {
+            enter_probe_bw(now);
+        }
+        if (_mode == mode::probe_bw && now - _cycle_stamp > _rt_prop) {
+            _cycle_index = (_cycle_index + 1) % probe_bw_gains.size();
+            _cycle_stamp = now;
+        }
+        if (_mode != mode::probe_rtt && rt_prop_expired) {
+            _mode = mode::probe_rtt;
+            _probe_rtt_done = now + probe_rtt_duration;
+        } else if (_mode == mode::probe_rtt && now >= _probe_rtt_done) {
+            _rt_prop_stamp = now;
+            if (_filled_pipe) {
+                enter_probe_bw(now);
+            } else {
+                _mode = mode::startup;
+            }
+        }
+    }
+public:
+    virtual seastar::tcp_congestion_control type() const override {
+        return seastar::tcp_congestion_control::bbr;
+    }
+    virtual bool wants_rate_samples() const override {
+        return true;
+    }
+    virtual void on_ack(tcp_congestion_window& w, uint32_t acked_bytes) override {
+        _acked += acked_bytes;
+    }
+    virtual void on_rate_sample(tcp_congestion_window& w, const tcp_rate_sample& rs) override {
+        auto now = clock_type::now();
+        auto acked = _acked;
+        _acked = 0;
+
+        bool round_start = false;
+        if (rs.prior_delivered >= _next_round_delivered) {
+            _next_round_delivered = rs.prior_delivered + rs.delivered;
+            ++_round_count;
+            round_start = true;
+        }
+        update_bw(rs, round_start);
+        check_full_pipe(round_start);
+
+        bool rt_prop_expired = _rt_prop != clock_type::duration::max() && now > _rt_prop_stamp + rtprop_window;
+        if (rs.rtt > clock_type::duration(0) && (rs.rtt <= _rt_prop || rt_prop_expired)) {
+            _rt_prop = rs.rtt;
+            _rt_prop_stamp = now;
+        }
+        auto prev_mode = _mode;
+        update_mode(rs, now, rt_prop_expired);
+        if (_mode == mode::probe_rtt && prev_mode != mode::probe_rtt) {
+            _prior_cwnd = std::max(_prior_cwnd, w.cwnd);
+        } else if (prev_mode == mode::probe_rtt && _mode != mode::probe_rtt) {
+            w.cwnd = std::max(w.cwnd, _prior_cwnd);
+            _prior_cwnd = 0;
+        }
+
+        if (rs.in_recovery) {
+            // The tcb conserves packets during recovery
+            return;
+        }
+        if (_mode == mode::probe_rtt) {
+            w.cwnd = std::min(w.cwnd, min_cwnd());
+            return;
+        }
+        if (!have_model()) {
+            w.cwnd += acked;
+        } else {
+            auto target = std::max(uint32_t(bdp() * gain()) + 2 * _mss, min_cwnd());
+            if (_filled_pipe) {
+                w.cwnd = std::min(w.cwnd + acked, target);
+            } else if (w.cwnd < target) {
+                w.cwnd += acked;
+            }
+        }
+        w.cwnd = std::max(w.cwnd, min_cwnd());
+        // BBR does not use ssthresh; keep it from limiting recovery
+        w.ssthresh = std::max(w.ssthresh, w.cwnd);
+    }
+    virtual void on_congestion_event(tcp_congestion_window& w, uint32_t flight_size) override {
+        // Packet conservation: send one segment per segment delivered
+        _prior_cwnd = std::max(_prior_cwnd, w.cwnd);
+        w.ssthresh = std::max(flight_size, min_cwnd());
+    }
+    virtual void on_recovery_exit(tcp_congestion_window& w, uint32_t flight_size) override {
+        w.cwnd = std::max(w.cwnd, _prior_cwnd);
+        _prior_cwnd = 0;
+    }
+    virtual void on_timeout(tcp_congestion_window& w, uint32_t flight_size, bool first_timeout) override {
+        _prior_cwnd = std::max(_prior_cwnd, w.cwnd);
+        w.cwnd = _mss;
+    }
+};
+
+constexpr double tcp_cubic::beta;
+constexpr double tcp_cubic::c;
+constexpr std::chrono::seconds tcp_bbr::rtprop_window;
+constexpr std::chrono::milliseconds tcp_bbr::probe_rtt_duration;
+constexpr std::array<double, 8> tcp_bbr::probe_bw_gains;
+
+std::unique_ptr<tcp_congestion_controller>
+make_tcp_congestion_controller(seastar::tcp_congestion_control type) {
+    switch (type) {
+    case seastar::tcp_congestion_control::cubic:
+        return std::make_unique<tcp_cubic>();
+    case seastar::tcp_congestion_control::bbr:
+        return std::make_unique<tcp_bbr>();
+    case seastar::tcp_congestion_control::reno:
+    case seastar::tcp_congestion_control::stack_default:
+        break;
+    }
+    return std::make_unique<tcp_reno>();
+}
+
+}
@@ -0,0 +1,96 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#ifndef TCP_CONGESTION_HH_
+#define TCP_CONGESTION_HH_
+
+// Congestion control algorithms of the native TCP stack.
+//
+// The tcb owns the congestion window and slow start threshold and runs loss
+// recovery (fast retransmit, NewReno or SACK based); a congestion controller
+// decides how the window grows as data is acknowledged and how far it is cut
+// back when loss is detected.
+
+#include "net/api.hh"
+#include "core/timer.hh"
+#include <chrono>
+#include <memory>
+
+namespace net {
+
+// Congestion state of a connection, in bytes
+struct tcp_congestion_window {
+    // Congestion window
+    uint32_t cwnd = 0;
+    // Slow start threshold
+    uint32_t ssthresh = 0;
+};
+
+// Delivery rate sample, taken on each ACK that acknowledges new data
+// (draft-cheng-iccrg-delivery-rate-estimation).  Samples are only
+// collected for controllers that ask for them.
+struct tcp_rate_sample {
+    using clock_type = steady_clock_type;
+    // Bytes delivered since the most recently acknowledged segment was sent
+    uint64_t delivered = 0;
+    // Bytes delivered before that segment was sent
+    uint64_t prior_delivered = 0;
+    // Time over which delivered was measured; zero if there is no sample
+    clock_type::duration interval{0};
+    // RTT of that segment; zero if it was retransmitted
+    clock_type::duration rtt{0};
+    // Bytes in flight before this ACK
+    uint32_t prior_in_flight = 0;
+    // Whether the connection is in loss recovery
+    bool in_recovery = false;
+};
+
+class tcp_congestion_controller {
+protected:
+    uint32_t _mss = 536;
+public:
+    virtual ~tcp_congestion_controller() {}
+    virtual seastar::tcp_congestion_control type() const = 0;
+    virtual bool wants_rate_samples() const { return false; }
+    // Sets up the initial window (RFC3390) once the MSS is known
+    virtual void init(tcp_congestion_window& w, uint16_t mss, uint32_t peer_window);
+    // A segment, or part of one, was acknowledged for the first time
+    virtual void on_ack(tcp_congestion_window& w, uint32_t acked_bytes) = 0;
+    // A new RTT measurement (RFC6298) is available; it is not rounded to
+    // milliseconds, datacenter RTTs are well below one
+    virtual void on_rtt_sample(steady_clock_type::duration rtt) {}
+    // Called once per ACK acknowledging new data, after on_ack()
+    virtual void on_rate_sample(tcp_congestion_window& w, const tcp_rate_sample& rs) {}
+    // Loss was detected by duplicate ACKs or SACK; sets ssthresh before the
+    // tcb enters fast recovery
+    virtual void on_congestion_event(tcp_congestion_window& w, uint32_t flight_size) = 0;
+    // Fast recovery ended with an ACK covering all data sent before it began
+    virtual void on_recovery_exit(tcp_congestion_window& w, uint32_t flight_size);
+    // The retransmission timer expired
+    virtual void on_timeout(tcp_congestion_window& w, uint32_t flight_size, bool first_timeout);
+};
+
+std::unique_ptr<tcp_congestion_controller>
+make_tcp_congestion_controller(seastar::tcp_congestion_control type);
+
+}
+
+#endif /* TCP_CONGESTION_HH_ */
@@ -33,6 +33,7 @@ class connected_socket;
 namespace net {
 
 class ipv4_traits;
+class ipv6_traits;
 template <typename InetTraits>
 class tcp;
 
@@ -42,6 +43,12 @@ tcpv4_listen(tcp<ipv4_traits>& tcpv4, uint16_t port, listen_options opts);
 seastar::socket
 tcpv4_socket(tcp<ipv4_traits>& tcpv4);
 
+server_socket
+tcpv6_listen(tcp<ipv6_traits>& tcpv6, uint16_t port, listen_options opts);
+
+seastar::socket
+tcpv6_socket(tcp<ipv6_traits>& tcpv6);
+
 }
 
 #endif
@@ -22,6 +22,7 @@
 #include "tcp.hh"
 #include "tcp-stack.hh"
 #include "ip.hh"
+#include "ipv6.hh"
 #include "core/align.hh"
 #include "core/future.hh"
 #include "native-stack-impl.hh"
@@ -29,6 +30,8 @@
 namespace net {
 
 void tcp_option::parse(uint8_t* beg, uint8_t* end) {
+    _nr_remote_sack_blocks = 0;
+    _ts_present = false;
     while (beg < end) {
         auto kind = option_kind(*beg);
         if (kind != option_kind::nop && kind != option_kind::eol) {
@@ -55,6 +58,33 @@ void tcp_option::parse(uint8_t* beg, uint8_t* end) {
             _sack_received = true;
             beg += option_len::sack;
             break;
+        case option_kind::sack_blocks: {
+            auto len = *(beg + 1);
+            if (len < uint8_t(option_len::sack_blocks)) {
+                return;
+            }
+            auto opt = reinterpret_cast<sack_blocks*>(beg);
+            auto nr = std::min<unsigned>((len - uint8_t(option_len::sack_blocks)) / sizeof(sack_blocks::edges),
+                                         max_sack_blocks);
+            for (unsigned i = 0; i < nr; ++i) {
+                auto e = ntoh(opt->blocks[i]);
+                _remote_sack_blocks[i] = sack_block{e.left, e.right};
+            }
+            _nr_remote_sack_blocks = nr;
+            beg += len;
+            break;
+        }
+        case option_kind::timestamps: {
+            if (*(beg + 1) != uint8_t(option_len::timestamps)) {
+                return;
+            }
+            auto ts = ntoh(*reinterpret_cast<timestamps*>(beg));
+            _ts_present = true;
+            _remote_ts_val = ts.t1;
+            _remote_ts_ecr = ts.t2;
+            beg += option_len::timestamps;
+            break;
+        }
         case option_kind::nop:
             beg += option_len::nop;
             break;
@@ -94,6 +124,30 @@ uint8_t tcp_option::fill(tcp_hdr* th, uint8_t options_size) {
             off += win_scale->len;
             size += win_scale->len;
         }
+        if (_sack_received || !ack_on) {
+            auto sack = new (off) tcp_option::sack;
+            off += sack->len;
+            size += sack->len;
+        }
+    }
+    if (_timestamps_received || (syn_on && !ack_on)) {
+        auto ts = new (off) tcp_option::timestamps;
+        ts->t1 = _local_ts_val;
+        ts->t2 = _local_ts_ecr;
+        off += ts->len;
+        size += ts->len;
+        *ts = hton(*ts);
+    }
+    if (!syn_on && _nr_local_sack_blocks) {
+        auto sack = new (off) tcp_option::sack_blocks;
+        sack->len = uint8_t(option_len::sack_blocks) + _nr_local_sack_blocks * sizeof(sack_blocks::edges);
+        for (unsigned i = 0; i < _nr_local_sack_blocks; ++i) {
+            sack->blocks[i].left = _local_sack_blocks[i].left;
+            sack->blocks[i].right = _local_sack_blocks[i].right;
+            sack->blocks[i] = hton(sack->blocks[i]);
+        }
+        off += sack->len;
+        size += sack->len;
     }
     if (size > 0) {
         // Insert NOP option
@@ -120,6 +174,15 @@ uint8_t tcp_option::get_size(bool syn_on, bool ack_on) {
         if (_win_scale_received || !ack_on) {
             size += option_len::win_scale;
         }
+        if (_sack_received || !ack_on) {
+            size += option_len::sack;
+        }
+    }
+    if (_timestamps_received || (syn_on && !ack_on)) {
+        size += option_len::timestamps;
+    }
+    if (!syn_on && _nr_local_sack_blocks) {
+        size += uint8_t(option_len::sack_blocks) + _nr_local_sack_blocks * sizeof(sack_blocks::edges);
     }
     if (size > 0) {
         size += option_len::eol;
@@ -157,5 +220,32 @@ tcpv4_socket(tcp<ipv4_traits>& tcpv4) {
             tcpv4));
 }
 
+ipv6_tcp::ipv6_tcp(ipv6& inet)
+    : _inet_l4(inet), _tcp(std::make_unique<tcp<ipv6_traits>>(_inet_l4)) {
+}
+
+ipv6_tcp::~ipv6_tcp() {
+}
+
+void ipv6_tcp::received(packet p, ipv6_address from, ipv6_address to) {
+    _tcp->received(std::move(p), from, to);
+}
+
+bool ipv6_tcp::forward(forward_hash& out_hash_data, packet& p, size_t off) {
+    return _tcp->forward(out_hash_data, p, off);
+}
+
+server_socket
+tcpv6_listen(tcp<ipv6_traits>& tcpv6, uint16_t port, listen_options opts) {
+    return server_socket(std::make_unique<native_server_socket_impl<tcp<ipv6_traits>>>(
+            tcpv6, port, opts));
+}
+
+::seastar::socket
+tcpv6_socket(tcp<ipv6_traits>& tcpv6) {
+    return ::seastar::socket(std::make_unique<native_socket_impl<tcp<ipv6_traits>>>(
+            tcpv6));
+}
+
 }
 
@@ -31,6 +31,8 @@
 #include "ip.hh"
 #include "const.hh"
 #include "packet-util.hh"
+#include "tcp-congestion.hh"
+#include "flow_table.hh"
 #include <unordered_map>
 #include <map>
 #include <functional>
@@ -93,8 +95,9 @@ void tcp_debug(const char* fmt, Args&&... args) {
 
 struct tcp_option {
     // The kind and len field are fixed and defined in TCP protocol
-    enum class option_kind: uint8_t { mss = 2, win_scale = 3, sack = 4, timestamps = 8,  nop = 1, eol = 0 };
-    enum class option_len:  uint8_t { mss = 4, win_scale = 3, sack = 2, timestamps = 10, nop = 1, eol = 1 };
+    enum class option_kind: uint8_t { mss = 2, win_scale = 3, sack = 4, sack_blocks = 5, timestamps = 8,  nop = 1, eol = 0 };
+    // sack_blocks is the length of the option without its blocks
+    enum class option_len:  uint8_t { mss = 4, win_scale = 3, sack = 2, sack_blocks = 2, timestamps = 10, nop = 1, eol = 1 };
     struct mss {
         option_kind kind = option_kind::mss;
         option_len len = option_len::mss;
@@ -111,6 +114,16 @@ struct tcp_option {
         option_kind kind = option_kind::sack;
         option_len len = option_len::sack;
     } __attribute__((packed));
+    struct sack_blocks {
+        option_kind kind = option_kind::sack_blocks;
+        uint8_t len;
+        struct edges {
+            packed<uint32_t> left;
+            packed<uint32_t> right;
+            template <typename Adjuster>
+            void adjust_endianness(Adjuster a) { a(left, right); }
+        } __attribute__((packed)) blocks[0];
+    } __attribute__((packed));
     struct timestamps {
         option_kind kind = option_kind::timestamps;
         option_len len = option_len::timestamps;
@@ -126,6 +139,16 @@ struct tcp_option {
         option_kind kind = option_kind::eol;
     } __attribute__((packed));
     static const uint8_t align = 4;
+    // A SACK option with four blocks (34 bytes) still fits the 40 bytes of
+    // option space of a segment without other options; next to the
+    // timestamps option only three do.
+    static constexpr unsigned max_sack_blocks = 4;
+    static constexpr unsigned max_sack_blocks_with_timestamps = 3;
+    // A range of sequence space [left, right) held by the receiver
+    struct sack_block {
+        uint32_t left;
+        uint32_t right;
+    };
 
     void parse(uint8_t* beg, uint8_t* end);
     uint8_t fill(tcp_hdr* th, uint8_t option_size);
@@ -137,6 +160,24 @@ struct tcp_option {
     bool _timestamps_received = false;
     bool _sack_received = false;
 
+    // SACK blocks carried by the last parsed segment
+    sack_block _remote_sack_blocks[max_sack_blocks];
+    unsigned _nr_remote_sack_blocks = 0;
+    // SACK blocks to add to the next non-SYN segment we send
+    sack_block _local_sack_blocks[max_sack_blocks];
+    unsigned _nr_local_sack_blocks = 0;
+    unsigned max_local_sack_blocks() const {
+        return _timestamps_received ? max_sack_blocks_with_timestamps : max_sack_blocks;
+    }
+
+    // Timestamps (RFC7323) carried by the last parsed segment
+    bool _ts_present = false;
+    uint32_t _remote_ts_val = 0;
+    uint32_t _remote_ts_ecr = 0;
+    // Timestamps to add to the next segment we send
+    uint32_t _local_ts_val = 0;
+    uint32_t _local_ts_ecr = 0;
+
     // Option data
     uint16_t _remote_mss = 536;
     uint16_t _local_mss;
@@ -176,6 +217,18 @@ inline bool operator>(tcp_seq s, tcp_seq q) { return q < s; }
 inline bool operator<=(tcp_seq s, tcp_seq q) { return !(s > q); }
 inline bool operator>=(tcp_seq s, tcp_seq q) { return !(s < q); }
 
+// Moves a port drawn from [min, max] into a shard's residue class modulo
+// the number of shards, staying within the range
+inline uint16_t shard_port(unsigned port, unsigned shard, unsigned nr_shards, unsigned min, unsigned max) {
+    port = port - port % nr_shards + shard;
+    if (port > max) {
+        port -= nr_shards;
+    } else if (port < min) {
+        port += nr_shards;
+    }
+    return port;
+}
+
 struct tcp_hdr {
     packed<uint16_t> src_port;
     packed<uint16_t> dst_port;
@@ -208,13 +261,16 @@ class tcp {
     using inet_type = typename InetTraits::inet_type;
     using connid = l4connid<InetTraits>;
     using connid_hash = typename connid::connid_hash;
+    static constexpr int address_family = InetTraits::address_family;
     class connection;
     class listener;
 private:
     class tcb;
 
     class tcb : public enable_lw_shared_from_this<tcb> {
-        using clock_type = lowres_clock;
+        // Not lowres_clock: its 10ms tick is far coarser than the RTTs and
+        // retransmission timeouts inside a datacenter
+        using clock_type = steady_clock_type;
         static constexpr tcp_state CLOSED         = tcp_state::CLOSED;
         static constexpr tcp_state LISTEN         = tcp_state::LISTEN;
         static constexpr tcp_state SYN_SENT       = tcp_state::SYN_SENT;
@@ -239,8 +295,19 @@ class tcp {
             uint16_t data_len;
             unsigned nr_transmits;
             clock_type::time_point tx_time;
+            tcp_seq seq;
+            // SACK scoreboard (RFC6675)
+            bool sacked = false;
+            bool lost = false;
+            bool retransmitted = false;
+            // Delivery rate sampling, only when the congestion controller
+            // asks for rate samples
+            uint64_t delivered = 0;
+            tcp_rate_sample::clock_type::time_point delivered_time;
         };
-        struct send {
+        // Congestion window and slow start threshold are maintained
+        // through _cc
+        struct send : tcp_congestion_window {
             tcp_seq unacknowledged;
             tcp_seq next;
             uint32_t window;
@@ -261,15 +328,14 @@ class tcp {
             // Limit number of data queued into send queue
             semaphore user_queue_space = {212992};
             // Round-trip time variation
-            std::chrono::milliseconds rttvar;
+            clock_type::duration rttvar;
             // Smoothed round-trip time
-            std::chrono::milliseconds srtt;
+            clock_type::duration srtt;
             bool first_rto_sample = true;
             clock_type::time_point syn_tx_time;
-            // Congestion window
-            uint32_t cwnd;
-            // Slow start threshold
-            uint32_t ssthresh;
+            // Bytes acknowledged so far, and when the last of them were
+            uint64_t delivered = 0;
+            tcp_rate_sample::clock_type::time_point delivered_time;
             // Duplicated ACKs
             uint16_t dupacks = 0;
             unsigned syn_retransmit = 0;
@@ -288,20 +354,32 @@ class tcp {
             tcp_seq initial;
             std::deque<packet> data;
             tcp_packet_merger out_of_order;
+            // Start of the most recently received out of order segment,
+            // reported in the first SACK block
+            tcp_seq last_out_of_order;
             std::experimental::optional<promise<>> _data_received_promise;
+            // RFC7323: most recent timestamp to echo, when it was taken,
+            // and the acknowledgment we last sent
+            uint32_t ts_recent = 0;
+            clock_type::time_point ts_recent_stamp;
+            tcp_seq last_ack_sent;
         } _rcv;
         tcp_option _option;
+        std::unique_ptr<tcp_congestion_controller> _cc;
         timer<lowres_clock> _delayed_ack;
         // Retransmission timeout
         std::chrono::milliseconds _rto{1000};
         std::chrono::milliseconds _persist_time_out{1000};
-        static constexpr std::chrono::milliseconds _rto_min{1000};
         static constexpr std::chrono::milliseconds _rto_max{60000};
         // Clock granularity
         static constexpr std::chrono::milliseconds _rto_clk_granularity{1};
         static constexpr uint16_t _max_nr_retransmit{5};
-        timer<lowres_clock> _retransmit;
-        timer<lowres_clock> _persist;
+        // PAWS does not trust a TS.Recent older than this (RFC7323 5.5)
+        static constexpr std::chrono::hours _paws_idle_limit{24 * 24};
+        // Per connection offset of the timestamp clock
+        uint32_t _ts_offset;
+        timer<clock_type> _retransmit;
+        timer<clock_type> _persist;
         uint16_t _nr_full_seg_received = 0;
         struct isn_secret {
             // 512 bits secretkey for ISN generating
@@ -319,21 +397,33 @@ class tcp {
         tcp_seq get_isn();
         circular_buffer<typename InetTraits::l4packet> _packetq;
         bool _poll_active = false;
+        // The device delivers this connection to us with a filter
+        bool _steered = false;
+        // The SYN waits for the device to be programmed
+        bool _steering = false;
     public:
-        tcb(tcp& t, connid id);
+        tcb(tcp& t, connid id, seastar::tcp_congestion_control cc = seastar::tcp_congestion_control::stack_default);
         void input_handle_listen_state(tcp_hdr* th, packet p);
         void input_handle_syn_sent_state(tcp_hdr* th, packet p);
+        void input_handle_syncookie_ack(tcp_hdr* th, packet p, uint16_t mss);
         void input_handle_other_state(tcp_hdr* th, packet p);
-        void output_one(bool data_retransmit = false);
+        void output_one(unacked_segment* retransmit_seg = nullptr);
         future<> wait_for_data();
         void abort_reader();
         future<> wait_for_all_data_acked();
         future<> send(packet p);
         void connect();
+        void steer_and_connect(flow_steering_rule rule);
         packet read();
         void close();
         void remove_from_tcbs() {
             auto id = connid{_local_ip, _foreign_ip, _local_port, _foreign_port};
+            if (_steered) {
+                _steered = false;
+                _tcp._inet._inet.netif()->unsteer_flow(*InetTraits::steering_rule(
+                        _foreign_ip, _foreign_port, _local_ip, _local_port, ip_protocol_num::tcp));
+            }
+            // May destroy us
             _tcp._tcbs.erase(id);
         }
         std::experimental::optional<typename InetTraits::l4packet> get_packet();
@@ -372,8 +462,10 @@ class tcp {
         void clear_delayed_ack();
         packet get_transmit_packet();
         void retransmit_one() {
-            bool data_retransmit = true;
-            output_one(data_retransmit);
+            retransmit_one(_snd.data.front());
+        }
+        void retransmit_one(unacked_segment& seg) {
+            output_one(&seg);
         }
         void start_retransmit_timer() {
             auto now = clock_type::now();
@@ -400,8 +492,25 @@ class tcp {
         void persist();
         void retransmit();
         void fast_retransmit();
+        bool sack_enabled() {
+            return _option._sack_received;
+        }
+        void update_sack_scoreboard();
+        void enter_sack_recovery(tcp_seq seg_ack);
+        void sack_retransmit();
+        void fill_sack_blocks();
+        uint32_t pipe();
         void update_rto(clock_type::time_point tx_time);
-        void update_cwnd(uint32_t acked_bytes);
+        void update_rto(clock_type::duration rtt);
+        bool timestamps_enabled() {
+            return _option._timestamps_received;
+        }
+        // Timestamp clock, ticking once per millisecond
+        uint32_t ts_now() {
+            auto now = std::chrono::steady_clock::now().time_since_epoch();
+            return uint32_t(std::chrono::duration_cast<std::chrono::milliseconds>(now).count()) + _ts_offset;
+        }
+        bool paws_reject(tcp_hdr* th);
         void cleanup();
         uint32_t can_send() {
             if (_snd.window_probe) {
@@ -419,6 +528,12 @@ class tcp {
                 x = flight <= max ? std::min(x, max - flight) : 0;
                 _snd.limited_transfer += x;
             } else if (_snd.dupacks >= 3) {
+                if (sack_enabled()) {
+                    // RFC6675: new data may be sent while the estimate of
+                    // data in flight is below cwnd
+                    auto in_pipe = pipe();
+                    x = in_pipe < _snd.cwnd ? std::min(x, _snd.cwnd - in_pipe) : 0;
+                }
                 // RFC5681 Step 3.5
                 // Sent 1 full-sized segment at most
                 x = std::min(uint32_t(_snd.mss), x);
@@ -430,6 +545,9 @@ class tcp {
             std::for_each(_snd.data.begin(), _snd.data.end(), [&] (unacked_segment& seg) { size += seg.p.len(); });
             return size;
         }
+        uint16_t max_segment_payload() {
+            return std::min(uint16_t(_tcp.hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min), _snd.mss);
+        }
         uint16_t local_mss() {
             return _tcp.hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min;
         }
@@ -525,15 +643,51 @@ class tcp {
         friend class connection;
     };
     inet_type& _inet;
-    std::unordered_map<connid, lw_shared_ptr<tcb>, connid_hash> _tcbs;
+    flow_table<connid, lw_shared_ptr<tcb>, connid_hash> _tcbs;
     std::unordered_map<uint16_t, listener*> _listening;
     std::random_device _rd;
     std::default_random_engine _e;
     std::uniform_int_distribution<uint16_t> _port_dist{41952, 65535};
     circular_buffer<std::pair<lw_shared_ptr<tcb>, ethernet_address>> _poll_tcbs;
     // queue for packets that do not belong to any tcb
-    circular_buffer<ipv4_traits::l4packet> _packetq;
+    circular_buffer<typename InetTraits::l4packet> _packetq;
     semaphore _queue_space = {212992};
+    uint64_t _sack_retransmits = 0;
+    seastar::tcp_congestion_control _default_congestion_control = seastar::tcp_congestion_control::reno;
+    // Lower bound of the retransmission timeout
+    std::chrono::milliseconds _rto_min{1000};
+    // Software receive coalescing (GRO) for devices without LRO: in-order
+    // data segments of a flow received in one poll are merged into a single
+    // segment before they reach the tcb
+    struct gro_flow {
+        ipaddr from;
+        ipaddr to;
+        packet p;
+        unsigned hdr_len;
+        tcp_seq next_seq;
+        tcp_seq ack;
+        uint16_t window;
+    };
+    static constexpr size_t max_gro_flows = 8;
+    static constexpr size_t max_gro_len = 65535;
+    std::vector<gro_flow> _gro_flows;
+    std::experimental::optional<reactor::poller> _gro_poller;
+    uint64_t _gro_merged = 0;
+    // SYN cookies (RFC4987): when a listener's backlog is full, a SYN is
+    // answered without creating a tcb.  The ISN of the SYN,ACK encodes what
+    // is needed to create the connection once the final ACK returns it:
+    //   bits 31-27: a counter that advances every 64 seconds
+    //   bits 26-24: the index of the peer's MSS in syncookie_mss()
+    //   bits 23-0:  a keyed hash of the connection id, counter and MSS
+    // Other SYN options (window scale, SACK, timestamps) are not kept.
+    bool _syncookies = true;
+    uint32_t _syncookie_secret[16];
+    uint64_t _syncookies_sent = 0;
+    uint64_t _syncookies_accepted = 0;
+    uint64_t _syncookies_failed = 0;
+    // Counter period of the last cookie sent; an ACK can only return a
+    // valid cookie for two periods after it
+    uint32_t _syncookie_last_sent = 0;
     scollectd::registrations _collectd_regs;
 public:
     class connection {
@@ -565,6 +719,10 @@ class tcp {
         packet read() {
             return _tcb->read();
         }
+        // Current retransmission timeout
+        std::chrono::milliseconds retransmission_timeout() const {
+            return _tcb->_rto;
+        }
         void shutdown_connect();
         void close_read();
         void close_write();
@@ -574,14 +732,15 @@ class tcp {
         uint16_t _port;
         queue<connection> _q;
         size_t _pending = 0;
+        seastar::tcp_congestion_control _cc;
     private:
-        listener(tcp& t, uint16_t port, size_t queue_length)
-            : _tcp(t), _port(port), _q(queue_length) {
+        listener(tcp& t, uint16_t port, size_t queue_length, seastar::tcp_congestion_control cc)
+            : _tcp(t), _port(port), _q(queue_length), _cc(cc) {
             _tcp._listening.emplace(_port, this);
         }
     public:
         listener(listener&& x)
-            : _tcp(x._tcp), _port(x._port), _q(std::move(x._q)) {
+            : _tcp(x._tcp), _port(x._port), _q(std::move(x._q)), _pending(x._pending), _cc(x._cc) {
             _tcp._listening[_port] = this;
             x._port = 0;
         }
@@ -607,8 +766,33 @@ class tcp {
     explicit tcp(inet_type& inet);
     void received(packet p, ipaddr from, ipaddr to);
     bool forward(forward_hash& out_hash_data, packet& p, size_t off);
-    listener listen(uint16_t port, size_t queue_length = 100);
-    connection connect(socket_address sa);
+    listener listen(uint16_t port, size_t queue_length = 100,
+            seastar::tcp_congestion_control cc = seastar::tcp_congestion_control::stack_default);
+    connection connect(socket_address sa,
+            seastar::tcp_congestion_control cc = seastar::tcp_congestion_control::stack_default);
+    // RFC6298 recommends a minimum RTO of one second; networks with a
+    // known small RTT (such as inside a datacenter) can use a lower one
+    void set_rto_min(std::chrono::milliseconds rto_min) {
+        _rto_min = rto_min;
+    }
+    // Congestion control of connections that do not ask for a specific one
+    void set_default_congestion_control(seastar::tcp_congestion_control cc) {
+        _default_congestion_control = cc == seastar::tcp_congestion_control::stack_default
+                ? seastar::tcp_congestion_control::reno : cc;
+    }
+    // Answer SYNs with cookies instead of refusing them when a listener's
+    // backlog is full
+    void set_syncookies(bool enable) {
+        _syncookies = enable;
+    }
+    // Segments resent because SACK information showed them lost
+    uint64_t sack_retransmits() const {
+        return _sack_retransmits;
+    }
+    // Connections that are not fully closed yet
+    size_t connections() const {
+        return _tcbs.size();
+    }
     const net::hw_features& hw_features() const { return _inet._inet.hw_features(); }
     future<> poll_tcb(ipaddr to, lw_shared_ptr<tcb> tcb);
     void add_connected_tcb(lw_shared_ptr<tcb> tcbp, uint16_t local_port) {
@@ -619,8 +803,23 @@ class tcp {
         }
     }
 private:
+    // Whether the device delivers a connection's packets to this shard
+    bool owns(const connid& id);
+    // Picks a free local port for a connection.  Its hash has to point to
+    // this shard, unless the connection is going to be steered here.
+    connid pick_connid(ipaddr local_ip, ipaddr foreign_ip, uint16_t foreign_port, bool any_shard);
+    void process_received(packet p, ipaddr from, ipaddr to);
+    void gro_receive(packet p, ipaddr from, ipaddr to);
+    bool gro_flush();
     void send_packet_without_tcb(ipaddr from, ipaddr to, packet p);
+    void send_segment_without_tcb(ipaddr local_ip, ipaddr foreign_ip, packet p);
     void respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr foreign_ip);
+    static uint16_t syncookie_mss(unsigned idx);
+    static uint32_t syncookie_counter();
+    uint32_t syncookie_hash(const connid& id, uint32_t counter, unsigned mss_idx);
+    void send_syncookie(tcp_hdr* rth, packet& p, const connid& id);
+    uint16_t check_syncookie(tcp_hdr* th, const connid& id);
+    void accept_syncookie(listener& l, tcp_hdr* th, packet p, const connid& id, uint16_t mss);
     friend class listener;
 };
 
@@ -633,13 +832,52 @@ tcp<InetTraits>::tcp(inet_type& inet)
         // Linearized events: DERIVE:0:u
         //
         scollectd::add_polled_metric(scollectd::type_instance_id(
-              "tcp"
+              InetTraits::tcp_plugin_name()
             , scollectd::per_cpu_plugin_instance
             , "total_operations", "linearizations")
             , scollectd::make_typed(scollectd::data_type::DERIVE
             , [] { return tcp_packet_merger::linearizations(); })
         ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin_name()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "sack-retransmits")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [this] { return _sack_retransmits; })
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin_name()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "gro-merged")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [this] { return _gro_merged; })
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin_name()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "syncookies-sent")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [this] { return _syncookies_sent; })
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin_name()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "syncookies-accepted")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [this] { return _syncookies_accepted; })
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin_name()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "syncookies-failed")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [this] { return _syncookies_failed; })
+        ),
     }) {
+    std::uniform_int_distribution<uint32_t> dist{};
+    for (auto& k : _syncookie_secret) {
+        k = dist(_rd);
+    }
     _inet.register_packet_provider([this, tcb_polled = 0u] () mutable {
         std::experimental::optional<typename InetTraits::l4packet> l4p;
         auto c = _poll_tcbs.size();
@@ -673,28 +911,53 @@ future<> tcp<InetTraits>::poll_tcb(ipaddr to, lw_shared_ptr<tcb> tcb) {
 }
 
 template <typename InetTraits>
-auto tcp<InetTraits>::listen(uint16_t port, size_t queue_length) -> listener {
-    return listener(*this, port, queue_length);
+auto tcp<InetTraits>::listen(uint16_t port, size_t queue_length, seastar::tcp_congestion_control cc) -> listener {
+    return listener(*this, port, queue_length, cc);
+}
+
+template <typename InetTraits>
+bool tcp<InetTraits>::owns(const connid& id) {
+    auto netif = _inet._inet.netif();
+    return netif->hw_queues_count() == 1 || netif->hash2cpu(id.hash(netif->rss_key())) == engine().cpu_id();
+}
+
+template <typename InetTraits>
+auto tcp<InetTraits>::pick_connid(ipaddr local_ip, ipaddr foreign_ip, uint16_t foreign_port, bool any_shard) -> connid {
+    // With flow steering a connection may live on a shard its hash does not
+    // point to, so each shard takes its ports from its own residue class to
+    // keep two shards from picking the same connection id
+    auto partition_ports = _inet._inet.netif()->flow_steering_supported();
+    for (;;) {
+        uint16_t port = _port_dist(_e);
+        if (partition_ports) {
+            port = shard_port(port, engine().cpu_id(), smp::count, _port_dist.min(), _port_dist.max());
+        }
+        auto id = connid{local_ip, foreign_ip, port, foreign_port};
+        if (!_tcbs.find(id) && (any_shard || owns(id))) {
+            return id;
+        }
+    }
 }
 
 template <typename InetTraits>
-auto tcp<InetTraits>::connect(socket_address sa) -> connection {
-    uint16_t src_port;
-    connid id;
+auto tcp<InetTraits>::connect(socket_address sa, seastar::tcp_congestion_control cc) -> connection {
     auto src_ip = _inet._inet.host_address();
-    auto dst_ip = ipv4_address(sa);
-    auto dst_port = net::ntoh(sa.u.in.sin_port);
-
-    do {
-        src_port = _port_dist(_e);
-        id = connid{src_ip, dst_ip, src_port, dst_port};
-    } while (_inet._inet.netif()->hw_queues_count() > 1 &&
-             (_inet._inet.netif()->hash2cpu(id.hash(_inet._inet.netif()->rss_key())) != engine().cpu_id()
-              || _tcbs.find(id) != _tcbs.end()));
-
-    auto tcbp = make_lw_shared<tcb>(*this, id);
-    _tcbs.insert({id, tcbp});
-    tcbp->connect();
+    auto dst_ip = InetTraits::address_of(sa);
+    auto dst_port = InetTraits::port_of(sa);
+    // Rather than searching for a port whose hash lands here, have the
+    // device steer the connection to us
+    auto try_steering = _inet._inet.netif()->flow_steering_supported()
+            && !_inet._inet.netif()->steering_backed_off()
+            && InetTraits::steering_rule(dst_ip, dst_port, src_ip, 0, ip_protocol_num::tcp);
+    auto id = pick_connid(src_ip, dst_ip, dst_port, try_steering);
+
+    auto tcbp = make_lw_shared<tcb>(*this, id, cc);
+    _tcbs.insert(id, tcbp);
+    if (owns(id)) {
+        tcbp->connect();
+    } else {
+        tcbp->steer_and_connect(*InetTraits::steering_rule(dst_ip, dst_port, src_ip, id.local_port, ip_protocol_num::tcp));
+    }
     return connection(tcbp);
 }
 
@@ -727,12 +990,105 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             return;
         }
     }
+    if (_inet._inet.sw_gro()) {
+        return gro_receive(std::move(p), from, to);
+    }
+    process_received(std::move(p), from, to);
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::gro_receive(packet p, ipaddr from, ipaddr to) {
+    unsigned hdr_len = p.get_header<tcp_hdr>(0)->data_offset * 4;
+    if (!p.get_header(0, hdr_len)) {
+        return process_received(std::move(p), from, to);
+    }
+    auto th = p.get_header<tcp_hdr>(0);
+    auto h = ntoh(*th);
+    // Only plain data segments are merged; anything else is processed as
+    // is, after whatever was held for its flow
+    bool mergeable = p.len() > hdr_len && h.f_ack && !h.f_syn && !h.f_fin && !h.f_rst && !h.f_urg;
+    auto flow = std::find_if(_gro_flows.begin(), _gro_flows.end(), [&] (gro_flow& f) {
+        auto fth = f.p.template get_header<tcp_hdr>(0);
+        return f.from == from && f.to == to && fth->src_port == th->src_port && fth->dst_port == th->dst_port;
+    });
+    if (flow != _gro_flows.end()) {
+        auto fth = reinterpret_cast<uint8_t*>(flow->p.get_header(0, flow->hdr_len));
+        auto opts = reinterpret_cast<uint8_t*>(th) + sizeof(tcp_hdr);
+        if (mergeable
+                && flow->hdr_len == hdr_len
+                && flow->next_seq == h.seq
+                && flow->ack == h.ack
+                && flow->window == h.window
+                && flow->p.len() + p.len() - hdr_len <= max_gro_len
+                && std::equal(opts, opts + hdr_len - sizeof(tcp_hdr), fth + sizeof(tcp_hdr))) {
+            p.trim_front(hdr_len);
+            flow->next_seq += p.len();
+            flow->p.append(std::move(p));
+            ++_gro_merged;
+            return;
+        }
+        auto held = std::move(*flow);
+        _gro_flows.erase(flow);
+        process_received(std::move(held.p), held.from, held.to);
+    }
+    if (!mergeable) {
+        return process_received(std::move(p), from, to);
+    }
+    if (_gro_flows.size() == max_gro_flows) {
+        auto held = std::move(_gro_flows.front());
+        _gro_flows.erase(_gro_flows.begin());
+        process_received(std::move(held.p), held.from, held.to);
+    }
+    if (!_gro_poller) {
+        _gro_poller.emplace(reactor::poller::simple([this] { return gro_flush(); }));
+    }
+    auto next_seq = h.seq + (p.len() - hdr_len);
+    _gro_flows.push_back(gro_flow{from, to, std::move(p), hdr_len, next_seq, h.ack, h.window});
+}
+
+template <typename InetTraits>
+bool tcp<InetTraits>::gro_flush() {
+    if (_gro_flows.empty()) {
+        return false;
+    }
+    auto flows = std::move(_gro_flows);
+    _gro_flows.clear();
+    for (auto& f : flows) {
+        auto th = f.p.template get_header<tcp_hdr>(0);
+        _tcbs.prefetch(connid{f.to, f.from, ntoh(th->dst_port), ntoh(th->src_port)});
+    }
+    for (auto& f : flows) {
+        process_received(std::move(f.p), f.from, f.to);
+    }
+    return true;
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::process_received(packet p, ipaddr from, ipaddr to) {
+    auto th = p.get_header<tcp_hdr>(0);
     auto h = ntoh(*th);
     auto id = connid{to, from, h.dst_port, h.src_port};
     auto tcbi = _tcbs.find(id);
     lw_shared_ptr<tcb> tcbp;
-    if (tcbi == _tcbs.end()) {
+    if (!tcbi) {
         auto listener = _listening.find(id.local_port);
+        if (listener != _listening.end() && _syncookies && !h.f_rst) {
+            if (h.f_syn && !h.f_ack && listener->second->full()) {
+                return send_syncookie(&h, p, id);
+            }
+            if (h.f_ack && !h.f_syn) {
+                if (auto mss = check_syncookie(&h, id)) {
+                    // The peer considers the connection established, and a
+                    // pure ACK is never retransmitted.  If the backlog is
+                    // still full, reset the connection so that the peer
+                    // fails now rather than stalls until it sends data.
+                    if (listener->second->full()) {
+                        return respond_with_reset(&h, id.local_ip, id.foreign_ip);
+                    }
+                    return accept_syncookie(*listener->second, &h, std::move(p), id, mss);
+                }
+            }
+        }
         if (listener == _listening.end() || listener->second->full()) {
             // 1) In CLOSE state
             // 1.1 all data in the incoming segment is discarded.  An incoming
@@ -760,8 +1116,8 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             if (h.f_syn) {
                 // check the security
                 // NOTE: Ignored for now
-                tcbp = make_lw_shared<tcb>(*this, id);
-                _tcbs.insert({id, tcbp});
+                tcbp = make_lw_shared<tcb>(*this, id, listener->second->_cc);
+                _tcbs.insert(id, tcbp);
                 // TODO: we need to remove the tcb and decrease the pending if
                 // it stays SYN_RECEIVED state forever.
                 listener->second->inc_pending();
@@ -774,7 +1130,7 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             return;
         }
     } else {
-        tcbp = tcbi->second;
+        tcbp = *tcbi;
         if (tcbp->state() == tcp_state::SYN_SENT) {
             // 3) In SYN_SENT State
             return tcbp->input_handle_syn_sent_state(&h, std::move(p));
@@ -792,7 +1148,7 @@ template <typename InetTraits>
 void tcp<InetTraits>::send_packet_without_tcb(ipaddr from, ipaddr to, packet p) {
     if (_queue_space.try_wait(p.len())) { // drop packets that do not fit the queue
         _inet.get_l2_dst_address(to).then([this, to, p = std::move(p)] (ethernet_address e_dst) mutable {
-                _packetq.emplace_back(ipv4_traits::l4packet{to, std::move(p), e_dst, ip_protocol_num::tcp});
+                _packetq.emplace_back(typename InetTraits::l4packet{to, std::move(p), e_dst, ip_protocol_num::tcp});
         });
     }
 }
@@ -807,13 +1163,16 @@ tcp<InetTraits>::connection::~connection() {
 }
 
 template <typename InetTraits>
-tcp<InetTraits>::tcb::tcb(tcp& t, connid id)
+tcp<InetTraits>::tcb::tcb(tcp& t, connid id, seastar::tcp_congestion_control cc)
     : _tcp(t)
     , _local_ip(id.local_ip)
     , _foreign_ip(id.foreign_ip)
     , _local_port(id.local_port)
     , _foreign_port(id.foreign_port)
+    , _cc(make_tcp_congestion_controller(cc == seastar::tcp_congestion_control::stack_default
+            ? t._default_congestion_control : cc))
     , _delayed_ack([this] { _nr_full_seg_received = 0; output(); })
+    , _ts_offset(t._e())
     , _retransmit([this] { retransmit(); })
     , _persist([this] { persist(); }) {
 }
@@ -845,9 +1204,16 @@ void tcp<InetTraits>::respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr f
     th->checksum = 0;
     *th = hton(*th);
 
+    send_segment_without_tcb(local_ip, foreign_ip, std::move(p));
+}
+
+// Fills in the checksum of a segment whose header is complete and sends it
+template <typename InetTraits>
+void tcp<InetTraits>::send_segment_without_tcb(ipaddr local_ip, ipaddr foreign_ip, packet p) {
+    auto th = p.get_header<tcp_hdr>(0);
     checksummer csum;
     offload_info oi;
-    InetTraits::tcp_pseudo_header_checksum(csum, local_ip, foreign_ip, sizeof(*th));
+    InetTraits::tcp_pseudo_header_checksum(csum, local_ip, foreign_ip, p.len());
     if (hw_features().tx_csum_l4_offload) {
         th->checksum = ~csum.get();
         oi.needs_csum = true;
@@ -858,27 +1224,146 @@ void tcp<InetTraits>::respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr f
     }
 
     oi.protocol = ip_protocol_num::tcp;
-    oi.tcp_hdr_len = sizeof(tcp_hdr);
+    oi.tcp_hdr_len = th->data_offset * 4;
     p.set_offload_info(oi);
 
     send_packet_without_tcb(local_ip, foreign_ip, std::move(p));
 }
 
+template <typename InetTraits>
+uint16_t tcp<InetTraits>::syncookie_mss(unsigned idx) {
+    static const uint16_t table[8] = { 536, 1220, 1300, 1400, 1440, 1460, 4312, 8960 };
+    return table[idx];
+}
+
+template <typename InetTraits>
+uint32_t tcp<InetTraits>::syncookie_counter() {
+    using namespace std::chrono;
+    return duration_cast<seconds>(steady_clock::now().time_since_epoch()).count() / 64;
+}
+
+template <typename InetTraits>
+uint32_t tcp<InetTraits>::syncookie_hash(const connid& id, uint32_t counter, unsigned mss_idx) {
+    uint32_t hash[4];
+    hash[0] = std::hash<ipaddr>()(id.local_ip);
+    hash[1] = std::hash<ipaddr>()(id.foreign_ip);
+    hash[2] = (id.local_port << 16) + id.foreign_port;
+    hash[3] = (counter << 3) | mss_idx;
+    CryptoPP::Weak::MD5::Transform(hash, _syncookie_secret);
+    return hash[0] & 0xffffff;
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::send_syncookie(tcp_hdr* rth, packet& p, const connid& id) {
+    tcp_option opt;
+    auto hdr = reinterpret_cast<uint8_t*>(p.get_header(0, rth->data_offset * 4));
+    if (!hdr) {
+        return;
+    }
+    opt.parse(hdr + sizeof(tcp_hdr), hdr + rth->data_offset * 4);
+    uint16_t local_mss = hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min;
+    auto mss = std::min(opt._remote_mss, local_mss);
+    unsigned mss_idx = 7;
+    while (mss_idx && syncookie_mss(mss_idx) > mss) {
+        --mss_idx;
+    }
+    auto counter = syncookie_counter();
+    auto isn = ((counter & 31) << 27) | (mss_idx << 24) | syncookie_hash(id, counter, mss_idx);
+
+    // <SEQ=cookie><ACK=SEG.SEQ+1><CTL=SYN,ACK>, announcing only the MSS
+    packet synack;
+    auto th = synack.prepend_header<tcp_hdr>(sizeof(tcp_option::mss));
+    th->src_port = rth->dst_port;
+    th->dst_port = rth->src_port;
+    th->seq = make_seq(isn);
+    th->ack = rth->seq + 1;
+    th->f_syn = true;
+    th->f_ack = true;
+    th->window = 29200;
+    th->data_offset = (sizeof(tcp_hdr) + sizeof(tcp_option::mss)) / 4;
+    th->checksum = 0;
+    *th = hton(*th);
+    auto mss_opt = new (th + 1) tcp_option::mss;
+    mss_opt->mss = local_mss;
+    *mss_opt = hton(*mss_opt);
+
+    ++_syncookies_sent;
+    _syncookie_last_sent = counter;
+    send_segment_without_tcb(id.local_ip, id.foreign_ip, std::move(synack));
+}
+
+// Returns the MSS encoded in the cookie this ACK acknowledges, or 0 if it
+// does not acknowledge a valid cookie.  Only ACKs that arrive while cookies
+// are outstanding count as failures; other stray ACKs are not checked.
+template <typename InetTraits>
+uint16_t tcp<InetTraits>::check_syncookie(tcp_hdr* th, const connid& id) {
+    auto now = syncookie_counter();
+    if (!_syncookies_sent || now - _syncookie_last_sent > 1) {
+        return 0;
+    }
+    auto cookie = (th->ack - 1).raw;
+    auto mss_idx = (cookie >> 24) & 7;
+    // Cookies are good for up to two counter periods
+    for (auto counter : {now, now - 1}) {
+        if ((counter & 31) == cookie >> 27 && syncookie_hash(id, counter, mss_idx) == (cookie & 0xffffff)) {
+            return syncookie_mss(mss_idx);
+        }
+    }
+    ++_syncookies_failed;
+    return 0;
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::accept_syncookie(listener& l, tcp_hdr* th, packet p, const connid& id, uint16_t mss) {
+    auto tcbp = make_lw_shared<tcb>(*this, id, l._cc);
+    _tcbs.insert(id, tcbp);
+    ++_syncookies_accepted;
+    tcbp->input_handle_syncookie_ack(th, std::move(p), mss);
+    l._q.push(connection(tcbp));
+}
+
 template <typename InetTraits>
 uint32_t tcp<InetTraits>::tcb::data_segment_acked(tcp_seq seg_ack) {
     uint32_t total_acked_bytes = 0;
+    // With timestamps every ACK of new data gives an RTT sample, even one
+    // for a retransmitted segment, since the echoed timestamp tells which
+    // transmission it acknowledges (RFC7323 section 4)
+    bool ts_rtt = timestamps_enabled() && _option._ts_present && _option._remote_ts_ecr;
+    // Send time of the most recently sent segment this ACK covers that was
+    // not retransmitted
+    std::experimental::optional<clock_type::time_point> rtt_tx_time;
+    bool rate_sampling = _cc->wants_rate_samples();
+    tcp_rate_sample rs;
+    bool have_rate_sample = false;
+    if (rate_sampling) {
+        rs.prior_in_flight = flight_size();
+        rs.in_recovery = _snd.dupacks >= 3;
+    }
     // Full ACK of segment
     while (!_snd.data.empty()
             && (_snd.unacknowledged + _snd.data.front().p.len() <= seg_ack)) {
-        auto acked_bytes = _snd.data.front().p.len();
+        auto& seg = _snd.data.front();
+        auto acked_bytes = seg.p.len();
         _snd.unacknowledged += acked_bytes;
         // Ignore retransmitted segments when setting the RTO
-        if (_snd.data.front().nr_transmits == 0) {
-            update_rto(_snd.data.front().tx_time);
+        if (seg.nr_transmits == 0) {
+            rtt_tx_time = seg.tx_time;
         }
-        update_cwnd(acked_bytes);
+        _cc->on_ack(_snd, acked_bytes);
         total_acked_bytes += acked_bytes;
-        _snd.user_queue_space.signal(_snd.data.front().data_len);
+        if (rate_sampling) {
+            // The sample is taken from the most recently sent segment
+            // this ACK covers
+            auto now = tcp_rate_sample::clock_type::now();
+            _snd.delivered += acked_bytes;
+            _snd.delivered_time = now;
+            rs.prior_delivered = seg.delivered;
+            rs.delivered = _snd.delivered - seg.delivered;
+            rs.interval = now - seg.delivered_time;
+            rs.rtt = seg.nr_transmits == 0 ? now - seg.tx_time : tcp_rate_sample::clock_type::duration(0);
+            have_rate_sample = true;
+        }
+        _snd.user_queue_space.signal(seg.data_len);
         _snd.data.pop_front();
     }
     // Partial ACK of segment
@@ -887,10 +1372,28 @@ uint32_t tcp<InetTraits>::tcb::data_segment_acked(tcp_seq seg_ack) {
         if (!_snd.data.empty()) {
             auto& unacked_seg = _snd.data.front();
             unacked_seg.p.trim_front(acked_bytes);
+            unacked_seg.seq = seg_ack;
         }
         _snd.unacknowledged = seg_ack;
-        update_cwnd(acked_bytes);
+        _cc->on_ack(_snd, acked_bytes);
         total_acked_bytes += acked_bytes;
+        if (rate_sampling) {
+            _snd.delivered += acked_bytes;
+            _snd.delivered_time = tcp_rate_sample::clock_type::now();
+        }
+    }
+    // The send time of a segment sent only once measures the RTT more
+    // precisely than the millisecond timestamp clock does
+    if (rtt_tx_time) {
+        update_rto(*rtt_tx_time);
+    } else if (ts_rtt && total_acked_bytes) {
+        auto rtt = int32_t(ts_now() - _option._remote_ts_ecr);
+        if (rtt >= 0) {
+            update_rto(std::chrono::milliseconds(rtt));
+        }
+    }
+    if (have_rate_sample) {
+        _cc->on_rate_sample(_snd, rs);
     }
     return total_acked_bytes;
 }
@@ -921,6 +1424,20 @@ void tcp<InetTraits>::tcb::init_from_options(tcp_hdr* th, uint8_t* opt_start, ui
     // Handle tcp options
     _option.parse(opt_start, opt_end);
 
+    // Timestamps are used only if both SYNs carry them
+    _option._timestamps_received = _option._ts_present;
+    if (timestamps_enabled()) {
+        _rcv.ts_recent = _option._remote_ts_val;
+        _rcv.ts_recent_stamp = clock_type::now();
+    }
+    _rcv.last_ack_sent = _rcv.next;
+
+    // Window scaling is used only if both SYNs carry the option; a SYN,ACK
+    // sent with a SYN cookie never does
+    if (!_option._win_scale_received) {
+        _option._local_win_scale = 0;
+    }
+
     // Remote receive window scale factor
     _snd.window_scale = _option._remote_win_scale;
     // Local receive window scale factor
@@ -940,17 +1457,8 @@ void tcp<InetTraits>::tcb::init_from_options(tcp_hdr* th, uint8_t* opt_start, ui
     // Segment acknowledgment number used for last window update
     _snd.wl2 = th->ack;
 
-    // Setup initial congestion window
-    if (2190 < _snd.mss) {
-        _snd.cwnd = 2 * _snd.mss;
-    } else if (1095 < _snd.mss && _snd.mss <= 2190) {
-        _snd.cwnd = 3 * _snd.mss;
-    } else {
-        _snd.cwnd = 4 * _snd.mss;
-    }
-
-    // Setup initial slow start threshold
-    _snd.ssthresh = th->window << _snd.window_scale;
+    // Setup initial congestion window and slow start threshold
+    _cc->init(_snd, _snd.mss, th->window << _snd.window_scale);
 }
 
 template <typename InetTraits>
@@ -1052,8 +1560,47 @@ void tcp<InetTraits>::tcb::input_handle_syn_sent_state(tcp_hdr* th, packet p) {
     return;
 }
 
+// The connection was accepted with a SYN cookie: set up the state that
+// LISTEN -> SYN_RECEIVED -> ESTABLISHED would have left, then process the
+// ACK and any data it carries
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::input_handle_syncookie_ack(tcp_hdr* th, packet p, uint16_t mss) {
+    auto opt_len = th->data_offset * 4 - sizeof(tcp_hdr);
+    auto opt_start = reinterpret_cast<uint8_t*>(p.get_header(0, th->data_offset * 4)) + sizeof(tcp_hdr);
+    auto opt_end = opt_start + opt_len;
+    tcp_seq seg_seq = th->seq;
+    tcp_seq seg_ack = th->ack;
+
+    _rcv.next = seg_seq;
+    _rcv.initial = seg_seq - 1;
+    _rcv.urgent = _rcv.next;
+    _snd.initial = seg_ack - 1;
+    _snd.unacknowledged = seg_ack;
+    _snd.next = seg_ack;
+    _snd.recover = _snd.initial;
+
+    // The cookie carries the MSS of the SYN; no other option survives it
+    _option._remote_mss = mss;
+    init_from_options(th, opt_start, opt_end);
+
+    tcp_debug("syncookie: LISTEN -> ESTABLISHED\n");
+    _state = ESTABLISHED;
+    _connect_done.set_value();
+    if (p.len() > unsigned(th->data_offset * 4) || th->f_fin) {
+        input_handle_other_state(th, std::move(p));
+    }
+}
+
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
+    _option._nr_remote_sack_blocks = 0;
+    _option._ts_present = false;
+    if ((sack_enabled() || timestamps_enabled()) && th->data_offset * 4 > sizeof(tcp_hdr)) {
+        auto hdr = reinterpret_cast<uint8_t*>(p.get_header(0, th->data_offset * 4));
+        if (hdr) {
+            _option.parse(hdr + sizeof(tcp_hdr), hdr + th->data_offset * 4);
+        }
+    }
     p.trim_front(th->data_offset * 4);
     bool do_output = false;
     bool do_output_data = false;
@@ -1061,12 +1608,25 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
     auto seg_ack = th->ack;
     auto seg_len = p.len();
 
+    // RFC7323 R1: drop old duplicates whose timestamp is behind TS.Recent
+    if (paws_reject(th)) {
+        //<SEQ=SND.NXT><ACK=RCV.NXT><CTL=ACK>
+        return output();
+    }
+
     // 4.1 first check sequence number
     if (!segment_acceptable(seg_seq, seg_len)) {
         //<SEQ=SND.NXT><ACK=RCV.NXT><CTL=ACK>
         return output();
     }
 
+    // RFC7323 R3: remember the timestamp to echo
+    if (_option._ts_present && seg_seq <= _rcv.last_ack_sent
+            && int32_t(_option._remote_ts_val - _rcv.ts_recent) >= 0) {
+        _rcv.ts_recent = _option._remote_ts_val;
+        _rcv.ts_recent_stamp = clock_type::now();
+    }
+
     // In the following it is assumed that the segment is the idealized
     // segment that begins at RCV.NXT and does not exceed the window.
     if (seg_seq < _rcv.next) {
@@ -1170,6 +1730,9 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
         // ESTABLISHED STATE or
         // CLOSE_WAIT STATE: Do the same processing as for the ESTABLISHED state.
         if (in_state(ESTABLISHED | CLOSE_WAIT)){
+            if (sack_enabled()) {
+                update_sack_scoreboard();
+            }
             // If SND.UNA < SEG.ACK =< SND.NXT then, set SND.UNA <- SEG.ACK.
             if (_snd.unacknowledged < seg_ack && seg_ack <= _snd.next) {
                 // Remote ACKed data we sent
@@ -1200,11 +1763,19 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                     uint32_t smss = _snd.mss;
                     if (seg_ack > _snd.recover) {
                         tcp_debug("ack: full_ack\n");
-                        // Set cwnd to min (ssthresh, max(FlightSize, SMSS) + SMSS)
-                        _snd.cwnd = std::min(_snd.ssthresh, std::max(flight_size(), smss) + smss);
+                        _cc->on_recovery_exit(_snd, flight_size());
                         // Exit the fast recovery procedure
                         exit_fast_recovery();
                         set_retransmit_timer();
+                    } else if (sack_enabled()) {
+                        tcp_debug("ack: partial_ack\n");
+                        // RFC6675 Step (C): the scoreboard, not the
+                        // cumulative ACK, tells which segments to resend,
+                        // and pipe takes the place of window inflation.
+                        sack_retransmit();
+                        if (++_snd.partial_ack == 1) {
+                            start_retransmit_timer();
+                        }
                     } else {
                         tcp_debug("ack: partial_ack\n");
                         // Retransmit the first unacknowledged segment
@@ -1254,12 +1825,20 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                     // RFC5681 Step 3.1
                     // Send cwnd + 2 * smss per RFC3042
                     do_output_data = true;
+                } else if (_snd.dupacks == 3 && sack_enabled()) {
+                    enter_sack_recovery(seg_ack);
+                    do_output_data = true;
+                } else if (_snd.dupacks > 3 && sack_enabled()) {
+                    // RFC6675 Step (C): fill holes while pipe allows it,
+                    // then send new data
+                    sack_retransmit();
+                    do_output_data = true;
                 } else if (_snd.dupacks == 3) {
                     // RFC6582 Step 3.2
                     if (seg_ack - 1 > _snd.recover) {
                         _snd.recover = _snd.next - 1;
                         // RFC5681 Step 3.2
-                        _snd.ssthresh = std::max((flight_size() - _snd.limited_transfer) / 2, 2 * smss);
+                        _cc->on_congestion_event(_snd, flight_size() - _snd.limited_transfer);
                         fast_retransmit();
                     } else {
                         // Do not enter fast retransmit and do not reset ssthresh
@@ -1280,6 +1859,13 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                 update_window();
                 do_output_data = true;
             }
+            // RFC6675 Section 5: enter loss recovery as soon as the SACK
+            // scoreboard shows the first unacknowledged segment to be lost,
+            // even if fewer than three duplicate ACKs were counted.
+            if (sack_enabled() && _snd.dupacks < 3 && !_snd.data.empty() && _snd.data.front().lost) {
+                enter_sack_recovery(seg_ack);
+                do_output_data = true;
+            }
         }
         // FIN_WAIT_1 STATE
         if (in_state(FIN_WAIT_1)) {
@@ -1419,7 +2005,8 @@ packet tcp<InetTraits>::tcb::get_transmit_packet() {
         // FIXME: Info tap device the size of the splitted packet
         len = _tcp.hw_features().max_packet_len - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min;
     } else {
-        len = std::min(uint16_t(_tcp.hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min), _snd.mss);
+        // Leave room for the SACK option, if the segment will carry one
+        len = max_segment_payload() - _option.get_size(false, true);
     }
     can_send = std::min(can_send, len);
     // easy case: one small packet
@@ -1456,18 +2043,33 @@ packet tcp<InetTraits>::tcb::get_transmit_packet() {
 }
 
 template <typename InetTraits>
-void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
+void tcp<InetTraits>::tcb::output_one(unacked_segment* retransmit_seg) {
     if (in_state(CLOSED)) {
         return;
     }
 
-    packet p = data_retransmit ? _snd.data.front().p.share() : get_transmit_packet();
-    packet clone = p.share();  // early clone to prevent share() from calling packet::unuse_internal_data() on header.
-    uint16_t len = p.len();
+    bool data_retransmit = retransmit_seg;
     bool syn_on = syn_needs_on();
     bool ack_on = ack_needs_on();
 
+    if (syn_on) {
+        _option._nr_local_sack_blocks = 0;
+    } else {
+        fill_sack_blocks();
+    }
+
+    packet p = data_retransmit ? retransmit_seg->p.share() : get_transmit_packet();
+    packet clone = p.share();  // early clone to prevent share() from calling packet::unuse_internal_data() on header.
+    uint16_t len = p.len();
+
     auto options_size = _option.get_size(syn_on, ack_on);
+    bool tso = _tcp.hw_features().tx_tso && len > _snd.mss;
+    if (data_retransmit && !tso && len + options_size > max_segment_payload()) {
+        // The segment was sized before these SACK blocks were known; send
+        // it without them rather than exceed the MTU.
+        _option._nr_local_sack_blocks = 0;
+        options_size = _option.get_size(syn_on, ack_on);
+    }
     auto th = p.prepend_header<tcp_hdr>(options_size);
 
     th->src_port = _local_port;
@@ -1483,13 +2085,16 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
 
     tcp_seq seq;
     if (data_retransmit) {
-        seq = _snd.unacknowledged;
+        seq = retransmit_seg->seq;
     } else {
         seq = syn_on ? _snd.initial : _snd.next;
         _snd.next += len;
     }
     th->seq = seq;
     th->ack = _rcv.next;
+    if (ack_on) {
+        _rcv.last_ack_sent = _rcv.next;
+    }
     th->data_offset = (sizeof(*th) + options_size) / 4;
     th->window = _rcv.window >> _rcv.window_scale;
     th->checksum = 0;
@@ -1499,6 +2104,8 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
     th->f_fin = fin_on;
 
     // Add tcp options
+    _option._local_ts_val = ts_now();
+    _option._local_ts_ecr = _rcv.ts_recent;
     _option.fill(th, options_size);
     *th = hton(*th);
 
@@ -1520,8 +2127,8 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
         // segment length set to 0. All the rest is the same as for a TCP Tx
         // CSUM offload case.
         //
-        if (_tcp.hw_features().tx_tso && len > _snd.mss) {
-            oi.tso_seg_size = _snd.mss;
+        if (tso) {
+            oi.tso_seg_size = _snd.mss - options_size;
         } else {
             pseudo_hdr_seg_len = sizeof(*th) + options_size + len;
         }
@@ -1548,8 +2155,18 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
         auto now = clock_type::now();
         if (len) {
             unsigned nr_transmits = 0;
+            if (_cc->wants_rate_samples() && _snd.data.empty()) {
+                // Nothing in flight: the delivery rate interval starts now,
+                // not when data was last acknowledged
+                _snd.delivered_time = tcp_rate_sample::clock_type::now();
+            }
             _snd.data.emplace_back(unacked_segment{std::move(clone),
-                                   len, nr_transmits, now});
+                                   len, nr_transmits, now, seq});
+            if (_cc->wants_rate_samples()) {
+                auto& seg = _snd.data.back();
+                seg.delivered = _snd.delivered;
+                seg.delivered_time = _snd.delivered_time;
+            }
         }
         if (!_retransmit.armed()) {
             start_retransmit_timer(now);
@@ -1604,6 +2221,35 @@ void tcp<InetTraits>::tcb::connect() {
     do_syn_sent();
 }
 
+// The SYN leaves once the device delivers the flow to this shard or, if it
+// cannot, from a port whose hash points here
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::steer_and_connect(flow_steering_rule rule) {
+    _steering = true;
+    auto netif = _tcp._inet._inet.netif();
+    netif->steer_flow_here(rule).then([this, zis = this->shared_from_this(), netif, rule] (bool steered) {
+        _steering = false;
+        auto id = connid{_local_ip, _foreign_ip, _local_port, _foreign_port};
+        auto registered = _tcp._tcbs.find(id);
+        if (!registered || registered->get() != this) {
+            // Connecting was given up meanwhile
+            if (steered) {
+                netif->unsteer_flow(rule);
+            }
+            return;
+        }
+        if (steered) {
+            _steered = true;
+        } else {
+            _tcp._tcbs.erase(id);
+            id = _tcp.pick_connid(_local_ip, _foreign_ip, _foreign_port, false);
+            _local_port = id.local_port;
+            _tcp._tcbs.insert(id, this->shared_from_this());
+        }
+        connect();
+    });
+}
+
 template <typename InetTraits>
 packet tcp<InetTraits>::tcb::read() {
     packet p;
@@ -1737,6 +2383,7 @@ bool tcp<InetTraits>::tcb::merge_out_of_order() {
 
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::insert_out_of_order(tcp_seq seg, packet p) {
+    _rcv.last_out_of_order = seg;
     _rcv.out_of_order.merge(seg, std::move(p));
 }
 
@@ -1797,18 +2444,18 @@ void tcp<InetTraits>::tcb::retransmit() {
     // If there are unacked data, retransmit the earliest segment
     auto& unacked_seg = _snd.data.front();
 
-    // According to RFC5681
-    // Update ssthresh only for the first retransmit
-    uint32_t smss = _snd.mss;
-    if (unacked_seg.nr_transmits == 0) {
-        _snd.ssthresh = std::max(flight_size() / 2, 2 * smss);
-    }
+    // Reduce ssthresh (only for the first retransmit) and restart slow start
+    _cc->on_timeout(_snd, flight_size(), unacked_seg.nr_transmits == 0);
     // RFC6582 Step 4
     _snd.recover = _snd.next - 1;
-    // Start the slow start process
-    _snd.cwnd = smss;
     // End fast recovery
     exit_fast_recovery();
+    // RFC6675 Section 5.1: after a timeout every hole may be resent again;
+    // SACKed segments stay marked, the receiver still holds them.
+    for (auto& seg : _snd.data) {
+        seg.lost = false;
+        seg.retransmitted = false;
+    }
 
     if (unacked_seg.nr_transmits < _max_nr_retransmit) {
         unacked_seg.nr_transmits++;
@@ -1832,10 +2479,167 @@ void tcp<InetTraits>::tcb::fast_retransmit() {
     }
 }
 
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::update_sack_scoreboard() {
+    if (!_option._nr_remote_sack_blocks) {
+        return;
+    }
+    for (unsigned i = 0; i < _option._nr_remote_sack_blocks; ++i) {
+        auto left = make_seq(_option._remote_sack_blocks[i].left);
+        auto right = make_seq(_option._remote_sack_blocks[i].right);
+        // Ignore blocks outside of the data in flight, including D-SACK
+        // blocks (RFC2883) which report data below SND.UNA
+        if (right <= left || left < _snd.unacknowledged || right > _snd.next) {
+            continue;
+        }
+        for (auto& seg : _snd.data) {
+            auto seg_end = seg.seq + seg.p.len();
+            if (seg_end <= left) {
+                continue;
+            }
+            if (seg.seq >= right) {
+                break;
+            }
+            if (left <= seg.seq && seg_end <= right) {
+                seg.sacked = true;
+            }
+        }
+    }
+    // RFC6675 IsLost(): a segment is lost once more than
+    // (DupThresh - 1) * SMSS bytes above it have been SACKed
+    uint32_t sacked_above = 0;
+    for (auto it = _snd.data.rbegin(); it != _snd.data.rend(); ++it) {
+        if (it->sacked) {
+            sacked_above += it->p.len();
+        } else if (sacked_above > 2 * uint32_t(_snd.mss)) {
+            it->lost = true;
+        }
+    }
+}
+
+template <typename InetTraits>
+uint32_t tcp<InetTraits>::tcb::pipe() {
+    // RFC6675 SetPipe(): bytes in flight are those neither SACKed nor
+    // lost, plus retransmissions not yet acknowledged
+    uint32_t size = 0;
+    for (auto& seg : _snd.data) {
+        if (seg.sacked) {
+            continue;
+        }
+        if (!seg.lost) {
+            size += seg.p.len();
+        }
+        if (seg.retransmitted) {
+            size += seg.p.len();
+        }
+    }
+    return size;
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::enter_sack_recovery(tcp_seq seg_ack) {
+    // RFC6675 Step (4.1) - (4.3); as in RFC6582, do not reduce the window
+    // again for losses of the same window of data
+    if (seg_ack - 1 > _snd.recover) {
+        _snd.recover = _snd.next - 1;
+        _cc->on_congestion_event(_snd, flight_size() - _snd.limited_transfer);
+        _snd.cwnd = _snd.ssthresh;
+    }
+    _snd.dupacks = std::max(_snd.dupacks, uint16_t(3));
+    // The first unacknowledged segment is retransmitted regardless of pipe
+    auto& front = _snd.data.front();
+    if (!front.sacked && !front.retransmitted) {
+        front.lost = true;
+        front.retransmitted = true;
+        front.nr_transmits++;
+        ++_tcp._sack_retransmits;
+        retransmit_one(front);
+    }
+    sack_retransmit();
+    output();
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::sack_retransmit() {
+    uint32_t smss = _snd.mss;
+    auto in_pipe = pipe();
+    bool sent = false;
+    auto resend = [&] (unacked_segment& seg) {
+        seg.retransmitted = true;
+        seg.nr_transmits++;
+        in_pipe += seg.p.len();
+        ++_tcp._sack_retransmits;
+        retransmit_one(seg);
+        sent = true;
+    };
+    // RFC6675 NextSeg() rule 1: resend the segments known to be lost
+    for (auto& seg : _snd.data) {
+        if (in_pipe + smss > _snd.cwnd) {
+            break;
+        }
+        if (seg.lost && !seg.sacked && !seg.retransmitted) {
+            resend(seg);
+        }
+    }
+    // Rule 3: when no new data can go out instead, also resend holes that
+    // are below SACKed data but not yet known to be lost
+    bool can_send_new = _snd.unsent_len && _snd.next < _snd.unacknowledged + _snd.window;
+    if (!can_send_new) {
+        auto last_sacked = std::find_if(_snd.data.rbegin(), _snd.data.rend(),
+                [] (unacked_segment& seg) { return seg.sacked; });
+        for (auto it = _snd.data.begin(); it != last_sacked.base(); ++it) {
+            if (in_pipe + smss > _snd.cwnd) {
+                break;
+            }
+            if (!it->sacked && !it->retransmitted) {
+                resend(*it);
+            }
+        }
+    }
+    if (sent) {
+        output();
+    }
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::fill_sack_blocks() {
+    auto& opt = _option;
+    opt._nr_local_sack_blocks = 0;
+    if (!sack_enabled() || _rcv.out_of_order.map.empty()) {
+        return;
+    }
+    auto add = [&opt] (tcp_seq beg, tcp_seq end) {
+        opt._local_sack_blocks[opt._nr_local_sack_blocks++] = tcp_option::sack_block{beg.raw, end.raw};
+    };
+    // RFC2018: the first block must report the most recently received
+    // segment; the others follow in sequence order
+    auto recent = _rcv.out_of_order.map.end();
+    for (auto it = _rcv.out_of_order.map.begin(); it != _rcv.out_of_order.map.end(); ++it) {
+        auto end = it->first + it->second.len();
+        if (it->first <= _rcv.last_out_of_order && _rcv.last_out_of_order < end && _rcv.next < end) {
+            recent = it;
+            add(std::max(it->first, _rcv.next), end);
+            break;
+        }
+    }
+    for (auto it = _rcv.out_of_order.map.begin();
+            it != _rcv.out_of_order.map.end() && opt._nr_local_sack_blocks < opt.max_local_sack_blocks(); ++it) {
+        auto end = it->first + it->second.len();
+        if (it == recent || end <= _rcv.next) {
+            continue;
+        }
+        add(std::max(it->first, _rcv.next), end);
+    }
+}
+
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::update_rto(clock_type::time_point tx_time) {
+    update_rto(clock_type::now() - tx_time);
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::update_rto(clock_type::duration R) {
     // Update RTO according to RFC6298
-    auto R = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - tx_time);
     if (_snd.first_rto_sample) {
         _snd.first_rto_sample = false;
         // RTTVAR <- R/2
@@ -1851,24 +2655,32 @@ void tcp<InetTraits>::tcb::update_rto(clock_type::time_point tx_time) {
         _snd.srtt = _snd.srtt * 7 / 8 +  R / 8;
     }
     // RTO <- SRTT + max(G, K * RTTVAR)
-    _rto =  _snd.srtt + std::max(_rto_clk_granularity, 4 * _snd.rttvar);
+    _rto = std::chrono::duration_cast<std::chrono::milliseconds>(
+            _snd.srtt + std::max<clock_type::duration>(_rto_clk_granularity, 4 * _snd.rttvar));
 
-    // Make sure 1 sec << _rto << 60 sec
-    _rto = std::max(_rto, _rto_min);
+    // Make sure rto_min (1 sec by default) << _rto << 60 sec
+    _rto = std::max(_rto, _tcp._rto_min);
     _rto = std::min(_rto, _rto_max);
+
+    _cc->on_rtt_sample(R);
 }
 
 template <typename InetTraits>
-void tcp<InetTraits>::tcb::update_cwnd(uint32_t acked_bytes) {
-    uint32_t smss = _snd.mss;
-    if (_snd.cwnd < _snd.ssthresh) {
-        // In slow start phase
-        _snd.cwnd += std::min(acked_bytes, smss);
-    } else {
-        // In congestion avoidance phase
-        uint32_t round_up = 1;
-        _snd.cwnd += std::max(round_up, smss * smss / _snd.cwnd);
+bool tcp<InetTraits>::tcb::paws_reject(tcp_hdr* th) {
+    // RST segments are acceptable regardless of their timestamp
+    if (!timestamps_enabled() || !_option._ts_present || th->f_rst) {
+        return false;
+    }
+    if (int32_t(_option._remote_ts_val - _rcv.ts_recent) >= 0) {
+        return false;
     }
+    if (clock_type::now() - _rcv.ts_recent_stamp > _paws_idle_limit) {
+        // TS.Recent is too old to be compared against (RFC7323 5.5)
+        _rcv.ts_recent = _option._remote_ts_val;
+        _rcv.ts_recent_stamp = clock_type::now();
+        return false;
+    }
+    return true;
 }
 
 template <typename InetTraits>
@@ -1890,8 +2702,8 @@ tcp_seq tcp<InetTraits>::tcb::get_isn() {
     //   M is the 4 microsecond timer
     using namespace std::chrono;
     uint32_t hash[4];
-    hash[0] = _local_ip.ip;
-    hash[1] = _foreign_ip.ip;
+    hash[0] = std::hash<ipaddr>()(_local_ip);
+    hash[1] = std::hash<ipaddr>()(_foreign_ip);
     hash[2] = (_local_port << 16) + _foreign_port;
     hash[3] = _isn_secret.key[15];
     CryptoPP::Weak::MD5::Transform(hash, _isn_secret.key);
@@ -1937,7 +2749,7 @@ void tcp<InetTraits>::connection::close_write() {
 
 template <typename InetTraits>
 void tcp<InetTraits>::connection::shutdown_connect() {
-    if (_tcb->syn_needs_on()) {
+    if (_tcb->syn_needs_on() || _tcb->_steering) {
       _tcb->_connect_done.set_exception(tcp_refused_error());
       _tcb->cleanup();
     } else {
@@ -1950,7 +2762,7 @@ template <typename InetTraits>
 constexpr uint16_t tcp<InetTraits>::tcb::_max_nr_retransmit;
 
 template <typename InetTraits>
-constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_rto_min;
+constexpr std::chrono::hours tcp<InetTraits>::tcb::_paws_idle_limit;
 
 template <typename InetTraits>
 constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_rto_max;
@@ -20,14 +20,25 @@
  */
 
 #include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
 #include <gnutls/x509.h>
+#include <gnutls/abstract.h>
+#include <arpa/inet.h>
+#ifdef HAVE_KTLS
+#include <linux/tls.h>
+#endif
 
 #include <experimental/optional>
 #include <system_error>
+#include <utility>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
 
 #include "core/reactor.hh"
 #include "core/thread.hh"
 #include "core/sstring.hh"
+#include "core/scollectd.hh"
 #include "tls.hh"
 #include "stack.hh"
 
@@ -113,6 +124,361 @@ static void gtls_chk(int res) {
     }
 }
 
+static seastar::tls::handshake_stats& shard_handshake_stats() {
+    static thread_local seastar::tls::handshake_stats stats;
+    static thread_local bool registered = false;
+    if (!registered) {
+        registered = true;
+        auto regs = std::make_unique<scollectd::registrations>(scollectd::registrations({
+            scollectd::add_polled_metric(scollectd::type_instance_id("tls"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "full-handshakes")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, stats.full)),
+            scollectd::add_polled_metric(scollectd::type_instance_id("tls"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "resumed-handshakes")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, stats.resumed)),
+            scollectd::add_polled_metric(scollectd::type_instance_id("tls"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "failed-handshakes")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, stats.failed)),
+            scollectd::add_polled_metric(scollectd::type_instance_id("tls"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "kernel-tls-sessions")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, stats.kernel_tls)),
+            scollectd::add_polled_metric(scollectd::type_instance_id("tls"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "offloaded-key-operations")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, stats.offloaded)),
+            scollectd::add_polled_metric(scollectd::type_instance_id("tls"
+                    , scollectd::per_cpu_plugin_instance
+                    , "queue_length", "handshake-offload")
+                    , scollectd::make_typed(scollectd::data_type::GAUGE, stats.offload_queue_length)),
+        }));
+        // Unregister while the reactor is still around
+        engine().at_destroy([regs = std::move(regs)] {});
+    }
+    return stats;
+}
+
+seastar::tls::handshake_stats seastar::tls::get_handshake_stats() {
+    return shard_handshake_stats();
+}
+
+// Whether this shard's private key operations run on helper threads
+static thread_local bool handshake_offload = false;
+
+void seastar::tls::set_handshake_offload(unsigned nr_threads) {
+    handshake_offload = nr_threads != 0;
+#ifndef HAVE_OSV
+    engine().set_min_helper_threads(nr_threads);
+#endif
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+
+// The seastar threads running a handshake step whose private key
+// operations may be offloaded. Only these can wait for a helper thread
+// from inside gnutls.
+static thread_local std::unordered_set<const seastar::thread_context*> offload_threads;
+
+class offload_thread_registration {
+    const seastar::thread_context* _thread = seastar::thread_impl::get();
+public:
+    offload_thread_registration() {
+        offload_threads.insert(_thread);
+    }
+    ~offload_thread_registration() {
+        offload_threads.erase(_thread);
+    }
+};
+
+// A certificate's private key, handed to gnutls as an external key.
+// Called from a handshake step running in one of offload_threads, an
+// operation runs on a helper thread while the step's seastar::thread
+// waits; called from anywhere else, it runs inline.
+//
+// Nothing the helper thread touches is owned by the session: the work
+// holds a reference to the key, reads gnutls' input, which stays put
+// while the step waits, and writes into a buffer of the waiting thread.
+// Memory gnutls allocates on the helper thread is freed there too.
+class offloadable_privkey {
+    gnutls_privkey_t _key;
+public:
+    explicit offloadable_privkey(gnutls_privkey_t key) : _key(key) {}
+    offloadable_privkey(const offloadable_privkey&) = delete;
+    ~offloadable_privkey() {
+        gnutls_privkey_deinit(_key);
+    }
+    operator gnutls_privkey_t() const {
+        return _key;
+    }
+
+    // Wraps key, which is then owned by the result
+    static gnutls_privkey_t wrap(gnutls_privkey_t key) {
+        auto ref = new lw_shared_ptr<offloadable_privkey>(make_lw_shared<offloadable_privkey>(key));
+        gnutls_privkey_t ext;
+        auto res = gnutls_privkey_init(&ext);
+        if (res == 0) {
+            res = gnutls_privkey_import_ext4(ext, ref, &sign_data_fn, &sign_hash_fn,
+                    &decrypt_fn, &deinit_fn, &info_fn, GNUTLS_PRIVKEY_INFO_HAVE_SIGN_ALGO);
+            if (res < 0) {
+                gnutls_privkey_deinit(ext);
+            }
+        }
+        if (res < 0) {
+            delete ref;
+            gtls_chk(res);
+        }
+        return ext;
+    }
+private:
+    gnutls_pk_algorithm_t algorithm(unsigned* bits = nullptr) const {
+        return gnutls_pk_algorithm_t(gnutls_privkey_get_pk_algorithm(_key, bits));
+    }
+    // Bounds signatures, DER encoded ones included, and decrypted data
+    size_t max_output_size() const {
+        unsigned bits = 0;
+        algorithm(&bits);
+        return 2 * ((bits + 7) / 8) + 16;
+    }
+
+    template <typename Op>
+    static int run(void* userdata, gnutls_datum_t* out, Op op) {
+        auto& key = *static_cast<lw_shared_ptr<offloadable_privkey>*>(userdata);
+        if (!offload_threads.count(seastar::thread_impl::get())) {
+            return op(*key, out);
+        }
+        try {
+            auto max_size = key->max_output_size();
+            std::unique_ptr<unsigned char[]> buf(new unsigned char[max_size]);
+            auto& stats = shard_handshake_stats();
+            ++stats.offloaded;
+            ++stats.offload_queue_length;
+            auto n = engine().submit_to_helper_thread<int>([key, op, dst = buf.get(), max_size] {
+                gnutls_datum_t res;
+                auto r = op(*key, &res);
+                if (r < 0) {
+                    return r;
+                }
+                if (res.size > max_size) {
+                    r = GNUTLS_E_SHORT_MEMORY_BUFFER;
+                } else {
+                    std::copy_n(res.data, res.size, dst);
+                    r = res.size;
+                }
+                gnutls_free(res.data);
+                return r;
+            }).finally([] {
+                --shard_handshake_stats().offload_queue_length;
+            }).get0();
+            if (n < 0) {
+                return n;
+            }
+            out->data = static_cast<unsigned char*>(gnutls_malloc(n));
+            if (out->data == nullptr && n != 0) {
+                return GNUTLS_E_MEMORY_ERROR;
+            }
+            std::copy_n(buf.get(), n, out->data);
+            out->size = n;
+            return 0;
+        } catch (...) {
+            return GNUTLS_E_INTERNAL_ERROR;
+        }
+    }
+
+    static int sign_data_fn(gnutls_privkey_t, gnutls_sign_algorithm_t algo, void* userdata,
+            unsigned flags, const gnutls_datum_t* data, gnutls_datum_t* signature) {
+        return run(userdata, signature, [algo, flags, data] (gnutls_privkey_t key, gnutls_datum_t* out) {
+            return gnutls_privkey_sign_data2(key, algo, flags, data, out);
+        });
+    }
+    static int sign_hash_fn(gnutls_privkey_t, gnutls_sign_algorithm_t algo, void* userdata,
+            unsigned flags, const gnutls_datum_t* hash, gnutls_datum_t* signature) {
+        return run(userdata, signature, [algo, flags, hash] (gnutls_privkey_t key, gnutls_datum_t* out) {
+            return gnutls_privkey_sign_hash2(key, algo, flags, hash, out);
+        });
+    }
+    static int decrypt_fn(gnutls_privkey_t, void* userdata, const gnutls_datum_t* ciphertext,
+            gnutls_datum_t* plaintext) {
+        return run(userdata, plaintext, [ciphertext] (gnutls_privkey_t key, gnutls_datum_t* out) {
+            return gnutls_privkey_decrypt_data(key, 0, ciphertext, out);
+        });
+    }
+    static void deinit_fn(gnutls_privkey_t, void* userdata) {
+        delete static_cast<lw_shared_ptr<offloadable_privkey>*>(userdata);
+    }
+    static int info_fn(gnutls_privkey_t, unsigned flags, void* userdata) {
+        auto& key = **static_cast<lw_shared_ptr<offloadable_privkey>*>(userdata);
+        if (flags & GNUTLS_PRIVKEY_INFO_PK_ALGO_BITS) {
+            unsigned bits = 0;
+            key.algorithm(&bits);
+            return bits;
+        }
+        if (flags & GNUTLS_PRIVKEY_INFO_PK_ALGO) {
+            return key.algorithm();
+        }
+        if (flags & GNUTLS_PRIVKEY_INFO_HAVE_SIGN_ALGO) {
+            return gnutls_sign_supports_pk_algorithm(static_cast<gnutls_sign_algorithm_t>(GNUTLS_FLAGS_TO_SIGN_ALGO(flags)), key.algorithm());
+        }
+        return -1;
+    }
+};
+
+#endif
+
+#ifdef HAVE_KTLS
+
+// Cipher suites the kernel and gnutls may both lack
+#if GNUTLS_VERSION_NUMBER >= 0x030603 && defined(TLS_1_3_VERSION)
+#define SEASTAR_KTLS_TLS1_3
+#endif
+#if GNUTLS_VERSION_NUMBER >= 0x030408 && defined(TLS_CIPHER_CHACHA20_POLY1305)
+#define SEASTAR_KTLS_CHACHA20_POLY1305
+#endif
+
+// One direction of an established session, as the kernel takes it
+union kernel_tls_crypto_info {
+    tls_crypto_info info;
+    tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#ifdef SEASTAR_KTLS_CHACHA20_POLY1305
+    tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+};
+
+template <typename Info>
+static size_t fill_kernel_tls_crypto_info(Info& ci, uint16_t version, uint16_t cipher_type,
+        const gnutls_datum_t& iv, const gnutls_datum_t& key, const unsigned char* seq) {
+    constexpr size_t salt_size = sizeof(ci.salt);
+    // The TLS 1.2 GCM nonce is the implicit salt plus an explicit part,
+    // which gnutls starts at the sequence number; the others use the
+    // whole IV.
+    bool explicit_nonce = version == TLS_1_2_VERSION && salt_size != 0;
+    if (key.size != sizeof(ci.key) || iv.size != salt_size + (explicit_nonce ? 0 : sizeof(ci.iv))) {
+        return 0;
+    }
+    ci.info.version = version;
+    ci.info.cipher_type = cipher_type;
+    memcpy(ci.salt, iv.data, salt_size);
+    memcpy(ci.iv, explicit_nonce ? seq : iv.data + salt_size, sizeof(ci.iv));
+    memcpy(ci.key, key.data, sizeof(ci.key));
+    memcpy(ci.rec_seq, seq, sizeof(ci.rec_seq));
+    return sizeof(ci);
+}
+
+// Returns the size of the filled in struct, or 0 if the kernel cannot
+// take over this session
+static size_t get_kernel_tls_crypto_info(gnutls_session_t session, bool read, kernel_tls_crypto_info& ci) {
+    uint16_t version;
+    switch (gnutls_protocol_get_version(session)) {
+    case GNUTLS_TLS1_2:
+        version = TLS_1_2_VERSION;
+        break;
+#ifdef SEASTAR_KTLS_TLS1_3
+    case GNUTLS_TLS1_3:
+        version = TLS_1_3_VERSION;
+        break;
+#endif
+    default:
+        return 0;
+    }
+    gnutls_datum_t mac_key, iv, key;
+    unsigned char seq[8];
+    if (gnutls_record_get_state(session, read, &mac_key, &iv, &key, seq) < 0) {
+        return 0;
+    }
+    memset(&ci, 0, sizeof(ci));
+    switch (gnutls_cipher_get(session)) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        return fill_kernel_tls_crypto_info(ci.aes_gcm_128, version, TLS_CIPHER_AES_GCM_128, iv, key, seq);
+    case GNUTLS_CIPHER_AES_256_GCM:
+        return fill_kernel_tls_crypto_info(ci.aes_gcm_256, version, TLS_CIPHER_AES_GCM_256, iv, key, seq);
+#ifdef SEASTAR_KTLS_CHACHA20_POLY1305
+    case GNUTLS_CIPHER_CHACHA20_POLY1305:
+        return fill_kernel_tls_crypto_info(ci.chacha20_poly1305, version, TLS_CIPHER_CHACHA20_POLY1305, iv, key, seq);
+#endif
+    default:
+        return 0;
+    }
+}
+
+#endif
+
+// Server side cache of negotiated sessions, looked up by session id when
+// a client asks to resume one.  Entries are evicted oldest first.
+class tls_session_cache {
+    struct entry {
+        sstring data;
+        lowres_clock::time_point expiry;
+        uint64_t seq;
+    };
+    std::unordered_map<sstring, entry> _entries;
+    // Keys in insertion order, with the sequence number they were stored
+    // under; may still hold keys removed or stored again since
+    std::deque<std::pair<sstring, uint64_t>> _order;
+    uint64_t _next_seq = 0;
+    size_t _max_entries;
+    std::chrono::seconds _ttl;
+public:
+    tls_session_cache(size_t max_entries, std::chrono::seconds ttl)
+        : _max_entries(std::max(max_entries, size_t(1))), _ttl(ttl) {
+    }
+    void setup(gnutls_session_t session) {
+        gnutls_db_set_ptr(session, this);
+        gnutls_db_set_store_function(session, &store_fn);
+        gnutls_db_set_retrieve_function(session, &retrieve_fn);
+        gnutls_db_set_remove_function(session, &remove_fn);
+        gnutls_db_set_cache_expiration(session, _ttl.count());
+    }
+private:
+    static sstring to_sstring(const gnutls_datum_t& d) {
+        return sstring(reinterpret_cast<const char*>(d.data), d.size);
+    }
+    void store(sstring key, sstring data) {
+        while (_entries.size() >= _max_entries || _order.size() >= 2 * _max_entries) {
+            auto& oldest = _order.front();
+            auto i = _entries.find(oldest.first);
+            // Only the latest position of a key owns its entry
+            if (i != _entries.end() && i->second.seq == oldest.second) {
+                _entries.erase(i);
+            }
+            _order.pop_front();
+        }
+        auto seq = _next_seq++;
+        _entries[key] = entry{std::move(data), lowres_clock::now() + _ttl, seq};
+        _order.emplace_back(std::move(key), seq);
+    }
+    static int store_fn(void* ptr, gnutls_datum_t key, gnutls_datum_t data) {
+        static_cast<tls_session_cache*>(ptr)->store(to_sstring(key), to_sstring(data));
+        return 0;
+    }
+    static gnutls_datum_t retrieve_fn(void* ptr, gnutls_datum_t key) {
+        auto& self = *static_cast<tls_session_cache*>(ptr);
+        gnutls_datum_t res = { nullptr, 0 };
+        auto i = self._entries.find(to_sstring(key));
+        if (i == self._entries.end()) {
+            return res;
+        }
+        if (i->second.expiry < lowres_clock::now()) {
+            self._entries.erase(i);
+            return res;
+        }
+        auto& data = i->second.data;
+        res.data = static_cast<unsigned char*>(gnutls_malloc(data.size()));
+        if (res.data) {
+            std::copy(data.begin(), data.end(), res.data);
+            res.size = data.size();
+        }
+        return res;
+    }
+    static int remove_fn(void* ptr, gnutls_datum_t key) {
+        auto& self = *static_cast<tls_session_cache*>(ptr);
+        self._entries.erase(to_sstring(key));
+        return 0;
+    }
+};
+
 class seastar::tls::dh_params::impl : gnutlsobj {
     static gnutls_sec_param_t to_gnutls_level(level l) {
         switch (l) {
@@ -268,9 +634,42 @@ class seastar::tls::certificate_credentials::impl: public gnutlsobj {
     void set_x509_key(const blob& cert, const blob& key, x509_crt_format fmt) {
         blob_wrapper w1(cert);
         blob_wrapper w2(key);
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+        // The key goes in as an external key, whose operations handshakes
+        // can offload
+        gnutls_privkey_t real;
+        gtls_chk(gnutls_privkey_init(&real));
+        auto res = gnutls_privkey_import_x509_raw(real, &w2, gnutls_x509_crt_fmt_t(fmt), nullptr, 0);
+        if (res < 0) {
+            gnutls_privkey_deinit(real);
+            gtls_chk(res);
+        }
+        auto pkey = offloadable_privkey::wrap(real);
+        std::vector<gnutls_pcert_st> pcerts(16);
+        unsigned n = pcerts.size();
+        res = gnutls_pcert_list_import_x509_raw(pcerts.data(), &n, &w1, gnutls_x509_crt_fmt_t(fmt), 0);
+        if (res == GNUTLS_E_SHORT_MEMORY_BUFFER) {
+            pcerts.resize(n);
+            res = gnutls_pcert_list_import_x509_raw(pcerts.data(), &n, &w1, gnutls_x509_crt_fmt_t(fmt), 0);
+        }
+        if (res >= 0) {
+            // On success the credentials own the certificates and the key
+            res = gnutls_certificate_set_key(_creds, nullptr, 0, pcerts.data(), n, pkey);
+            if (res < 0) {
+                for (unsigned i = 0; i < n; ++i) {
+                    gnutls_pcert_deinit(&pcerts[i]);
+                }
+            }
+        }
+        if (res < 0) {
+            gnutls_privkey_deinit(pkey);
+            gtls_chk(res);
+        }
+#else
         gtls_chk(
                 gnutls_certificate_set_x509_key_mem(_creds, &w1, &w2,
                         gnutls_x509_crt_fmt_t(fmt)));
+#endif
     }
     void set_simple_pkcs12(const blob& b, x509_crt_format fmt,
             const sstring& password) {
@@ -290,10 +689,90 @@ class seastar::tls::certificate_credentials::impl: public gnutlsobj {
             _load_system_trust = false; // should only do once, for whatever reason
         });
     }
+    void enable_session_tickets(const blob& master_key, std::chrono::seconds rotation_interval) {
+        if (master_key.size() < 32) {
+            throw std::invalid_argument("Session ticket master key must be at least 32 bytes");
+        }
+        _ticket_master_key = master_key.to_string();
+        _ticket_rotation = std::max(rotation_interval, std::chrono::seconds(1));
+        _ticket_epoch = -1;
+    }
+    void enable_session_cache(size_t max_entries, std::chrono::seconds ttl) {
+        _session_cache = std::make_unique<tls_session_cache>(max_entries, ttl);
+    }
+    void set_session_resumption(bool enable) {
+        _client_resumption = enable;
+        if (!enable) {
+            _client_sessions.clear();
+        }
+    }
+    void set_kernel_tls(bool enable) {
+        _kernel_tls = enable;
+    }
+    void setup_server_session(gnutls_session_t session) {
+        if (_session_cache) {
+            _session_cache->setup(session);
+        }
+        if (!_ticket_master_key.empty()) {
+            gtls_chk(gnutls_session_ticket_enable_server(session, &current_ticket_key()));
+#if GNUTLS_VERSION_NUMBER >= 0x030604
+            // gnutls rotates the ticket key every three ticket lifetimes
+            gnutls_db_set_cache_expiration(session, std::max(_ticket_rotation / 3, std::chrono::seconds(1)).count());
+#endif
+        }
+    }
+    void setup_client_session(gnutls_session_t session, const sstring& key) {
+        if (!_client_resumption || key.empty()) {
+            return;
+        }
+        auto i = _client_sessions.find(key);
+        if (i != _client_sessions.end()) {
+            // If the server does not know the session anymore, we just get
+            // a full handshake
+            gnutls_session_set_data(session, i->second.data(), i->second.size());
+        }
+    }
+    void save_client_session(const sstring& key, sstring data) {
+        if (!_client_resumption || key.empty()) {
+            return;
+        }
+        if (_client_sessions.size() >= max_client_sessions && !_client_sessions.count(key)) {
+            _client_sessions.erase(_client_sessions.begin());
+        }
+        _client_sessions[key] = std::move(data);
+    }
 private:
     friend class credentials_builder;
     friend class session;
 
+    static constexpr size_t max_client_sessions = 1024;
+
+    // Derives the ticket key of the current rotation period from the
+    // master key, so that every shard (and every process sharing the
+    // master key) arrives at the same one.
+    const gnutls_datum_t& current_ticket_key() {
+#if GNUTLS_VERSION_NUMBER >= 0x030604
+        // gnutls derives the key of each period from the one we give it
+        // (TOTP), itself and the same way on every shard.  Rotating it
+        // here as well would invalidate tickets in between its periods.
+        int64_t epoch = 0;
+#else
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        int64_t epoch = std::chrono::duration_cast<std::chrono::seconds>(now).count() / _ticket_rotation.count();
+#endif
+        if (epoch != _ticket_epoch) {
+            uint8_t msg[8];
+            for (int i = 0; i < 8; ++i) {
+                msg[i] = uint8_t(uint64_t(epoch) >> (56 - 8 * i));
+            }
+            gtls_chk(gnutls_hmac_fast(GNUTLS_MAC_SHA512, _ticket_master_key.data(), _ticket_master_key.size(),
+                    msg, sizeof(msg), _ticket_key.data()));
+            _ticket_key_datum = { _ticket_key.data(), unsigned(_ticket_key.size()) };
+            _ticket_epoch = epoch;
+        }
+        return _ticket_key_datum;
+    }
+
     bool need_load_system_trust() const {
         return _load_system_trust;
     }
@@ -310,6 +789,17 @@ class seastar::tls::certificate_credentials::impl: public gnutlsobj {
     std::unique_ptr<tls::dh_params::impl> _dh_params;
     bool _load_system_trust = false;
     semaphore _system_trust_sem;
+    sstring _ticket_master_key;
+    std::chrono::seconds _ticket_rotation;
+    int64_t _ticket_epoch = -1;
+    // The size of a SHA512 digest happens to be the ticket key size
+    // gnutls expects
+    std::array<uint8_t, 64> _ticket_key;
+    gnutls_datum_t _ticket_key_datum;
+    std::unique_ptr<tls_session_cache> _session_cache;
+    bool _client_resumption = true;
+    std::unordered_map<sstring, sstring> _client_sessions;
+    bool _kernel_tls = false;
 };
 
 seastar::tls::certificate_credentials::certificate_credentials()
@@ -379,6 +869,14 @@ future<> seastar::tls::certificate_credentials::set_system_trust() {
     return _impl->set_system_trust();
 }
 
+void seastar::tls::certificate_credentials::set_session_resumption(bool enable) {
+    _impl->set_session_resumption(enable);
+}
+
+void seastar::tls::certificate_credentials::set_kernel_tls(bool enable) {
+    _impl->set_kernel_tls(enable);
+}
+
 seastar::tls::server_credentials::server_credentials(::shared_ptr<dh_params> dh)
     : server_credentials(*dh)
 {}
@@ -391,12 +889,35 @@ seastar::tls::server_credentials::server_credentials(server_credentials&&) noexc
 seastar::tls::server_credentials& seastar::tls::server_credentials::operator=(
         server_credentials&&) noexcept = default;
 
+void seastar::tls::server_credentials::enable_session_tickets(const blob& master_key,
+        std::chrono::seconds rotation_interval) {
+    _impl->enable_session_tickets(master_key, rotation_interval);
+}
+
+void seastar::tls::server_credentials::enable_session_cache(size_t max_entries,
+        std::chrono::seconds ttl) {
+    _impl->enable_session_cache(max_entries, ttl);
+}
+
+sstring seastar::tls::generate_session_ticket_key() {
+    gnutlsobj init;
+    gnutls_datum_t key;
+    gtls_chk(gnutls_session_ticket_key_generate(&key));
+    sstring res(reinterpret_cast<const char*>(key.data), key.size);
+    gnutls_memset(key.data, 0, key.size);
+    gnutls_free(key.data);
+    return res;
+}
+
 static const sstring dh_level_key = "dh_level";
 static const sstring x509_trust_key = "x509_trust";
 static const sstring x509_crl_key = "x509_crl";
 static const sstring x509_key_key = "x509_key";
 static const sstring pkcs12_key = "pkcs12";
 static const sstring system_trust = "system_trust";
+static const sstring session_tickets_key = "session_tickets";
+static const sstring session_cache_key = "session_cache";
+static const sstring kernel_tls_key = "kernel_tls";
 
 typedef std::basic_string<seastar::tls::blob::value_type, seastar::tls::blob::traits_type, std::allocator<seastar::tls::blob::value_type>> buffer_type;
 
@@ -434,6 +955,21 @@ future<> seastar::tls::credentials_builder::set_system_trust() {
     return make_ready_future();
 }
 
+void seastar::tls::credentials_builder::set_session_tickets(const blob& master_key, std::chrono::seconds rotation_interval) {
+    _blobs.erase(session_tickets_key);
+    _blobs.emplace(session_tickets_key, std::make_pair(master_key.to_string(), rotation_interval));
+}
+
+void seastar::tls::credentials_builder::set_session_cache(size_t max_entries, std::chrono::seconds ttl) {
+    _blobs.erase(session_cache_key);
+    _blobs.emplace(session_cache_key, std::make_pair(max_entries, ttl));
+}
+
+void seastar::tls::credentials_builder::set_kernel_tls(bool enable) {
+    _blobs.erase(kernel_tls_key);
+    _blobs.emplace(kernel_tls_key, enable);
+}
+
 void seastar::tls::credentials_builder::apply_to(certificate_credentials& creds) const {
     // Could potentially be templated down, but why bother...
     {
@@ -473,6 +1009,10 @@ void seastar::tls::credentials_builder::apply_to(certificate_credentials& creds)
     if (_blobs.count(system_trust)) {
         creds._impl->_load_system_trust = true;
     }
+    auto i = _blobs.find(kernel_tls_key);
+    if (i != _blobs.end()) {
+        creds.set_kernel_tls(boost::any_cast<bool>(i->second));
+    }
 }
 
 ::shared_ptr<seastar::tls::certificate_credentials> seastar::tls::credentials_builder::build_certificate_credentials() const {
@@ -488,12 +1028,27 @@ ::shared_ptr<seastar::tls::server_credentials> seastar::tls::credentials_builder
     }
     auto creds = ::make_shared<server_credentials>(dh_params(boost::any_cast<dh_params::level>(i->second)));
     apply_to(*creds);
+    i = _blobs.find(session_tickets_key);
+    if (i != _blobs.end()) {
+        auto v = boost::any_cast<std::pair<buffer_type, std::chrono::seconds>>(i->second);
+        creds->enable_session_tickets(v.first, v.second);
+    }
+    i = _blobs.find(session_cache_key);
+    if (i != _blobs.end()) {
+        auto v = boost::any_cast<std::pair<size_t, std::chrono::seconds>>(i->second);
+        creds->enable_session_cache(v.first, v.second);
+    }
     return creds;
 }
 
 namespace seastar {
 namespace tls {
 
+// Client connections whose sessions are remembered under a key made of
+// the server name and address
+future<::connected_socket> wrap_client(::shared_ptr<certificate_credentials>, ::connected_socket&&, sstring name, socket_address);
+future<::connected_socket> wrap_client_session(::shared_ptr<certificate_credentials>, ::connected_socket&&, sstring name, sstring resume_key);
+
 /**
  * Session wraps gnutls session, and is the
  * actual conduit for an TLS/SSL data flow.
@@ -511,10 +1066,10 @@ class session: public net::connected_socket_impl {
     };
 
     session(type t, ::shared_ptr<certificate_credentials> creds,
-            std::unique_ptr<net::connected_socket_impl> sock, sstring name = { })
+            std::unique_ptr<net::connected_socket_impl> sock, sstring name = { },
+            sstring resume_key = { })
             : _type(t), _sock(std::move(sock)), _creds(std::move(creds)), _hostname(
-                    std::move(name)), _in(_sock->source()), _out(_sock->sink()), _output_pending(
-                    make_ready_future<>()), _session([t] {
+                    std::move(name)), _resume_key(std::move(resume_key)), _in(_sock->source()), _out(_sock->sink()), _session([t] {
                 gnutls_session_t session;
                 gtls_chk(gnutls_init(&session, GNUTLS_NONBLOCK|uint32_t(t)));
                 return session;
@@ -525,6 +1080,9 @@ class session: public net::connected_socket_impl {
                         *_creds->_impl));
         if (_type == type::SERVER) {
             gnutls_certificate_server_set_request(_session, GNUTLS_CERT_IGNORE);
+            _creds->_impl->setup_server_session(_session);
+        } else {
+            _creds->_impl->setup_client_session(_session, _resume_key);
         }
         gnutls_transport_set_ptr(_session, this);
         gnutls_transport_set_vec_push_function(_session, &vec_push_wrapper);
@@ -537,9 +1095,9 @@ class session: public net::connected_socket_impl {
 #endif
     }
     session(type t, ::shared_ptr<certificate_credentials> creds,
-            ::connected_socket sock, sstring name = { })
+            ::connected_socket sock, sstring name = { }, sstring resume_key = { })
             : session(t, std::move(creds), net::get_impl::get(std::move(sock)),
-                    std::move(name)) {
+                    std::move(name), std::move(resume_key)) {
     }
 
     ~session() {
@@ -562,30 +1120,125 @@ class session: public net::connected_socket_impl {
         if (_type == type::CLIENT) {
             return make_ready_future<>(); // can ignore
         }
-        return handshake();
+        // Never offloaded: the session is already handed out, and a key
+        // operation must not let its records be sent meanwhile
+        return handshake(false);
+    }
+
+    future<> handshake(bool offload = handshake_offload) {
+        return futurize<future<>>::apply([this, offload] {
+            return do_handshake(offload);
+        }).finally([this] {
+            // Records we queued must reach the socket before the session is
+            // handed out, or dropped because the handshake failed
+            return wait_for_output();
+        }).then_wrapped([this] (future<> f) {
+            auto& stats = shard_handshake_stats();
+            if (f.failed()) {
+                ++stats.failed;
+                return f;
+            }
+            if (gnutls_session_is_resumed(_session)) {
+                ++stats.resumed;
+            } else {
+                ++stats.full;
+            }
+            maybe_save_client_session();
+            maybe_enable_kernel_tls();
+            return f;
+        });
+    }
+
+    // Hands record processing to the kernel, if allowed and possible.
+    // Called with the handshake done and its output flushed.
+    // Without kernel support at build time, the session stays in userspace.
+    void maybe_enable_kernel_tls() {
+#ifdef HAVE_KTLS
+        if (!_creds->_impl->_kernel_tls || _ktls_tx) {
+            return;
+        }
+        kernel_tls_crypto_info ci;
+        auto size = get_kernel_tls_crypto_info(_session, false, ci);
+        if (!size || !_sock->enable_kernel_tls(false, &ci, size)) {
+            return;
+        }
+        _ktls_tx = true;
+        ++shard_handshake_stats().kernel_tls;
+        // Records already read past the handshake never reach the kernel,
+        // and a client still waiting for its TLS 1.3 session ticket has
+        // to read it here. Both keep decrypting in userspace.
+        bool awaiting_ticket = _type == type::CLIENT && !_session_saved
+                && !_resume_key.empty() && _creds->_impl->_client_resumption;
+        if (!_input.empty() || gnutls_record_check_pending(_session) || awaiting_ticket) {
+            return;
+        }
+        size = get_kernel_tls_crypto_info(_session, true, ci);
+        if (size && _sock->enable_kernel_tls(true, &ci, size)) {
+            _ktls_rx = true;
+        }
+#endif
     }
 
-    future<> handshake() {
+    // Remembers the negotiated session, to resume it on reconnection
+    void maybe_save_client_session() {
+        if (_type != type::CLIENT || _session_saved || _resume_key.empty()) {
+            return;
+        }
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+        // TLS 1.3 tickets are only sent after the handshake, and arrive
+        // with the first records read
+        if (gnutls_protocol_get_version(_session) == GNUTLS_TLS1_3
+                && !(gnutls_session_get_flags(_session) & GNUTLS_SFLAGS_SESSION_TICKET)) {
+            return;
+        }
+#endif
+        _session_saved = true;
+        gnutls_datum_t data;
+        if (gnutls_session_get_data2(_session, &data) == 0) {
+            _creds->_impl->save_client_session(_resume_key, sstring(reinterpret_cast<const char*>(data.data), data.size));
+            gnutls_free(data.data);
+        }
+    }
+
+    future<> do_handshake(bool offload) {
         // maybe load system certificates before handshake, in case we
         // have not done so yet...
         if (_creds->_impl->need_load_system_trust()) {
-            return _creds->_impl->maybe_load_system_trust().then([this] {
-               return handshake();
+            return _creds->_impl->maybe_load_system_trust().then([this, offload] {
+               return do_handshake(offload);
+            });
+        }
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+        if (offload) {
+            // gnutls cannot suspend a handshake inside a private key
+            // callback, so the step runs in a seastar::thread, which the
+            // callback blocks instead while the operation is offloaded.
+            // The session outlives the step: whoever waits for handshake()
+            // owns it.
+            return seastar::async([this] {
+                offload_thread_registration reg;
+                return gnutls_handshake(_session);
+            }).then([this] (int res) {
+                return handshake_step_done(res, true);
             });
         }
-        auto res = gnutls_handshake(_session);
+#endif
+        return handshake_step_done(gnutls_handshake(_session), offload);
+    }
+
+    future<> handshake_step_done(int res, bool offload) {
         if (res < 0) {
             switch (res) {
             case GNUTLS_E_AGAIN:
                 // Could not send/recv data immediately.
                 // Ask gnutls which direction we are waiting for.
                 if (gnutls_record_get_direction(_session) == 0) {
-                    return wait_for_input().then([this] {
-                        return handshake();
+                    return wait_for_input().then([this, offload] {
+                        return do_handshake(offload);
                     });
                 } else {
-                    return wait_for_output().then([this] {
-                        return handshake();
+                    return wait_for_output().then([this, offload] {
+                        return do_handshake(offload);
                     });
                 }
 #if GNUTLS_VERSION_NUMBER >= 0x030406
@@ -618,13 +1271,21 @@ class session: public net::connected_socket_impl {
         });
     }
     future<> wait_for_output() {
-        // The future generated by sending.
-        auto f = std::move(*_output_pending);
-        _output_pending = {};
-        return f.handle_exception([this](auto ep) {
+        // The future of all queued sends.
+        _output_inflight = 0;
+        return std::exchange(_output_pending, make_ready_future<>()).handle_exception([this](auto ep) {
             _output_exception = std::move(ep);
         });
     }
+    // Waits for all queued sends, and reports if any of them failed
+    future<> flush_output() {
+        return wait_for_output().then([this] {
+            if (_output_exception) {
+                return make_exception_future<>(_output_exception);
+            }
+            return make_ready_future<>();
+        });
+    }
 
     static session * from_transport_ptr(gnutls_transport_ptr_t ptr) {
         return static_cast<session *>(ptr);
@@ -689,58 +1350,77 @@ class session: public net::connected_socket_impl {
         // (us) can send null+0 and thus cause a re-send
         // of the last encrypted packet attempted
         // (from the internal buffers in gnutls).
-        // So, to handle all the above, we keep track
-        // of how much we issued a send of,
-        // and then attempt to match it with next
-        // send request. If the data size match, we
-        // assume it is the re-send from higher up,
-        // that has properly waited for output future
-        // completion. In this case we can ignore the
-        // send and just consider it completed.
+        // So, we queue every record on the underlying
+        // sink and report it sent, as long as not too
+        // much is in flight. Once it is, we still queue
+        // the record, but report EAGAIN and remember its
+        // size. The next send request must then be the
+        // re-send from higher up, that has properly
+        // waited for output future completion, and we
+        // can just consider it completed.
 
         size_t n = 0;
         for (int i = 0; i < iovcnt; ++i) {
             n += iov[i].iov_len;
         }
+        if (_ktls_tx) {
+            // gnutls' send state went to the kernel, whatever it would
+            // write now (say, a TLS 1.3 key update) would be garbage
+            gnutls_transport_set_errno(_session, EIO);
+            return -1;
+        }
         // See above. If we have a pending send
         // the next time we reach this point, it
         // must be the re-send, otherwise we
         // have broken our state machine.
-        if (_out_expect == 0) {
-            scattered_message<char> msg;
-            for (int i = 0; i < iovcnt; ++i) {
-                msg.append(sstring(reinterpret_cast<const char *>(iov[i].iov_base), iov[i].iov_len));
+        if (_out_expect != 0) {
+            if (n != _out_expect) {
+                throw std::logic_error("State machine broken?");
             }
-            _output_exception = {};
-            _output_pending = _out.put(std::move(msg).release());
-            // Did we complete already?
-            if (_output_pending->available() && !_output_pending->failed()) {
-                return n;
+            _out_expect = 0;
+        } else if (!_output_exception) {
+            // gnutls reuses its buffers, so this is the one copy we make
+            temporary_buffer<char> buf(n);
+            auto dst = buf.get_write();
+            for (int i = 0; i < iovcnt; ++i) {
+                dst = std::copy_n(reinterpret_cast<const char *>(iov[i].iov_base), iov[i].iov_len, dst);
             }
-            if (_output_pending->failed()) {
-                _output_exception = _output_pending->get_exception();
+            net::fragment frag{buf.get_write(), buf.size()};
+            queue_output(net::packet(frag, buf.release()));
+            if (_output_inflight > max_output_inflight) {
+                // Let the IO complete and tell gnutls we could not
+                // complete. This will propagate the error code upwards to
+                // our higher level code.
+                _out_expect = n;
+                gnutls_transport_set_errno(_session, EAGAIN);
+                return -1;
             }
         }
         if (_output_exception) {
-            _output_pending = {};
-            _out_expect = 0;
             gnutls_transport_set_errno(_session, EIO);
             return -1;
         }
-        if (_out_expect != 0) {
-            assert(!_output_pending);
-            if (n != _out_expect) {
-                throw std::logic_error("State machine broken?");
+        return n;
+    }
+
+    // Sends are chained, so several records can be in flight while
+    // still reaching the underlying sink in order.
+    void queue_output(net::packet p) {
+        auto size = p.len();
+        if (_output_pending.available()) {
+            if (_output_pending.failed()) {
+                _output_exception = _output_pending.get_exception();
+                _output_pending = make_ready_future<>();
+                return;
             }
-            _out_expect = 0;
-            return n;
+            _output_inflight = 0;
+            _output_pending = _out.put(std::move(p));
+        } else {
+            _output_pending = _output_pending.then([out = &_out, p = std::move(p)] () mutable {
+                return out->put(std::move(p));
+            });
         }
-        // No? Let the IO complete and tell gnutls we could not
-        // complete. This will propagate the error code upwards to
-        // our higher level code.
-        _out_expect = n;
-        gnutls_transport_set_errno(_session, EAGAIN);
-        return -1;
+        _output_inflight += size;
     }
 
     operator gnutls_session_t() const {
@@ -786,7 +1466,7 @@ class session: public net::connected_socket_impl {
                 return handle_output_error(res);
             }
         }
-        return make_ready_future<>();
+        return flush_output();
     }
 
     future<> shutdown(gnutls_close_request_t how) {
@@ -794,9 +1474,16 @@ class session: public net::connected_socket_impl {
                 std::bind(&session::shutdown, this, how));
     }
     future<> shutdown_input() override {
+        if (_ktls_tx) {
+            return _sock->shutdown_input();
+        }
         return shutdown(GNUTLS_SHUT_RDWR);
     }
     future<> shutdown_output() override {
+        if (_ktls_tx) {
+            // The kernel sends the close_notify
+            return _sock->shutdown_output();
+        }
         return shutdown(GNUTLS_SHUT_WR);
     }
     void set_nodelay(bool nodelay) override {
@@ -820,7 +1507,9 @@ class session: public net::connected_socket_impl {
 
     // helper for sink
     future<> flush() {
-        return _out.flush();
+        return flush_output().then([this] {
+            return _out.flush();
+        });
     }
 private:
     class source_impl;
@@ -831,12 +1520,23 @@ class session: public net::connected_socket_impl {
     std::unique_ptr<net::connected_socket_impl> _sock;
     ::shared_ptr<certificate_credentials> _creds;
     const sstring _hostname;
+    // Identifies the server for client session resumption
+    const sstring _resume_key;
+    bool _session_saved = false;
+    // Record processing done by the kernel; rx implies tx
+    bool _ktls_tx = false;
+    bool _ktls_rx = false;
     data_source _in;
     data_sink _out;
 
     bool _eof = false;
 
-    std::experimental::optional<future<>> _output_pending;
+    // Bytes we let be in flight before pushing back on gnutls
+    static constexpr size_t max_output_inflight = 256 * 1024;
+
+    future<> _output_pending = make_ready_future<>();
+    // Queued since _output_pending was last seen resolved; may overestimate
+    size_t _output_inflight = 0;
     std::exception_ptr _output_exception;
     size_t _out_expect = 0;
     buf_type _input;
@@ -859,11 +1559,10 @@ class session::source_impl: public ::data_source_impl {
             avail = _session.in_avail();
         }
         if (avail != 0) {
-            // typically, unencrypted data can get smaller (padding),
-            // but not larger.
-            temporary_buffer<char> output(avail);
-            auto n = gnutls_record_recv(_session, output.get_write(),
-                    output.size());
+            // Take the decrypted record as gnutls holds it, rather than
+            // copying it out
+            gnutls_packet_t packet;
+            auto n = gnutls_record_recv_packet(_session, &packet);
             if (n < 0) {
                 switch (n) {
                 case GNUTLS_E_AGAIN:
@@ -879,7 +1578,14 @@ class session::source_impl: public ::data_source_impl {
                     return make_exception_future<temporary_buffer<char>>(std::system_error(n, glts_errorc));
                 }
             }
-            output.trim(n);
+            _session.maybe_save_client_session();
+            if (n == 0) {
+                return make_ready_future<temporary_buffer<char>>();
+            }
+            gnutls_datum_t data;
+            gnutls_packet_get(packet, &data, nullptr);
+            temporary_buffer<char> output(reinterpret_cast<char*>(data.data), data.size,
+                    make_deleter(deleter(), [packet] { gnutls_packet_deinit(packet); }));
             return make_ready_future<temporary_buffer<char>>(std::move(output));
         }
         if (_session.eof()) {
@@ -909,51 +1615,53 @@ class session::sink_impl: public ::data_sink_impl {
             : _session(s) {
     }
 private:
-    typedef net::fragment* frag_iter;
-
-    future<> put(net::packet p, frag_iter i, frag_iter e, size_t off = 0) {
-        while (i != e) {
-            auto ptr = i->base;
-            auto size = i->size;
-            while (off < size) {
-                // gnutls does not have a sendv. Why?...
-                auto res = gnutls_record_send(_session, ptr + off, size - off);
-
-                if (res < 0) {
-                    switch (res) {
-                    case GNUTLS_E_AGAIN:
-                        // See the session::put comments.
-                        // If underlying says EAGAIN, we've actually issued
-                        // a send, but must wait for completion.
-                        return _session.wait_for_output().then(
-                                [this, p = std::move(p), size, i, e, off]() mutable {
-                                    // re-send same buffers (gnutls internal)
-                                    auto check = gnutls_record_send(_session, nullptr, 0);
-                                    return this->put(std::move(p), i, e, off + check);
-                                });
-                    default:
-                        return _session.handle_output_error(res);
-                    }
-                }
-                off += res;
-            }
-            off = 0;
-            ++i;
+    // Small puts are packed into full records: data is corked in gnutls,
+    // and only encrypted and pushed once this much is buffered, or on
+    // flush().
+    size_t max_corked() const {
+        return 4 * gnutls_record_get_max_size(_session);
+    }
+
+    future<> uncork() {
+        auto res = gnutls_record_uncork(_session, 0);
+        if (res == GNUTLS_E_AGAIN) {
+            // See the session::vec_push comments. The record was
+            // queued, gnutls resends it from its buffers once we
+            // have waited.
+            return _session.wait_for_output().then([this] {
+                return uncork();
+            });
+        }
+        if (res < 0) {
+            return _session.handle_output_error(res);
         }
         return make_ready_future<>();
     }
 
     future<> flush() override {
-        return _session.flush();
+        return uncork().then([this] {
+            return _session.flush();
+        });
     }
     future<> put(net::packet p) override {
-        auto i = p.fragments().begin();
-        auto e = p.fragments().end();
-        return put(std::move(p), i, e);
+        gnutls_record_cork(_session);
+        for (auto& f : p.fragments()) {
+            // While corked, gnutls only buffers the data
+            auto res = gnutls_record_send(_session, f.base, f.size);
+            if (res < 0) {
+                return _session.handle_output_error(res);
+            }
+        }
+        if (gnutls_record_check_corked(_session) < max_corked()) {
+            return make_ready_future<>();
+        }
+        return uncork();
     }
 
     future<> close() override {
-        return _session.shutdown_output().then([this] {
+        return uncork().then([this] {
+            return _session.shutdown_output();
+        }).then([this] {
             return _session._out.close();
         });
     }
@@ -993,8 +1701,13 @@ class tls_socket_impl : public net::socket_impl {
             : _cred(cred), _name(std::move(name)), _socket(engine().net().socket()) {
     }
     virtual future<connected_socket> connect(socket_address sa, socket_address local, transport proto = transport::TCP) override {
-        return _socket.connect(sa, local, proto).then([cred = std::move(_cred), name = std::move(_name)](::connected_socket s) mutable {
-            return wrap_client(cred, std::move(s), std::move(name));
+        connect_options opts;
+        opts.proto = proto;
+        return connect_with_options(sa, local, opts);
+    }
+    virtual future<connected_socket> connect_with_options(socket_address sa, socket_address local, const connect_options& opts) override {
+        return _socket.connect(sa, local, opts).then([cred = std::move(_cred), name = std::move(_name), sa](::connected_socket s) mutable {
+            return wrap_client(cred, std::move(s), std::move(name), sa);
         });
     }
     virtual void shutdown() override {
@@ -1006,23 +1719,29 @@ class tls_socket_impl : public net::socket_impl {
 }
 
 data_source seastar::tls::session::source() {
+    if (_ktls_rx) {
+        return _sock->source();
+    }
     return data_source(std::make_unique<source_impl>(*this));
 }
 
 data_sink seastar::tls::session::sink() {
+    if (_ktls_tx) {
+        return _sock->sink();
+    }
     return data_sink(std::make_unique<sink_impl>(*this));
 }
 
 
 future<::connected_socket> seastar::tls::connect(::shared_ptr<certificate_credentials> cred, socket_address sa, sstring name) {
-    return engine().connect(sa).then([cred = std::move(cred), name = std::move(name)](::connected_socket s) mutable {
-        return wrap_client(cred, std::move(s), std::move(name));
+    return engine().connect(sa).then([cred = std::move(cred), name = std::move(name), sa](::connected_socket s) mutable {
+        return wrap_client(cred, std::move(s), std::move(name), sa);
     });
 }
 
 future<::connected_socket> seastar::tls::connect(::shared_ptr<certificate_credentials> cred, socket_address sa, socket_address local, sstring name) {
-    return engine().connect(sa, local).then([cred = std::move(cred), name = std::move(name)](::connected_socket s) mutable {
-        return wrap_client(cred, std::move(s), std::move(name));
+    return engine().connect(sa, local).then([cred = std::move(cred), name = std::move(name), sa](::connected_socket s) mutable {
+        return wrap_client(cred, std::move(s), std::move(name), sa);
     });
 }
 
@@ -1031,7 +1750,29 @@ seastar::socket seastar::tls::socket(::shared_ptr<certificate_credentials> cred,
 }
 
 future<::connected_socket> seastar::tls::wrap_client(::shared_ptr<certificate_credentials> cred, ::connected_socket&& s, sstring name) {
-    auto sess = std::make_unique<session>(session::type::CLIENT, std::move(cred), std::move(s), std::move(name));
+    // Without an address, only the server name identifies the server
+    auto resume_key = name;
+    return wrap_client_session(std::move(cred), std::move(s), std::move(name), std::move(resume_key));
+}
+
+future<::connected_socket> seastar::tls::wrap_client(::shared_ptr<certificate_credentials> cred, ::connected_socket&& s, sstring name, socket_address sa) {
+    char addr[INET6_ADDRSTRLEN] = {};
+    uint16_t port;
+    if (sa.u.sa.sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &sa.u.in6.sin6_addr, addr, sizeof(addr));
+        port = ntohs(sa.u.in6.sin6_port);
+    } else {
+        inet_ntop(AF_INET, &sa.u.in.sin_addr, addr, sizeof(addr));
+        port = ntohs(sa.u.in.sin_port);
+    }
+    // The server name is part of the key: a session is only resumed for
+    // the name it was verified against
+    auto resume_key = sprint("%s/%s:%d", name, addr, port);
+    return wrap_client_session(std::move(cred), std::move(s), std::move(name), std::move(resume_key));
+}
+
+future<::connected_socket> seastar::tls::wrap_client_session(::shared_ptr<certificate_credentials> cred, ::connected_socket&& s, sstring name, sstring resume_key) {
+    auto sess = std::make_unique<session>(session::type::CLIENT, std::move(cred), std::move(s), std::move(name), std::move(resume_key));
     auto f = sess->handshake();
     return f.then([sess = std::move(sess)]() mutable {
         ::connected_socket ssls(std::move(sess));
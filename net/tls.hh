@@ -22,6 +22,7 @@
 
 #include <experimental/string_view>
 #include <vector>
+#include <chrono>
 
 #include "core/future.hh"
 #include "core/sstring.hh"
@@ -144,6 +145,23 @@ namespace tls {
          */
         future<> set_system_trust();
 
+        /**
+         * Client connections made with these credentials remember the
+         * sessions they negotiated, and try to resume them when they
+         * reconnect to the same server (and server name).  On by default.
+         */
+        void set_session_resumption(bool);
+
+        /**
+         * Once the handshake is done, hands record encryption and
+         * decryption to the kernel (kTLS), so the connection reads and
+         * writes plain data on the socket.  Only the posix stack can do
+         * this, on kernels with the tls module and for AES-GCM and
+         * ChaCha20-Poly1305 ciphers; other sessions silently stay in
+         * userspace.  Off by default.
+         */
+        void set_kernel_tls(bool);
+
         // TODO add methods for certificate verification
     private:
         class impl;
@@ -174,8 +192,39 @@ namespace tls {
 
         server_credentials(const server_credentials&) = delete;
         server_credentials& operator=(const server_credentials&) = delete;
+
+        /**
+         * Lets clients resume sessions with tickets (RFC 5077).
+         *
+         * The ticket encryption key is derived from \c master_key and
+         * changes every \c rotation_interval, so credentials created on
+         * each shard from the same master key accept each other's tickets
+         * without talking to each other.  A ticket stops being accepted
+         * when the key it was encrypted with is rotated out.
+         *
+         * With gnutls 3.6.4 and later gnutls rotates the key itself, and
+         * tickets are issued for a third of \c rotation_interval, so a
+         * rotation only cuts short the tickets issued in the last third of
+         * a period.  Sessions in the session cache expire as early, too.
+         *
+         * \param master_key at least 32 bytes of secret random data, see
+         *                   generate_session_ticket_key()
+         */
+        void enable_session_tickets(const blob& master_key,
+                std::chrono::seconds rotation_interval = std::chrono::hours(12));
+        /**
+         * Keeps the sessions negotiated with these credentials, so that
+         * clients resuming by session id (rather than ticket) can skip the
+         * full handshake.  The cache belongs to this object, so it is
+         * per shard.
+         */
+        void enable_session_cache(size_t max_entries = 10000,
+                std::chrono::seconds ttl = std::chrono::hours(1));
     };
 
+    /** Returns a new random master key for session tickets */
+    sstring generate_session_ticket_key();
+
     /**
      * Intentionally "primitive", and more importantly, copyable
      * container for certificate credentials options.
@@ -197,6 +246,15 @@ namespace tls {
 
         future<> set_system_trust();
 
+        /** See server_credentials::enable_session_tickets() */
+        void set_session_tickets(const blob& master_key,
+                std::chrono::seconds rotation_interval = std::chrono::hours(12));
+        /** See server_credentials::enable_session_cache() */
+        void set_session_cache(size_t max_entries = 10000,
+                std::chrono::seconds ttl = std::chrono::hours(1));
+        /** See certificate_credentials::set_kernel_tls() */
+        void set_kernel_tls(bool);
+
         void apply_to(certificate_credentials&) const;
 
         ::shared_ptr<certificate_credentials> build_certificate_credentials() const;
@@ -206,6 +264,34 @@ namespace tls {
         std::multimap<sstring, boost::any> _blobs;
     };
 
+    /** Handshake counters of a shard, for client and server sessions */
+    struct handshake_stats {
+        /** Handshakes that negotiated a new session */
+        uint64_t full = 0;
+        /** Handshakes that resumed an earlier session */
+        uint64_t resumed = 0;
+        uint64_t failed = 0;
+        /** Sessions whose record processing went to the kernel */
+        uint64_t kernel_tls = 0;
+        /** Private key operations run on helper threads */
+        uint64_t offloaded = 0;
+        /** Private key operations waiting for, or running on, a helper thread */
+        uint64_t offload_queue_length = 0;
+    };
+
+    handshake_stats get_handshake_stats();
+
+    /**
+     * Runs the private key operations of this shard's handshakes, those
+     * using a key given to set_x509_key() or set_x509_key_file(), on
+     * \c nr_threads helper threads (shared with blocking system calls,
+     * see --syscall-threads) instead of on the reactor, so that a burst
+     * of new connections does not stall the established ones.  The rest
+     * of the handshake, and any renegotiation, stays on the reactor.
+     * 0, the default, runs them inline.
+     */
+    void set_handshake_offload(unsigned nr_threads);
+
     /**
      * Creates a TLS client connection using the default network stack and the
      * supplied credentials.
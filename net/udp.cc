@@ -20,12 +20,14 @@
  */
 
 #include "ip.hh"
+#include "ipv6.hh"
 #include "stack.hh"
+#include "core/future-util.hh"
 
 using namespace net;
 
 namespace net {
-namespace ipv4_udp_impl {
+namespace udp_impl {
 
 static inline
 ipv4_addr
@@ -65,15 +67,59 @@ class native_datagram : public udp_datagram_impl {
     }
 };
 
-class native_channel : public udp_channel_impl {
+class native_datagram6 : public udp_datagram_impl {
 private:
-    ipv4_udp& _proto;
-    ipv4_udp::registration _reg;
+    socket_address _src;
+    socket_address _dst;
+    uint16_t _dst_port;
+    packet _p;
+public:
+    native_datagram6(ipv6_address src, ipv6_address dst, packet p)
+            : _p(std::move(p)) {
+        udp_hdr* hdr = _p.get_header<udp_hdr>();
+        auto h = ntoh(*hdr);
+        _p.trim_front(sizeof(*hdr));
+        _src = src.to_sockaddr(h.src_port);
+        _dst = dst.to_sockaddr(h.dst_port);
+        _dst_port = h.dst_port;
+    }
+
+    virtual ipv4_addr get_src() override {
+        throw std::system_error(EAFNOSUPPORT, std::system_category());
+    };
+
+    virtual ipv4_addr get_dst() override {
+        throw std::system_error(EAFNOSUPPORT, std::system_category());
+    };
+
+    virtual socket_address get_src_address() override {
+        return _src;
+    }
+
+    virtual socket_address get_dst_address() override {
+        return _dst;
+    }
+
+    virtual uint16_t get_dst_port() override {
+        return _dst_port;
+    }
+
+    virtual packet& get_data() override {
+        return _p;
+    }
+};
+
+// The part of a channel that does not depend on the address family
+template <typename Proto>
+class native_channel_base : public udp_channel_impl {
+protected:
+    Proto& _proto;
+    typename Proto::registration _reg;
     bool _closed;
     lw_shared_ptr<udp_channel_state> _state;
 
 public:
-    native_channel(ipv4_udp &proto, ipv4_udp::registration reg, lw_shared_ptr<udp_channel_state> state)
+    native_channel_base(Proto &proto, typename Proto::registration reg, lw_shared_ptr<udp_channel_state> state)
             : _proto(proto)
             , _reg(reg)
             , _closed(false)
@@ -81,7 +127,7 @@ class native_channel : public udp_channel_impl {
     {
     }
 
-    ~native_channel()
+    ~native_channel_base()
     {
         if (!_closed)
             close();
@@ -91,11 +137,29 @@ class native_channel : public udp_channel_impl {
         return _state->_queue.pop_eventually();
     }
 
-    virtual future<> send(ipv4_addr dst, const char* msg) override {
-        return send(dst, packet::from_static_data(msg, strlen(msg)));
+    virtual future<std::vector<udp_datagram>> receive_batch(size_t max) override {
+        return _state->_queue.not_empty().then([this, max] {
+            std::vector<udp_datagram> datagrams;
+            datagrams.reserve(std::min(max, _state->_queue.size()));
+            while (!_state->_queue.empty() && datagrams.size() < max) {
+                datagrams.push_back(_state->_queue.pop());
+            }
+            return datagrams;
+        });
     }
 
-    virtual future<> send(ipv4_addr dst, packet p) override {
+    virtual bool is_closed() const {
+        return _closed;
+    }
+
+    virtual void close() override {
+        _reg.unregister();
+        _closed = true;
+    }
+
+protected:
+    template <typename Endpoint>
+    future<> do_send(Endpoint dst, packet p) {
         auto len = p.len();
         return _state->wait_for_send_buffer(len).then([this, dst, p = std::move(p), len] () mutable {
             p = packet(std::move(p), make_deleter([s = _state, len] { s->complete_send(len); }));
@@ -103,19 +167,100 @@ class native_channel : public udp_channel_impl {
         });
     }
 
-    virtual bool is_closed() const {
-        return _closed;
+    // Reserves send buffer space for as many datagrams as it can hold at
+    // a time, and releases it once all of them are gone.
+    template <typename Endpoint>
+    future<> do_send_batch(std::vector<std::pair<Endpoint, packet>> datagrams) {
+        return do_with(std::move(datagrams), size_t(0), [this] (auto& datagrams, size_t& done) {
+            return repeat([this, &datagrams, &done] {
+                if (done == datagrams.size()) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                auto end = done;
+                size_t len = 0;
+                do {
+                    len += datagrams[end++].second.len();
+                } while (end < datagrams.size()
+                        && len + datagrams[end].second.len() <= udp_channel_state::send_buffer_size);
+                return _state->wait_for_send_buffer(len).then([this, &datagrams, &done, end, len] {
+                    auto d = make_deleter([s = _state, len] { s->complete_send(len); });
+                    for (; done < end; ++done) {
+                        auto& dgram = datagrams[done];
+                        _proto.send(_reg.port(), dgram.first, packet(std::move(dgram.second), d.share()));
+                    }
+                    return stop_iteration::no;
+                });
+            });
+        });
+    }
+};
+
+class native_channel : public native_channel_base<ipv4_udp> {
+public:
+    using native_channel_base::native_channel_base;
+
+    virtual future<> send(ipv4_addr dst, const char* msg) override {
+        return send(dst, packet::from_static_data(msg, strlen(msg)));
     }
 
-    virtual void close() override {
-        _reg.unregister();
-        _closed = true;
+    virtual future<> send(ipv4_addr dst, packet p) override {
+        return do_send(dst, std::move(p));
+    }
+
+    virtual future<> send_batch(std::vector<std::pair<ipv4_addr, packet>> datagrams) override {
+        return do_send_batch(std::move(datagrams));
+    }
+
+    using udp_channel_impl::send;
+    using udp_channel_impl::send_batch;
+};
+
+class native_channel6 : public native_channel_base<ipv6_udp> {
+private:
+    static future<> unsupported() {
+        return make_exception_future<>(std::system_error(EAFNOSUPPORT, std::system_category()));
+    }
+public:
+    using native_channel_base::native_channel_base;
+
+    virtual future<> send(ipv4_addr dst, const char* msg) override {
+        return unsupported();
+    }
+
+    virtual future<> send(ipv4_addr dst, packet p) override {
+        return unsupported();
+    }
+
+    virtual future<> send_batch(std::vector<std::pair<ipv4_addr, packet>> datagrams) override {
+        return unsupported();
+    }
+
+    virtual future<> send(const socket_address& dst, packet p) override {
+        if (dst.u.sa.sa_family != AF_INET6) {
+            return unsupported();
+        }
+        if (p.len() > _proto.max_datagram_size()) {
+            return make_exception_future<>(std::system_error(EMSGSIZE, std::system_category()));
+        }
+        return do_send(dst, std::move(p));
+    }
+
+    virtual future<> send_batch(std::vector<std::pair<socket_address, packet>> datagrams) override {
+        for (auto&& d : datagrams) {
+            if (d.first.u.sa.sa_family != AF_INET6) {
+                return unsupported();
+            }
+            if (d.second.len() > _proto.max_datagram_size()) {
+                return make_exception_future<>(std::system_error(EMSGSIZE, std::system_category()));
+            }
+        }
+        return do_send_batch(std::move(datagrams));
     }
 };
 
-} /* namespace ipv4_udp_impl */
+} /* namespace udp_impl */
 
-using namespace net::ipv4_udp_impl;
+using namespace net::udp_impl;
 
 const int ipv4_udp::default_queue_size = 1024;
 
@@ -218,4 +363,111 @@ ipv4_udp::make_channel(ipv4_addr addr) {
     return udp_channel(std::make_unique<native_channel>(*this, registration(*this, bind_port), chan_state));
 }
 
+ipv6_udp::ipv6_udp(ipv6& inet)
+    : _inet_l4(inet)
+{
+    _inet_l4.register_packet_provider([this] {
+        std::experimental::optional<ipv6_traits::l4packet> l4p;
+        if (!_packetq.empty()) {
+            l4p = std::move(_packetq.front());
+            _packetq.pop_front();
+        }
+        return l4p;
+    });
+}
+
+bool ipv6_udp::forward(forward_hash& out_hash_data, packet& p, size_t off)
+{
+    auto uh = p.get_header<udp_hdr>(off);
+
+    if (uh) {
+        out_hash_data.push_back(uh->src_port);
+        out_hash_data.push_back(uh->dst_port);
+    }
+    return true;
+}
+
+size_t ipv6_udp::max_datagram_size() const
+{
+    return _inet_l4._inet.netif()->hw_features().mtu - ipv6_hdr_len_min - sizeof(udp_hdr);
+}
+
+void ipv6_udp::received(packet p, ipv6_address from, ipv6_address to)
+{
+    auto uh = p.get_header<udp_hdr>(0);
+    if (!uh) {
+        return;
+    }
+    auto h = ntoh(*uh);
+    auto len = h.len;
+    if (len < sizeof(udp_hdr) || len > p.len()) {
+        return;
+    }
+    p.trim_back(p.len() - len);
+    // The checksum is mandatory over IPv6 (RFC8200 section 8.1), so a zero
+    // one is as bad as a wrong one
+    checksummer csum;
+    ipv6_traits::udp_pseudo_header_checksum(csum, from, to, len);
+    csum.sum(p);
+    if (h.cksum == 0 || csum.get() != 0) {
+        return;
+    }
+    auto chan_it = _channels.find(h.dst_port);
+    if (chan_it != _channels.end()) {
+        chan_it->second->_queue.push(udp_datagram(std::make_unique<native_datagram6>(from, to, std::move(p))));
+    }
+}
+
+void ipv6_udp::send(uint16_t src_port, const socket_address& dst, packet &&p)
+{
+    auto to = ipv6_traits::address_of(dst);
+    auto hdr = p.prepend_header<udp_hdr>();
+    hdr->src_port = src_port;
+    hdr->dst_port = ipv6_traits::port_of(dst);
+    hdr->len = p.len();
+    *hdr = hton(*hdr);
+
+    // IPv6 has no checksum offload here (see ipv6::_hw_features)
+    checksummer csum;
+    ipv6_traits::udp_pseudo_header_checksum(csum, _inet_l4._inet.source_address(to), to, p.len());
+    csum.sum(p);
+    auto cksum = csum.get();
+    hdr->cksum = cksum ? cksum : 0xffff;
+
+    _inet_l4.get_l2_dst_address(to).then([this, to, p = std::move(p)] (ethernet_address e_dst) mutable {
+        _packetq.emplace_back(ipv6_traits::l4packet{to, std::move(p), e_dst, ip_protocol_num::udp});
+    }).handle_exception([] (auto ep) {});
+}
+
+uint16_t ipv6_udp::next_port(uint16_t port) {
+    return (port + 1) == 0 ? min_anonymous_port : port + 1;
+}
+
+udp_channel
+ipv6_udp::make_channel(uint16_t port) {
+    uint16_t bind_port;
+
+    if (port) {
+        if (_channels.count(port)) {
+            throw std::runtime_error("Address already in use");
+        }
+        bind_port = port;
+    } else {
+        auto starting_port = _next_anonymous_port;
+        while (_channels.count(_next_anonymous_port)) {
+            _next_anonymous_port = next_port(_next_anonymous_port);
+            if (starting_port == _next_anonymous_port) {
+                throw std::runtime_error("No free port");
+            }
+        }
+
+        bind_port = _next_anonymous_port;
+        _next_anonymous_port = next_port(_next_anonymous_port);
+    }
+
+    auto chan_state = make_lw_shared<udp_channel_state>(_queue_size);
+    _channels[bind_port] = chan_state;
+    return udp_channel(std::make_unique<native_channel6>(*this, registration(*this, bind_port), chan_state));
+}
+
 } /* namespace net */
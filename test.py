@@ -37,9 +37,20 @@ boost_tests = [
     'shared_ptr_test',
     'fileiotest',
     'packet_test',
+    'ip_frag_test',
     'tls_test',
     'rpc_test',
     'connect_test',
+    'page_cache_test',
+    'append_log_test',
+    'tcp_congestion_test',
+    'ipv6_test',
+    'native_tcp_test',
+    'flow_table_test',
+    'checksum_test',
+    'input_stream_test',
+    'udp_test',
+    'connection_pool_test',
 ]
 
 other_tests = [
@@ -0,0 +1,192 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/append_log.hh"
+#include "core/thread.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "test-utils.hh"
+#include <boost/range/irange.hpp>
+
+static sstring make_record(unsigned i) {
+    // Vary the size so that records straddle alignment boundaries.
+    return sstring(1 + (i * 37) % 3000, char('a' + i % 26)) + to_sstring(i);
+}
+
+static std::vector<sstring> replay(sstring prefix) {
+    std::vector<sstring> records;
+    replay_append_log(".", prefix, [&records] (temporary_buffer<char> data, append_log_position) {
+        records.emplace_back(data.get(), data.size());
+        return make_ready_future<>();
+    }).get();
+    return records;
+}
+
+static void check_log(sstring prefix, uint64_t segment_size) {
+    auto cfg = append_log_config();
+    cfg.directory = ".";
+    cfg.prefix = prefix;
+    cfg.segment_size = segment_size;
+    cfg.buffer_size = 16 << 10;
+    auto log = append_log::open(cfg).get0();
+    auto expected = std::vector<sstring>();
+    auto appends = std::vector<future<append_log_position>>();
+    for (unsigned i = 0; i < 500; ++i) {
+        auto rec = make_record(i);
+        expected.push_back(rec);
+        appends.push_back(log->append(rec.c_str(), rec.size()));
+    }
+    auto last = append_log_position{0, 0};
+    for (auto&& f : appends) {
+        auto pos = f.get0();
+        BOOST_REQUIRE(pos.segment_id > last.segment_id || pos.offset >= last.offset);
+        last = pos;
+    }
+    log->close().get();
+    BOOST_REQUIRE(replay(prefix) == expected);
+    log->remove_segments_before(std::numeric_limits<uint64_t>::max()).get();
+    remove_file(sprint("./%s-%016d.log", prefix, log->current_segment_id())).get();
+}
+
+SEASTAR_TEST_CASE(test_append_log_group_commit) {
+    return seastar::async([] {
+        check_log("append_log_test", 32 << 20);
+    });
+}
+
+SEASTAR_TEST_CASE(test_append_log_segment_rollover) {
+    return seastar::async([] {
+        check_log("append_log_rollover_test", 64 << 10);
+    });
+}
+
+SEASTAR_TEST_CASE(test_append_log_rejects_empty_record) {
+    return seastar::async([] {
+        auto cfg = append_log_config();
+        cfg.directory = ".";
+        cfg.prefix = "append_log_empty_test";
+        auto log = append_log::open(cfg).get0();
+        auto first = log->append("before", 6);
+        auto empty = log->append("", 0);
+        auto last = log->append("after", 5);
+        BOOST_REQUIRE_THROW(empty.get(), std::invalid_argument);
+        first.get();
+        last.get();
+        log->close().get();
+        BOOST_REQUIRE(replay(cfg.prefix) == (std::vector<sstring>{"before", "after"}));
+        log->remove_segments_before(std::numeric_limits<uint64_t>::max()).get();
+        remove_file(sprint("./%s-%016d.log", cfg.prefix, log->current_segment_id())).get();
+    });
+}
+
+// Counts the flushes of a segment, and holds them while asked to.
+class held_flush_file_impl : public file_impl {
+    file _file;
+    unsigned& _flushes;
+    semaphore& _hold;
+public:
+    held_flush_file_impl(file f, unsigned& flushes, semaphore& hold)
+            : _file(std::move(f)), _flushes(flushes), _hold(hold) {
+        _memory_dma_alignment = _file.memory_dma_alignment();
+        _disk_read_dma_alignment = _file.disk_read_dma_alignment();
+        _disk_write_dma_alignment = _file.disk_write_dma_alignment();
+    }
+    virtual future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len, const io_priority_class& pc) override {
+        return _file.dma_write(pos, reinterpret_cast<const char*>(buffer), len, pc);
+    }
+    virtual future<size_t> write_dma(uint64_t pos, std::vector<iovec> iov, const io_priority_class& pc) override {
+        return _file.dma_write(pos, std::move(iov), pc);
+    }
+    virtual future<size_t> read_dma(uint64_t pos, void* buffer, size_t len, const io_priority_class& pc) override {
+        return _file.dma_read(pos, reinterpret_cast<char*>(buffer), len, pc);
+    }
+    virtual future<size_t> read_dma(uint64_t pos, std::vector<iovec> iov, const io_priority_class& pc) override {
+        return _file.dma_read(pos, std::move(iov), pc);
+    }
+    virtual future<> flush() override {
+        ++_flushes;
+        return _hold.wait().then([this] {
+            _hold.signal();
+            return _file.flush();
+        });
+    }
+    virtual future<struct stat> stat() override {
+        return _file.stat();
+    }
+    virtual future<> truncate(uint64_t length) override {
+        return _file.truncate(length);
+    }
+    virtual future<> discard(uint64_t offset, uint64_t length) override {
+        return _file.discard(offset, length);
+    }
+    virtual future<> allocate(uint64_t position, uint64_t length) override {
+        return _file.allocate(position, length);
+    }
+    virtual future<uint64_t> size() override {
+        return _file.size();
+    }
+    virtual future<> close() override {
+        return _file.close();
+    }
+    virtual subscription<directory_entry> list_directory(std::function<future<> (directory_entry de)> next) override {
+        return _file.list_directory(std::move(next));
+    }
+};
+
+SEASTAR_TEST_CASE(test_append_log_appends_share_write_in_flight) {
+    return seastar::async([] {
+        unsigned flushes = 0;
+        semaphore hold(1);
+        auto cfg = append_log_config();
+        cfg.directory = ".";
+        cfg.prefix = "append_log_in_flight_test";
+        cfg.commit_window = std::chrono::microseconds(0);
+        cfg.segment_file_wrapper = [&] (file f) {
+            return file(make_shared<held_flush_file_impl>(std::move(f), flushes, hold));
+        };
+        auto log = append_log::open(cfg).get0();
+        hold.wait().get();
+        auto expected = std::vector<sstring>{make_record(0)};
+        auto appends = std::vector<future<append_log_position>>();
+        appends.push_back(log->append(expected.back().c_str(), expected.back().size()));
+        while (!flushes) {
+            sleep(std::chrono::milliseconds(1)).get();
+        }
+        // Each of these outlives its commit window while the first write
+        // is held
+        for (unsigned i = 1; i < 10; ++i) {
+            expected.push_back(make_record(i));
+            appends.push_back(log->append(expected.back().c_str(), expected.back().size()));
+            sleep(std::chrono::milliseconds(1)).get();
+        }
+        BOOST_REQUIRE_EQUAL(flushes, 1u);
+        hold.signal();
+        for (auto&& f : appends) {
+            f.get();
+        }
+        BOOST_REQUIRE_EQUAL(flushes, 2u);
+        log->close().get();
+        BOOST_REQUIRE(replay(cfg.prefix) == expected);
+        log->remove_segments_before(std::numeric_limits<uint64_t>::max()).get();
+        remove_file(sprint("./%s-%016d.log", cfg.prefix, log->current_segment_id())).get();
+    });
+}
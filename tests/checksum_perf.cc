@@ -0,0 +1,71 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Measures the throughput of each internet checksum implementation the
+// CPU supports, for a few typical packet sizes.
+
+#include "net/ip_checksum.hh"
+#include "core/print.hh"
+#include <chrono>
+#include <vector>
+
+using namespace net;
+
+int main(int ac, char** av) {
+    using clock = std::chrono::steady_clock;
+    static const auto test_time = std::chrono::milliseconds(500);
+    std::vector<char> data(65536);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = i * 7;
+    }
+    const std::pair<checksum_impl, const char*> impls[] = {
+        {checksum_impl::scalar, "scalar"},
+        {checksum_impl::sse2, "sse2"},
+        {checksum_impl::avx2, "avx2"},
+    };
+    for (auto&& impl : impls) {
+        if (!checksum_impl_supported(impl.first)) {
+            print("%-6s: not supported\n", impl.second);
+            continue;
+        }
+        set_checksum_impl(impl.first);
+        for (size_t len : {64, 576, 1460, 9000, 65536}) {
+            // Start one byte in, as a payload behind an odd-sized header would
+            auto buf = data.data() + 1;
+            len = std::min(len, data.size() - 1);
+            uint64_t iterations = 0;
+            uint16_t result = 0;
+            auto start = clock::now();
+            auto end = start;
+            do {
+                for (int i = 0; i < 1000; ++i) {
+                    result += ip_checksum(buf, len);
+                }
+                iterations += 1000;
+                end = clock::now();
+            } while (end - start < test_time);
+            auto secs = std::chrono::duration<double>(end - start).count();
+            print("%-6s %6d bytes: %8.2f GB/s %8.1f ns/checksum (%04x)\n", impl.second, len,
+                    iterations * len / secs / 1e9, secs * 1e9 / iterations, result);
+        }
+    }
+    return 0;
+}
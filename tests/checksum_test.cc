@@ -0,0 +1,104 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "net/ip_checksum.hh"
+#include <random>
+#include <vector>
+
+using namespace net;
+
+static const checksum_impl all_impls[] = {
+    checksum_impl::scalar, checksum_impl::sse2, checksum_impl::avx2,
+};
+
+// RFC1071, one 16-bit word at a time
+static uint16_t reference_checksum(const std::vector<uint8_t>& data) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < data.size(); i += 2) {
+        sum += data[i] << 8;
+        if (i + 1 < data.size()) {
+            sum += data[i + 1];
+        }
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons(~sum);
+}
+
+// Sums the data in fragments of random (possibly odd or empty) sizes,
+// starting at a random alignment
+static uint16_t fragmented_checksum(const std::vector<uint8_t>& data, std::default_random_engine& reng) {
+    std::uniform_int_distribution<size_t> frag_dist(0, 300);
+    std::uniform_int_distribution<size_t> align_dist(0, 31);
+    checksummer csum;
+    for (size_t pos = 0; pos < data.size(); ) {
+        auto len = std::min(frag_dist(reng), data.size() - pos);
+        auto align = align_dist(reng);
+        std::vector<char> buf(align + len);
+        std::copy_n(data.begin() + pos, len, buf.begin() + align);
+        csum.sum(buf.data() + align, len);
+        pos += len;
+    }
+    return csum.get();
+}
+
+BOOST_AUTO_TEST_CASE(checksum_matches_reference) {
+    auto saved = get_checksum_impl();
+    std::default_random_engine reng;
+    std::uniform_int_distribution<size_t> len_dist(0, 3000);
+    std::uniform_int_distribution<int> byte_dist(0, 255);
+    for (auto impl : all_impls) {
+        if (!checksum_impl_supported(impl)) {
+            BOOST_TEST_MESSAGE("skipping unsupported checksum implementation " << int(impl));
+            continue;
+        }
+        set_checksum_impl(impl);
+        for (int i = 0; i < 2000; ++i) {
+            std::vector<uint8_t> data(len_dist(reng));
+            // Runs of 0xff bytes exercise the carries
+            auto fill = i % 3 == 0 ? 0xff : -1;
+            for (auto& b : data) {
+                b = fill >= 0 ? fill : byte_dist(reng);
+            }
+            auto expected = reference_checksum(data);
+            BOOST_REQUIRE_EQUAL(ip_checksum(data.data(), data.size()), expected);
+            BOOST_REQUIRE_EQUAL(fragmented_checksum(data, reng), expected);
+        }
+    }
+    set_checksum_impl(saved);
+}
+
+BOOST_AUTO_TEST_CASE(checksum_large_buffer) {
+    auto saved = get_checksum_impl();
+    std::vector<uint8_t> data((1 << 20) + 7, 0xff);
+    data[12345] = 0x12;
+    auto expected = reference_checksum(data);
+    for (auto impl : all_impls) {
+        if (checksum_impl_supported(impl)) {
+            set_checksum_impl(impl);
+            BOOST_REQUIRE_EQUAL(ip_checksum(data.data(), data.size()), expected);
+        }
+    }
+    set_checksum_impl(saved);
+}
@@ -0,0 +1,187 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "net/api.hh"
+#include "net/connection_pool.hh"
+#include "test-utils.hh"
+
+using namespace seastar;
+using namespace std::chrono_literals;
+
+// Echoes 4 byte messages back, and counts the connections it accepted
+class echo_server {
+    server_socket _listener;
+    gate _gate;
+public:
+    unsigned accepted = 0;
+
+    explicit echo_server(socket_address sa) {
+        listen_options lo;
+        lo.reuse_address = true;
+        _listener = engine().listen(sa, lo);
+        with_gate(_gate, [this] {
+            return keep_doing([this] {
+                return _listener.accept().then([this] (connected_socket s, socket_address) {
+                    ++accepted;
+                    serve(std::move(s));
+                });
+            }).handle_exception([] (auto ep) {});
+        });
+    }
+    void serve(connected_socket s) {
+        struct conn {
+            connected_socket s;
+            input_stream<char> in;
+            output_stream<char> out;
+            conn(connected_socket cs) : s(std::move(cs)), in(s.input()), out(s.output()) {}
+        };
+        auto c = make_lw_shared<conn>(std::move(s));
+        with_gate(_gate, [c] {
+            return repeat([c] {
+                return c->in.read_exactly(4).then([c] (temporary_buffer<char> buf) {
+                    if (buf.size() != 4) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    return c->out.write(std::move(buf)).then([c] {
+                        return c->out.flush();
+                    }).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            }).then([c] {
+                return c->out.close();
+            }).handle_exception([c] (auto ep) {});
+        });
+    }
+    future<> stop() {
+        _listener.abort_accept();
+        return _gate.close();
+    }
+};
+
+static void ping(connection_pool::connection& c, const char* msg = "ping") {
+    c.out().write(msg, 4).get();
+    c.out().flush().get();
+    auto buf = c.in().read_exactly(4).get0();
+    BOOST_REQUIRE_EQUAL(sstring(buf.get(), buf.size()), sstring(msg));
+}
+
+SEASTAR_TEST_CASE(test_connection_pool_reuses_connections) {
+    return seastar::async([] {
+        auto sa = make_ipv4_address({"127.0.0.1", 10030});
+        echo_server server(sa);
+        connection_pool pool;
+        for (int i = 0; i < 10; ++i) {
+            auto c = pool.get(sa).get0();
+            ping(c);
+        }
+        BOOST_REQUIRE_EQUAL(pool.get_stats().connects, 1u);
+        BOOST_REQUIRE_EQUAL(pool.get_stats().reused, 9u);
+        {
+            // A broken connection is not handed out again
+            auto c = pool.get(sa).get0();
+            c.mark_broken();
+        }
+        {
+            auto c = pool.get(sa).get0();
+            ping(c);
+        }
+        BOOST_REQUIRE_EQUAL(pool.get_stats().connects, 2u);
+        // Connections still out at stop are closed when released
+        auto c = pool.get(sa).get0();
+        BOOST_REQUIRE_EQUAL(pool.get_stats().connects, 2u);
+        pool.stop().get();
+        {
+            auto released = std::move(c);
+        }
+        server.stop().get();
+        BOOST_REQUIRE_EQUAL(server.accepted, 2u);
+    });
+}
+
+SEASTAR_TEST_CASE(test_connection_pool_limits_connections_in_use) {
+    return seastar::async([] {
+        auto sa = make_ipv4_address({"127.0.0.1", 10031});
+        echo_server server(sa);
+        connection_pool_config cfg;
+        cfg.max_in_use = 2;
+        connection_pool pool(cfg);
+        auto c1 = pool.get(sa).get0();
+        auto c2 = pool.get(sa).get0();
+        auto f3 = pool.get(sa);
+        sleep(10ms).get();
+        BOOST_REQUIRE(!f3.available());
+        BOOST_REQUIRE_EQUAL(pool.get_stats().waits, 1u);
+        ping(c1);
+        {
+            auto released = std::move(c1);
+        }
+        auto c3 = f3.get0();
+        ping(c3);
+        ping(c2);
+        BOOST_REQUIRE_EQUAL(pool.get_stats().connects, 2u);
+        {
+            auto released2 = std::move(c2);
+            auto released3 = std::move(c3);
+        }
+        pool.stop().get();
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_connection_pool_warm_up_and_health_check) {
+    return seastar::async([] {
+        auto sa = make_ipv4_address({"127.0.0.1", 10032});
+        echo_server server(sa);
+        connection_pool_config cfg;
+        cfg.min_idle = 3;
+        cfg.health_check_interval = 10ms;
+        auto healthy = make_lw_shared<bool>(true);
+        connection_pool pool(cfg, {}, [healthy] (connection_pool::connection& c) {
+            return make_ready_future<bool>(*healthy);
+        });
+        pool.warm_up(sa).get();
+        BOOST_REQUIRE_EQUAL(pool.get_stats().connects, 3u);
+        {
+            auto c = pool.get(sa).get0();
+            ping(c);
+            BOOST_REQUIRE_EQUAL(pool.get_stats().reused, 1u);
+        }
+        // Failed checks close the idle connections, and the pool opens
+        // new ones to stay warm
+        *healthy = false;
+        sleep(50ms).get();
+        *healthy = true;
+        BOOST_REQUIRE_GT(pool.get_stats().health_check_failures, 0u);
+        sleep(50ms).get();
+        {
+            auto c = pool.get(sa).get0();
+            ping(c);
+        }
+        BOOST_REQUIRE_GT(pool.get_stats().connects, 3u);
+        pool.stop().get();
+        server.stop().get();
+    });
+}
@@ -24,6 +24,7 @@
 #include "core/semaphore.hh"
 #include "core/file.hh"
 #include "core/reactor.hh"
+#include "core/thread.hh"
 
 struct file_test {
     file_test(file&& f) : f(std::move(f)) {}
@@ -69,3 +70,37 @@ SEASTAR_TEST_CASE(test1) {
 }
 
 
+
+SEASTAR_TEST_CASE(test_dma_read_many) {
+    return seastar::async([] {
+        static constexpr size_t len = 64 * 4096 + 100;
+        auto f = open_file_dma("testfile.tmp", open_flags::rw | open_flags::create | open_flags::truncate).get0();
+        auto wbuf = allocate_aligned_buffer<unsigned char>(align_up(len, size_t(4096)), 4096);
+        for (size_t i = 0; i < len; ++i) {
+            wbuf.get()[i] = i * 7;
+        }
+        f.dma_write(0, wbuf.get(), align_up(len, size_t(4096))).get();
+        f.truncate(len).get();
+
+        auto ranges = std::vector<std::pair<uint64_t, size_t>>{
+            {8192 + 10, 100},       // merged with the next two
+            {3, 5000},
+            {4096 * 3 + 1, 10},
+            {40 * 4096, 4096},      // far away: separate read
+            {40 * 4096 + 1, 1},     // overlaps the previous one
+            {len - 50, 200},        // crosses EOF
+            {len + 4096, 10},       // past EOF
+        };
+        auto opts = dma_read_many_options();
+        opts.max_gap = 4096;
+        auto bufs = f.dma_read_many<unsigned char>(ranges, opts).get0();
+        BOOST_REQUIRE_EQUAL(bufs.size(), ranges.size());
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            auto pos = ranges[i].first;
+            auto expected = pos < len ? std::min(ranges[i].second, len - pos) : 0;
+            BOOST_REQUIRE_EQUAL(bufs[i].size(), expected);
+            BOOST_REQUIRE(std::equal(bufs[i].begin(), bufs[i].end(), wbuf.get() + pos));
+        }
+        f.close().get();
+    });
+}
@@ -0,0 +1,92 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "net/flow_table.hh"
+#include <unordered_map>
+#include <random>
+#include <memory>
+
+using namespace net;
+
+BOOST_AUTO_TEST_CASE(flow_table_basic) {
+    flow_table<int, std::string> t;
+    BOOST_REQUIRE(t.empty());
+    BOOST_REQUIRE(!t.find(1));
+    BOOST_REQUIRE(!t.erase(1));
+    BOOST_REQUIRE(t.insert(1, "one"));
+    BOOST_REQUIRE(!t.insert(1, "uno"));
+    BOOST_REQUIRE_EQUAL(*t.find(1), "one");
+    BOOST_REQUIRE_EQUAL(t.size(), 1u);
+    BOOST_REQUIRE(t.erase(1));
+    BOOST_REQUIRE(!t.find(1));
+    BOOST_REQUIRE(t.empty());
+}
+
+// All keys collide, so every lookup and removal walks a probe chain
+struct bad_hash {
+    size_t operator()(int x) const { return x & 1; }
+};
+
+BOOST_AUTO_TEST_CASE(flow_table_collisions) {
+    flow_table<int, int, bad_hash> t;
+    for (int i = 0; i < 100; ++i) {
+        BOOST_REQUIRE(t.insert(i, i * 10));
+    }
+    // Removing from the middle of a chain must keep the rest reachable
+    for (int i = 0; i < 100; i += 3) {
+        BOOST_REQUIRE(t.erase(i));
+    }
+    for (int i = 0; i < 100; ++i) {
+        auto v = t.find(i);
+        if (i % 3 == 0) {
+            BOOST_REQUIRE(!v);
+        } else {
+            BOOST_REQUIRE(v);
+            BOOST_REQUIRE_EQUAL(*v, i * 10);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(flow_table_random) {
+    flow_table<uint32_t, std::shared_ptr<uint32_t>> t;
+    std::unordered_map<uint32_t, uint32_t> ref;
+    std::default_random_engine reng;
+    std::uniform_int_distribution<uint32_t> key_dist(0, 2000);
+    for (int i = 0; i < 100000; ++i) {
+        auto k = key_dist(reng);
+        if (reng() % 2) {
+            BOOST_REQUIRE_EQUAL(t.insert(k, std::make_shared<uint32_t>(i)), ref.emplace(k, i).second);
+        } else {
+            BOOST_REQUIRE_EQUAL(t.erase(k), bool(ref.erase(k)));
+        }
+        BOOST_REQUIRE_EQUAL(t.size(), ref.size());
+    }
+    size_t seen = 0;
+    t.for_each([&] (uint32_t k, std::shared_ptr<uint32_t>& v) {
+        BOOST_REQUIRE_EQUAL(*v, ref.at(k));
+        ++seen;
+    });
+    BOOST_REQUIRE_EQUAL(seen, ref.size());
+}
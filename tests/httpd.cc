@@ -10,8 +10,13 @@
 #include "http/routes.hh"
 #include "http/exception.hh"
 #include "http/transformers.hh"
+#include "http/file_handler.hh"
 #include "core/future-util.hh"
+#include "core/thread.hh"
+#include "core/sleep.hh"
 #include "tests/test-utils.hh"
+#include <fstream>
+#include <dirent.h>
 
 using namespace httpd;
 
@@ -165,3 +170,97 @@ SEASTAR_TEST_CASE(test_transformer) {
     BOOST_REQUIRE_EQUAL(content, "hello-http-xyz-localhost");
     return make_ready_future<>();
 }
+
+// Collects what is written to it
+class string_data_sink_impl : public data_sink_impl {
+    sstring& _out;
+public:
+    explicit string_data_sink_impl(sstring& out) : _out(out) {}
+    virtual future<> put(net::packet data) override {
+        for (auto&& f : data.fragments()) {
+            _out.append(f.base, f.size);
+        }
+        return make_ready_future<>();
+    }
+    virtual future<> close() override {
+        return make_ready_future<>();
+    }
+};
+
+static unsigned open_fds() {
+    unsigned n = 0;
+    auto dir = opendir("/proc/self/fd");
+    while (readdir(dir)) {
+        ++n;
+    }
+    closedir(dir);
+    return n;
+}
+
+// Files are closed in the background
+static void wait_for_open_fds(unsigned fds) {
+    for (int i = 0; i < 1000 && open_fds() != fds; ++i) {
+        sleep(std::chrono::milliseconds(1)).get();
+    }
+    BOOST_REQUIRE_EQUAL(open_fds(), fds);
+}
+
+// A file of several stream buffers is sent whole, and closed with the reply
+SEASTAR_TEST_CASE(test_file_handler_streams_large_file) {
+    return seastar::async([] {
+        sstring name = "httpd_test_file.txt";
+        sstring content(sstring::initialized_later(), 3 * 64 * 1024 + 1001);
+        for (size_t i = 0; i < content.size(); ++i) {
+            content[i] = 'a' + i % 26;
+        }
+        {
+            std::ofstream f(name.c_str());
+            f.write(content.c_str(), content.size());
+        }
+        // Count after opening a file once, in case that sets up anything
+        // that stays open
+        open_file_dma(name, open_flags::ro).then([] (file f) {
+            return f.close();
+        }).get();
+        auto fds = open_fds();
+        file_handler handler(name, nullptr, false);
+        auto rep = handler.handle("/", std::make_unique<request>(), std::make_unique<reply>()).get0();
+        BOOST_REQUIRE_EQUAL(rep->content_length(), content.size());
+        sstring body;
+        output_stream<char> out(data_sink(std::make_unique<string_data_sink_impl>(body)), 8192);
+        rep->_body_writer(out).get();
+        out.close().get();
+        BOOST_REQUIRE(body == content);
+        rep.reset();
+        wait_for_open_fds(fds);
+        remove_file(name).get();
+    });
+}
+
+// The file is closed with the reply even when the body is never written:
+// the connection went away first, or the handler replaced the body
+SEASTAR_TEST_CASE(test_file_handler_closes_unwritten_file) {
+    return seastar::async([] {
+        sstring name = "httpd_test_file.txt";
+        {
+            std::ofstream f(name.c_str());
+            f << "never sent";
+        }
+        open_file_dma(name, open_flags::ro).then([] (file f) {
+            return f.close();
+        }).get();
+        auto fds = open_fds();
+        file_handler handler(name, nullptr, false);
+
+        auto rep = handler.handle("/", std::make_unique<request>(), std::make_unique<reply>()).get0();
+        BOOST_REQUIRE_EQUAL(open_fds(), fds + 1);
+        rep.reset();
+        wait_for_open_fds(fds);
+
+        rep = handler.handle("/", std::make_unique<request>(), std::make_unique<reply>()).get0();
+        rep->set_status(reply::status_type::internal_server_error, "failed");
+        BOOST_REQUIRE(!rep->_body_writer);
+        wait_for_open_fds(fds);
+        remove_file(name).get();
+    });
+}
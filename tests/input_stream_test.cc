@@ -0,0 +1,68 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "core/sstring.hh"
+#include "net/packet.hh"
+#include "net/packet-data-source.hh"
+#include "test-utils.hh"
+
+using namespace net;
+
+static sstring to_sstring(const packet& p) {
+    sstring res(sstring::initialized_later(), p.len());
+    auto i = res.begin();
+    for (auto& frag : p.fragments()) {
+        i = std::copy(frag.base, frag.base + frag.size, i);
+    }
+    return res;
+}
+
+// A stream that delivers the text in pieces of the given size
+static input_stream<char> make_stream(sstring text, size_t piece) {
+    packet p;
+    for (size_t pos = 0; pos < text.size(); pos += piece) {
+        p.append(packet(text.begin() + pos, std::min(piece, text.size() - pos)));
+    }
+    return as_input_stream(std::move(p));
+}
+
+SEASTAR_TEST_CASE(test_read_exactly_scattered) {
+    return seastar::async([] {
+        sstring text = "0123456789abcdefghijklmnopqrstuvwxyz";
+        for (size_t piece : {1, 3, 7, 36}) {
+            auto in = make_stream(text, piece);
+            auto p = in.read_exactly_scattered(10).get0();
+            BOOST_REQUIRE_EQUAL(to_sstring(p), "0123456789");
+            // The data is not copied: one fragment per piece it spans
+            BOOST_REQUIRE_EQUAL(p.nr_frags(), (10 + piece - 1) / piece);
+            // What is left of a piece stays buffered for the next read
+            BOOST_REQUIRE_EQUAL(to_sstring(in.read_exactly_scattered(6).get0()), "abcdef");
+            BOOST_REQUIRE_EQUAL(in.read_exactly(4).get0().size(), 4u);
+            // A short read at end of stream returns what there is
+            p = in.read_exactly_scattered(100).get0();
+            BOOST_REQUIRE_EQUAL(to_sstring(p), "klmnopqrstuvwxyz");
+            BOOST_REQUIRE(in.eof());
+            BOOST_REQUIRE_EQUAL(in.read_exactly_scattered(1).get0().len(), 0u);
+        }
+    });
+}
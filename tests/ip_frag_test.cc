@@ -0,0 +1,129 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "net/ip.hh"
+#include <random>
+
+using namespace net;
+
+static ipv4_frag_id make_id(uint16_t identification) {
+    return ipv4_frag_id{ipv4_address(0x0a000001), ipv4_address(0x0a000002), identification, uint8_t(ip_protocol_num::udp)};
+}
+
+// An IP packet carrying bytes [off, off + len) of the datagram payload
+static packet make_fragment(ip_hdr& h, const std::vector<char>& payload, uint32_t off, uint32_t len) {
+    h.ihl = 5;
+    bool mf = off + len < payload.size();
+    h.frag = (mf << uint8_t(ip_hdr::frag_bits::mf)) | (off >> uint8_t(ip_hdr::frag_bits::offset_shift));
+    std::vector<char> buf(sizeof(ip_hdr) + len);
+    std::copy_n(payload.begin() + off, len, buf.begin() + sizeof(ip_hdr));
+    return packet(buf.data(), buf.size());
+}
+
+static bool payload_equal(packet p, const std::vector<char>& payload) {
+    if (p.len() != payload.size()) {
+        return false;
+    }
+    p.linearize();
+    return std::equal(payload.begin(), payload.end(), p.frag(0).base);
+}
+
+BOOST_AUTO_TEST_CASE(test_reassembly_of_overlapping_fragments) {
+    std::default_random_engine rng(0);
+    for (int i = 0; i < 1000; ++i) {
+        ipv4_frag_table frags;
+        std::vector<char> payload(8 * (1 + rng() % 200));
+        for (auto& c : payload) {
+            c = rng();
+        }
+        auto& f = frags.get(make_id(1), ipv4_frag_table::clock_type::now());
+        while (!f.is_complete()) {
+            uint32_t off = 8 * (rng() % (payload.size() / 8));
+            uint32_t len = std::min<uint32_t>(payload.size() - off, 8 * (1 + rng() % 20));
+            ip_hdr h;
+            frags.add_mem(f.merge(h, off, make_fragment(h, payload, off, len)));
+        }
+        BOOST_REQUIRE(payload_equal(f.assemble(), payload));
+        frags.erase(f);
+        BOOST_REQUIRE(frags.empty());
+        BOOST_REQUIRE_EQUAL(frags.mem(), 0u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_oldest_datagram_is_evicted) {
+    ipv4_frag_table frags(4);
+    auto now = ipv4_frag_table::clock_type::now();
+    for (uint16_t id = 0; id < 4; ++id) {
+        frags.get(make_id(id), now);
+    }
+    // Another fragment of 0 does not make it younger, so 0 makes room for 4
+    frags.get(make_id(0), now);
+    frags.get(make_id(4), now);
+    BOOST_REQUIRE_EQUAL(frags.get_stats().evicted, 1u);
+    for (uint16_t id : {1, 2, 3, 4}) {
+        frags.get(make_id(id), now);
+    }
+    BOOST_REQUIRE_EQUAL(frags.get_stats().evicted, 1u);
+    frags.get(make_id(0), now);
+    BOOST_REQUIRE_EQUAL(frags.get_stats().evicted, 2u);
+}
+
+// A trickle of fragments does not keep a datagram alive past the timeout
+// from its first fragment
+BOOST_AUTO_TEST_CASE(test_timeout_runs_from_first_fragment) {
+    ipv4_frag_table frags;
+    auto start = ipv4_frag_table::clock_type::now();
+    std::vector<char> payload(16000);
+    for (int i = 0; i < 4; ++i) {
+        auto& f = frags.get(make_id(1), start + std::chrono::seconds(10 * i));
+        ip_hdr h;
+        uint32_t off = 1000 * i;
+        frags.add_mem(f.merge(h, off, make_fragment(h, payload, off, 1000)));
+    }
+    frags.expire(start + std::chrono::seconds(29), std::chrono::seconds(30));
+    BOOST_REQUIRE(!frags.empty());
+    frags.expire(start + std::chrono::seconds(31), std::chrono::seconds(30));
+    BOOST_REQUIRE(frags.empty());
+    BOOST_REQUIRE_EQUAL(frags.get_stats().timed_out, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_limit_and_timeout) {
+    ipv4_frag_table frags(16, 4000);
+    auto now = ipv4_frag_table::clock_type::now();
+    std::vector<char> payload(16000);
+    for (uint16_t id = 0; id < 8; ++id) {
+        auto& f = frags.get(make_id(id), now);
+        ip_hdr h;
+        frags.add_mem(f.merge(h, 0, make_fragment(h, payload, 0, 1000)));
+        frags.limit_mem();
+        BOOST_REQUIRE_LE(frags.mem(), 4000u);
+    }
+    BOOST_REQUIRE_GT(frags.get_stats().evicted, 0u);
+    BOOST_REQUIRE(!frags.empty());
+    frags.expire(now + std::chrono::seconds(31), std::chrono::seconds(30));
+    BOOST_REQUIRE(frags.empty());
+    BOOST_REQUIRE_EQUAL(frags.mem(), 0u);
+    BOOST_REQUIRE_GT(frags.get_stats().timed_out, 0u);
+}
@@ -0,0 +1,170 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "core/sleep.hh"
+#include "net/tcp-stack.hh"
+#include "tcp_loopback.hh"
+#include "test-utils.hh"
+
+using namespace net;
+using namespace std::chrono_literals;
+
+static std::vector<char> make_payload(size_t len) {
+    std::vector<char> data(len);
+    auto reng = std::default_random_engine();
+    auto rdist = std::uniform_int_distribution<int>(0, 255);
+    for (auto&& c : data) {
+        c = rdist(reng);
+    }
+    return data;
+}
+
+static sstring contents(packet& p) {
+    p.linearize();
+    return sstring(p.frag(0).base, p.frag(0).size);
+}
+
+// A solicitation is answered with an advertisement, and the node being
+// solicited learns the sender's address from it as well
+SEASTAR_TEST_CASE(test_ndp_resolves_neighbour) {
+    return seastar::async([] {
+        auto lo = tcp_loopback::create(tcp_loopback_link_config());
+        auto mac = lo->host0.inet6().get_ndp().lookup(tcp_loopback_host::address6(1)).get0();
+        BOOST_REQUIRE(mac.mac == lo->host1.hw_address().mac);
+        auto back = lo->host1.inet6().get_ndp().lookup(tcp_loopback_host::address6(0));
+        BOOST_REQUIRE(back.available());
+        BOOST_REQUIRE(back.get0().mac == lo->host0.hw_address().mac);
+        lo->stop().get();
+    });
+}
+
+// Neighbour discovery messages that crossed a router are ignored
+SEASTAR_TEST_CASE(test_ndp_ignores_routed_messages) {
+    return seastar::async([] {
+        auto cfg = tcp_loopback_link_config();
+        cfg.drop = [] (unsigned side, packet& p) {
+            // host1's advertisements arrive as if routed
+            auto eh = p.get_header<eth_hdr>();
+            auto iph = p.get_header<ipv6_hdr>(sizeof(eth_hdr));
+            if (side == 1 && ntoh(eh->eth_proto) == uint16_t(eth_protocol_num::ipv6)
+                    && iph && iph->next_header == uint8_t(ip_protocol_num::icmpv6)) {
+                iph->hop_limit = 64;
+            }
+            return false;
+        };
+        auto lo = tcp_loopback::create(cfg);
+        auto& ndp = lo->host0.inet6().get_ndp();
+        BOOST_REQUIRE_THROW(ndp.lookup(tcp_loopback_host::address6(1)).get(), ndp_timeout_error);
+        lo->stop().get();
+    });
+}
+
+// An address nobody answers for is solicited a bounded number of times,
+// after which the resolution is dropped
+SEASTAR_TEST_CASE(test_ndp_gives_up) {
+    return seastar::async([] {
+        auto lo = tcp_loopback::create(tcp_loopback_link_config());
+        auto& ndp = lo->host0.inet6().get_ndp();
+        auto nobody = ipv6_address("fd00::3");
+        BOOST_REQUIRE_THROW(ndp.lookup(nobody).get(), ndp_timeout_error);
+        sleep(4s).get();
+        auto sent = lo->link._stats.packets;
+        BOOST_REQUIRE_EQUAL(sent, 3u);
+        sleep(2s).get();
+        BOOST_REQUIRE_EQUAL(lo->link._stats.packets, sent);
+        // A later lookup starts over
+        auto again = ndp.lookup(nobody);
+        sleep(100ms).get();
+        BOOST_REQUIRE_EQUAL(lo->link._stats.packets, sent + 1);
+        BOOST_REQUIRE_THROW(again.get(), ndp_timeout_error);
+        lo->stop().get();
+    });
+}
+
+// The peers find each other with neighbour discovery before connecting
+SEASTAR_TEST_CASE(test_transfer_ipv6) {
+    return seastar::async([] {
+        tcp_loopback_link_config cfg;
+        cfg.bandwidth = 50 << 20;
+        auto lo = tcp_loopback::create(cfg);
+        {
+            auto data = make_payload(1 << 20);
+            uint16_t port = 10000;
+            auto ss = tcpv6_listen(lo->host0.tcp6(), port, listen_options());
+            auto accepted = ss.accept();
+            auto sock = tcpv6_socket(lo->host1.tcp6());
+            auto client = sock.connect(socket_address(tcp_loopback_host::address6(0).to_sockaddr(port))).get0();
+            auto server = std::get<0>(accepted.get());
+
+            auto writer = seastar::async([&client, &data] {
+                auto out = client.output();
+                out.write(data.data(), data.size()).get();
+                out.close().get();
+            });
+            auto in = server.input();
+            size_t received = 0;
+            while (auto buf = in.read().get0()) {
+                BOOST_REQUIRE_LE(received + buf.size(), data.size());
+                BOOST_REQUIRE(std::equal(buf.begin(), buf.end(), data.begin() + received));
+                received += buf.size();
+            }
+            writer.get();
+            BOOST_REQUIRE_EQUAL(received, data.size());
+        }
+        lo->stop().get();
+    });
+}
+
+// Datagrams are addressed with socket_address both ways, and the ones
+// IPv6 cannot carry are refused up front
+SEASTAR_TEST_CASE(test_udp_ipv6) {
+    return seastar::async([] {
+        auto lo = tcp_loopback::create(tcp_loopback_link_config());
+        {
+            uint16_t port = 5000;
+            auto server = lo->host0.inet6().get_udp().make_channel(port);
+            auto client = lo->host1.inet6().get_udp().make_channel(0);
+            auto to_server = socket_address(tcp_loopback_host::address6(0).to_sockaddr(port));
+
+            client.send(to_server, packet::from_static_data("ping", 4)).get();
+            auto req = server.receive().get0();
+            BOOST_REQUIRE_EQUAL(contents(req.get_data()), "ping");
+            auto from = req.get_src_address();
+            BOOST_REQUIRE_EQUAL(from.u.sa.sa_family, AF_INET6);
+            BOOST_REQUIRE(ipv6_traits::address_of(from) == tcp_loopback_host::address6(1));
+            BOOST_REQUIRE_EQUAL(req.get_dst_port(), port);
+            BOOST_REQUIRE_THROW(req.get_src(), std::system_error);
+
+            server.send(from, packet::from_static_data("pong", 4)).get();
+            auto reply = client.receive().get0();
+            BOOST_REQUIRE_EQUAL(contents(reply.get_data()), "pong");
+            BOOST_REQUIRE_EQUAL(ipv6_traits::port_of(reply.get_src_address()), port);
+
+            auto too_big = lo->host1.inet6().get_udp().max_datagram_size() + 1;
+            BOOST_REQUIRE_THROW(client.send(to_server, packet(std::vector<char>(too_big).data(), too_big)).get(),
+                    std::system_error);
+            BOOST_REQUIRE_THROW(client.send(ipv4_addr("10.0.0.1", port), "x").get(), std::system_error);
+        }
+        lo->stop().get();
+    });
+}
@@ -49,15 +49,34 @@ static auto make_input_stream(packet&& p) {
             std::make_unique<packet_data_source>(std::move(p))));
 }
 
+// Parses a command and, like the server, reads the value that follows it
+static future<> parse_command(input_stream<char>& is, parser_type& parser) {
+    parser.init();
+    return is.consume(parser).then([&is, &parser] {
+        if (parser.has_value()) {
+            return parser.read_value(is);
+        }
+        return make_ready_future<>();
+    });
+}
+
 static auto parse(packet&& p) {
     auto is = make_lw_shared<input_stream<char>>(make_input_stream(std::move(p)));
     auto parser = make_lw_shared<parser_type>();
-    parser->init();
-    return is->consume(*parser).then([is, parser] {
+    return parse_command(*is, *parser).then([is, parser] {
         return make_ready_future<lw_shared_ptr<parser_type>>(parser);
     });
 }
 
+static sstring blob(const packet& p) {
+    sstring res(sstring::initialized_later(), p.len());
+    auto i = res.begin();
+    for (auto& frag : p.fragments()) {
+        i = std::copy(frag.base, frag.base + frag.size, i);
+    }
+    return res;
+}
+
 auto for_each_fragment_size = [] (auto&& func) {
     auto buffer_sizes = { 100000, 1000, 100, 10, 5, 2, 1 };
     return do_for_each(buffer_sizes.begin(), buffer_sizes.end(), [func] (size_t buffer_size) {
@@ -76,7 +95,7 @@ SEASTAR_TEST_CASE(test_set_command_is_parsed) {
             BOOST_REQUIRE(p->_size == 3);
             BOOST_REQUIRE(p->_size_str == "3");
             BOOST_REQUIRE(p->_key.key() == "key");
-            BOOST_REQUIRE(p->_blob == "abc");
+            BOOST_REQUIRE(blob(p->_blob) == "abc");
         });
     });
 }
@@ -90,7 +109,7 @@ SEASTAR_TEST_CASE(test_empty_data_is_parsed) {
             BOOST_REQUIRE(p->_size == 0);
             BOOST_REQUIRE(p->_size_str == "0");
             BOOST_REQUIRE(p->_key.key() == "key");
-            BOOST_REQUIRE(p->_blob == "");
+            BOOST_REQUIRE(blob(p->_blob) == "");
         });
     });
 }
@@ -156,7 +175,7 @@ SEASTAR_TEST_CASE(test_parsing_of_split_data) {
                 BOOST_REQUIRE(p->_expiration == 222);
                 BOOST_REQUIRE(p->_size == 3);
                 BOOST_REQUIRE(p->_size_str == "3");
-                BOOST_REQUIRE(p->_blob == "asd");
+                BOOST_REQUIRE(blob(p->_blob) == "asd");
             });
         }).then([make_packet] {
             return parse(make_packet({"set key 11", "1 22", "2 3", "\r\nasd\r\n"}))
@@ -167,7 +186,7 @@ SEASTAR_TEST_CASE(test_parsing_of_split_data) {
                 BOOST_REQUIRE(p->_expiration == 222);
                 BOOST_REQUIRE(p->_size == 3);
                 BOOST_REQUIRE(p->_size_str == "3");
-                BOOST_REQUIRE(p->_blob == "asd");
+                BOOST_REQUIRE(blob(p->_blob) == "asd");
             });
         }).then([make_packet] {
             return parse(make_packet({"set k", "ey 11", "1 2", "2", "2 3", "\r\nasd\r\n"}))
@@ -178,7 +197,7 @@ SEASTAR_TEST_CASE(test_parsing_of_split_data) {
                 BOOST_REQUIRE(p->_expiration == 222);
                 BOOST_REQUIRE(p->_size == 3);
                 BOOST_REQUIRE(p->_size_str == "3");
-                BOOST_REQUIRE(p->_blob == "asd");
+                BOOST_REQUIRE(blob(p->_blob) == "asd");
             });
         }).then([make_packet] {
             return parse(make_packet({"set key 111 222 3\r\n", "asd\r\n"}))
@@ -189,7 +208,7 @@ SEASTAR_TEST_CASE(test_parsing_of_split_data) {
                 BOOST_REQUIRE(p->_expiration == 222);
                 BOOST_REQUIRE(p->_size == 3);
                 BOOST_REQUIRE(p->_size_str == "3");
-                BOOST_REQUIRE(p->_blob == "asd");
+                BOOST_REQUIRE(blob(p->_blob) == "asd");
             });
         }).then([make_packet] {
             return parse(make_packet({"set key 111 222 3\r\na", "sd\r\n"}))
@@ -200,7 +219,7 @@ SEASTAR_TEST_CASE(test_parsing_of_split_data) {
                 BOOST_REQUIRE(p->_expiration == 222);
                 BOOST_REQUIRE(p->_size == 3);
                 BOOST_REQUIRE(p->_size_str == "3");
-                BOOST_REQUIRE(p->_blob == "asd");
+                BOOST_REQUIRE(blob(p->_blob) == "asd");
             });
         }).then([make_packet] {
             return parse(make_packet({"set key 111 222 3\r\nasd", "\r\n"}))
@@ -211,7 +230,7 @@ SEASTAR_TEST_CASE(test_parsing_of_split_data) {
                 BOOST_REQUIRE(p->_expiration == 222);
                 BOOST_REQUIRE(p->_size == 3);
                 BOOST_REQUIRE(p->_size_str == "3");
-                BOOST_REQUIRE(p->_blob == "asd");
+                BOOST_REQUIRE(blob(p->_blob) == "asd");
             });
         }).then([make_packet] {
             return parse(make_packet({"set key 111 222 3\r\nasd\r", "\n"}))
@@ -222,7 +241,7 @@ SEASTAR_TEST_CASE(test_parsing_of_split_data) {
                 BOOST_REQUIRE(p->_expiration == 222);
                 BOOST_REQUIRE(p->_size == 3);
                 BOOST_REQUIRE(p->_size_str == "3");
-                BOOST_REQUIRE(p->_blob == "asd");
+                BOOST_REQUIRE(blob(p->_blob) == "asd");
             });
         });
     });
@@ -309,26 +328,49 @@ SEASTAR_TEST_CASE(test_multiple_requests_in_one_stream) {
     return for_each_fragment_size([] (auto make_packet) {
         auto p = make_shared<parser_type>();
         auto is = make_shared<input_stream<char>>(make_input_stream(make_packet({"set key1 1 1 5\r\ndata1\r\nset key2 2 2 6\r\ndata2+\r\n"})));
-        p->init();
-        return is->consume(*p).then([p] {
+        return parse_command(*is, *p).then([p] {
             BOOST_REQUIRE(p->_state == parser_type::state::cmd_set);
             BOOST_REQUIRE(p->_key.key() == "key1");
             BOOST_REQUIRE(p->_flags_str == "1");
             BOOST_REQUIRE(p->_expiration == 1);
             BOOST_REQUIRE(p->_size == 5);
             BOOST_REQUIRE(p->_size_str == "5");
-            BOOST_REQUIRE(p->_blob == "data1");
+            BOOST_REQUIRE(blob(p->_blob) == "data1");
         }).then([is, p] {
-            p->init();
-            return is->consume(*p).then([p, is] {
+            return parse_command(*is, *p).then([p, is] {
                 BOOST_REQUIRE(p->_state == parser_type::state::cmd_set);
                 BOOST_REQUIRE(p->_key.key() == "key2");
                 BOOST_REQUIRE(p->_flags_str == "2");
                 BOOST_REQUIRE(p->_expiration == 2);
                 BOOST_REQUIRE(p->_size == 6);
                 BOOST_REQUIRE(p->_size_str == "6");
-                BOOST_REQUIRE(p->_blob == "data2+");
+                BOOST_REQUIRE(blob(p->_blob) == "data2+");
             });
         });
     });
 }
+
+SEASTAR_TEST_CASE(test_large_value_is_parsed) {
+    std::string value;
+    for (int i = 0; i < 100000; ++i) {
+        value += char('a' + i % 26);
+    }
+    return for_each_fragment_size([value] (auto make_packet) {
+        return parse(make_packet({"set key 0 0 " + std::to_string(value.size()) + "\r\n", value, "\r\n"})).then([value] (auto p) {
+            BOOST_REQUIRE(p->_state == parser_type::state::cmd_set);
+            BOOST_REQUIRE(p->_size == value.size());
+            BOOST_REQUIRE(blob(p->_blob) == sstring(value.data(), value.size()));
+        });
+    });
+}
+
+// The value is handed over in the pieces it arrived in, not copied together
+SEASTAR_TEST_CASE(test_value_shares_received_buffers) {
+    auto is = make_shared<input_stream<char>>(make_input_stream(make_packet({"set key 0 0 10\r\n", "abcde", "fghij", "\r\n"}, 100)));
+    auto p = make_shared<parser_type>();
+    return parse_command(*is, *p).then([is, p] {
+        BOOST_REQUIRE(p->_state == parser_type::state::cmd_set);
+        BOOST_REQUIRE_EQUAL(p->_blob.nr_frags(), 2u);
+        BOOST_REQUIRE(blob(p->_blob) == "abcdefghij");
+    });
+}
@@ -171,6 +171,17 @@ class TcpSpecificTests(MemcacheTest):
             self.assertEqual(conn('get key\r\n'), b'VALUE key 0 5\r\nhello\r\nEND\r\n')
             self.assertEqual(conn('delete key\r\n'), b'DELETED\r\n')
 
+    def test_too_large_value_is_rejected(self):
+        value = b'x' * (2 * 1024 * 1024)
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.settimeout(5)
+        s.connect(server_addr)
+        # The value is skipped, and the command after it still served
+        s.sendall(b'set key 0 0 %d\r\n' % len(value) + value + b'\r\nget key\r\n')
+        s.shutdown(socket.SHUT_WR)
+        self.assertEqual(recv_all(s), b'SERVER_ERROR object too large for cache\r\nEND\r\n')
+        s.close()
+
     def test_flush_all_no_reply(self):
         self.assertEqual(call('flush_all noreply\r\n'), b'')
 
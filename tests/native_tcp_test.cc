@@ -0,0 +1,461 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "core/sleep.hh"
+#include "net/tcp-stack.hh"
+#include "tcp_loopback.hh"
+#include "test-utils.hh"
+#include <set>
+
+using namespace net;
+using namespace std::chrono_literals;
+
+// Tests of the native TCP stack's connection handling, run between the two
+// hosts of a tcp_loopback.
+
+// A connection that arrives while the backlog is full gets a SYN cookie, and
+// is accepted if there is room by the time the peer's ACK returns it
+SEASTAR_TEST_CASE(test_syncookies) {
+    return seastar::async([] {
+        tcp_loopback_link_config cfg;
+        cfg.delay = 20ms;
+        auto lo = tcp_loopback::create(cfg);
+        {
+            uint16_t port = 10000;
+            auto ss = lo->host0.tcp().listen(port, 1);
+            auto addr = make_ipv4_address(ipv4_addr(tcp_loopback_host::address(0).ip, port));
+            auto c1 = lo->host1.tcp().connect(addr);
+            c1.connected().get();
+            // The first connection fills the backlog; make room after the SYN
+            // of the second one arrived, but before its ACK does
+            auto c2 = lo->host1.tcp().connect(addr);
+            sleep(30ms).get();
+            auto s1 = ss.accept().get0();
+            c2.connected().get();
+            auto s2 = ss.accept().get0();
+            c2.send(packet::from_static_data("hello", 5)).get();
+            s2.wait_for_data().get();
+            auto p = s2.read();
+            p.linearize();
+            BOOST_REQUIRE_EQUAL(sstring(p.fragments()[0].base, p.len()), "hello");
+        }
+        lo->stop().get();
+    });
+}
+
+// A pure ACK is never retransmitted, so a cookie returned while the backlog
+// is still full resets the connection instead of leaving the peer hanging
+SEASTAR_TEST_CASE(test_syncookie_reset_when_backlog_full) {
+    return seastar::async([] {
+        auto lo = tcp_loopback::create(tcp_loopback_link_config());
+        {
+            uint16_t port = 10000;
+            auto ss = lo->host0.tcp().listen(port, 1);
+            auto addr = make_ipv4_address(ipv4_addr(tcp_loopback_host::address(0).ip, port));
+            auto c1 = lo->host1.tcp().connect(addr);
+            c1.connected().get();
+            auto c2 = lo->host1.tcp().connect(addr);
+            c2.connected().get();
+            BOOST_REQUIRE_THROW(c2.wait_for_data().get(), std::system_error);
+            // The connection that fit is unaffected
+            auto s1 = ss.accept().get0();
+            c1.send(packet::from_static_data("hello", 5)).get();
+            s1.wait_for_data().get();
+            BOOST_REQUIRE_EQUAL(s1.read().len(), 5u);
+        }
+        lo->stop().get();
+    });
+}
+
+// Loses every other data segment over a stretch of one window, leaving
+// several holes.  SACK tells the sender about all of them at once, so it
+// repairs them in about one round trip rather than one round trip each.
+SEASTAR_TEST_CASE(test_sack_repairs_several_holes_per_rtt) {
+    return seastar::async([] {
+        static constexpr unsigned nr_holes = 6;
+        struct holes {
+            unsigned segments = 0;
+            // Sequence numbers dropped and not sent again yet
+            std::set<uint32_t> missing;
+            steady_clock_type::time_point first_drop;
+            steady_clock_type::time_point repaired;
+        };
+        auto h = std::make_shared<holes>();
+        tcp_loopback_link_config cfg;
+        cfg.delay = 20ms;
+        // One segment per frame, so that the holes are the size of one
+        cfg.sw_offloads = false;
+        cfg.drop = [h] (unsigned side, packet& p) {
+            if (side != 0 || ntoh(*p.get_header<eth_hdr>()).eth_proto != uint16_t(eth_protocol_num::ipv4)) {
+                return false;
+            }
+            auto iph = ntoh(*p.get_header<ip_hdr>(sizeof(eth_hdr)));
+            if (iph.ip_proto != uint8_t(ip_protocol_num::tcp)) {
+                return false;
+            }
+            auto th = ntoh(*p.get_header<tcp_hdr>(sizeof(eth_hdr) + iph.ihl * 4));
+            if (iph.len == iph.ihl * 4 + th.data_offset * 4) {
+                return false;
+            }
+            auto now = steady_clock_type::now();
+            net::tcp_seq seq = th.seq;
+            // Far enough into slow start that the holes share a window
+            auto n = h->segments++;
+            if (n >= 30 && n < 30 + 2 * nr_holes && n % 2 == 0) {
+                if (h->missing.empty()) {
+                    h->first_drop = now;
+                }
+                h->missing.insert(seq.raw);
+                return true;
+            }
+            if (h->missing.erase(seq.raw) && h->missing.empty()) {
+                h->repaired = now;
+            }
+            return false;
+        };
+        auto lo = tcp_loopback::create(cfg);
+        {
+            auto sack_retransmits = lo->host0.tcp().sack_retransmits();
+            uint16_t port = 10000;
+            auto ss = tcpv4_listen(lo->host0.tcp(), port, listen_options());
+            auto accepted = ss.accept();
+            auto client = tcpv4_socket(lo->host1.tcp()).connect(make_ipv4_address(ipv4_addr(tcp_loopback_host::address(0).ip, port))).get0();
+            auto server = std::get<0>(accepted.get());
+            size_t len = 1 << 20;
+            auto writer = seastar::async([&server, len] {
+                auto out = server.output();
+                std::vector<char> buf(4096);
+                for (size_t pos = 0; pos < len; pos += buf.size()) {
+                    out.write(buf.data(), buf.size()).get();
+                }
+                out.flush().get();
+                out.close().get();
+            });
+            auto in = client.input();
+            size_t received = 0;
+            while (auto buf = in.read().get0()) {
+                received += buf.size();
+            }
+            writer.get();
+            BOOST_REQUIRE_EQUAL(received, len);
+            BOOST_REQUIRE(h->missing.empty());
+            BOOST_REQUIRE_EQUAL(lo->link._stats.dropped, nr_holes);
+            BOOST_REQUIRE_GE(lo->host0.tcp().sack_retransmits() - sack_retransmits, nr_holes);
+            // Repairing one hole per round trip would take nr_holes of them
+            auto rtt = 2 * cfg.delay;
+            BOOST_REQUIRE(h->repaired - h->first_drop < 3 * rtt);
+        }
+        lo->stop().get();
+    });
+}
+
+// An IPv4 TCP frame, copied out of the link so that it can be examined,
+// altered and sent again
+struct tcp_frame {
+    std::vector<uint8_t> b;
+    size_t tcp;
+
+    static std::experimental::optional<tcp_frame> parse(packet& p) {
+        std::vector<uint8_t> b;
+        for (auto&& f : p.fragments()) {
+            b.insert(b.end(), f.base, f.base + f.size);
+        }
+        if (b.size() < sizeof(eth_hdr) + 20 || b[12] != 0x08 || b[13] != 0x00
+                || b[sizeof(eth_hdr) + 9] != uint8_t(ip_protocol_num::tcp)) {
+            return {};
+        }
+        return tcp_frame{std::move(b), sizeof(eth_hdr) + (b[sizeof(eth_hdr)] & 0xf) * 4};
+    }
+    uint32_t get32(size_t off) const {
+        return uint32_t(b[off]) << 24 | uint32_t(b[off + 1]) << 16 | uint32_t(b[off + 2]) << 8 | b[off + 3];
+    }
+    size_t header_len() const {
+        return (b[tcp + 12] >> 4) * 4;
+    }
+    size_t data_len() const {
+        size_t ip_len = b[sizeof(eth_hdr) + 2] << 8 | b[sizeof(eth_hdr) + 3];
+        return ip_len - (tcp - sizeof(eth_hdr)) - header_len();
+    }
+    uint32_t seq() const {
+        return get32(tcp + 4);
+    }
+    uint32_t ack() const {
+        return get32(tcp + 8);
+    }
+    // Offset of the TSval of the timestamps option
+    size_t tsval_offset() const {
+        auto off = tcp + 20;
+        auto end = tcp + header_len();
+        while (off < end && b[off] != 0) {
+            if (b[off] == 1) {
+                ++off;
+                continue;
+            }
+            if (b[off] == 8) {
+                return off + 2;
+            }
+            off += b[off + 1];
+        }
+        BOOST_FAIL("no timestamps option");
+        return 0;
+    }
+    // Replaces the 32-bit value at off, updating the TCP checksum
+    // incrementally (RFC1624)
+    void set32(size_t off, uint32_t v) {
+        auto word = [this] (size_t o) { return uint32_t(b[o] << 8 | b[o + 1]); };
+        // 16-bit words, aligned to the start of the TCP header, that the
+        // value covers
+        auto start = tcp + ((off - tcp) & ~size_t(1));
+        auto end = tcp + ((off + 4 - tcp + 1) & ~size_t(1));
+        uint32_t sum = uint16_t(~word(tcp + 16));
+        for (auto o = start; o < end; o += 2) {
+            sum += uint16_t(~word(o));
+        }
+        for (unsigned i = 0; i < 4; ++i) {
+            b[off + i] = v >> (24 - 8 * i);
+        }
+        for (auto o = start; o < end; o += 2) {
+            sum += word(o);
+        }
+        while (sum >> 16) {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+        b[tcp + 16] = uint8_t(~sum >> 8);
+        b[tcp + 17] = uint8_t(~sum);
+    }
+    packet to_packet() const {
+        return packet(reinterpret_cast<const char*>(b.data()), b.size());
+    }
+};
+
+// A segment whose timestamp is older than the last one seen is a stale
+// duplicate from an earlier wrap of the sequence space: PAWS drops it and
+// acknowledges what was really received (RFC7323 section 5.3)
+SEASTAR_TEST_CASE(test_paws_drops_old_timestamp) {
+    return seastar::async([] {
+        struct capture {
+            bool hold = false;
+            std::experimental::optional<tcp_frame> held;
+            // Acknowledgments host0 sent without data
+            std::vector<uint32_t> acks;
+        };
+        auto c = std::make_shared<capture>();
+        tcp_loopback_link_config cfg;
+        cfg.sw_offloads = false;
+        cfg.drop = [c] (unsigned side, packet& p) {
+            auto f = tcp_frame::parse(p);
+            if (!f) {
+                return false;
+            }
+            if (side == 0 && !f->data_len()) {
+                c->acks.push_back(f->ack());
+            }
+            if (side == 1 && f->data_len() && c->hold) {
+                c->hold = false;
+                c->held = std::move(f);
+                return true;
+            }
+            return false;
+        };
+        auto lo = tcp_loopback::create(cfg);
+        lo->host1.tcp().set_rto_min(std::chrono::milliseconds(50));
+        {
+            uint16_t port = 10000;
+            auto ss = lo->host0.tcp().listen(port);
+            auto client = lo->host1.tcp().connect(make_ipv4_address(ipv4_addr(tcp_loopback_host::address(0).ip, port)));
+            client.connected().get();
+            auto server = ss.accept().get0();
+            client.send(packet::from_static_data("a", 1)).get();
+            server.wait_for_data().get();
+            BOOST_REQUIRE_EQUAL(server.read().len(), 1u);
+
+            // Keep the next segment, and send it again with a timestamp
+            // from long ago
+            c->hold = true;
+            client.send(packet::from_static_data("hello", 5)).get();
+            while (!c->held) {
+                sleep(std::chrono::milliseconds(1)).get();
+            }
+            auto stale = *c->held;
+            auto off = stale.tsval_offset();
+            stale.set32(off, stale.get32(off) - 1000000);
+            c->acks.clear();
+            lo->link.send(1, stale.to_packet());
+            sleep(std::chrono::milliseconds(10)).get();
+            BOOST_REQUIRE_EQUAL(server.read().len(), 0u);
+            BOOST_REQUIRE_EQUAL(c->acks.size(), 1u);
+            BOOST_REQUIRE_EQUAL(c->acks[0], stale.seq());
+
+            // The retransmission carries a current timestamp and is accepted
+            server.wait_for_data().get();
+            BOOST_REQUIRE_EQUAL(server.read().len(), 5u);
+        }
+        lo->stop().get();
+    });
+}
+
+// With timestamps the ACK of a retransmitted segment is an RTT sample too,
+// so the RTO falls back from its exponential backoff right away instead of
+// waiting for a segment that was sent only once (Karn's algorithm)
+SEASTAR_TEST_CASE(test_rtt_sample_after_retransmit) {
+    return seastar::async([] {
+        auto drop_next = std::make_shared<bool>(false);
+        tcp_loopback_link_config cfg;
+        cfg.sw_offloads = false;
+        cfg.drop = [drop_next] (unsigned side, packet& p) {
+            auto f = tcp_frame::parse(p);
+            if (side == 1 && f && f->data_len() && *drop_next) {
+                *drop_next = false;
+                return true;
+            }
+            return false;
+        };
+        auto lo = tcp_loopback::create(cfg);
+        lo->host1.tcp().set_rto_min(std::chrono::milliseconds(5));
+        {
+            uint16_t port = 10000;
+            auto ss = lo->host0.tcp().listen(port);
+            auto client = lo->host1.tcp().connect(make_ipv4_address(ipv4_addr(tcp_loopback_host::address(0).ip, port)));
+            client.connected().get();
+            auto server = ss.accept().get0();
+            // The server answers every message, so that its ACKs are not
+            // delayed
+            auto exchange = [&] (const char* msg) {
+                client.send(packet::from_static_data(msg, strlen(msg))).get();
+                server.wait_for_data().get();
+                BOOST_REQUIRE_EQUAL(server.read().len(), strlen(msg));
+                server.send(packet::from_static_data("ok", 2)).get();
+                client.wait_for_data().get();
+                client.read();
+            };
+            for (int i = 0; i < 10; ++i) {
+                exchange("a");
+            }
+            auto rto = client.retransmission_timeout();
+
+            *drop_next = true;
+            exchange("hello");
+            BOOST_REQUIRE(!*drop_next);
+            // Only the retransmission was acknowledged; without a sample
+            // from it the RTO would have stayed doubled
+            BOOST_REQUIRE(client.retransmission_timeout() < 2 * rto);
+        }
+        lo->stop().get();
+    });
+}
+
+// Each shard draws its ports from its own residue class, within the range
+SEASTAR_TEST_CASE(test_shard_port) {
+    const unsigned min = 41952, max = 65535;
+    unsigned bad = 0;
+    for (unsigned nr_shards : { 1u, 2u, 3u, 7u, 64u }) {
+        for (unsigned shard = 0; shard < nr_shards; ++shard) {
+            for (unsigned port = min; port <= max; ++port) {
+                auto p = shard_port(port, shard, nr_shards, min, max);
+                bad += p < min || p > max || p % nr_shards != shard;
+            }
+        }
+    }
+    BOOST_REQUIRE_EQUAL(bad, 0u);
+    return make_ready_future<>();
+}
+
+// On a device whose RSS hash sends some flows to a queue no shard polls,
+// connections whose hash does not land here are steered to the local
+// queue while there are filters left, and get a port whose hash does
+// once there are not.  After one refusal the device is not asked again
+// until a filter is removed.  Their filters go away with them.
+SEASTAR_TEST_CASE(test_flow_steering) {
+    return seastar::async([] {
+        tcp_loopback_link_config cfg;
+        cfg.hw_queues = 2;
+        cfg.flow_steering = true;
+        cfg.max_filters = 4;
+        auto syn_ports = std::make_shared<std::vector<uint16_t>>();
+        cfg.drop = [syn_ports] (unsigned side, packet& p) {
+            auto f = tcp_frame::parse(p);
+            // SYN without ACK
+            if (side == 1 && f && (f->b[f->tcp + 13] & 0x12) == 0x02) {
+                syn_ports->push_back(f->b[f->tcp] << 8 | f->b[f->tcp + 1]);
+            }
+            return false;
+        };
+        auto lo = tcp_loopback::create(cfg);
+        auto& dev = lo->host1.device();
+        auto local_ip = tcp_loopback_host::address(1);
+        auto foreign_ip = tcp_loopback_host::address(0);
+        uint16_t port = 10000;
+        auto lands_here = [&] (uint16_t local_port) {
+            auto id = l4connid<ipv4_traits>{local_ip, foreign_ip, local_port, port};
+            return dev.hash2cpu(id.hash(dev.rss_key())) == engine().cpu_id();
+        };
+        auto steered = [&] (uint16_t local_port) {
+            return std::any_of(dev._filters.begin(), dev._filters.end(), [&] (auto& f) {
+                return f.rule.dst_port == local_port;
+            });
+        };
+        {
+            auto ss = lo->host0.tcp().listen(port);
+            auto addr = make_ipv4_address(ipv4_addr(foreign_ip.ip, port));
+            const unsigned count = 32;
+            std::vector<tcp<ipv4_traits>::connection> conns;
+            for (unsigned i = 0; i < count; ++i) {
+                conns.push_back(lo->host1.tcp().connect(addr));
+                conns.back().connected().get();
+                conns.push_back(ss.accept().get0());
+            }
+            BOOST_REQUIRE_EQUAL(syn_ports->size(), count);
+            BOOST_REQUIRE_EQUAL(dev._filters.size(), cfg.max_filters);
+            for (auto& f : dev._filters) {
+                BOOST_REQUIRE_EQUAL(f.qid, engine().cpu_id());
+                BOOST_REQUIRE_EQUAL(f.rule.src_ip, foreign_ip.ip);
+                BOOST_REQUIRE_EQUAL(f.rule.dst_ip, local_ip.ip);
+                BOOST_REQUIRE_EQUAL(f.rule.src_port, port);
+                BOOST_REQUIRE(!lands_here(f.rule.dst_port));
+            }
+            for (auto p : *syn_ports) {
+                BOOST_REQUIRE_EQUAL(p % smp::count, engine().cpu_id());
+                BOOST_REQUIRE(lands_here(p) || steered(p));
+            }
+            BOOST_REQUIRE_EQUAL(dev._filter_requests, cfg.max_filters + 1);
+        }
+        while (lo->host1.connections()) {
+            sleep(std::chrono::milliseconds(1)).get();
+        }
+        BOOST_REQUIRE(dev._filters.empty());
+        {
+            // With filters freed, connections are steered again
+            auto ss = lo->host0.tcp().listen(port);
+            auto addr = make_ipv4_address(ipv4_addr(foreign_ip.ip, port));
+            std::vector<tcp<ipv4_traits>::connection> conns;
+            for (unsigned i = 0; i < 32 && dev._filters.empty(); ++i) {
+                conns.push_back(lo->host1.tcp().connect(addr));
+                conns.back().connected().get();
+                conns.push_back(ss.accept().get0());
+            }
+            BOOST_REQUIRE_EQUAL(dev._filters.size(), 1u);
+        }
+        lo->stop().get();
+        BOOST_REQUIRE(dev._filters.empty());
+    });
+}
@@ -0,0 +1,135 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/fstream.hh"
+#include "core/page_cache.hh"
+#include "core/thread.hh"
+#include "core/do_with.hh"
+#include "test-utils.hh"
+#include <random>
+
+static std::vector<char> write_test_file(sstring name, size_t len) {
+    auto rdist = std::uniform_int_distribution<int>(0, 255);
+    auto reng = std::default_random_engine();
+    std::vector<char> data(len);
+    for (auto&& c : data) {
+        c = rdist(reng);
+    }
+    auto f = open_file_dma(name, open_flags::rw | open_flags::create | open_flags::truncate).get0();
+    auto out = make_file_output_stream(f);
+    out.write(data.data(), data.size()).get();
+    out.flush().get();
+    f.close().get();
+    return data;
+}
+
+SEASTAR_TEST_CASE(test_page_cache_hits_and_eof) {
+    return seastar::async([] {
+        auto flen = size_t(3 * 4096 + 1234);
+        auto data = write_test_file("page_cache.tmp", flen);
+        page_cache cache(1 << 20);
+        for (auto pass : {0, 1}) {
+            auto f = cache.wrap(open_file_dma("page_cache.tmp", open_flags::ro).get0()).get0();
+            auto buf = temporary_buffer<char>::aligned(4096, 4 * 4096);
+            auto n = f.dma_read(0, buf.get_write(), buf.size()).get0();
+            BOOST_REQUIRE_EQUAL(n, flen);
+            BOOST_REQUIRE(std::equal(data.begin(), data.end(), buf.get()));
+            auto tail = f.dma_read<char>(4096 + 17, 9000).get0();
+            BOOST_REQUIRE_EQUAL(tail.size(), flen - 4096 - 17);
+            BOOST_REQUIRE(std::equal(tail.begin(), tail.end(), data.begin() + 4096 + 17));
+            f.close().get();
+            if (pass == 0) {
+                BOOST_REQUIRE_EQUAL(cache.get_stats().misses, 4);
+            }
+        }
+        // The second open found every block in memory.
+        BOOST_REQUIRE_EQUAL(cache.get_stats().misses, 4);
+        BOOST_REQUIRE(cache.get_stats().hits > 0);
+        remove_file("page_cache.tmp").get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_page_cache_coalesces_concurrent_misses) {
+    return seastar::async([] {
+        write_test_file("page_cache.tmp", 4096);
+        page_cache cache(1 << 20);
+        auto f = cache.wrap(open_file_dma("page_cache.tmp", open_flags::ro).get0()).get0();
+        auto reads = std::vector<future<temporary_buffer<char>>>();
+        for (int i = 0; i < 10; ++i) {
+            reads.push_back(f.dma_read<char>(0, 4096));
+        }
+        for (auto&& r : reads) {
+            BOOST_REQUIRE_EQUAL(r.get0().size(), 4096);
+        }
+        BOOST_REQUIRE_EQUAL(cache.get_stats().misses, 1);
+        BOOST_REQUIRE_EQUAL(cache.get_stats().coalesced, 9);
+        f.close().get();
+        remove_file("page_cache.tmp").get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_page_cache_eviction_and_invalidation) {
+    return seastar::async([] {
+        write_test_file("page_cache.tmp", 16 * 4096);
+        page_cache cache(4 * 4096);
+        auto f = cache.wrap(open_file_dma("page_cache.tmp", open_flags::rw).get0()).get0();
+        for (uint64_t pos = 0; pos < 16 * 4096; pos += 4096) {
+            f.dma_read<char>(pos, 4096).get();
+        }
+        BOOST_REQUIRE(cache.used_memory() <= 4 * 4096);
+        BOOST_REQUIRE_EQUAL(cache.get_stats().evictions, 12);
+
+        f.dma_read<char>(15 * 4096, 4096).get();
+        auto wbuf = temporary_buffer<char>::aligned(4096, 4096);
+        std::fill(wbuf.get_write(), wbuf.get_write() + 4096, 'x');
+        f.dma_write(15 * 4096, wbuf.get(), 4096).get();
+        auto after = f.dma_read<char>(15 * 4096, 4096).get0();
+        BOOST_REQUIRE(std::all_of(after.begin(), after.end(), [] (char c) { return c == 'x'; }));
+        f.close().get();
+        remove_file("page_cache.tmp").get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_page_cache_read_after_write_during_load) {
+    return seastar::async([] {
+        write_test_file("page_cache.tmp", 4096);
+        page_cache cache(1 << 20);
+        auto f = cache.wrap(open_file_dma("page_cache.tmp", open_flags::rw).get0()).get0();
+        // Leave the first read in flight across the write; a read issued
+        // after the write must not be served by it.
+        auto before = f.dma_read<char>(0, 4096);
+        auto wbuf = temporary_buffer<char>::aligned(4096, 4096);
+        std::fill(wbuf.get_write(), wbuf.get_write() + 4096, 'x');
+        f.dma_write(0, wbuf.get(), 4096).get();
+        auto after = f.dma_read<char>(0, 4096).get0();
+        BOOST_REQUIRE(std::all_of(after.begin(), after.end(), [] (char c) { return c == 'x'; }));
+        BOOST_REQUIRE_EQUAL(before.get0().size(), 4096);
+        BOOST_REQUIRE_EQUAL(cache.get_stats().misses, 2);
+        BOOST_REQUIRE_EQUAL(cache.get_stats().coalesced, 0);
+        // The newer read is the one that got cached.
+        auto cached = f.dma_read<char>(0, 4096).get0();
+        BOOST_REQUIRE(std::all_of(cached.begin(), cached.end(), [] (char c) { return c == 'x'; }));
+        BOOST_REQUIRE_EQUAL(cache.get_stats().misses, 2);
+        f.close().get();
+        remove_file("page_cache.tmp").get();
+    });
+}
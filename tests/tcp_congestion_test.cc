@@ -0,0 +1,209 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "net/tcp-stack.hh"
+#include "net/tcp-congestion.hh"
+#include "tcp_loopback.hh"
+#include "test-utils.hh"
+
+using namespace net;
+
+static std::vector<char> make_payload(size_t len) {
+    std::vector<char> data(len);
+    auto reng = std::default_random_engine();
+    auto rdist = std::uniform_int_distribution<int>(0, 255);
+    for (auto&& c : data) {
+        c = rdist(reng);
+    }
+    return data;
+}
+
+// Sends len bytes from host0 (using the given congestion control) to host1
+// and checks that they arrive intact.
+static void transfer(tcp_loopback& lo, uint16_t port, seastar::tcp_congestion_control cc, size_t len) {
+    auto data = make_payload(len);
+    listen_options lo_opts;
+    lo_opts.congestion_control = cc;
+    auto ss = tcpv4_listen(lo.host0.tcp(), port, lo_opts);
+    auto accepted = ss.accept();
+    auto sock = tcpv4_socket(lo.host1.tcp());
+    auto client = sock.connect(make_ipv4_address(ipv4_addr(tcp_loopback_host::address(0).ip, port))).get0();
+    auto server = std::get<0>(accepted.get());
+
+    auto writer = seastar::async([&server, &data] {
+        auto out = server.output();
+        for (size_t pos = 0; pos < data.size(); pos += 4096) {
+            out.write(data.data() + pos, std::min(data.size() - pos, size_t(4096))).get();
+        }
+        out.flush().get();
+        out.close().get();
+    });
+    auto in = client.input();
+    size_t received = 0;
+    while (auto buf = in.read().get0()) {
+        BOOST_REQUIRE_LE(received + buf.size(), data.size());
+        BOOST_REQUIRE(std::equal(buf.begin(), buf.end(), data.begin() + received));
+        received += buf.size();
+    }
+    writer.get();
+    BOOST_REQUIRE_EQUAL(received, data.size());
+}
+
+static void test_all(tcp_loopback_link_config cfg, std::chrono::milliseconds rto_min = std::chrono::milliseconds(1000)) {
+    auto lo = tcp_loopback::create(cfg);
+    lo->host0.tcp().set_rto_min(rto_min);
+    lo->host1.tcp().set_rto_min(rto_min);
+    uint16_t port = 10000;
+    for (auto cc : {seastar::tcp_congestion_control::reno,
+                    seastar::tcp_congestion_control::cubic,
+                    seastar::tcp_congestion_control::bbr}) {
+        transfer(*lo, port++, cc, 1 << 20);
+    }
+    lo->stop().get();
+}
+
+SEASTAR_TEST_CASE(test_transfer_clean_link) {
+    return seastar::async([] {
+        tcp_loopback_link_config cfg;
+        cfg.bandwidth = 50 << 20;
+        cfg.queue_limit = 256 << 10;
+        test_all(cfg);
+    });
+}
+
+SEASTAR_TEST_CASE(test_transfer_clean_link_no_offloads) {
+    return seastar::async([] {
+        tcp_loopback_link_config cfg;
+        cfg.bandwidth = 50 << 20;
+        cfg.queue_limit = 256 << 10;
+        cfg.sw_offloads = false;
+        test_all(cfg);
+    });
+}
+
+SEASTAR_TEST_CASE(test_transfer_lossy_link) {
+    return seastar::async([] {
+        tcp_loopback_link_config cfg;
+        cfg.bandwidth = 50 << 20;
+        cfg.loss = 0.01;
+        test_all(cfg);
+    });
+}
+
+// Timestamps give RTT samples for every ACK, so the RTO can follow a short
+// RTT closely once the minimum is lowered
+SEASTAR_TEST_CASE(test_transfer_lossy_link_low_rto_min) {
+    return seastar::async([] {
+        tcp_loopback_link_config cfg;
+        cfg.delay = std::chrono::microseconds(100);
+        cfg.bandwidth = 100 << 20;
+        cfg.loss = 0.02;
+        cfg.seed = 2;
+        test_all(cfg, std::chrono::milliseconds(5));
+    });
+}
+
+// Sends len bytes from host1 to host0, over a connection host1 opens with
+// the given congestion control; returns the frames the link dropped
+static uint64_t upload(tcp_loopback_link_config cfg, seastar::tcp_congestion_control cc, size_t len) {
+    auto lo = tcp_loopback::create(cfg);
+    uint64_t dropped;
+    {
+        uint16_t port = 10000;
+        auto ss = tcpv4_listen(lo->host0.tcp(), port, listen_options());
+        auto accepted = ss.accept();
+        connect_options opts;
+        opts.congestion_control = cc;
+        auto sock = tcpv4_socket(lo->host1.tcp());
+        auto client = sock.connect(make_ipv4_address(ipv4_addr(tcp_loopback_host::address(0).ip, port)),
+                socket_address(::sockaddr_in{AF_INET, INADDR_ANY, {0}}), opts).get0();
+        auto server = std::get<0>(accepted.get());
+
+        auto writer = seastar::async([&client, len] {
+            auto out = client.output();
+            std::vector<char> buf(4096);
+            for (size_t pos = 0; pos < len; pos += buf.size()) {
+                out.write(buf.data(), buf.size()).get();
+            }
+            out.flush().get();
+            out.close().get();
+        });
+        auto in = server.input();
+        size_t received = 0;
+        while (auto buf = in.read().get0()) {
+            received += buf.size();
+        }
+        writer.get();
+        BOOST_REQUIRE_EQUAL(received, len);
+        dropped = lo->link._stats.dropped;
+    }
+    lo->stop().get();
+    return dropped;
+}
+
+// Behind a bottleneck with a queue of several bandwidth-delay products,
+// CUBIC grows its window until the queue overflows, while BBR sizes it to
+// the bandwidth-delay product and loses nothing
+SEASTAR_TEST_CASE(test_cubic_and_bbr_on_deep_queue) {
+    return seastar::async([] {
+        tcp_loopback_link_config cfg;
+        cfg.delay = std::chrono::milliseconds(5);
+        cfg.bandwidth = 10 << 20;
+        cfg.queue_limit = 512 << 10;
+        BOOST_REQUIRE_GT(upload(cfg, seastar::tcp_congestion_control::cubic, 8 << 20), 0u);
+        BOOST_REQUIRE_EQUAL(upload(cfg, seastar::tcp_congestion_control::bbr, 8 << 20), 0u);
+    });
+}
+
+SEASTAR_TEST_CASE(test_controller_reactions) {
+    using namespace std::chrono_literals;
+    for (auto type : {seastar::tcp_congestion_control::reno,
+                      seastar::tcp_congestion_control::cubic,
+                      seastar::tcp_congestion_control::bbr}) {
+        auto cc = make_tcp_congestion_controller(type);
+        BOOST_REQUIRE(cc->type() == type);
+        tcp_congestion_window w;
+        cc->init(w, 1460, 64 << 10);
+        BOOST_REQUIRE_EQUAL(w.cwnd, 3 * 1460u);
+        BOOST_REQUIRE_EQUAL(w.ssthresh, 64u << 10);
+
+        // Loss must never leave ssthresh below two segments
+        cc->on_congestion_event(w, 1460);
+        BOOST_REQUIRE_GE(w.ssthresh, 2 * 1460u);
+
+        // A timeout collapses the window to one segment
+        cc->on_timeout(w, 10 * 1460, true);
+        BOOST_REQUIRE_EQUAL(w.cwnd, 1460u);
+    }
+    auto reno = make_tcp_congestion_controller(seastar::tcp_congestion_control::stack_default);
+    BOOST_REQUIRE(reno->type() == seastar::tcp_congestion_control::reno);
+
+    // CUBIC backs off less than Reno
+    auto cubic = make_tcp_congestion_controller(seastar::tcp_congestion_control::cubic);
+    tcp_congestion_window w;
+    cubic->init(w, 1000, 1 << 20);
+    w.cwnd = 100000;
+    cubic->on_congestion_event(w, 100000);
+    BOOST_REQUIRE_EQUAL(w.ssthresh, 70000u);
+    return make_ready_future<>();
+}
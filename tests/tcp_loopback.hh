@@ -0,0 +1,335 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+// Two native network stacks on the same shard, connected by an emulated
+// link with configurable delay, bandwidth, queue size and random loss.
+
+#include "core/reactor.hh"
+#include "core/timer.hh"
+#include "core/circular_buffer.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "net/net.hh"
+#include "net/ip.hh"
+#include "net/ipv6.hh"
+#include "net/tcp.hh"
+#include <random>
+#include <chrono>
+#include <functional>
+
+struct tcp_loopback_link_config {
+    // One-way propagation delay
+    std::chrono::microseconds delay{1000};
+    // Bottleneck rate in bytes per second; 0 is unlimited
+    uint64_t bandwidth = 0;
+    // Bytes that may wait for the bottleneck before packets are dropped;
+    // 0 is unlimited
+    size_t queue_limit = 0;
+    // Probability that a packet is lost
+    double loss = 0;
+    // Loses the frames it returns true for, given the side sending them,
+    // on top of the random loss
+    std::function<bool (unsigned side, net::packet& p)> drop;
+    unsigned seed = 1;
+    // Emulate TSO and LRO in software (the device offers neither)
+    bool sw_offloads = true;
+    // Emulate a device whose RSS hash spreads flows over several hardware
+    // queues, of which only the first one is polled, and which can steer up
+    // to max_filters flows to a queue
+    uint16_t hw_queues = 1;
+    bool flow_steering = false;
+    size_t max_filters = 8;
+};
+
+class tcp_loopback_link {
+    using clock_type = steady_clock_type;
+    struct direction {
+        net::device* to = nullptr;
+        circular_buffer<std::pair<clock_type::time_point, net::packet>> in_flight;
+        size_t queued_bytes = 0;
+        clock_type::time_point busy_until;
+        timer<> deliver;
+        // Multicast addresses the receiving device registered
+        std::vector<net::ethernet_address> multicast;
+    };
+    tcp_loopback_link_config _cfg;
+    direction _dir[2];
+    std::default_random_engine _rng;
+    std::bernoulli_distribution _drop;
+    bool _stopped = false;
+public:
+    struct stats {
+        uint64_t packets = 0;
+        uint64_t dropped = 0;
+    } _stats;
+public:
+    explicit tcp_loopback_link(tcp_loopback_link_config cfg)
+            : _cfg(cfg), _rng(cfg.seed), _drop(cfg.loss) {
+        for (auto& d : _dir) {
+            d.deliver.set_callback([this, &d] { deliver(d); });
+        }
+    }
+    void attach(unsigned side, net::device* dev) {
+        _dir[side ^ 1].to = dev;
+    }
+    const tcp_loopback_link_config& config() const {
+        return _cfg;
+    }
+    void set_multicast_addresses(unsigned side, std::vector<net::ethernet_address> addrs) {
+        _dir[side ^ 1].multicast = std::move(addrs);
+    }
+    // Drops the frames in flight, and any sent from now on
+    void stop() {
+        _stopped = true;
+        for (auto& d : _dir) {
+            d.deliver.cancel();
+            while (!d.in_flight.empty()) {
+                d.in_flight.pop_front();
+            }
+            d.queued_bytes = 0;
+        }
+    }
+    void send(unsigned side, net::packet p) {
+        if (_stopped) {
+            return;
+        }
+        auto& d = _dir[side];
+        ++_stats.packets;
+        if ((_cfg.drop && _cfg.drop(side, p)) || _drop(_rng) || (_cfg.queue_limit && d.queued_bytes + p.len() > _cfg.queue_limit)) {
+            ++_stats.dropped;
+            return;
+        }
+        // Copy the frame: the sender keeps its own buffers for retransmission
+        net::packet copy;
+        for (auto&& f : p.fragments()) {
+            copy = net::packet(std::move(copy), f);
+        }
+        auto now = clock_type::now();
+        auto start = std::max(now, d.busy_until);
+        if (_cfg.bandwidth) {
+            d.busy_until = start + std::chrono::nanoseconds(copy.len() * 1000000000ULL / _cfg.bandwidth);
+        } else {
+            d.busy_until = start;
+        }
+        d.queued_bytes += copy.len();
+        d.in_flight.emplace_back(d.busy_until + _cfg.delay, std::move(copy));
+        if (!d.deliver.armed()) {
+            d.deliver.arm(d.in_flight.front().first);
+        }
+    }
+private:
+    void deliver(direction& d) {
+        auto now = clock_type::now();
+        // Hand everything that is due up in one burst, like a NIC driver
+        std::vector<net::packet> burst;
+        while (!d.in_flight.empty() && d.in_flight.front().first <= now) {
+            auto p = std::move(d.in_flight.front().second);
+            d.in_flight.pop_front();
+            d.queued_bytes -= p.len();
+            if (accepts(d, p)) {
+                burst.push_back(std::move(p));
+            }
+        }
+        if (!burst.empty()) {
+            d.to->l2receive_burst(burst);
+        }
+        if (!d.in_flight.empty()) {
+            d.deliver.arm(d.in_flight.front().first);
+        }
+    }
+
+    // Like a NIC, lets through only the multicast frames of the groups
+    // the receiving device registered
+    static bool accepts(direction& d, net::packet& p) {
+        auto eh = p.get_header<net::eth_hdr>();
+        if (!eh || !(eh->dst_mac.mac[0] & 1)) {
+            return true;
+        }
+        auto& dst = eh->dst_mac.mac;
+        return std::all_of(dst.begin(), dst.end(), [] (uint8_t b) { return b == 0xff; })
+                || std::any_of(d.multicast.begin(), d.multicast.end(), [&dst] (const net::ethernet_address& a) {
+            return a.mac == dst;
+        });
+    }
+};
+
+class tcp_loopback_qp : public net::qp {
+    tcp_loopback_link& _link;
+    unsigned _side;
+public:
+    tcp_loopback_qp(tcp_loopback_link& link, unsigned side) : _link(link), _side(side) {}
+    virtual future<> send(net::packet p) override {
+        _link.send(_side, std::move(p));
+        return make_ready_future<>();
+    }
+};
+
+class tcp_loopback_device : public net::device {
+    tcp_loopback_link& _link;
+    unsigned _side;
+    // Owned here instead of being handed to the reactor by set_local_queue(),
+    // so that its poller goes away together with the stack it polls
+    std::unique_ptr<net::qp> _qp;
+public:
+    struct filter {
+        net::flow_steering_rule rule;
+        unsigned qid;
+    };
+    std::vector<filter> _filters;
+    // Calls to add_flow_steering(), refused ones included
+    size_t _filter_requests = 0;
+public:
+    tcp_loopback_device(tcp_loopback_link& link, unsigned side) : _link(link), _side(side) {
+        _link.attach(side, this);
+    }
+    virtual net::ethernet_address hw_address() override {
+        return {0x12, 0x23, 0x34, 0x56, 0x67, uint8_t(0x78 + _side)};
+    }
+    virtual net::hw_features hw_features() override {
+        return net::hw_features();
+    }
+    virtual std::unique_ptr<net::qp> init_local_queue(boost::program_options::variables_map opts, uint16_t qid) override {
+        return std::make_unique<tcp_loopback_qp>(_link, _side);
+    }
+    virtual uint16_t hw_queues_count() override {
+        return _link.config().hw_queues;
+    }
+    // The queues beyond the first have no shard behind them
+    virtual unsigned hash2cpu(uint32_t hash) override {
+        return hash2qid(hash);
+    }
+    virtual bool flow_steering_supported() override {
+        return _link.config().flow_steering;
+    }
+    virtual bool add_flow_steering(const net::flow_steering_rule& rule, unsigned qid) override {
+        ++_filter_requests;
+        if (_filters.size() == _link.config().max_filters) {
+            return false;
+        }
+        _filters.push_back(filter{rule, qid});
+        return true;
+    }
+    virtual void remove_flow_steering(const net::flow_steering_rule& rule) override {
+        auto i = std::find_if(_filters.begin(), _filters.end(), [&rule] (const filter& f) {
+            return f.rule.src_ip == rule.src_ip && f.rule.dst_ip == rule.dst_ip
+                    && f.rule.src_port == rule.src_port && f.rule.dst_port == rule.dst_port;
+        });
+        assert(i != _filters.end());
+        _filters.erase(i);
+    }
+    virtual void set_multicast_addresses(const std::vector<net::ethernet_address>& addrs) override {
+        _link.set_multicast_addresses(_side, addrs);
+    }
+    void init_own_local_queue() {
+        _qp = init_local_queue({}, 0);
+        _queues[engine().cpu_id()] = _qp.get();
+    }
+};
+
+// One end of the link: a device, an interface, an IPv4 stack with
+// 10.0.0.1 (side 0) or 10.0.0.2 (side 1) and an IPv6 stack with fd00::1
+// or fd00::2.  IPv4 neighbours are configured statically, IPv6 ones are
+// resolved with neighbour discovery.
+class tcp_loopback_host {
+    std::shared_ptr<tcp_loopback_device> _dev;
+    net::interface _netif;
+    net::ipv4 _inet;
+    net::ipv6 _inet6;
+private:
+    static std::shared_ptr<tcp_loopback_device> make_device(tcp_loopback_link& link, unsigned side) {
+        auto dev = std::make_shared<tcp_loopback_device>(link, side);
+        // The interface subscribes to the local queue when it is created
+        dev->init_own_local_queue();
+        return dev;
+    }
+public:
+    tcp_loopback_host(tcp_loopback_link& link, unsigned side, bool sw_offloads)
+            : _dev(make_device(link, side)), _netif(_dev), _inet(&_netif), _inet6(&_netif) {
+        _inet.set_host_address(address(side));
+        _inet6.set_host_address(address6(side));
+        _inet.set_netmask_address(net::ipv4_address("255.255.255.0"));
+        if (sw_offloads) {
+            _inet.enable_sw_tso();
+            _inet.enable_sw_gro();
+            _inet6.enable_sw_gro();
+        }
+    }
+    static net::ipv4_address address(unsigned side) {
+        return net::ipv4_address(side ? "10.0.0.2" : "10.0.0.1");
+    }
+    static net::ipv6_address address6(unsigned side) {
+        return net::ipv6_address(side ? "fd00::2" : "fd00::1");
+    }
+    net::ethernet_address hw_address() {
+        return _dev->hw_address();
+    }
+    tcp_loopback_device& device() {
+        return *_dev;
+    }
+    void learn(tcp_loopback_host& peer, unsigned peer_side) {
+        _inet.learn(peer.hw_address(), address(peer_side));
+    }
+    net::tcp<net::ipv4_traits>& tcp() {
+        return _inet.get_tcp();
+    }
+    net::tcp<net::ipv6_traits>& tcp6() {
+        return _inet6.get_tcp();
+    }
+    net::ipv4& inet() {
+        return _inet;
+    }
+    net::ipv6& inet6() {
+        return _inet6;
+    }
+    size_t connections() {
+        return _inet.get_tcp().connections() + _inet6.get_tcp().connections();
+    }
+};
+
+struct tcp_loopback {
+    tcp_loopback_link link;
+    tcp_loopback_host host0;
+    tcp_loopback_host host1;
+
+    explicit tcp_loopback(tcp_loopback_link_config cfg)
+            : link(cfg), host0(link, 0, cfg.sw_offloads), host1(link, 1, cfg.sw_offloads) {
+        host0.learn(host1, 1);
+        host1.learn(host0, 0);
+    }
+    // Waits for the connections the test closed to finish closing, then
+    // cuts the link.  Call it once the test's sockets are gone, before the
+    // setup is destroyed: timers of connections still open reference the
+    // stacks.
+    future<> stop() {
+        return do_until([this] { return !host0.connections() && !host1.connections(); }, [] {
+            return sleep(std::chrono::milliseconds(1));
+        }).then([this] {
+            link.stop();
+            // Let continuations that still reference the stacks run
+            return later();
+        });
+    }
+    static std::unique_ptr<tcp_loopback> create(tcp_loopback_link_config cfg) {
+        return std::make_unique<tcp_loopback>(cfg);
+    }
+};
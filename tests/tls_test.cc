@@ -29,6 +29,9 @@
 #include "core/sharded.hh"
 #include "core/gate.hh"
 #include "net/tls.hh"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
 
 using namespace seastar;
 
@@ -113,6 +116,15 @@ class echoserver {
             , _size(message_size)
     {}
 
+    void enable_session_resumption(sstring ticket_key) {
+        _certs->enable_session_tickets(ticket_key);
+        _certs->enable_session_cache();
+    }
+
+    void enable_kernel_tls() {
+        _certs->set_kernel_tls(true);
+    }
+
     future<> listen(socket_address addr, sstring crtfile, sstring keyfile) {
         return _certs->set_x509_key_file(crtfile, keyfile, tls::x509_crt_format::PEM).then([this, addr] {
             ::listen_options opts;
@@ -257,3 +269,205 @@ SEASTAR_TEST_CASE(test_large_message_x509_client_server) {
     }
     return run_echo_test(std::move(msg), 20, "tests/catest.pem", "test.scylladb.org");
 }
+
+SEASTAR_TEST_CASE(test_x509_client_server_offloaded_handshake) {
+    return smp::invoke_on_all([] {
+        tls::set_handshake_offload(2);
+    }).then([] {
+        return run_echo_test(message, 20, "tests/catest.pem", "test.scylladb.org");
+    }).then([] {
+        BOOST_REQUIRE_GT(tls::get_handshake_stats().offloaded, 0u);
+        BOOST_REQUIRE_EQUAL(tls::get_handshake_stats().offload_queue_length, 0u);
+    }).finally([] {
+        return smp::invoke_on_all([] {
+            tls::set_handshake_offload(0);
+        });
+    });
+}
+
+static future<uint64_t> resumed_handshakes() {
+    return map_reduce(boost::irange(0u, smp::count), [] (unsigned cpu) {
+        return smp::submit_to(cpu, [] {
+            return tls::get_handshake_stats().resumed;
+        });
+    }, uint64_t(0), std::plus<uint64_t>());
+}
+
+SEASTAR_TEST_CASE(test_x509_client_server_session_resumption) {
+    static const auto port = 4712;
+
+    auto certs = ::make_shared<tls::certificate_credentials>();
+    auto server = ::make_shared<seastar::sharded<echoserver>>();
+    auto addr = ::make_ipv4_address( {0x7f000001, port});
+    // Every shard's server gets the same master key, whichever accepts
+    // the second connection must take the ticket issued for the first
+    auto key = tls::generate_session_ticket_key();
+
+    auto echo = [certs, addr] {
+        return tls::connect(certs, addr, "test.scylladb.org").then([](::connected_socket s) {
+            auto strms = ::make_lw_shared<streams>(std::move(s));
+            return strms->out.write(message).then([strms] {
+                return strms->out.flush();
+            }).then([strms] {
+                return strms->in.read_exactly(message.size());
+            }).then([strms] (temporary_buffer<char> buf) {
+                BOOST_REQUIRE(message == sstring(buf.begin(), buf.end()));
+                return strms->out.close();
+            }).finally([strms] {});
+        });
+    };
+
+    return certs->set_x509_trust_file("tests/catest.pem", tls::x509_crt_format::PEM).then([=] {
+        return server->start(message.size()).then([=] {
+            return server->invoke_on_all(&echoserver::enable_session_resumption, key);
+        }).then([=] {
+            return server->invoke_on_all(&echoserver::listen, addr, sstring("tests/test.crt"), sstring("tests/test.key"));
+        }).then([=] {
+            return resumed_handshakes().then([=] (uint64_t before) {
+                return echo().then([=] {
+                    return resumed_handshakes();
+                }).then([=] (uint64_t after) {
+                    BOOST_REQUIRE_EQUAL(after, before);
+                    return echo();
+                }).then([=] {
+                    return resumed_handshakes();
+                }).then([=] (uint64_t after) {
+                    // Both the client and the server count it
+                    BOOST_REQUIRE_EQUAL(after, before + 2);
+                });
+            });
+        }).finally([server] {
+            return server->stop().finally([server]{});
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_x509_client_server_many_small_writes) {
+    // Lots of unflushed writes of mixed sizes, so records get packed from
+    // several puts and many of them are in flight at once
+    sstring msg(sstring::initialized_later(), 1024 * 1024);
+    for (size_t i = 0; i < msg.size(); ++i) {
+        msg[i] = 'a' + char(i % 26);
+    }
+    static const auto port = 4713;
+
+    auto certs = ::make_shared<tls::certificate_credentials>();
+    auto server = ::make_shared<seastar::sharded<echoserver>>();
+    auto addr = ::make_ipv4_address( {0x7f000001, port});
+
+    return certs->set_x509_trust_file("tests/catest.pem", tls::x509_crt_format::PEM).then([=] {
+        return server->start(msg.size()).then([=] {
+            return server->invoke_on_all(&echoserver::listen, addr, sstring("tests/test.crt"), sstring("tests/test.key"));
+        }).then([=] {
+            return tls::connect(certs, addr, "test.scylladb.org").then([msg](::connected_socket s) {
+                auto strms = ::make_lw_shared<streams>(std::move(s));
+                auto pos = ::make_lw_shared<size_t>(0);
+                return repeat([strms, msg, pos] {
+                    if (*pos == msg.size()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    // Up to 20k bytes, so both below and above the stream buffer size
+                    auto len = std::min(1 + (*pos * 7919) % 20000, msg.size() - *pos);
+                    auto f = strms->out.write(msg.begin() + *pos, len);
+                    *pos += len;
+                    return f.then([] {
+                        return stop_iteration::no;
+                    });
+                }).then([strms] {
+                    return strms->out.flush();
+                }).then([strms, msg] {
+                    return strms->in.read_exactly(msg.size());
+                }).then([strms, msg] (temporary_buffer<char> buf) {
+                    BOOST_REQUIRE(msg == sstring(buf.begin(), buf.end()));
+                    return strms->out.close();
+                }).finally([strms] {});
+            });
+        }).finally([server] {
+            return server->stop().finally([server]{});
+        });
+    });
+}
+
+// Whether the kernel accepts the TLS ULP on a connected TCP socket, which
+// is what the posix stack needs to hand sessions over
+static bool kernel_tls_supported() {
+#ifdef HAVE_KTLS
+    auto lfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    auto cfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int afd = -1;
+    bool ok = false;
+    sockaddr_in sa = {};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sa);
+    if (lfd >= 0 && cfd >= 0
+            && ::bind(lfd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) == 0
+            && ::listen(lfd, 1) == 0
+            && ::getsockname(lfd, reinterpret_cast<sockaddr*>(&sa), &len) == 0
+            && ::connect(cfd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) == 0) {
+        afd = ::accept(lfd, nullptr, nullptr);
+        ok = ::setsockopt(cfd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+    }
+    for (auto fd : {lfd, cfd, afd}) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    return ok;
+#else
+    return false;
+#endif
+}
+
+SEASTAR_TEST_CASE(test_x509_client_server_kernel_tls) {
+    // Whether or not this kernel can take the sessions over, the data
+    // must come through; if it can, it must have
+    auto expect_kernel_tls = kernel_tls_supported();
+    if (!expect_kernel_tls) {
+        BOOST_TEST_MESSAGE("kernel TLS not available, only checking the userspace fallback");
+    }
+    auto kernel_tls_before = tls::get_handshake_stats().kernel_tls;
+    sstring msg(sstring::initialized_later(), 100 * 1024);
+    for (size_t i = 0; i < msg.size(); ++i) {
+        msg[i] = '0' + char(i % 30);
+    }
+    static const auto port = 4714;
+
+    auto certs = ::make_shared<tls::certificate_credentials>();
+    auto server = ::make_shared<seastar::sharded<echoserver>>();
+    auto addr = ::make_ipv4_address( {0x7f000001, port});
+    certs->set_kernel_tls(true);
+
+    return certs->set_x509_trust_file("tests/catest.pem", tls::x509_crt_format::PEM).then([=] {
+        return server->start(msg.size()).then([=] {
+            return server->invoke_on_all(&echoserver::enable_kernel_tls);
+        }).then([=] {
+            return server->invoke_on_all(&echoserver::listen, addr, sstring("tests/test.crt"), sstring("tests/test.key"));
+        }).then([=] {
+            return tls::connect(certs, addr, "test.scylladb.org").then([msg](::connected_socket s) {
+                auto strms = ::make_lw_shared<streams>(std::move(s));
+                auto range = boost::irange(0, 5);
+                return do_for_each(range, [strms, msg](auto) {
+                    return strms->out.write(msg).then([strms] {
+                        return strms->out.flush();
+                    }).then([strms, msg] {
+                        return strms->in.read_exactly(msg.size());
+                    }).then([msg] (temporary_buffer<char> buf) {
+                        BOOST_REQUIRE(msg == sstring(buf.begin(), buf.end()));
+                    });
+                }).then([strms] {
+                    return strms->out.close();
+                }).finally([strms] {});
+            });
+        }).then([=] {
+            // The client session runs on this shard
+            if (expect_kernel_tls) {
+                BOOST_REQUIRE_GT(tls::get_handshake_stats().kernel_tls, kernel_tls_before);
+            } else {
+                BOOST_REQUIRE_EQUAL(tls::get_handshake_stats().kernel_tls, kernel_tls_before);
+            }
+        }).finally([server] {
+            return server->stop().finally([server]{});
+        });
+    });
+}
@@ -19,11 +19,16 @@
  * Copyright (C) 2014 Cloudius Systems, Ltd.
  */
 
+// Measures UDP throughput on one shard: a sender channel sends datagrams
+// built from three chunks of a memory pool (referenced in place, or copied
+// with --copy) to a receiver channel.  With --batch-size > 1 both sides
+// use send_batch() and receive_batch(); with --batch-size=1 they go one
+// datagram per call.
+
 #include "core/app-template.hh"
+#include "core/reactor.hh"
 #include "core/future-util.hh"
 #include "core/scattered_message.hh"
-#include "core/vector-data-sink.hh"
-#include "core/shared_ptr.hh"
 #include "core/units.hh"
 #include <random>
 #include <iomanip>
@@ -32,116 +37,132 @@ using namespace net;
 using namespace std::chrono_literals;
 namespace bpo = boost::program_options;
 
-template <typename Duration>
-typename Duration::rep to_seconds(Duration d) {
-    return std::chrono::duration_cast<std::chrono::seconds>(d).count();
-}
-
-class server {
+class benchmark {
 private:
-    udp_channel _chan;
+    udp_channel _rx;
+    udp_channel _tx;
+    ipv4_addr _dst;
     timer<> _stats_timer;
     uint64_t _n_sent {};
+    uint64_t _n_received {};
+    uint64_t _bytes_received {};
     size_t _chunk_size;
     bool _copy;
-    std::vector<packet> _packets;
-    std::unique_ptr<output_stream<char>> _out;
+    unsigned _batch_size;
     steady_clock_type::time_point _last;
-    sstring _key;
-    size_t _packet_size = 8*KB;
-    char* _mem;
+    std::unique_ptr<char[]> _mem;
     size_t _mem_size;
     std::mt19937 _rnd;
-    std::random_device _randem_dev;
     std::uniform_int_distribution<size_t> _chunk_distribution;
 private:
     char* next_chunk() {
-        return _mem + _chunk_distribution(_rnd);
+        return _mem.get() + _chunk_distribution(_rnd);
     }
-public:
-    server()
-        : _rnd(std::random_device()()) {
+    packet make_packet() {
+        if (_copy) {
+            packet p;
+            for (int i = 0; i < 3; ++i) {
+                p = packet(std::move(p), fragment{next_chunk(), _chunk_size});
+            }
+            return p;
+        }
+        scattered_message<char> msg;
+        msg.reserve(3);
+        for (int i = 0; i < 3; ++i) {
+            msg.append_static(next_chunk(), _chunk_size);
+        }
+        return std::move(msg).release();
     }
-    future<> send(ipv4_addr dst, packet p) {
-        return _chan.send(dst, std::move(p)).then([this] {
-            _n_sent++;
+    future<> send() {
+        if (_batch_size == 1) {
+            return _tx.send(_dst, make_packet()).then([this] {
+                _n_sent++;
+            });
+        }
+        std::vector<std::pair<ipv4_addr, packet>> datagrams;
+        datagrams.reserve(_batch_size);
+        for (unsigned i = 0; i < _batch_size; ++i) {
+            datagrams.emplace_back(_dst, make_packet());
+        }
+        return _tx.send_batch(std::move(datagrams)).then([this] {
+            _n_sent += _batch_size;
+        });
+    }
+    future<> receive() {
+        if (_batch_size == 1) {
+            return _rx.receive().then([this] (udp_datagram dgram) {
+                _n_received++;
+                _bytes_received += dgram.get_data().len();
+            });
+        }
+        return _rx.receive_batch(_batch_size).then([this] (std::vector<udp_datagram> datagrams) {
+            _n_received += datagrams.size();
+            for (auto&& dgram : datagrams) {
+                _bytes_received += dgram.get_data().len();
+            }
         });
     }
-    void start(int chunk_size, bool copy, size_t mem_size) {
-        ipv4_addr listen_addr{10000};
-        _chan = engine().net().make_udp_channel(listen_addr);
+public:
+    benchmark()
+        : _rnd(std::random_device()()) {
+    }
+    void start(ipv4_addr dst, size_t chunk_size, bool copy, unsigned batch_size, size_t mem_size) {
+        _dst = dst;
+        _rx = engine().net().make_udp_channel(dst);
+        _tx = engine().net().make_udp_channel({});
 
-        std::cout << "Listening on " << listen_addr << std::endl;
+        std::cout << "Sending to " << dst << std::endl;
 
         _last = steady_clock_type::now();
         _stats_timer.set_callback([this] {
             auto now = steady_clock_type::now();
-            std::cout << "Out: "
-                << std::setprecision(2) << std::fixed
-                << (double)_n_sent / to_seconds(now - _last)
-                << " pps" << std::endl;
+            auto secs = std::chrono::duration<double>(now - _last).count();
+            std::cout << std::setprecision(2) << std::fixed
+                << "Out: " << _n_sent / secs << " pps, "
+                << "In: " << _n_received / secs << " pps, "
+                << _bytes_received * 8 / secs / 1e9 << " Gbps" << std::endl;
             _last = now;
             _n_sent = 0;
+            _n_received = 0;
+            _bytes_received = 0;
         });
         _stats_timer.arm_periodic(1s);
 
         _chunk_size = chunk_size;
         _copy = copy;
-        _key = sstring(new char[64], 64);
-
-        _out = std::make_unique<output_stream<char>>(
-            data_sink(std::make_unique<vector_data_sink>(_packets)), _packet_size);
-
-        _mem = new char[mem_size];
+        _batch_size = std::max(batch_size, 1u);
+        _mem.reset(new char[mem_size]);
         _mem_size = mem_size;
+        _chunk_distribution = std::uniform_int_distribution<size_t>(0, _mem_size - _chunk_size);
 
-        _chunk_distribution = std::uniform_int_distribution<size_t>(0, _mem_size - _chunk_size * 3);
-
-        assert(3 * _chunk_size <= _packet_size);
-
-        keep_doing([this] {
-            return _chan.receive().then([this] (udp_datagram dgram) {
-                auto chunk = next_chunk();
-                lw_shared_ptr<sstring> item;
-                if (_copy) {
-                    _packets.clear();
-                    _out->write(chunk, _chunk_size);
-                    chunk += _chunk_size;
-                    _out->write(chunk, _chunk_size);
-                    chunk += _chunk_size;
-                    _out->write(chunk, _chunk_size);
-                    _out->flush();
-                    assert(_packets.size() == 1);
-                    return send(dgram.get_src(), std::move(_packets[0]));
-                } else {
-                    auto chunk = next_chunk();
-                    scattered_message<char> msg;
-                    msg.reserve(3);
-                    msg.append_static(chunk, _chunk_size);
-                    msg.append_static(chunk, _chunk_size);
-                    msg.append_static(chunk, _chunk_size);
-                    return send(dgram.get_src(), std::move(msg).release());
-                }
-            });
-        });
+        keep_doing([this] { return receive(); });
+        keep_doing([this] { return send(); });
     }
 };
 
 int main(int ac, char ** av) {
-    server s;
+    benchmark b;
     app_template app;
     app.add_options()
-        ("chunk-size", bpo::value<int>()->default_value(1024),
-             "Chunk size")
+        ("address", bpo::value<std::string>()->default_value("127.0.0.1"),
+             "Receiver address")
+        ("port", bpo::value<uint16_t>()->default_value(10000),
+             "Receiver port")
+        ("chunk-size", bpo::value<int>()->default_value(400),
+             "Chunk size; each datagram carries three chunks")
+        ("batch-size", bpo::value<unsigned>()->default_value(32),
+             "Datagrams per send_batch() and receive_batch() call (1: use send() and receive())")
         ("mem-size", bpo::value<int>()->default_value(512),
              "Memory pool size in MiB")
         ("copy", "Copy data rather than send via zero-copy")
         ;
-    return app.run_deprecated(ac, av, [&app, &s] {
+    return app.run_deprecated(ac, av, [&app, &b] {
         auto&& config = app.configuration();
+        auto dst = ipv4_addr(config["address"].as<std::string>(), config["port"].as<uint16_t>());
         auto chunk_size = config["chunk-size"].as<int>();
+        auto batch_size = config["batch-size"].as<unsigned>();
         auto mem_size = (size_t)config["mem-size"].as<int>() * MB;
         auto copy = config.count("copy");
-        s.start(chunk_size, copy, mem_size);
+        b.start(dst, chunk_size, copy, batch_size, mem_size);
     });
 }